@@ -0,0 +1,587 @@
+#include "analysis.hpp"
+#include "optimizer.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <map>
+
+int countVariables(FlowGraph& graph)
+{
+  int count = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    for (const Command& command : block->code)
+    {
+      Instruction instruction = command.instruction();
+      if (instruction == BLOAD || instruction == BSTORE)
+      {
+        return -1;
+      }
+      if (instruction == LOAD || instruction == STORE)
+      {
+        count = max(count, command.arg() + 1);
+      }
+    }
+  }
+  return count;
+}
+
+bool buildExpressionTrees(const vector<Command>& code, vector<ExpressionNode>& nodes, vector<int>& top)
+{
+  nodes.clear();
+  top.assign(code.size(), -1);
+  vector<int> stack;
+  for (int i = 0; i < int(code.size()); ++i)
+  {
+    top[i] = stack.empty() ? -1 : stack.back();
+    Instruction instruction = code[i].instruction();
+    ExpressionNode node;
+    node.start = -1;
+    node.end = i + 1;
+    node.operands[0] = node.operands[1] = -1;
+    node.parent = -1;
+    switch (instruction)
+    {
+    case LOAD:
+    case PUSH:
+    case INPUT:
+    case INVERT:
+    case SHL:
+    case SHR:
+    case ADD:
+    case SUB:
+    case MULT:
+    case DIV:
+    case COMPARE:
+    {
+      int count = stackPops(instruction);
+      if (int(stack.size()) < count)
+      {
+        return false;
+      }
+      //Участок выражения - участки операндов, идущие подряд, и сама инструкция
+      node.start = i;
+      for (int k = count - 1; k >= 0; --k)
+      {
+        int operand = stack.back();
+        stack.pop_back();
+        node.operands[k] = operand;
+        nodes[operand].parent = nodes.size();
+        const ExpressionNode& child = nodes[operand];
+        node.start = (node.start < 0 || child.start < 0 || child.end != node.start) ? -1 : child.start;
+      }
+      stack.push_back(nodes.size());
+      nodes.push_back(node);
+      break;
+    }
+    default:
+    {
+      int pops, pushes;
+      stackEffect(instruction, pops, pushes);
+      if (int(stack.size()) < pops)
+      {
+        return false;
+      }
+      stack.resize(stack.size() - pops);
+      for (int k = 0; k < pushes; ++k)
+      {
+        stack.push_back(nodes.size());
+        nodes.push_back(node);
+      }
+      break;
+    }
+    }
+  }
+  return true;
+}
+
+bool sameCommand(const Command& a, const Command& b)
+{
+  return a.instruction() == b.instruction() && Value::fromCommand(a).same(Value::fromCommand(b));
+}
+
+pair<int, uint64_t> commandKey(const Command& command)
+{
+  return make_pair(int(command.instruction()), Value::fromCommand(command).key());
+}
+
+vector<bool> integerVariables(FlowGraph& graph, int variableCount)
+{
+  //Предполагаем все переменные целыми и снимаем предположение, пока находятся
+  //записи вещественных значений
+  vector<bool> integer(variableCount, true);
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (BasicBlock* block : graph.blocks())
+    {
+      vector<bool> stack;
+      for (const Command& command : block->code)
+      {
+        Instruction instruction = command.instruction();
+        switch (instruction)
+        {
+        case PUSH:
+          stack.push_back(!command.isFloat());
+          break;
+        case LOAD:
+          stack.push_back(command.arg() < variableCount && integer[command.arg()]);
+          break;
+        case INPUT:
+          stack.push_back(true);
+          break;
+        case STORE:
+        {
+          bool value = !stack.empty() && stack.back();
+          if (!stack.empty())
+          {
+            stack.pop_back();
+          }
+          if (!value && command.arg() < variableCount && integer[command.arg()])
+          {
+            integer[command.arg()] = false;
+            changed = true;
+          }
+          break;
+        }
+        case ADD:
+        case SUB:
+        case MULT:
+        case DIV:
+        case COMPARE:
+        {
+          bool b = !stack.empty() && stack.back();
+          if (!stack.empty())
+          {
+            stack.pop_back();
+          }
+          bool a = !stack.empty() && stack.back();
+          if (!stack.empty())
+          {
+            stack.pop_back();
+          }
+          stack.push_back(instruction == COMPARE || (a && b));
+          break;
+        }
+        case INVERT:
+        case SHL:
+        case SHR:
+          //Тип операнда сохраняется
+          break;
+        case DUP:
+          if (!stack.empty())
+          {
+            stack.push_back(stack.back());
+          }
+          break;
+        default:
+        {
+          int pops, pushes;
+          stackEffect(instruction, pops, pushes);
+          stack.resize(stack.size() > size_t(pops) ? stack.size() - pops : 0);
+          stack.insert(stack.end(), pushes, false);
+          break;
+        }
+        }
+      }
+    }
+  }
+  return integer;
+}
+
+bool BitSet::unite(const BitSet& other)
+{
+  bool changed = false;
+  for (size_t i = 0; i < words_.size(); ++i)
+  {
+    uint64_t word = words_[i] | other.words_[i];
+    changed |= word != words_[i];
+    words_[i] = word;
+  }
+  return changed;
+}
+
+bool BitSet::transfer(const BitSet& gen, const BitSet& other, const BitSet& kill)
+{
+  bool changed = false;
+  for (size_t i = 0; i < words_.size(); ++i)
+  {
+    uint64_t word = gen.words_[i] | (other.words_[i] & ~kill.words_[i]);
+    changed |= word != words_[i];
+    words_[i] = word;
+  }
+  return changed;
+}
+
+Liveness::Liveness(FlowGraph& graph, int variableCount)
+{
+  DominatorTree dom(graph);
+  int count = graph.blocks().size();
+  liveIn_.assign(count, BitSet(variableCount));
+  liveOut_.assign(count, BitSet(variableCount));
+
+  //Переменные, читаемые в блоке до записи (gen), и записываемые в блоке (kill)
+  vector<BitSet> gen(count, BitSet(variableCount));
+  vector<BitSet> kill(count, BitSet(variableCount));
+  for (BasicBlock* block : graph.blocks())
+  {
+    for (auto it = block->code.rbegin(); it != block->code.rend(); ++it)
+    {
+      if (it->instruction() == STORE)
+      {
+        gen[block->id].reset(it->arg());
+        kill[block->id].set(it->arg());
+      }
+      else if (it->instruction() == LOAD)
+      {
+        gen[block->id].set(it->arg());
+      }
+    }
+  }
+
+  //Обратная задача: блоки обходятся в постпорядке, чтобы преемники обрабатывались раньше
+  const vector<BasicBlock*>& order = dom.order();
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (auto it = order.rbegin(); it != order.rend(); ++it)
+    {
+      BasicBlock* block = *it;
+      for (BasicBlock* succ : block->succs)
+      {
+        liveOut_[block->id].unite(liveIn_[succ->id]);
+      }
+      changed |= liveIn_[block->id].transfer(gen[block->id], liveOut_[block->id], kill[block->id]);
+    }
+  }
+}
+
+vector<Loop> findLoops(const DominatorTree& dom)
+{
+  map<BasicBlock*, vector<BasicBlock*>> latches;
+  vector<BasicBlock*> headers;
+  for (BasicBlock* block : dom.order())
+  {
+    for (BasicBlock* succ : block->succs)
+    {
+      if (dom.dominates(succ, block))
+      {
+        if (latches[succ].empty())
+        {
+          headers.push_back(succ);
+        }
+        latches[succ].push_back(block);
+      }
+    }
+  }
+
+  vector<Loop> loops;
+  for (BasicBlock* header : headers)
+  {
+    Loop loop;
+    loop.header = header;
+    loop.members.insert(header);
+    loop.body.push_back(header);
+    vector<BasicBlock*> work;
+    for (BasicBlock* latch : latches[header])
+    {
+      if (loop.members.insert(latch).second)
+      {
+        loop.body.push_back(latch);
+        work.push_back(latch);
+      }
+    }
+    while (!work.empty())
+    {
+      BasicBlock* block = work.back();
+      work.pop_back();
+      for (BasicBlock* pred : block->preds)
+      {
+        if (dom.reachable(pred) && loop.members.insert(pred).second)
+        {
+          loop.body.push_back(pred);
+          work.push_back(pred);
+        }
+      }
+    }
+    loops.push_back(loop);
+  }
+
+  stable_sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) {
+    return a.body.size() < b.body.size();
+  });
+
+  //Ближайший объемлющий цикл - наименьший из циклов, содержащих заголовок
+  unordered_map<BasicBlock*, int> headerLoop;
+  for (size_t i = 0; i < loops.size(); ++i)
+  {
+    loops[i].parent = -1;
+    headerLoop[loops[i].header] = i;
+  }
+  for (size_t i = 0; i < loops.size(); ++i)
+  {
+    for (BasicBlock* block : loops[i].body)
+    {
+      auto it = headerLoop.find(block);
+      if (it != headerLoop.end() && it->second != int(i) && loops[it->second].parent < 0)
+      {
+        loops[it->second].parent = i;
+      }
+    }
+  }
+  return loops;
+}
+
+unordered_map<BasicBlock*, int> innermostLoops(const vector<Loop>& loops)
+{
+  //Циклы упорядочены по размеру, поэтому первый цикл, содержащий блок, - ближайший
+  unordered_map<BasicBlock*, int> innermost;
+  for (size_t i = 0; i < loops.size(); ++i)
+  {
+    for (BasicBlock* block : loops[i].body)
+    {
+      innermost.insert(make_pair(block, int(i)));
+    }
+  }
+  return innermost;
+}
+
+DominatorTree::DominatorTree(FlowGraph& graph)
+{
+  graph.computeEdges();
+  int count = graph.blocks().size();
+  rpoIndex_.assign(count, -1);
+  idom_.assign(count, nullptr);
+  children_.assign(count, vector<BasicBlock*>());
+  enter_.assign(count, 0);
+  leave_.assign(count, -1);
+  if (count == 0)
+  {
+    return;
+  }
+
+  //Постпорядок обхода в глубину с явным стеком: пара (блок, номер следующего преемника)
+  vector<BasicBlock*> postorder;
+  vector<bool> visited(count, false);
+  vector<pair<BasicBlock*, size_t>> stack;
+  stack.push_back(make_pair(graph.entry(), 0));
+  visited[graph.entry()->id] = true;
+  while (!stack.empty())
+  {
+    BasicBlock* block = stack.back().first;
+    size_t& nextSucc = stack.back().second;
+    if (nextSucc < block->succs.size())
+    {
+      BasicBlock* succ = block->succs[nextSucc++];
+      if (!visited[succ->id])
+      {
+        visited[succ->id] = true;
+        stack.push_back(make_pair(succ, 0));
+      }
+    }
+    else
+    {
+      postorder.push_back(block);
+      stack.pop_back();
+    }
+  }
+
+  order_.assign(postorder.rbegin(), postorder.rend());
+  for (size_t i = 0; i < order_.size(); ++i)
+  {
+    rpoIndex_[order_[i]->id] = i;
+  }
+
+  //Итерации до неподвижной точки. Пересечение поднимается по уже найденным доминаторам
+  //к общему предку, сравнивая номера в обратном постпорядке.
+  BasicBlock* entry = graph.entry();
+  idom_[entry->id] = entry;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (size_t i = 1; i < order_.size(); ++i)
+    {
+      BasicBlock* block = order_[i];
+      BasicBlock* newIdom = nullptr;
+      for (BasicBlock* pred : block->preds)
+      {
+        if (rpoIndex_[pred->id] < 0 || !idom_[pred->id])
+        {
+          continue;
+        }
+        if (!newIdom)
+        {
+          newIdom = pred;
+          continue;
+        }
+        BasicBlock* a = pred;
+        BasicBlock* b = newIdom;
+        while (a != b)
+        {
+          while (rpoIndex_[a->id] > rpoIndex_[b->id])
+          {
+            a = idom_[a->id];
+          }
+          while (rpoIndex_[b->id] > rpoIndex_[a->id])
+          {
+            b = idom_[b->id];
+          }
+        }
+        newIdom = a;
+      }
+      if (idom_[block->id] != newIdom)
+      {
+        idom_[block->id] = newIdom;
+        changed = true;
+      }
+    }
+  }
+  idom_[entry->id] = nullptr;
+
+  for (size_t i = 1; i < order_.size(); ++i)
+  {
+    children_[idom_[order_[i]->id]->id].push_back(order_[i]);
+  }
+
+  //Нумерация дерева для проверки доминирования за постоянное время
+  int counter = 0;
+  vector<pair<BasicBlock*, size_t>> walk;
+  walk.push_back(make_pair(entry, 0));
+  enter_[entry->id] = counter++;
+  while (!walk.empty())
+  {
+    BasicBlock* block = walk.back().first;
+    size_t& nextChild = walk.back().second;
+    if (nextChild < children_[block->id].size())
+    {
+      BasicBlock* child = children_[block->id][nextChild++];
+      enter_[child->id] = counter++;
+      walk.push_back(make_pair(child, 0));
+    }
+    else
+    {
+      leave_[block->id] = counter++;
+      walk.pop_back();
+    }
+  }
+}
+
+vector<vector<BasicBlock*>> DominatorTree::frontiers() const
+{
+  //Алгоритм Купера - Харви - Кеннеди: от каждого предшественника узла слияния поднимаемся
+  //по дереву до непосредственного доминатора узла.
+  vector<vector<BasicBlock*>> frontier(rpoIndex_.size());
+  for (BasicBlock* block : order_)
+  {
+    int reachablePreds = 0;
+    for (BasicBlock* pred : block->preds)
+    {
+      reachablePreds += reachable(pred) ? 1 : 0;
+    }
+    if (reachablePreds < 2)
+    {
+      continue;
+    }
+    for (BasicBlock* pred : block->preds)
+    {
+      if (!reachable(pred))
+      {
+        continue;
+      }
+      BasicBlock* runner = pred;
+      while (runner && runner != idom_[block->id])
+      {
+        vector<BasicBlock*>& list = frontier[runner->id];
+        if (list.empty() || list.back() != block)
+        {
+          list.push_back(block);
+        }
+        runner = idom_[runner->id];
+      }
+    }
+  }
+  return frontier;
+}
+
+int AnalysisManager::variableCount()
+{
+  if (!(valid_ & VARIABLES))
+  {
+    variableCount_ = countVariables(graph_);
+    valid_ |= VARIABLES;
+    ++computed_;
+  }
+  return variableCount_;
+}
+
+bool AnalysisManager::integerVariable(int variable)
+{
+  if (!(valid_ & TYPES))
+  {
+    int count = variableCount();
+    integer_ = (count >= 0) ? integerVariables(graph_, count) : vector<bool>();
+    valid_ |= TYPES;
+    ++computed_;
+  }
+  return variable >= 0 && variable < int(integer_.size()) && integer_[variable];
+}
+
+const DominatorTree& AnalysisManager::dominators()
+{
+  if (!(valid_ & DOMINATORS))
+  {
+    dominators_ = new DominatorTree(graph_);
+    valid_ |= DOMINATORS;
+    ++computed_;
+  }
+  return *dominators_;
+}
+
+vector<Loop>& AnalysisManager::loops()
+{
+  if (!(valid_ & LOOPS))
+  {
+    loops_ = findLoops(dominators());
+    valid_ |= LOOPS;
+    ++computed_;
+  }
+  return loops_;
+}
+
+const Liveness& AnalysisManager::liveness()
+{
+  if (!(valid_ & LIVENESS))
+  {
+    liveness_ = new Liveness(graph_, variableCount());
+    valid_ |= LIVENESS;
+    ++computed_;
+  }
+  return *liveness_;
+}
+
+void AnalysisManager::invalidate(unsigned preserved)
+{
+  //Живые переменные считаются для известного числа переменных
+  if (!(preserved & VARIABLES))
+  {
+    preserved &= ~unsigned(LIVENESS);
+  }
+  unsigned dropped = valid_ & ~preserved;
+  if (dropped & DOMINATORS)
+  {
+    delete dominators_;
+    dominators_ = nullptr;
+  }
+  if (dropped & LOOPS)
+  {
+    loops_.clear();
+  }
+  if (dropped & LIVENESS)
+  {
+    delete liveness_;
+    liveness_ = nullptr;
+  }
+  valid_ &= preserved;
+}
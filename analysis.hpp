@@ -0,0 +1,237 @@
+#ifndef CMILAN_ANALYSIS_HPP
+#define CMILAN_ANALYSIS_HPP
+
+#include "flowgraph.hpp"
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+// Анализы графа потока управления. Анализ вычисляется по текущему состоянию графа
+// и становится недействительным, как только граф изменяется.
+
+// Число переменных программы (наибольший адрес LOAD/STORE плюс один).
+// Возвращает -1, если программа использует индексную адресацию BLOAD/BSTORE: тогда любая
+// инструкция может обратиться к любой переменной и анализы переменных неприменимы.
+int countVariables(FlowGraph& graph);
+
+// Переменные, которые при любом выполнении программы хранят только целые значения.
+// Анализ не зависит от потока управления: переменная целая, если целые все записываемые
+// в нее значения (изначально память заполнена целыми нулями). Целыми считаются константы
+// PUSH целого типа, результаты INPUT и COMPARE, а также арифметика над целыми.
+vector<bool> integerVariables(FlowGraph& graph, int variableCount);
+
+// Дерево выражения: узел - значение, которое инструкция кода блока кладет в стек.
+// Выражения - LOAD, PUSH, INPUT и инструкции, вычисляющие значение из stackPops операндов
+// (ADD, SUB, MULT, DIV, INVERT, SHL, SHR, COMPARE). Значения, которые кладут в стек другие
+// инструкции (DUP, BLOAD), - листья без участка кода.
+struct ExpressionNode
+{
+  int start;        // Участок кода [start, end) из инструкций дерева (-1 - такого участка нет)
+  int end;          // Следующая инструкция после той, что положила значение в стек
+  int operands[2];  // Узлы операндов (-1 - нет)
+  int parent;       // Выражение, использующее значение (-1 - значение снимает со стека
+                    // другая инструкция или оно остается в стеке в конце блока)
+};
+
+// Разбор кода блока в деревья выражений. nodes - узлы в порядке вычисления (операнды раньше
+// выражений), top[i] - узел на вершине стека перед инструкцией i (-1 - стек пуст).
+// Возвращает false, если код снимает со стека значения, положенные не в нем (так не бывает
+// для кода, построенного Parser).
+bool buildExpressionTrees(const vector<Command>& code, vector<ExpressionNode>& nodes, vector<int>& top);
+
+// Совпадают ли инструкции и их аргументы (аргументы PUSH сравниваются Value::same)
+bool sameCommand(const Command& a, const Command& b);
+
+// Ключ инструкции для упорядоченных контейнеров, согласованный с sameCommand
+pair<int, uint64_t> commandKey(const Command& command);
+
+// Множество переменных, представленное битовой шкалой
+class BitSet
+{
+public:
+  explicit BitSet(int size = 0)
+    : words_((size + 63) / 64, 0)
+  {}
+
+  bool test(int i) const
+  {
+    return (words_[i / 64] >> (i % 64)) & 1;
+  }
+
+  void set(int i)
+  {
+    words_[i / 64] |= uint64_t(1) << (i % 64);
+  }
+
+  void reset(int i)
+  {
+    words_[i / 64] &= ~(uint64_t(1) << (i % 64));
+  }
+
+  // Объединение с other; возвращает true, если множество изменилось
+  bool unite(const BitSet& other);
+
+  // this = gen | (other & ~kill); возвращает true, если множество изменилось
+  bool transfer(const BitSet& gen, const BitSet& other, const BitSet& kill);
+
+private:
+  vector<uint64_t> words_;
+};
+
+// Живые переменные: переменная жива в точке программы, если ее значение может быть прочитано
+// инструкцией LOAD до следующей записи. После STOP живых переменных нет.
+// Итерации в постпорядке до неподвижной точки.
+
+class Liveness
+{
+public:
+  Liveness(FlowGraph& graph, int variableCount);
+
+  // Переменные, живые на выходе из блока
+  const BitSet& liveOut(const BasicBlock* block) const
+  {
+    return liveOut_[block->id];
+  }
+
+  // Переменные, живые на входе в блок
+  const BitSet& liveIn(const BasicBlock* block) const
+  {
+    return liveIn_[block->id];
+  }
+
+private:
+  vector<BitSet> liveIn_;
+  vector<BitSet> liveOut_;
+};
+
+// Дерево доминаторов.
+// Вычисляется итеративным алгоритмом Купера - Харви - Кеннеди в обратном постпорядке;
+// для сводимых графов, которые порождает Милан, он сходится за два-три прохода.
+// Недостижимые блоки в дерево не входят.
+
+class DominatorTree
+{
+public:
+  explicit DominatorTree(FlowGraph& graph);
+
+  // Блоки, достижимые из входа, в обратном постпорядке
+  const vector<BasicBlock*>& order() const
+  {
+    return order_;
+  }
+
+  // Достижим ли блок из входа
+  bool reachable(const BasicBlock* block) const
+  {
+    return rpoIndex_[block->id] >= 0;
+  }
+
+  // Непосредственный доминатор блока (для входа - nullptr)
+  BasicBlock* idom(const BasicBlock* block) const
+  {
+    return idom_[block->id];
+  }
+
+  // Непосредственно доминируемые блоки
+  const vector<BasicBlock*>& children(const BasicBlock* block) const
+  {
+    return children_[block->id];
+  }
+
+  // Доминирует ли a над b (каждый блок доминирует над собой)
+  bool dominates(const BasicBlock* a, const BasicBlock* b) const
+  {
+    return enter_[a->id] <= enter_[b->id] && leave_[b->id] <= leave_[a->id];
+  }
+
+  // Границы доминирования всех блоков
+  vector<vector<BasicBlock*>> frontiers() const;
+
+private:
+  vector<BasicBlock*> order_;
+  vector<int> rpoIndex_;
+  vector<BasicBlock*> idom_;
+  vector<vector<BasicBlock*>> children_;
+  vector<int> enter_;   // Номера входа и выхода при обходе дерева в глубину
+  vector<int> leave_;
+};
+
+// Естественный цикл: заголовок и блоки, из которых заголовок достижим по обратной дуге
+// без прохода через него. Циклы с общим заголовком объединяются, поэтому два цикла либо
+// не пересекаются, либо один вложен в другой.
+struct Loop
+{
+  BasicBlock* header;
+  vector<BasicBlock*> body;                 // Блоки цикла, заголовок - первый
+  unordered_set<BasicBlock*> members;
+  int parent;                               // Номер ближайшего объемлющего цикла (-1 - нет)
+};
+
+// Естественные циклы графа с деревом доминаторов dom; вложенные циклы идут раньше внешних
+vector<Loop> findLoops(const DominatorTree& dom);
+
+// Номер ближайшего цикла из loops, содержащего блок, для каждого блока циклов
+unordered_map<BasicBlock*, int> innermostLoops(const vector<Loop>& loops);
+
+// Кэш анализов графа. Анализ вычисляется при первом запросе и хранится, пока преобразование
+// не изменит граф и не сбросит кэш вызовом invalidate. Ссылки на результаты действительны
+// до сброса соответствующего анализа.
+class AnalysisManager
+{
+public:
+  enum Analysis
+  {
+    VARIABLES = 1,    // countVariables
+    TYPES = 2,        // integerVariables
+    DOMINATORS = 4,   // DominatorTree
+    LOOPS = 8,        // findLoops
+    LIVENESS = 16     // Liveness
+  };
+
+  explicit AnalysisManager(FlowGraph& graph)
+    : graph_(graph), valid_(0), dominators_(nullptr), liveness_(nullptr), computed_(0)
+  {}
+
+  ~AnalysisManager()
+  {
+    invalidate();
+  }
+
+  int variableCount();
+
+  // Хранит ли переменная только целые значения; для переменных, появившихся после
+  // вычисления анализа, и при индексной адресации - false
+  bool integerVariable(int variable);
+
+  const DominatorTree& dominators();
+
+  // Циклы можно изменять на месте (loopPreheader поддерживает их актуальными)
+  vector<Loop>& loops();
+
+  // Требует variableCount() >= 0
+  const Liveness& liveness();
+
+  // Сброс всех анализов, кроме перечисленных в preserved (сумма значений Analysis)
+  void invalidate(unsigned preserved = 0);
+
+  // Сколько раз анализы вычислялись
+  int computed() const
+  {
+    return computed_;
+  }
+
+private:
+  FlowGraph& graph_;
+  unsigned valid_;
+  int variableCount_;
+  vector<bool> integer_;
+  DominatorTree* dominators_;
+  vector<Loop> loops_;
+  Liveness* liveness_;
+  int computed_;
+};
+
+#endif
@@ -0,0 +1,229 @@
+#include "codecache.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MILAN_CODE_CACHE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifdef MILAN_CODE_CACHE
+
+namespace
+{
+
+const char MAGIC[8] = {'M', 'I', 'L', 'A', 'N', 'J', 'I', 'T'};
+const uint32_t FORMAT = 1;          // Версия формата записи
+const size_t CODE_ALIGNMENT = 4096; // Выравнивание кода в файле (mmap отображает целые страницы)
+
+// Заголовок записи. За ним следует ключ, затем, с выравниванием CODE_ALIGNMENT, код.
+struct EntryHeader
+{
+  char magic[8];
+  uint32_t format;
+  uint32_t keySize;
+  uint64_t codeOffset;
+  uint64_t codeSize;
+  uint64_t checksum;      // FNV-1a кода
+};
+
+uint64_t fnv1a(const void* data, size_t size)
+{
+  uint64_t hash = 14695981039346656037ull;
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+void append(string& key, uint32_t value)
+{
+  key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Ключ записи: идентификатор компилятора, признаки процессора и инструкции программы
+string makeKey(const string& compilerId, const vector<Command>& program)
+{
+  string key = compilerId;
+  key.push_back('\0');
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    append(key, ecx);
+    append(key, edx);
+  }
+  if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+  {
+    append(key, ebx);
+    append(key, ecx);
+  }
+#endif
+  append(key, program.size());
+  for (const Command& command : program)
+  {
+    append(key, command.instruction());
+    for (int i = 0; i < argumentCount(command.instruction()); ++i)
+    {
+      append(key, command.arg(i));
+    }
+    append(key, command.isFloat());
+    if (command.isFloat())
+    {
+      float value = command.farg();
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      append(key, bits);
+    }
+  }
+  return key;
+}
+
+string entryPath(const string& directory, const string& key)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.jit", static_cast<unsigned long long>(fnv1a(key.data(), key.size())));
+  return directory + "/" + name;
+}
+
+}
+
+bool loadCachedCode(const string& directory, const string& compilerId, const vector<Command>& program,
+                    CachedCode& code, string& status)
+{
+  string key = makeKey(compilerId, program);
+  string path = entryPath(directory, key);
+  int file = open(path.c_str(), O_RDONLY);
+  if (file < 0)
+  {
+    status = "no entry " + path;
+    return false;
+  }
+
+  //Проверки заголовка и ключа
+  struct stat info;
+  EntryHeader header;
+  string stored(key.size(), '\0');
+  bool valid = fstat(file, &info) == 0 && pread(file, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+               memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0;
+  if (valid && header.format != FORMAT)
+  {
+    close(file);
+    status = "stale entry " + path + " (format " + to_string(header.format) + ")";
+    return false;
+  }
+  valid = valid && header.codeSize > 0 && header.codeOffset >= sizeof(header) + header.keySize &&
+          header.codeOffset <= uint64_t(info.st_size) && header.codeSize <= uint64_t(info.st_size) - header.codeOffset;
+  if (valid && (header.keySize != key.size() ||
+                pread(file, &stored[0], key.size(), sizeof(header)) != ssize_t(key.size()) || stored != key))
+  {
+    close(file);
+    status = "stale entry " + path + " (different program, compiler or processor)";
+    return false;
+  }
+  if (!valid)
+  {
+    close(file);
+    status = "corrupt entry " + path;
+    return false;
+  }
+
+  //Отображение кода: смещение в файле должно быть кратно размеру страницы
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t base = header.codeOffset / page * page;
+  size_t size = header.codeOffset - base + header.codeSize;
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE, file, base);
+  close(file);
+  if (mapping == MAP_FAILED)
+  {
+    status = "cannot map " + path + ": " + strerror(errno);
+    return false;
+  }
+  const uint8_t* start = static_cast<const uint8_t*>(mapping) + (header.codeOffset - base);
+  if (fnv1a(start, header.codeSize) != header.checksum)
+  {
+    munmap(mapping, size);
+    status = "corrupt entry " + path + " (checksum mismatch)";
+    return false;
+  }
+  code.mapping = mapping;
+  code.mappingSize = size;
+  code.code = start;
+  code.codeSize = header.codeSize;
+  status = path;
+  return true;
+}
+
+bool storeCachedCode(const string& directory, const string& compilerId, const vector<Command>& program,
+                     const vector<uint8_t>& code, string& status)
+{
+  if (mkdir(directory.c_str(), 0777) != 0 && errno != EEXIST)
+  {
+    status = "cannot create " + directory + ": " + strerror(errno);
+    return false;
+  }
+  string key = makeKey(compilerId, program);
+  string path = entryPath(directory, key);
+
+  EntryHeader header;
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.format = FORMAT;
+  header.keySize = key.size();
+  header.codeOffset = (sizeof(header) + key.size() + CODE_ALIGNMENT - 1) / CODE_ALIGNMENT * CODE_ALIGNMENT;
+  header.codeSize = code.size();
+  header.checksum = fnv1a(code.data(), code.size());
+  string entry(header.codeOffset, '\0');
+  memcpy(&entry[0], &header, sizeof(header));
+  memcpy(&entry[sizeof(header)], key.data(), key.size());
+  entry.append(reinterpret_cast<const char*>(code.data()), code.size());
+
+  //Запись во временный файл и переименование: другие процессы видят либо старую запись,
+  //либо новую целиком
+  string temporary = path + ".tmp" + to_string(getpid());
+  {
+    ofstream file(temporary, ios::binary | ios::trunc);
+    if (!file || !file.write(entry.data(), entry.size()) || !file.flush())
+    {
+      file.close();
+      unlink(temporary.c_str());
+      status = "cannot write " + temporary;
+      return false;
+    }
+  }
+  if (rename(temporary.c_str(), path.c_str()) != 0)
+  {
+    status = "cannot rename " + temporary + ": " + strerror(errno);
+    unlink(temporary.c_str());
+    return false;
+  }
+  status = path;
+  return true;
+}
+
+#else
+
+// Без mmap кэш не поддерживается
+bool loadCachedCode(const string&, const string&, const vector<Command>&, CachedCode&, string& status)
+{
+  status = "code cache is not supported on this platform";
+  return false;
+}
+
+bool storeCachedCode(const string&, const string&, const vector<Command>&, const vector<uint8_t>&, string& status)
+{
+  status = "code cache is not supported on this platform";
+  return false;
+}
+
+#endif
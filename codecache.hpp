@@ -0,0 +1,45 @@
+#ifndef CMILAN_CODECACHE_HPP
+#define CMILAN_CODECACHE_HPP
+
+#include "codegen.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Постоянный кэш машинного кода на диске: программа, которую запускают многократно, не
+// компилируется заново при каждом запуске.
+//
+// Запись кэша - файл в каталоге кэша, имя которого - 64-разрядный хеш ключа. Ключ состоит из
+// идентификатора компилятора (версии генератора кода), признаков процессора (CPUID) и
+// потока инструкций программы; ключ целиком хранится в записи и сравнивается при загрузке,
+// так что совпадение хешей разных программ не приводит к загрузке чужого кода. Код должен
+// не зависеть от адреса загрузки: при загрузке он отображается из файла в память mmap
+// сразу с правом исполнения, без перемещения. Заголовок записи, границы кода и его
+// контрольная сумма проверяются; запись, не прошедшая проверку, считается промахом и
+// заменяется новой. Записи создаются во временном файле и переименовываются, поэтому
+// параллельные запуски никогда не видят недописанную запись, а файлы, уже отображенные
+// в память, не меняются.
+
+// Код записи, отображенный в память; отображение освобождается munmap(mapping, mappingSize)
+struct CachedCode
+{
+  void* mapping = nullptr;      // Начало отображения (выровнено на страницу)
+  size_t mappingSize = 0;
+  const void* code = nullptr;   // Начало кода
+  size_t codeSize = 0;
+};
+
+// Поиск записи для program. При попадании возвращает true, отображение в code и путь к
+// записи в status; при промахе - false и причину в status.
+bool loadCachedCode(const string& directory, const string& compilerId, const vector<Command>& program,
+                    CachedCode& code, string& status);
+
+// Сохранение кода для program (каталог создается, если его нет). Возвращает true и путь
+// к записи в status или false и сообщение об ошибке в status.
+bool storeCachedCode(const string& directory, const string& compilerId, const vector<Command>& program,
+                     const vector<uint8_t>& code, string& status);
+
+#endif
@@ -1,6 +1,201 @@
 #include "codegen.hpp"
+#include "flowgraph.hpp"
+#include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <charconv>
 
-void Command::print(int address, ostream& os)
+static const char* instructionNames_[] = {
+  "NOP",
+  "STOP",
+  "LOAD",
+  "STORE",
+  "BLOAD",
+  "BSTORE",
+  "PUSH",
+  "POP",
+  "DUP",
+  "ADD",
+  "SUB",
+  "MULT",
+  "DIV",
+  "INVERT",
+  "COMPARE",
+  "JUMP",
+  "JUMP_YES",
+  "JUMP_NO",
+  "INPUT",
+  "PRINT",
+  "JEQ",
+  "JNE",
+  "JLT",
+  "JGT",
+  "JLE",
+  "JGE",
+  "SHL",
+  "SHR"
+};
+
+static const int baseInstructionCount_ = sizeof(instructionNames_) / sizeof(instructionNames_[0]);
+
+static const Superop superopTable_[] = {
+#define SUPEROP(name, length, ...) { name, #name, length, { __VA_ARGS__ } },
+#include "superops.def"
+#undef SUPEROP
+  { NOP, "", 0, { NOP } } // ограничитель, чтобы таблица не была пустой
+};
+
+static const int superopCount_ = sizeof(superopTable_) / sizeof(superopTable_[0]) - 1;
+
+const Superop* findSuperop(Instruction instruction)
+{
+  int index = instruction - baseInstructionCount_;
+  if (index < 0 || index >= superopCount_)
+  {
+    return nullptr;
+  }
+  return &superopTable_[index];
+}
+
+const vector<Superop>& superops()
+{
+  static vector<Superop> sorted;
+  if (sorted.empty() && superopCount_ > 0)
+  {
+    sorted.assign(superopTable_, superopTable_ + superopCount_);
+    stable_sort(sorted.begin(), sorted.end(), [] (const Superop& a, const Superop& b) { return a.length > b.length; });
+  }
+  return sorted;
+}
+
+const char* instructionToString(Instruction instruction)
+{
+  const Superop* superop = findSuperop(instruction);
+  if (superop)
+  {
+    return superop->name;
+  }
+  return instructionNames_[instruction];
+}
+
+bool stringToInstruction(const string& name, Instruction& instruction)
+{
+  for (int i = 0; i < baseInstructionCount_ + superopCount_; ++i)
+  {
+    if (name == instructionToString(static_cast<Instruction>(i)))
+    {
+      instruction = static_cast<Instruction>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+int argumentCount(Instruction instruction)
+{
+  const Superop* superop = findSuperop(instruction);
+  if (superop)
+  {
+    int count = 0;
+    for (int i = 0; i < superop->length; ++i)
+    {
+      count += argumentCount(superop->parts[i]);
+    }
+    return count;
+  }
+
+  switch (instruction)
+  {
+  case LOAD:
+  case STORE:
+  case BLOAD:
+  case BSTORE:
+  case PUSH:
+  case COMPARE:
+  case SHL:
+  case SHR:
+    return 1;
+  default:
+    return isJump(instruction) ? 1 : 0;
+  }
+}
+
+bool isJump(Instruction instruction)
+{
+  const Superop* superop = findSuperop(instruction);
+  if (superop)
+  {
+    return isJump(superop->parts[superop->length - 1]);
+  }
+
+  switch (instruction)
+  {
+  case JUMP:
+  case JUMP_YES:
+  case JUMP_NO:
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void stackEffect(Instruction instruction, int& pops, int& pushes)
+{
+  const Superop* superop = findSuperop(instruction);
+  if (!superop)
+  {
+    pops = stackPops(instruction);
+    pushes = stackPushes(instruction);
+    return;
+  }
+
+  //Суперинструкция: моделируем составляющие по порядку
+  int depth = 0;
+  int lowest = 0;
+  for (int i = 0; i < superop->length; ++i)
+  {
+    depth -= stackPops(superop->parts[i]);
+    lowest = min(lowest, depth);
+    depth += stackPushes(superop->parts[i]);
+  }
+  pops = -lowest;
+  pushes = depth - lowest;
+}
+
+char* formatFloat(char* buffer, float value)
+{
+  char* end = to_chars(buffer, buffer + FLOAT_TEXT_SIZE - 2, value).ptr;
+  for (const char* c = buffer; c != end; ++c)
+  {
+    if (*c == '.' || *c == 'e' || *c == 'n')
+    {
+      return end;
+    }
+  }
+  *end++ = '.';
+  *end++ = '0';
+  return end;
+}
+
+string formatFloat(float value)
+{
+  char buffer[FLOAT_TEXT_SIZE];
+  return string(buffer, formatFloat(buffer, value));
+}
+
+// Текстовое представление аргумента
+static string formatArg(bool isFloat, int arg, float farg)
+{
+  return isFloat ? formatFloat(farg) : to_string(arg);
+}
+
+void Command::print(int address, ostream& os) const
 {
   os << address << ":\t";
   switch (instruction_)
@@ -14,23 +209,23 @@ void Command::print(int address, ostream& os)
     break;
 
   case LOAD:
-    os << "LOAD\t" << (flag_ ? farg_ : arg_);
+    os << "LOAD\t" << formatArg(flag_, arg_, farg_);
     break;
 
   case STORE:
-    os << "STORE\t" << (flag_ ? farg_ : arg_);
+    os << "STORE\t" << formatArg(flag_, arg_, farg_);
     break;
 
   case BLOAD:
-    os << "BLOAD\t" << (flag_ ? farg_ : arg_);
+    os << "BLOAD\t" << formatArg(flag_, arg_, farg_);
     break;
 
   case BSTORE:
-    os << "BSTORE\t" << (flag_ ? farg_ : arg_);
+    os << "BSTORE\t" << formatArg(flag_, arg_, farg_);
     break;
 
   case PUSH:
-    os << "PUSH\t" << (flag_ ? farg_ : arg_);
+    os << "PUSH\t" << formatArg(flag_, arg_, farg_);
     break;
 
   case POP:
@@ -65,6 +260,14 @@ void Command::print(int address, ostream& os)
     os << "COMPARE\t" << arg_;
     break;
 
+  case SHL:
+    os << "SHL\t" << arg_;
+    break;
+
+  case SHR:
+    os << "SHR\t" << arg_;
+    break;
+
   case JUMP:
     os << "JUMP\t" << arg_;
     break;
@@ -84,58 +287,273 @@ void Command::print(int address, ostream& os)
   case PRINT:
     os << "PRINT";
     break;
+
+  case JEQ:
+    os << "JEQ\t" << arg_;
+    break;
+
+  case JNE:
+    os << "JNE\t" << arg_;
+    break;
+
+  case JLT:
+    os << "JLT\t" << arg_;
+    break;
+
+  case JGT:
+    os << "JGT\t" << arg_;
+    break;
+
+  case JLE:
+    os << "JLE\t" << arg_;
+    break;
+
+  case JGE:
+    os << "JGE\t" << arg_;
+    break;
+
+  default:
+    //Суперинструкция: название и аргументы составляющих ее инструкций
+    os << instructionToString(instruction_);
+    for (int i = 0; i < argumentCount(instruction_); ++i)
+    {
+      os << "\t" << arg(i);
+    }
+    break;
   }
 
   os << endl;
 }
 
+bool Command::parse(const string& line, Command& command)
+{
+  istringstream is(line);
+  int address;
+  char colon;
+  string name;
+  Instruction instruction;
+  if (!(is >> address >> colon >> name) || colon != ':' || !stringToInstruction(name, instruction))
+  {
+    return false;
+  }
+
+  int count = argumentCount(instruction);
+  if (count == 1 && !findSuperop(instruction))
+  {
+    string arg;
+    if (!(is >> arg))
+    {
+      return false;
+    }
+    //Вещественный аргумент отличается от целого наличием точки, показателя степени или inf/nan
+    if (arg.find_first_of(".eEnN") != string::npos)
+    {
+      command = Command(instruction, strtof(arg.c_str(), nullptr));
+    }
+    else
+    {
+      command = Command(instruction, atoi(arg.c_str()));
+    }
+    return true;
+  }
+
+  int args[MAX_SUPEROP_ARGS] = {0, 0, 0};
+  for (int i = 0; i < count; ++i)
+  {
+    if (!(is >> args[i]))
+    {
+      return false;
+    }
+  }
+  command = Command(instruction, args[0], args[1], args[2]);
+  return true;
+}
+
+CodeGen::CodeGen()
+  : current_(nullptr), closed_(false)
+{
+  graph_ = new FlowGraph();
+}
+
+CodeGen::~CodeGen()
+{
+  delete graph_;
+}
+
 void CodeGen::emit(Instruction instruction)
 {
-  commandBuffer_.push_back(Command(instruction));
+  currentBlock()->code.push_back(Command(instruction));
 }
 
 void CodeGen::emit(Instruction instruction, int arg)
 {
-  commandBuffer_.push_back(Command(instruction, arg));
+  currentBlock()->code.push_back(Command(instruction, arg));
 }
 
 void CodeGen::emit(Instruction instruction, float farg)
 {
-  commandBuffer_.push_back(Command(instruction, farg));
+  currentBlock()->code.push_back(Command(instruction, farg));
+}
+
+void CodeGen::emitCopy(BasicBlock* block, int from, int to)
+{
+  vector<Command>& code = currentBlock()->code;
+  //Копируемый участок может находиться в текущем блоке, поэтому копируем по индексам
+  for (int i = from; i < to; ++i)
+  {
+    code.push_back(block->code[i]);
+  }
+}
+
+BasicBlock* CodeGen::newBlock()
+{
+  return graph_->newBlock();
+}
+
+void CodeGen::startBlock(BasicBlock* block)
+{
+  //Блок, завершенный условным переходом или не завершенный вовсе, передает управление следующему
+  if (current_ && current_->branch != STOP && !current_->next)
+  {
+    current_->next = block;
+  }
+  graph_->place(block);
+  current_ = block;
+  closed_ = false;
 }
 
-void CodeGen::emitAt(int address, Instruction instruction)
+void CodeGen::branch(Instruction instruction, BasicBlock* target)
 {
-  commandBuffer_[address] = Command(instruction);
+  BasicBlock* block = currentBlock();
+  block->branch = instruction;
+  block->target = target;
+  closed_ = true;
 }
 
-void CodeGen::emitAt(int address, Instruction instruction, int arg)
+void CodeGen::jump(BasicBlock* target)
 {
-  commandBuffer_[address] = Command(instruction, arg);
+  BasicBlock* block = currentBlock();
+  block->next = target;
+  closed_ = true;
 }
 
-void CodeGen::emitAt(int address, Instruction instruction, float arg)
+void CodeGen::stop()
 {
-  commandBuffer_[address] = Command(instruction, arg);
+  currentBlock()->branch = STOP;
+  closed_ = true;
 }
 
-int CodeGen::getCurrentAddress()
+BasicBlock* CodeGen::currentBlock()
 {
-  return commandBuffer_.size();
+  if (!current_ || closed_)
+  {
+    startBlock(newBlock());
+  }
+  return current_;
 }
 
-int CodeGen::reserve()
+int CodeGen::position()
 {
-  emit(NOP);
-  return commandBuffer_.size() - 1;
+  return currentBlock()->code.size();
 }
 
-void CodeGen::flush()
+void CodeGen::linearize()
+{
+  graph_->skipEmptyBlocks();
+  graph_->removeUnreachable();
+  graph_->linearize(commandBuffer_);
+}
+
+// Проверка, что с адреса address начинается последовательность, заменяемая суперинструкцией op.
+// Внутрь последовательности не должно быть переходов, вещественные аргументы не допускаются.
+static bool matchSuperop(const vector<Command>& code, int address, const Superop& op, const vector<bool>& isTarget)
+{
+  if (address + op.length > static_cast<int>(code.size()))
+  {
+    return false;
+  }
+  for (int i = 0; i < op.length; ++i)
+  {
+    const Command& command = code[address + i];
+    if (command.instruction() != op.parts[i] || command.isFloat() || (i > 0 && isTarget[address + i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void CodeGen::fuseSuperops()
 {
   int count = commandBuffer_.size();
+  //Отметим адреса, на которые есть переходы
+  vector<bool> isTarget(count + 1, false);
+  for (const Command& command : commandBuffer_)
+  {
+    if (isJump(command.instruction()))
+    {
+      isTarget[command.arg(argumentCount(command.instruction()) - 1)] = true;
+    }
+  }
+
+  //Жадно заменяем последовательности, начиная с самых длинных, и запоминаем новые адреса инструкций
+  vector<Command> fused;
+  vector<int> newAddress(count + 1);
+  int address = 0;
+  while (address < count)
+  {
+    const Superop* match = nullptr;
+    for (const Superop& op : superops())
+    {
+      if (matchSuperop(commandBuffer_, address, op, isTarget))
+      {
+        match = &op;
+        break;
+      }
+    }
+
+    newAddress[address] = fused.size();
+    if (!match)
+    {
+      fused.push_back(commandBuffer_[address]);
+      ++address;
+      continue;
+    }
+
+    int args[MAX_SUPEROP_ARGS] = {0, 0, 0};
+    int argCount = 0;
+    for (int i = 0; i < match->length; ++i)
+    {
+      const Command& command = commandBuffer_[address + i];
+      if (argumentCount(command.instruction()) > 0)
+      {
+        args[argCount++] = command.arg();
+      }
+      newAddress[address + i] = fused.size();
+    }
+    fused.push_back(Command(match->code, args[0], args[1], args[2]));
+    address += match->length;
+  }
+  newAddress[count] = fused.size();
+
+  //Адрес перехода всегда последний аргумент инструкции
+  for (Command& command : fused)
+  {
+    if (isJump(command.instruction()))
+    {
+      int target = argumentCount(command.instruction()) - 1;
+      command.setArg(target, newAddress[command.arg(target)]);
+    }
+  }
+  commandBuffer_.swap(fused);
+}
+
+void printListing(const vector<Command>& code, ostream& output)
+{
+  int count = code.size();
   for (int address = 0; address < count; ++address)
   {
-    commandBuffer_[address].print(address, output_);
+    code[address].print(address, output);
   }
-  output_.flush();
+  output.flush();
 }
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <iostream>
+#include <string>
 
 using namespace std;
 
@@ -29,9 +30,128 @@ enum Instruction
   JUMP_YES,	// JUMP_YES addr - переход по адресу addr, если на вершине стека значение 1
   JUMP_NO,	// JUMP_NO addr - переход по адресу addr, если на вершине стека значение 0
   INPUT,		// чтение целого числа со стандартного ввода и загрузка его в стек
-  PRINT		// печать на стандартный вывод числа с вершины стека
+  PRINT,		// печать на стандартный вывод числа с вершины стека
+  JEQ,		// JEQ addr - удаление двух слов с вершины стека и переход по адресу addr, если они равны
+  JNE,		// JNE addr - то же, если слова не равны
+  JLT,		// JLT addr - то же, если нижнее слово меньше верхнего
+  JGT,		// JGT addr - то же, если нижнее слово больше верхнего
+  JLE,		// JLE addr - то же, если нижнее слово меньше или равно верхнему
+  JGE,		// JGE addr - то же, если нижнее слово больше или равно верхнему
+  SHL,		// SHL n - умножение целого слова на вершине стека на 2^n (сдвиг влево на n разрядов)
+  SHR,		// SHR n - деление целого слова на вершине стека на 2^n с округлением к нулю, как DIV
+
+  // Суперинструкции: часто встречающиеся последовательности базовых инструкций, выполняемые
+  // за одну диспетчеризацию. Список генерируется утилитой tools/superops (см. superops.def).
+#define SUPEROP(name, length, ...) name,
+#include "superops.def"
+#undef SUPEROP
 };
 
+// Наибольшая длина последовательности, заменяемой суперинструкцией, и наибольшее число ее аргументов
+const int MAX_SUPEROP_LENGTH = 4;
+const int MAX_SUPEROP_ARGS = 3;
+
+// Описание суперинструкции: базовые инструкции, которые она заменяет, в порядке выполнения.
+// Аргументы суперинструкции - аргументы составляющих инструкций в том же порядке.
+// Переход может быть только последней составляющей.
+struct Superop
+{
+  Instruction code;
+  const char* name;
+  int length;
+  Instruction parts[MAX_SUPEROP_LENGTH];
+};
+
+// Название инструкции в текстовом листинге
+const char* instructionToString(Instruction instruction);
+
+// Поиск инструкции по названию. Возвращает false, если такой инструкции нет.
+bool stringToInstruction(const string& name, Instruction& instruction);
+
+// Число аргументов инструкции (для суперинструкций - суммарное число аргументов составляющих)
+int argumentCount(Instruction instruction);
+
+// Является ли инструкция переходом (для суперинструкций - заканчивается ли она переходом)
+bool isJump(Instruction instruction);
+
+// Число значений, которые базовая инструкция снимает со стека
+constexpr int stackPops(Instruction instruction)
+{
+  switch (instruction)
+  {
+  case STORE:
+  case BLOAD:
+  case POP:
+  case DUP:
+  case INVERT:
+  case SHL:
+  case SHR:
+  case JUMP_YES:
+  case JUMP_NO:
+  case PRINT:
+    return 1;
+  case BSTORE:
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  case COMPARE:
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+// Число значений, которые базовая инструкция кладет в стек
+constexpr int stackPushes(Instruction instruction)
+{
+  switch (instruction)
+  {
+  case LOAD:
+  case BLOAD:
+  case PUSH:
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  case INVERT:
+  case SHL:
+  case SHR:
+  case COMPARE:
+  case INPUT:
+    return 1;
+  case DUP:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+// Число значений, которые инструкция снимает со стека и кладет в стек (для суперинструкций -
+// суммарно по составляющим)
+void stackEffect(Instruction instruction, int& pops, int& pushes);
+
+// Описание суперинструкции или nullptr для базовой инструкции
+const Superop* findSuperop(Instruction instruction);
+
+// Все суперинструкции в порядке убывания длины
+const vector<Superop>& superops();
+
+// Текстовое представление вещественного числа: кратчайшая форма, которая читается обратно
+// без потерь, всегда с точкой или показателем степени, чтобы отличаться от целого
+string formatFloat(float value);
+
+// То же без выделения памяти: запись в buffer длиной не меньше FLOAT_TEXT_SIZE,
+// возвращает конец записи
+const int FLOAT_TEXT_SIZE = 32;
+char* formatFloat(char* buffer, float value);
+
 // Класс Command представляет машинные инструкции.
 
 class Command
@@ -54,59 +174,134 @@ public:
     flag_ = true;
   }
 
+  // Конструктор для суперинструкций с несколькими целыми аргументами
+  Command(Instruction instruction, int arg, int arg2, int arg3)
+    : instruction_(instruction), arg_(arg), arg2_(arg2), arg3_(arg3)
+  {}
+
   // Печать инструкции
   //     int address - адрес инструкции
   //     ostream& os - поток вывода, куда будет напечатана инструкция
-  void print(int address, ostream& os);
+  void print(int address, ostream& os) const;
+
+  // Разбор строки листинга вида "адрес: ИНСТРУКЦИЯ аргументы".
+  // Возвращает false, если строка не является инструкцией.
+  static bool parse(const string& line, Command& command);
+
+  Instruction instruction() const
+  {
+    return instruction_;
+  }
+
+  // i-й целый аргумент (0 - основной аргумент)
+  int arg(int i = 0) const
+  {
+    return i == 0 ? arg_ : (i == 1 ? arg2_ : arg3_);
+  }
+
+  float farg() const
+  {
+    return farg_;
+  }
+
+  bool isFloat() const
+  {
+    return flag_;
+  }
+
+  void setArg(int i, int value)
+  {
+    (i == 0 ? arg_ : (i == 1 ? arg2_ : arg3_)) = value;
+  }
 
 private:
   Instruction instruction_; // Код инструкции
   int arg_;				  // Аргумент инструкции
   float farg_;
   bool flag_ = false;
+  int arg2_ = 0;			  // Второй и третий аргументы суперинструкций
+  int arg3_ = 0;
 };
 
+struct BasicBlock;
+class FlowGraph;
+
 // Кодогенератор.
 // Назначение кодогенератора:
-// - Формировать программу для виртуальной машины Милана
-// - Отслеживать адрес последней инструкции
-// - Буферизовать программу и печатать ее в указанный поток вывода
+// - Формировать программу для виртуальной машины Милана в виде графа базовых блоков
+// - Отслеживать текущий блок, в который добавляются инструкции
+// - Преобразовывать граф в последовательность инструкций
+//
+// Переходы задаются ссылками на блоки, а не адресами: адреса назначаются при линеаризации.
 
 class CodeGen
 {
 public:
-  explicit CodeGen(ostream& output)
-    : output_(output)
-  {}
+  CodeGen();
+
+  ~CodeGen();
 
-  // Добавление инструкции без аргументов в конец программы
+  // Добавление инструкции без аргументов в конец текущего блока
   void emit(Instruction instruction);
 
-  // Добавление инструкции с одним аргументом в конец программы
+  // Добавление инструкции с одним аргументом в конец текущего блока
   void emit(Instruction instruction, int arg);
 
   void emit(Instruction instruction, float farg);
 
-  // Запись инструкции без аргументов по указанному адресу
-  void emitAt(int address, Instruction instruction);
+  // Копирование в конец текущего блока инструкций блока block с позициями от from до to (не включая to)
+  void emitCopy(BasicBlock* block, int from, int to);
+
+  // Создание блока, который будет размещен позже вызовом startBlock
+  BasicBlock* newBlock();
+
+  // Размещение блока block следом за текущим, block становится текущим.
+  // Если текущий блок не закончился безусловным переходом или остановкой, управление из него
+  // переходит в block.
+  void startBlock(BasicBlock* block);
 
-  // Запись инструкции с одним аргументом по указанному адресу
-  void emitAt(int address, Instruction instruction, int arg);
+  // Завершение текущего блока условным переходом к target. Если условие не выполнено,
+  // управление переходит в следующий размещенный блок.
+  void branch(Instruction instruction, BasicBlock* target);
 
-  void emitAt(int address, Instruction instruction, float arg);
+  // Завершение текущего блока безусловным переходом к target
+  void jump(BasicBlock* target);
 
-  // Получение адреса, непосредственно следующего за последней инструкцией в программе
-  int getCurrentAddress();
+  // Завершение текущего блока остановкой машины
+  void stop();
 
-  // Формирование "пустой" инструкции (NOP) и возврат ее адреса
-  int reserve();
+  // Текущий блок (создается, если предыдущий уже завершен)
+  BasicBlock* currentBlock();
 
-  // Запись последовательности инструкций в выходной поток
-  void flush();
+  // Число инструкций в текущем блоке
+  int position();
+
+  // Граф программы
+  FlowGraph& graph()
+  {
+    return *graph_;
+  }
+
+  // Преобразование графа в последовательность инструкций
+  void linearize();
+
+  // Замена частых последовательностей инструкций суперинструкциями с пересчетом адресов переходов
+  void fuseSuperops();
+
+  // Последовательность инструкций, полученная linearize и fuseSuperops
+  const vector<Command>& code() const
+  {
+    return commandBuffer_;
+  }
 
 private:
-  ostream& output_;               // Выходной поток
+  FlowGraph* graph_;              // Граф программы
+  BasicBlock* current_;           // Текущий блок
+  bool closed_;                   // Текущий блок завершен, новые инструкции попадут в следующий
   vector<Command> commandBuffer_;	// Буфер инструкций
 };
 
+// Печать листинга: инструкции с адресами, по одной на строке
+void printListing(const vector<Command>& code, ostream& output);
+
 #endif
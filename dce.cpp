@@ -0,0 +1,96 @@
+// Удаление мертвого кода и мертвых записей.
+//
+// - Условный переход, обе ветви которого ведут в один блок, заменяется снятием операндов со стека.
+// - Запись STORE в переменную, которая не жива после нее, заменяется на POP; вычисление
+//   записываемого значения затем удаляется, если у него нет побочных эффектов. Удаление записи
+//   может сделать мертвыми записи, значения которых она читала, поэтому шаги повторяются до
+//   неподвижной точки.
+// - Недостижимые блоки (в том числе код после безусловного перехода и STOP) удаляются,
+//   переходы на пустые блоки перенаправляются на их преемников.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+
+// Замена условных переходов на следующий блок
+static int removeTrivialBranches(FlowGraph& graph)
+{
+  int changes = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    if (block->isConditional() && block->target == block->next)
+    {
+      int pops = branchPops(block->branch);
+      for (int i = 0; i < pops; ++i)
+      {
+        block->code.push_back(Command(POP));
+      }
+      block->branch = NOP;
+      block->target = nullptr;
+      removeDeadPops(block->code);
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+// Замена мертвых записей на POP
+static int removeDeadStores(FlowGraph& graph, AnalysisManager& analyses)
+{
+  const Liveness& liveness = analyses.liveness();
+  int changes = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    BitSet live = liveness.liveOut(block);
+    bool changed = false;
+    for (auto it = block->code.rbegin(); it != block->code.rend(); ++it)
+    {
+      if (it->instruction() == LOAD)
+      {
+        live.set(it->arg());
+      }
+      else if (it->instruction() == STORE)
+      {
+        if (!live.test(it->arg()))
+        {
+          *it = Command(POP);
+          changed = true;
+          ++changes;
+        }
+        else
+        {
+          live.reset(it->arg());
+        }
+      }
+    }
+    if (changed)
+    {
+      removeDeadPops(block->code);
+    }
+  }
+  return changes;
+}
+
+int eliminateDeadCode(FlowGraph& graph, AnalysisManager& analyses)
+{
+  //Удаление записей опустошает блоки, а после обхода пустых блоков переходы
+  //могут стать тривиальными, поэтому шаги повторяются, пока граф меняется.
+  //Удаление кода не добавляет переменных и вещественных записей, поэтому число
+  //переменных и их типы остаются верными (с запасом).
+  int variableCount = analyses.variableCount();
+  int changes = 0;
+  int removed;
+  do
+  {
+    graph.skipEmptyBlocks();
+    removed = removeTrivialBranches(graph);
+    removed += graph.removeUnreachable();
+    if (variableCount >= 0)
+    {
+      analyses.invalidate(AnalysisManager::VARIABLES | AnalysisManager::TYPES);
+      removed += removeDeadStores(graph, analyses);
+    }
+    changes += removed;
+  }
+  while (removed > 0);
+  return changes;
+}
@@ -0,0 +1,261 @@
+#include "flowgraph.hpp"
+
+FlowGraph::~FlowGraph()
+{
+  for (BasicBlock* block : pool_)
+  {
+    delete block;
+  }
+}
+
+BasicBlock* FlowGraph::newBlock()
+{
+  BasicBlock* block = new BasicBlock();
+  pool_.push_back(block);
+  return block;
+}
+
+void FlowGraph::place(BasicBlock* block)
+{
+  block->id = blocks_.size();
+  blocks_.push_back(block);
+}
+
+void FlowGraph::placeBefore(const vector<pair<BasicBlock*, BasicBlock*>>& placements)
+{
+  if (placements.empty())
+  {
+    return;
+  }
+  vector<vector<BasicBlock*>> before(blocks_.size());
+  for (const auto& placement : placements)
+  {
+    before[placement.second->id].push_back(placement.first);
+  }
+  vector<BasicBlock*> blocks;
+  blocks.reserve(blocks_.size() + placements.size());
+  for (size_t i = 0; i < blocks_.size(); ++i)
+  {
+    blocks.insert(blocks.end(), before[i].begin(), before[i].end());
+    blocks.push_back(blocks_[i]);
+  }
+  blocks_.swap(blocks);
+  for (size_t i = 0; i < blocks_.size(); ++i)
+  {
+    blocks_[i]->id = i;
+  }
+}
+
+void FlowGraph::computeEdges()
+{
+  for (size_t i = 0; i < blocks_.size(); ++i)
+  {
+    blocks_[i]->id = i;
+    blocks_[i]->succs.clear();
+    blocks_[i]->preds.clear();
+  }
+
+  for (BasicBlock* block : blocks_)
+  {
+    if (block->isConditional())
+    {
+      block->succs.push_back(block->target);
+    }
+    if (block->branch != STOP && block->next && block->next != block->target)
+    {
+      block->succs.push_back(block->next);
+    }
+    for (BasicBlock* succ : block->succs)
+    {
+      succ->preds.push_back(block);
+    }
+  }
+}
+
+// Конечный блок цепочки пустых блоков, начинающейся с block. Найденный конец запоминается
+// в каждом блоке цепочки, поэтому общее время обработки линейно.
+static BasicBlock* skipEmpty(BasicBlock* block, vector<BasicBlock*>& resolved, vector<bool>& visiting)
+{
+  vector<BasicBlock*> chain;
+  BasicBlock* current = block;
+  while (current->id >= 0 && !resolved[current->id] && current->code.empty() && current->branch == NOP &&
+         current->next && !visiting[current->id])
+  {
+    visiting[current->id] = true;
+    chain.push_back(current);
+    current = current->next;
+  }
+  BasicBlock* end = (current->id >= 0 && resolved[current->id]) ? resolved[current->id] : current;
+  for (BasicBlock* link : chain)
+  {
+    resolved[link->id] = end;
+  }
+  return end;
+}
+
+void FlowGraph::skipEmptyBlocks()
+{
+  computeEdges();
+  vector<BasicBlock*> resolved(blocks_.size(), nullptr);
+  vector<bool> visiting(blocks_.size(), false);
+  for (BasicBlock* block : blocks_)
+  {
+    if (block->target)
+    {
+      block->target = skipEmpty(block->target, resolved, visiting);
+    }
+    if (block->next)
+    {
+      block->next = skipEmpty(block->next, resolved, visiting);
+    }
+  }
+}
+
+int FlowGraph::removeUnreachable()
+{
+  if (blocks_.empty())
+  {
+    return 0;
+  }
+
+  computeEdges();
+
+  //Обход в глубину с явным стеком, чтобы не зависеть от глубины вложенности
+  vector<bool> reached(blocks_.size(), false);
+  vector<BasicBlock*> work(1, entry());
+  reached[entry()->id] = true;
+  while (!work.empty())
+  {
+    BasicBlock* block = work.back();
+    work.pop_back();
+    for (BasicBlock* succ : block->succs)
+    {
+      if (!reached[succ->id])
+      {
+        reached[succ->id] = true;
+        work.push_back(succ);
+      }
+    }
+  }
+
+  int removed = 0;
+  vector<BasicBlock*> kept;
+  for (BasicBlock* block : blocks_)
+  {
+    if (reached[block->id])
+    {
+      kept.push_back(block);
+    }
+    else
+    {
+      removed += block->code.size() + (block->branch == NOP ? 0 : 1);
+    }
+  }
+  blocks_.swap(kept);
+  computeEdges();
+  return removed;
+}
+
+int FlowGraph::size() const
+{
+  int count = 0;
+  for (const BasicBlock* block : blocks_)
+  {
+    count += block->code.size();
+    if (block->branch != NOP)
+    {
+      ++count;
+    }
+  }
+  return count;
+}
+
+// Условный переход с противоположным условием. Для переходов со сравнением противоположное
+// условие не совпадает с исходным на NaN, поэтому они не обращаются.
+static bool invertBranch(Instruction branch, Instruction& inverted)
+{
+  switch (branch)
+  {
+  case JUMP_YES:
+    inverted = JUMP_NO;
+    return true;
+  case JUMP_NO:
+    inverted = JUMP_YES;
+    return true;
+  default:
+    return false;
+  }
+}
+
+void FlowGraph::linearize(vector<Command>& program)
+{
+  //Первый проход: адреса начала блоков. Размер завершения блока зависит только от того,
+  //какой блок размещен следом.
+  int count = blocks_.size();
+  for (int i = 0; i < count; ++i)
+  {
+    blocks_[i]->id = i;
+  }
+
+  vector<int> address(count + 1, 0);
+  for (int i = 0; i < count; ++i)
+  {
+    BasicBlock* block = blocks_[i];
+    BasicBlock* following = (i + 1 < count) ? blocks_[i + 1] : nullptr;
+    Instruction inverted;
+    int branchSize = 0;
+    if (block->branch == STOP)
+    {
+      branchSize = 1;
+    }
+    else if (!block->isConditional())
+    {
+      branchSize = (block->next == following) ? 0 : 1;
+    }
+    else if (block->next == following || (block->target == following && invertBranch(block->branch, inverted)))
+    {
+      branchSize = 1;
+    }
+    else
+    {
+      branchSize = 2;
+    }
+    address[i + 1] = address[i] + block->code.size() + branchSize;
+  }
+
+  //Второй проход: генерация инструкций
+  program.clear();
+  program.reserve(address[count]);
+  for (int i = 0; i < count; ++i)
+  {
+    BasicBlock* block = blocks_[i];
+    BasicBlock* following = (i + 1 < count) ? blocks_[i + 1] : nullptr;
+    program.insert(program.end(), block->code.begin(), block->code.end());
+
+    Instruction inverted;
+    if (block->branch == STOP)
+    {
+      program.push_back(Command(STOP));
+    }
+    else if (!block->isConditional())
+    {
+      if (block->next != following)
+      {
+        program.push_back(Command(JUMP, address[block->next->id]));
+      }
+    }
+    else if (block->next == following)
+    {
+      program.push_back(Command(block->branch, address[block->target->id]));
+    }
+    else if (block->target == following && invertBranch(block->branch, inverted))
+    {
+      program.push_back(Command(inverted, address[block->next->id]));
+    }
+    else
+    {
+      program.push_back(Command(block->branch, address[block->target->id]));
+      program.push_back(Command(JUMP, address[block->next->id]));
+    }
+  }
+}
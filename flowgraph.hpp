@@ -0,0 +1,100 @@
+#ifndef CMILAN_FLOWGRAPH_HPP
+#define CMILAN_FLOWGRAPH_HPP
+
+#include "codegen.hpp"
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Базовый блок - линейная последовательность инструкций без переходов, после которой
+// управление передается одному или двум блокам-преемникам.
+//
+// Переходы внутри блока не хранятся: блок ссылается на преемников напрямую, а адреса
+// переходов назначаются только при линеаризации графа (FlowGraph::linearize).
+
+struct BasicBlock
+{
+  int id;                       // Номер блока в порядке размещения (индекс в FlowGraph::blocks())
+  vector<Command> code;         // Инструкции блока, переходов среди них нет
+  Instruction branch;           // Завершение блока: NOP - переход к next, STOP - остановка,
+                                // условный переход (JUMP_YES, JUMP_NO, JEQ, ...) - к target, если
+                                // условие выполнено, и к next иначе
+  BasicBlock* target;           // Цель условного перехода
+  BasicBlock* next;             // Преемник при безусловном переходе или невыполненном условии
+  vector<BasicBlock*> succs;    // Преемники (заполняются FlowGraph::computeEdges)
+  vector<BasicBlock*> preds;    // Предшественники (заполняются FlowGraph::computeEdges)
+
+  BasicBlock()
+    : id(-1), branch(NOP), target(nullptr), next(nullptr)
+  {}
+
+  // Заканчивается ли блок условным переходом
+  bool isConditional() const
+  {
+    return branch != NOP && branch != STOP;
+  }
+};
+
+// Граф потока управления программы.
+//
+// Порядок блоков в blocks() - порядок их размещения в памяти машины, первый блок - вход
+// в программу. Все алгоритмы над графом итеративные и линейные по числу блоков и дуг.
+
+class FlowGraph
+{
+public:
+  FlowGraph()
+  {}
+
+  ~FlowGraph();
+
+  FlowGraph(const FlowGraph&) = delete;
+  FlowGraph& operator=(const FlowGraph&) = delete;
+
+  // Создание нового блока. Блок не участвует в размещении, пока не будет добавлен методом place.
+  BasicBlock* newBlock();
+
+  // Добавление блока в конец размещения
+  void place(BasicBlock* block);
+
+  // Добавление блоков в размещение: блок placements[i].first - непосредственно перед
+  // размещенным блоком placements[i].second (блоки перед одним блоком - в порядке списка).
+  // Блоки перенумеровываются один раз, поэтому новые блоки преобразования собираются
+  // в список и размещаются одним вызовом.
+  void placeBefore(const vector<pair<BasicBlock*, BasicBlock*>>& placements);
+
+  // Блоки в порядке размещения
+  vector<BasicBlock*>& blocks()
+  {
+    return blocks_;
+  }
+
+  BasicBlock* entry() const
+  {
+    return blocks_.empty() ? nullptr : blocks_.front();
+  }
+
+  // Заполнение списков преемников и предшественников и перенумерация блоков
+  void computeEdges();
+
+  // Перенаправление переходов в обход пустых блоков, которые только передают управление дальше
+  void skipEmptyBlocks();
+
+  // Удаление блоков, недостижимых из входа. Возвращает число удаленных инструкций.
+  int removeUnreachable();
+
+  // Общее число инструкций в блоках, включая условные переходы и STOP
+  // (безусловные переходы зависят от размещения и не учитываются)
+  int size() const;
+
+  // Преобразование графа в последовательность инструкций с абсолютными адресами переходов.
+  // Безусловный переход к блоку, размещенному следом, не генерируется.
+  void linearize(vector<Command>& program);
+
+private:
+  vector<BasicBlock*> blocks_;  // Размещенные блоки
+  vector<BasicBlock*> pool_;    // Все созданные блоки (для освобождения памяти)
+};
+
+#endif
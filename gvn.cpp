@@ -0,0 +1,357 @@
+// Нумерация значений и удаление общих подвыражений.
+//
+// Код блока разбирается в деревья выражений, каждому узлу назначается номер значения:
+// узлы с одинаковой операцией над значениями с одинаковыми номерами получают одинаковый
+// номер (операнды целых ADD и MULT и сравнений на равенство упорядочиваются; вещественные
+// сложение и умножение не перестановочны: из двух NaN результатом будет первый, а знак NaN
+// виден при печати). LOAD получает номер
+// значения, последним записанного в переменную, поэтому значение, сохраненное в переменной,
+// узнается и при повторном вычислении.
+//
+// Повторное вычисление чистого выражения заменяется одним из способов:
+// - LOAD переменной, которая в этот момент хранит то же значение;
+// - DUP, если повторное вычисление следует сразу за первым;
+// - LOAD временной переменной, в которую первое вычисление сохраняется через DUP; STORE.
+//
+// Модель стоимости считает каждую инструкцию машины одной диспетчеризацией: повторное
+// вычисление стоит столько, сколько инструкций в его участке кода, загрузка - одну
+// инструкцию, сохранение во временную переменную - две (DUP и STORE) на все использования.
+// Временная переменная заводится, только если суммарная экономия по всем заменам
+// положительна. Временные переменные получают адреса после переменных программы и
+// не живут дольше блока, поэтому в разных блоках используются одни и те же адреса.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <map>
+#include <tuple>
+
+namespace
+{
+
+// Узел дерева выражения (buildExpressionTrees) и его значение
+struct Node : ExpressionNode
+{
+  int number;     // Номер значения
+  bool pure;      // Участок не имеет побочных эффектов и может быть заменен
+  bool integer;   // Значение заведомо целое
+  int holder;     // Переменная, хранящая это значение в момент вычисления (-1 - нет)
+
+  int length() const
+  {
+    return end - start;
+  }
+};
+
+enum Reuse
+{
+  RECOMPUTE,
+  REUSE_DUP,
+  REUSE_VARIABLE,
+  REUSE_TEMPORARY
+};
+
+class ValueNumbering
+{
+public:
+  ValueNumbering(vector<Command>& code, AnalysisManager& analyses, int firstTemporary)
+    : code_(code), analyses_(analyses), firstTemporary_(firstTemporary), numberCount_(0)
+  {}
+
+  // Возвращает число замененных вычислений
+  int run();
+
+private:
+  typedef tuple<int, uint64_t, int, int> Key;
+
+  bool build();
+  int number(const Key& key);
+  int newNumber();
+  void setNumber(int n, int number, bool pure);
+  void choose();
+  void rewrite();
+
+  vector<Command>& code_;
+  AnalysisManager& analyses_;
+  int firstTemporary_;          // Адрес первой временной переменной (-1 - временные запрещены)
+  int numberCount_;
+  map<Key, int> numbers_;
+  map<int, int> variableValue_; // Номер значения, хранящегося в переменной
+  map<int, int> holder_;        // Переменная, в которую последней записано значение
+  vector<Node> nodes_;
+  vector<int> leader_;          // Первый узел с данным номером значения
+  vector<Reuse> reuse_;
+  vector<int> temporary_;       // Временная переменная номера значения (-1 - нет)
+};
+
+int ValueNumbering::newNumber()
+{
+  leader_.push_back(-1);
+  return numberCount_++;
+}
+
+int ValueNumbering::number(const Key& key)
+{
+  auto it = numbers_.find(key);
+  if (it != numbers_.end())
+  {
+    return it->second;
+  }
+  int result = newNumber();
+  numbers_[key] = result;
+  return result;
+}
+
+void ValueNumbering::setNumber(int n, int number, bool pure)
+{
+  Node& node = nodes_[n];
+  node.number = number;
+  node.pure = pure;
+  node.holder = -1;
+  auto it = holder_.find(number);
+  if (it != holder_.end() && variableValue_[it->second] == number)
+  {
+    node.holder = it->second;
+  }
+  if (leader_[number] < 0)
+  {
+    leader_[number] = n;
+  }
+}
+
+// Нумерация значений узлов деревьев выражений блока в порядке вычисления. Возвращает false,
+// если блок использует значения, вычисленные не в нем.
+bool ValueNumbering::build()
+{
+  vector<ExpressionNode> trees;
+  vector<int> top;
+  if (!buildExpressionTrees(code_, trees, top))
+  {
+    return false;
+  }
+  nodes_.resize(trees.size());
+  int n = 0;
+  for (int i = 0; i < int(code_.size()); ++i)
+  {
+    const Command& command = code_[i];
+    Instruction instruction = command.instruction();
+    for (; n < int(trees.size()) && trees[n].end == i + 1; ++n)
+    {
+      static_cast<ExpressionNode&>(nodes_[n]) = trees[n];
+      const ExpressionNode& node = trees[n];
+      nodes_[n].integer = false;
+      if (node.start < 0)
+      {
+        //Значения, вычисленные не выражением, неизвестны
+        setNumber(n, newNumber(), false);
+      }
+      else if (instruction == LOAD)
+      {
+        auto it = variableValue_.find(command.arg());
+        int value = (it != variableValue_.end()) ? it->second : number(Key(LOAD, command.arg(), 0, 0));
+        variableValue_[command.arg()] = value;
+        setNumber(n, value, true);
+        nodes_[n].integer = analyses_.integerVariable(command.arg());
+      }
+      else if (instruction == PUSH)
+      {
+        setNumber(n, number(Key(PUSH, Value::fromCommand(command).key(), 0, 0)), true);
+        nodes_[n].integer = !command.isFloat();
+      }
+      else if (instruction == INPUT)
+      {
+        setNumber(n, newNumber(), false);
+        nodes_[n].integer = true;
+      }
+      else
+      {
+        int a = nodes_[node.operands[0]].number;
+        int b = (node.operands[1] >= 0) ? nodes_[node.operands[1]].number : -1;
+        bool pure = nodes_[node.operands[0]].pure && (b < 0 || nodes_[node.operands[1]].pure);
+        bool integer = nodes_[node.operands[0]].integer && (b < 0 || nodes_[node.operands[1]].integer);
+        int arg = (instruction == COMPARE || instruction == SHL || instruction == SHR) ? command.arg() : 0;
+        bool commutative = ((instruction == ADD || instruction == MULT) && integer) ||
+                           (instruction == COMPARE && (arg == 0 || arg == 1));
+        if (commutative && b < a)
+        {
+          swap(a, b);
+        }
+        setNumber(n, number(Key(instruction, arg, a, b)), pure);
+        nodes_[n].integer = integer || instruction == COMPARE;
+      }
+    }
+
+    if (instruction == STORE)
+    {
+      int value = nodes_[top[i]].number;
+      variableValue_[command.arg()] = value;
+      holder_[value] = command.arg();
+    }
+    else if (instruction == BSTORE)
+    {
+      variableValue_.clear();
+    }
+  }
+  return true;
+}
+
+// Выбор способа замены повторных вычислений
+void ValueNumbering::choose()
+{
+  //Оценка экономии от временной переменной по всем повторам, которые нельзя заменить даром
+  vector<int> saving(numberCount_, -2);
+  for (int n = 0; n < int(nodes_.size()); ++n)
+  {
+    const Node& node = nodes_[n];
+    int leader = leader_[node.number];
+    if (leader != n && node.pure && node.length() > 1 && node.holder < 0 &&
+        node.start != nodes_[leader].end)
+    {
+      saving[node.number] += node.length() - 1;
+    }
+  }
+
+  //Узлы обходятся от корней к листьям (родитель создан позже операндов); участки внутри
+  //замененного выражения не рассматриваются
+  reuse_.assign(nodes_.size(), RECOMPUTE);
+  vector<bool> covered(nodes_.size(), false);
+  for (int n = nodes_.size() - 1; n >= 0; --n)
+  {
+    const Node& node = nodes_[n];
+    if (node.parent >= 0)
+    {
+      covered[n] = covered[node.parent] || reuse_[node.parent] != RECOMPUTE;
+    }
+    int leader = leader_[node.number];
+    if (covered[n] || leader == n || !node.pure || node.length() <= 1)
+    {
+      continue;
+    }
+    if (node.holder >= 0)
+    {
+      reuse_[n] = REUSE_VARIABLE;
+    }
+    else if (node.start == nodes_[leader].end)
+    {
+      reuse_[n] = REUSE_DUP;
+    }
+    else if (firstTemporary_ >= 0 && saving[node.number] > 0)
+    {
+      reuse_[n] = REUSE_TEMPORARY;
+    }
+  }
+
+  //Оценка могла учесть повторы внутри замененных выражений: пересчитываем по
+  //фактическим заменам и отказываемся от невыгодных временных переменных
+  saving.assign(numberCount_, -2);
+  for (int n = 0; n < int(nodes_.size()); ++n)
+  {
+    if (reuse_[n] == REUSE_TEMPORARY)
+    {
+      saving[nodes_[n].number] += nodes_[n].length() - 1;
+    }
+  }
+  temporary_.assign(numberCount_, -1);
+  int temporaryCount = 0;
+  for (int n = 0; n < int(nodes_.size()); ++n)
+  {
+    int value = nodes_[n].number;
+    if (reuse_[n] != REUSE_TEMPORARY)
+    {
+      continue;
+    }
+    if (saving[value] <= 0)
+    {
+      reuse_[n] = RECOMPUTE;
+    }
+    else if (temporary_[value] < 0)
+    {
+      temporary_[value] = firstTemporary_ + temporaryCount++;
+    }
+  }
+}
+
+void ValueNumbering::rewrite()
+{
+  //Замены начинаются в начале участка, сохранение во временную - в конце первого вычисления
+  vector<int> replaceAt(code_.size(), -1);
+  vector<int> saveAfter(code_.size() + 1, -1);
+  for (int n = 0; n < int(nodes_.size()); ++n)
+  {
+    if (reuse_[n] != RECOMPUTE)
+    {
+      replaceAt[nodes_[n].start] = n;
+    }
+    if (leader_[nodes_[n].number] == n && temporary_[nodes_[n].number] >= 0)
+    {
+      saveAfter[nodes_[n].end] = temporary_[nodes_[n].number];
+    }
+  }
+
+  vector<Command> result;
+  result.reserve(code_.size());
+  int i = 0;
+  while (i < int(code_.size()))
+  {
+    int n = replaceAt[i];
+    if (n >= 0)
+    {
+      const Node& node = nodes_[n];
+      switch (reuse_[n])
+      {
+      case REUSE_DUP:
+        result.push_back(Command(DUP));
+        break;
+      case REUSE_VARIABLE:
+        result.push_back(Command(LOAD, node.holder));
+        break;
+      default:
+        result.push_back(Command(LOAD, temporary_[node.number]));
+        break;
+      }
+      i = node.end;
+    }
+    else
+    {
+      result.push_back(code_[i]);
+      ++i;
+    }
+    if (saveAfter[i] >= 0)
+    {
+      result.push_back(Command(DUP));
+      result.push_back(Command(STORE, saveAfter[i]));
+    }
+  }
+  code_.swap(result);
+}
+
+int ValueNumbering::run()
+{
+  if (!build())
+  {
+    return 0;
+  }
+  choose();
+  int changes = count_if(reuse_.begin(), reuse_.end(), [](Reuse reuse) { return reuse != RECOMPUTE; });
+  if (changes > 0)
+  {
+    rewrite();
+  }
+  return changes;
+}
+
+}
+
+int eliminateCommonSubexpressions(FlowGraph& graph, AnalysisManager& analyses)
+{
+  //При индексной адресации временная переменная может совпасть с элементом массива
+  int firstTemporary = analyses.variableCount();
+  int changes = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    ValueNumbering numbering(block->code, analyses, firstTemporary);
+    changes += numbering.run();
+  }
+  return changes;
+}
@@ -0,0 +1,1120 @@
+#include "vm.hpp"
+#include "codecache.hpp"
+#include "vmio.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define MILAN_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+#ifdef MILAN_JIT_X86_64
+
+namespace
+{
+
+struct Context;
+
+typedef bool (*Helper)(Context* context, Value* operands, int arg);
+
+const int HELPER_COUNT = 10;
+
+// Данные, к которым обращаются вспомогательные функции. Адрес памяти - первое поле:
+// после вызовов, которые могут расширить память, код перечитывает его в r12. Машинный код
+// вызывает вспомогательные функции через таблицу helpers, а не по абсолютным адресам, и
+// поэтому не зависит от адреса, по которому загружен (это нужно кэшу кода).
+struct Context
+{
+  Value* memory;
+  vector<Value>* memoryVector;
+  istream* input;
+  ostream* output;
+  Helper helpers[HELPER_COUNT];
+  string message;
+};
+
+static_assert(offsetof(Context, memory) == 0, "memory must be the first field of Context");
+static_assert(sizeof(Value) == 12 && offsetof(Value, isFloat) == 0 && offsetof(Value, i) == 4 &&
+              offsetof(Value, f) == 8, "machine code relies on the layout of Value");
+
+// Вспомогательные функции, которые вызывает машинный код. Все получают контекст, указатель
+// на первый операнд (операнды лежат подряд, результат записывается на место первого) и целый
+// аргумент; возвращают false при ошибке, функции test* - условие перехода.
+
+bool arithmetic(Context* context, Value* operands, int instruction)
+{
+  if (!evaluate(static_cast<Instruction>(instruction), operands[0], operands[1], operands[0]))
+  {
+    context->message = "division by zero";
+    return false;
+  }
+  return true;
+}
+
+bool shiftLeft(Context*, Value* operands, int bits)
+{
+  operands[0] = shift(SHL, operands[0], bits);
+  return true;
+}
+
+bool shiftRight(Context*, Value* operands, int bits)
+{
+  operands[0] = shift(SHR, operands[0], bits);
+  return true;
+}
+
+bool compareValues(Context*, Value* operands, int cmp)
+{
+  operands[0] = Value::fromInt(compare(cmp, operands[0], operands[1]) ? 1 : 0);
+  return true;
+}
+
+bool testCondition(Context*, Value* operands, int cmp)
+{
+  return compare(cmp, operands[0], operands[1]);
+}
+
+bool testTruth(Context*, Value* operands, int)
+{
+  return operands[0].isTrue();
+}
+
+Value* locate(Context* context, const Value& index, int base)
+{
+  if (index.isFloat)
+  {
+    context->message = "float index";
+    return nullptr;
+  }
+  int address = base + index.i;
+  if (address < 0 || address >= MEMORY_LIMIT)
+  {
+    context->message = "invalid address " + to_string(address);
+    return nullptr;
+  }
+  if (address >= int(context->memoryVector->size()))
+  {
+    context->memoryVector->resize(address + 1);
+    context->memory = context->memoryVector->data();
+  }
+  return &context->memory[address];
+}
+
+bool loadIndexed(Context* context, Value* operands, int base)
+{
+  Value* cell = locate(context, operands[0], base);
+  if (!cell)
+  {
+    return false;
+  }
+  operands[0] = *cell;
+  return true;
+}
+
+bool storeIndexed(Context* context, Value* operands, int base)
+{
+  Value* cell = locate(context, operands[1], base);
+  if (!cell)
+  {
+    return false;
+  }
+  *cell = operands[0];
+  return true;
+}
+
+bool input(Context* context, Value* operands, int)
+{
+  int value;
+  if (!readInt(*context->input, value))
+  {
+    context->message = "invalid input";
+    return false;
+  }
+  operands[0] = Value::fromInt(value);
+  return true;
+}
+
+bool print(Context* context, Value* operands, int)
+{
+  printValue(*context->output, operands[0]);
+  return true;
+}
+
+// Таблица вспомогательных функций; машинный код вызывает их по номеру в ней
+const Helper HELPERS[HELPER_COUNT] = {arithmetic, shiftLeft, shiftRight, compareValues, testCondition, testTruth,
+                                      loadIndexed, storeIndexed, input, print};
+
+// Слово в памяти: слот стека (относительно rbx) или переменная (относительно r12)
+struct Location
+{
+  bool variable;
+  int offset;
+};
+
+// Слово стека во время компиляции. Значения LOAD и PUSH не копируются в стек, пока это
+// не понадобится: операции читают их прямо из переменной или как непосредственный операнд.
+struct Operand
+{
+  enum Kind
+  {
+    SLOT,       // Значение в слоте стека
+    VARIABLE,   // Значение переменной address
+    CONSTANT    // Значение value
+  };
+
+  Kind kind;
+  int address;
+  Value value;
+};
+
+// Составляющая инструкции программы (у суперинструкций их несколько)
+struct Part
+{
+  Instruction instruction;
+  int arg;
+  Value value;
+  int address;
+  bool first;
+};
+
+// Шаблонный компилятор: каждая базовая инструкция заменяется фиксированной последовательностью
+// машинных команд. Регистры: rbx - начало стека, r12 - память, r13 - Context. Глубина стека
+// перед каждой инструкцией известна (verifyProgram), поэтому адреса слотов постоянны.
+// Целые операнды обрабатываются на месте, вещественные и редкие инструкции - вызовом
+// вспомогательных функций. Машинный код - функция int(Context*, Value* stack, Value* memory),
+// возвращающая -1 после STOP или адрес инструкции, на которой произошла ошибка.
+//
+// Компилироваться может и часть программы - инструкции с адресами от first до last (цикл
+// для TieredMachine). Тогда код начинает с адреса first со стеком в слотах, а переходы за
+// пределы участка возвращают -2 - X, где X - адрес, с которого продолжает интерпретатор.
+class Compiler
+{
+public:
+  Compiler(const vector<Command>& program, const vector<int>& depth)
+    : program_(program), depth_(depth), first_(0), last_(program.size() - 1)
+  {}
+
+  Compiler(const vector<Command>& program, const vector<int>& depth, int first, int last)
+    : program_(program), depth_(depth), first_(first), last_(last)
+  {}
+
+  void compile(vector<uint8_t>& code);
+
+private:
+  // Компиляция составляющей parts_[index]; возвращает число использованных составляющих
+  int compilePart(size_t index);
+
+  void compileArithmetic(Instruction instruction, Location* target);
+  void compileShift(Instruction instruction, int bits);
+  void compileBranch(Instruction instruction, int target);
+
+  void bytes(initializer_list<uint8_t> list)
+  {
+    code_->insert(code_->end(), list);
+  }
+
+  void dword(uint32_t value)
+  {
+    uint8_t buffer[4];
+    memcpy(buffer, &value, 4);
+    code_->insert(code_->end(), buffer, buffer + 4);
+  }
+
+  void qword(uint64_t value)
+  {
+    uint8_t buffer[8];
+    memcpy(buffer, &value, 8);
+    code_->insert(code_->end(), buffer, buffer + 8);
+  }
+
+  // Команда с операндом в памяти [at + extra]: префикс REX (W - 64-разрядный операнд,
+  // B - база r12), код операции, ModRM с полем reg и 32-разрядное смещение
+  void memory(bool wide, initializer_list<uint8_t> opcode, int reg, Location at, int extra)
+  {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (at.variable ? 0x01 : 0);
+    if (rex != 0x40)
+    {
+      bytes({rex});
+    }
+    bytes(opcode);
+    bytes({uint8_t(0x80 | reg << 3 | (at.variable ? 4 : 3))});
+    if (at.variable)
+    {
+      bytes({0x24});
+    }
+    dword(at.offset + extra);
+  }
+
+  // Переход вперед: condition - второй байт jcc rel32 (0x84 - je и т.д.) или 0 для jmp.
+  // Смещение записывается вызовом bind.
+  int forward(uint8_t condition)
+  {
+    if (condition)
+    {
+      bytes({0x0F, condition});
+    }
+    else
+    {
+      bytes({0xE9});
+    }
+    dword(0);
+    return code_->size() - 4;
+  }
+
+  void bind(int position)
+  {
+    int32_t offset = code_->size() - (position + 4);
+    memcpy(&(*code_)[position], &offset, 4);
+  }
+
+  // Переход к инструкции программы target
+  void jumpTo(uint8_t condition, int target)
+  {
+    fixups_.push_back({forward(condition), target});
+  }
+
+  // Переход к выходу с кодом возврата в eax
+  void exit()
+  {
+    exits_.push_back(forward(0));
+  }
+
+  static Location slot(int position)
+  {
+    return {false, 12 * position};
+  }
+
+  static Location variable(int address)
+  {
+    return {true, 12 * address};
+  }
+
+  Location locate(int position) const
+  {
+    const Operand& operand = stack_[position];
+    return operand.kind == Operand::VARIABLE ? variable(operand.address) : slot(position);
+  }
+
+  // Копирование значения операнда в слово target (без изменения стека компиляции)
+  void copy(const Operand& operand, int position, Location target);
+
+  // Запись операнда в его слот стека
+  void materialize(int position);
+
+  // Запись в слоты всех операндов, которые еще не там (перед переходами и их адресами)
+  void flush();
+
+  // Запись в слоты операндов ниже позиции limit - переменных, которые изменит запись
+  // в address (для address < 0 - всех переменных)
+  void release(int address, int limit);
+
+  void push(Operand::Kind kind, int address, const Value& value)
+  {
+    stack_.push_back({kind, address, value});
+  }
+
+  // Вызов helper(context, &at, arg); результат в eax
+  void call(Helper helper, Location at, int arg);
+
+  // Выход с ошибкой, если вызванная функция вернула false
+  void checkResult();
+
+  // Проверка, что операнды целые: переходы к медленному пути добавляются в slow.
+  // Для константы проверка не нужна.
+  void checkIntegers(int first, int second, vector<int>& slow);
+
+  // mov eax, операнд (целое значение)
+  void loadInteger(int position);
+
+  // Запись целого из eax в слово target
+  void storeInteger(Location target);
+
+  const vector<Command>& program_;
+  const vector<int>& depth_;
+  int first_;                       // Адреса первой и последней инструкций участка
+  int last_;
+  vector<Part> parts_;
+  vector<bool> isTarget_;
+  vector<Operand> stack_;
+  vector<uint8_t>* code_;
+  vector<pair<int, int>> fixups_;   // Позиция смещения rel32 и адрес инструкции
+  vector<int> exits_;               // Позиции смещений переходов к выходу
+  int address_;                     // Адрес компилируемой инструкции
+};
+
+void Compiler::copy(const Operand& operand, int position, Location target)
+{
+  if (operand.kind == Operand::CONSTANT)
+  {
+    uint32_t bits;
+    memcpy(&bits, &operand.value.f, 4);
+    bytes({0x48, 0xB8});                                // mov rax, isFloat | i << 32
+    qword((operand.value.isFloat ? 1 : 0) | uint64_t(uint32_t(operand.value.i)) << 32);
+    memory(true, {0x89}, 0, target, 0);                 // mov [target], rax
+    memory(false, {0xC7}, 0, target, 8);                // mov dword [target + 8], f
+    dword(bits);
+    return;
+  }
+  Location source = operand.kind == Operand::VARIABLE ? variable(operand.address) : slot(position);
+  if (source.variable == target.variable && source.offset == target.offset)
+  {
+    return;
+  }
+  memory(true, {0x8B}, 0, source, 0);                   // mov rax, [source]
+  memory(true, {0x89}, 0, target, 0);                   // mov [target], rax
+  memory(false, {0x8B}, 0, source, 8);                  // mov eax, [source + 8]
+  memory(false, {0x89}, 0, target, 8);                  // mov [target + 8], eax
+}
+
+void Compiler::materialize(int position)
+{
+  Operand& operand = stack_[position];
+  if (operand.kind != Operand::SLOT)
+  {
+    copy(operand, position, slot(position));
+    operand.kind = Operand::SLOT;
+  }
+}
+
+void Compiler::flush()
+{
+  for (size_t i = 0; i < stack_.size(); ++i)
+  {
+    materialize(i);
+  }
+}
+
+void Compiler::release(int address, int limit)
+{
+  for (int i = 0; i < limit; ++i)
+  {
+    if (stack_[i].kind == Operand::VARIABLE && (address < 0 || stack_[i].address == address))
+    {
+      materialize(i);
+    }
+  }
+}
+
+void Compiler::call(Helper helper, Location at, int arg)
+{
+  memory(true, {0x8D}, 6, at, 0);                       // lea rsi, [at]
+  bytes({0x4C, 0x89, 0xEF});                            // mov rdi, r13
+  bytes({0xBA});                                        // mov edx, arg
+  dword(arg);
+  int index = find(HELPERS, HELPERS + HELPER_COUNT, helper) - HELPERS;
+  bytes({0x41, 0xFF, 0x95});                            // call [r13 + helpers + 8 * index]
+  dword(offsetof(Context, helpers) + 8 * index);
+}
+
+void Compiler::checkResult()
+{
+  bytes({0x84, 0xC0});                                  // test al, al
+  int ok = forward(0x85);                               // jnz ok
+  bytes({0xB8});                                        // mov eax, address
+  dword(address_);
+  exit();
+  bind(ok);
+}
+
+void Compiler::checkIntegers(int first, int second, vector<int>& slow)
+{
+  vector<Location> tags;
+  for (int position : {first, second})
+  {
+    if (position >= 0 && stack_[position].kind != Operand::CONSTANT)
+    {
+      tags.push_back(locate(position));
+    }
+  }
+  if (tags.empty())
+  {
+    return;
+  }
+  if (tags.size() == 1)
+  {
+    memory(false, {0x80}, 7, tags[0], 0);               // cmp byte [tag], 0
+    bytes({0x00});
+  }
+  else
+  {
+    memory(false, {0x8A}, 0, tags[0], 0);               // mov al, [tag]
+    memory(false, {0x0A}, 0, tags[1], 0);               // or al, [tag]
+  }
+  slow.push_back(forward(0x85));                        // jnz slow
+}
+
+void Compiler::loadInteger(int position)
+{
+  if (stack_[position].kind == Operand::CONSTANT)
+  {
+    bytes({0xB8});                                      // mov eax, imm
+    dword(stack_[position].value.i);
+  }
+  else
+  {
+    memory(false, {0x8B}, 0, locate(position), 4);      // mov eax, [i]
+  }
+}
+
+void Compiler::storeInteger(Location target)
+{
+  memory(false, {0x89}, 0, target, 4);                  // mov [target + 4], eax
+  memory(false, {0xC6}, 0, target, 0);                  // mov byte [target], 0
+  bytes({0x00});
+}
+
+void Compiler::compileArithmetic(Instruction instruction, Location* target)
+{
+  int first = stack_.size() - 2;
+  int second = first + 1;
+  const Operand& a = stack_[first];
+  const Operand& b = stack_[second];
+  Value result;
+  if (a.kind == Operand::CONSTANT && b.kind == Operand::CONSTANT && evaluate(instruction, a.value, b.value, result))
+  {
+    stack_.resize(first);
+    push(Operand::CONSTANT, 0, result);
+    if (target)
+    {
+      copy(stack_.back(), first, *target);
+    }
+    return;
+  }
+
+  //Быстрый путь: оба операнда целые (для DIV - и делитель положителен)
+  bool constantFloat = (a.kind == Operand::CONSTANT && a.value.isFloat) ||
+                       (b.kind == Operand::CONSTANT && b.value.isFloat);
+  bool badDivisor = instruction == DIV && b.kind == Operand::CONSTANT && b.value.i <= 0;
+  Location destination = target ? *target : slot(first);
+  vector<int> slow;
+  int done = -1;
+  if (!constantFloat && !badDivisor)
+  {
+    checkIntegers(first, second, slow);
+    loadInteger(first);
+    if (b.kind == Operand::CONSTANT)
+    {
+      switch (instruction)
+      {
+      case ADD:
+        bytes({0x05});                                  // add eax, imm
+        break;
+      case SUB:
+        bytes({0x2D});                                  // sub eax, imm
+        break;
+      case MULT:
+        bytes({0x69, 0xC0});                            // imul eax, eax, imm
+        break;
+      default:
+        bytes({0xB9});                                  // mov ecx, imm
+        dword(b.value.i);
+        bytes({0x99, 0xF7, 0xF9});                      // cdq; idiv ecx
+        break;
+      }
+      if (instruction != DIV)
+      {
+        dword(b.value.i);
+      }
+    }
+    else
+    {
+      Location at = locate(second);
+      switch (instruction)
+      {
+      case ADD:
+        memory(false, {0x03}, 0, at, 4);                // add eax, [b]
+        break;
+      case SUB:
+        memory(false, {0x2B}, 0, at, 4);                // sub eax, [b]
+        break;
+      case MULT:
+        memory(false, {0x0F, 0xAF}, 0, at, 4);          // imul eax, [b]
+        break;
+      default:
+        memory(false, {0x83}, 7, at, 4);                // cmp dword [b], 0
+        bytes({0x00});
+        slow.push_back(forward(0x8E));                  // jle slow
+        bytes({0x99});                                  // cdq
+        memory(false, {0xF7}, 7, at, 4);                // idiv dword [b]
+        break;
+      }
+    }
+    storeInteger(destination);
+    done = forward(0);
+  }
+
+  //Медленный путь: операнды копируются в слоты стека, результат вычисляет evaluate
+  for (int position : slow)
+  {
+    bind(position);
+  }
+  copy(a, first, slot(first));
+  copy(b, second, slot(second));
+  call(arithmetic, slot(first), instruction);
+  checkResult();
+  if (target)
+  {
+    copy({Operand::SLOT, 0, Value()}, first, *target);
+  }
+  if (done >= 0)
+  {
+    bind(done);
+  }
+  stack_.resize(first);
+  push(Operand::SLOT, 0, Value());
+}
+
+void Compiler::compileShift(Instruction instruction, int bits)
+{
+  int position = stack_.size() - 1;
+  if (stack_[position].kind == Operand::CONSTANT)
+  {
+    stack_[position].value = shift(instruction, stack_[position].value, bits);
+    return;
+  }
+  materialize(position);
+  Location at = slot(position);
+  memory(false, {0x80}, 7, at, 0);                      // cmp byte [tag], 0
+  bytes({0x00});
+  int slow = forward(0x85);                             // jne slow
+  if (instruction == SHL)
+  {
+    memory(false, {0xC1}, 4, at, 4);                    // shl dword [i], bits
+    bytes({uint8_t(bits)});
+  }
+  else
+  {
+    //Для отрицательных чисел прибавляем 2^bits - 1, чтобы сдвиг округлял к нулю
+    memory(false, {0x8B}, 0, at, 4);                    // mov eax, [i]
+    bytes({0x89, 0xC2});                                // mov edx, eax
+    bytes({0xC1, 0xFA, 0x1F});                          // sar edx, 31
+    bytes({0x81, 0xE2});                                // and edx, 2^bits - 1
+    dword((1u << bits) - 1);
+    bytes({0x01, 0xD0});                                // add eax, edx
+    bytes({0xC1, 0xF8, uint8_t(bits)});                 // sar eax, bits
+    memory(false, {0x89}, 0, at, 4);                    // mov [i], eax
+  }
+  int done = forward(0);
+  bind(slow);
+  call(instruction == SHL ? shiftLeft : shiftRight, at, bits);
+  bind(done);
+}
+
+void Compiler::compileBranch(Instruction instruction, int target)
+{
+  //Условие перехода: 0x84 - je, 0x85 - jne, 0x8C - jl, 0x8F - jg, 0x8E - jle, 0x8D - jge
+  static const uint8_t conditions[] = {0x84, 0x85, 0x8C, 0x8F, 0x8E, 0x8D};
+  if (instruction == JUMP_YES || instruction == JUMP_NO)
+  {
+    int position = stack_.size() - 1;
+    Operand operand = stack_[position];
+    stack_.pop_back();
+    flush();
+    uint8_t taken = instruction == JUMP_YES ? 0x85 : 0x84;
+    if (operand.kind == Operand::CONSTANT)
+    {
+      if (operand.value.isTrue() == (instruction == JUMP_YES))
+      {
+        jumpTo(0, target);
+      }
+      return;
+    }
+    stack_.push_back(operand);
+    Location at = locate(position);
+    stack_.pop_back();
+    memory(false, {0x80}, 7, at, 0);                    // cmp byte [tag], 0
+    bytes({0x00});
+    int slow = forward(0x85);                           // jne slow
+    memory(false, {0x83}, 7, at, 4);                    // cmp dword [i], 0
+    bytes({0x00});
+    jumpTo(taken, target);                              // jnz/jz target
+    int done = forward(0);
+    bind(slow);
+    call(testTruth, at, 0);
+    bytes({0x84, 0xC0});                                // test al, al
+    jumpTo(taken, target);                              // jnz/jz target
+    bind(done);
+    return;
+  }
+
+  int cmp = jumpComparison(instruction);
+  int first = stack_.size() - 2;
+  int second = first + 1;
+  Operand a = stack_[first];
+  Operand b = stack_[second];
+  if (a.kind == Operand::CONSTANT && b.kind == Operand::CONSTANT)
+  {
+    stack_.resize(first);
+    flush();
+    if (compare(cmp, a.value, b.value))
+    {
+      jumpTo(0, target);
+    }
+    return;
+  }
+
+  //Операнды остаются на месте, остальные слова стека записываются в слоты
+  for (int i = 0; i < first; ++i)
+  {
+    materialize(i);
+  }
+  vector<int> slow;
+  int done = -1;
+  if (!(a.kind == Operand::CONSTANT && a.value.isFloat) && !(b.kind == Operand::CONSTANT && b.value.isFloat))
+  {
+    checkIntegers(first, second, slow);
+    loadInteger(first);
+    if (b.kind == Operand::CONSTANT)
+    {
+      bytes({0x3D});                                    // cmp eax, imm
+      dword(b.value.i);
+    }
+    else
+    {
+      memory(false, {0x3B}, 0, locate(second), 4);      // cmp eax, [b]
+    }
+    jumpTo(conditions[cmp], target);                    // jcc target
+    done = forward(0);
+  }
+  for (int position : slow)
+  {
+    bind(position);
+  }
+  copy(a, first, slot(first));
+  copy(b, second, slot(second));
+  call(testCondition, slot(first), cmp);
+  bytes({0x84, 0xC0});                                  // test al, al
+  jumpTo(0x85, target);                                 // jnz target
+  if (done >= 0)
+  {
+    bind(done);
+  }
+  stack_.resize(first);
+}
+
+int Compiler::compilePart(size_t index)
+{
+  const Part& part = parts_[index];
+  int top = stack_.size() - 1;
+  switch (part.instruction)
+  {
+  case NOP:
+    break;
+
+  case STOP:
+    bytes({0xB8});                                      // mov eax, -1
+    dword(-1);
+    exit();
+    break;
+
+  case LOAD:
+    push(Operand::VARIABLE, part.arg, Value());
+    break;
+
+  case PUSH:
+    push(Operand::CONSTANT, 0, part.value);
+    break;
+
+  case STORE:
+  {
+    Operand operand = stack_[top];
+    stack_.pop_back();
+    if (operand.kind != Operand::VARIABLE || operand.address != part.arg)
+    {
+      release(part.arg, top);
+      copy(operand, top, variable(part.arg));
+    }
+    break;
+  }
+
+  case POP:
+    stack_.pop_back();
+    break;
+
+  case DUP:
+    if (stack_[top].kind == Operand::SLOT)
+    {
+      copy(stack_[top], top, slot(top + 1));
+    }
+    stack_.push_back(stack_[top]);
+    break;
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  {
+    //Результат, который сразу записывается в переменную, вычисляется прямо в нее;
+    //сами операнды читаются раньше записи
+    if (index + 1 < parts_.size() && parts_[index + 1].instruction == STORE &&
+        !(parts_[index + 1].first && isTarget_[parts_[index + 1].address]))
+    {
+      Location target = variable(parts_[index + 1].arg);
+      release(parts_[index + 1].arg, top - 1);
+      compileArithmetic(part.instruction, &target);
+      stack_.pop_back();
+      return 2;
+    }
+    compileArithmetic(part.instruction, nullptr);
+    break;
+  }
+
+  case INVERT:
+    if (stack_[top].kind == Operand::CONSTANT)
+    {
+      stack_[top].value = invert(stack_[top].value);
+      break;
+    }
+    materialize(top);
+    {
+      Location at = slot(top);
+      memory(false, {0x80}, 7, at, 0);                  // cmp byte [tag], 0
+      bytes({0x00});
+      int isFloat = forward(0x85);                      // jne float
+      memory(false, {0xF7}, 3, at, 4);                  // neg dword [i]
+      int done = forward(0);
+      bind(isFloat);
+      memory(false, {0x81}, 6, at, 8);                  // xor dword [f], знаковый разряд
+      dword(0x80000000u);
+      bind(done);
+    }
+    break;
+
+  case SHL:
+  case SHR:
+    compileShift(part.instruction, part.arg);
+    break;
+
+  case COMPARE:
+    materialize(top - 1);
+    materialize(top);
+    call(compareValues, slot(top - 1), part.arg);
+    stack_.pop_back();
+    break;
+
+  case BLOAD:
+    materialize(top);
+    call(loadIndexed, slot(top), part.arg);
+    checkResult();
+    bytes({0x4D, 0x8B, 0x65, 0x00});                    // mov r12, [r13]: память могла переместиться
+    break;
+
+  case BSTORE:
+    //Запись по индексу может изменить любую переменную
+    materialize(top - 1);
+    materialize(top);
+    release(-1, top - 1);
+    call(storeIndexed, slot(top - 1), part.arg);
+    checkResult();
+    bytes({0x4D, 0x8B, 0x65, 0x00});                    // mov r12, [r13]
+    stack_.resize(top - 1);
+    break;
+
+  case INPUT:
+    call(input, slot(top + 1), 0);
+    checkResult();
+    push(Operand::SLOT, 0, Value());
+    break;
+
+  case PRINT:
+    if (stack_[top].kind == Operand::CONSTANT)
+    {
+      materialize(top);
+    }
+    call(print, locate(top), 0);
+    stack_.pop_back();
+    break;
+
+  case JUMP:
+    flush();
+    jumpTo(0, part.arg);
+    break;
+
+  default:
+    compileBranch(part.instruction, part.arg);
+    break;
+  }
+  return 1;
+}
+
+void Compiler::compile(vector<uint8_t>& code)
+{
+  code_ = &code;
+  code.clear();
+  fixups_.clear();
+  exits_.clear();
+
+  //Разбиение суперинструкций на составляющие и поиск адресов переходов
+  parts_.clear();
+  isTarget_.assign(program_.size(), false);
+  for (int i = first_; i <= last_; ++i)
+  {
+    const Command& command = program_[i];
+    const Superop* superop = findSuperop(command.instruction());
+    int length = superop ? superop->length : 1;
+    int next = 0;
+    for (int j = 0; j < length; ++j)
+    {
+      Instruction instruction = superop ? superop->parts[j] : command.instruction();
+      int arg = argumentCount(instruction) > 0 ? command.arg(next++) : 0;
+      Value value = superop ? Value::fromInt(arg) : Value::fromCommand(command);
+      parts_.push_back({instruction, arg, value, i, j == 0});
+      if (isJump(instruction))
+      {
+        isTarget_[arg] = true;
+      }
+    }
+  }
+
+  //Пролог: сохранение rbx и r12 - r15 (стек остается выровненным на 16 байт для вызовов)
+  bytes({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+  bytes({0x49, 0x89, 0xFD});                            // mov r13, rdi
+  bytes({0x48, 0x89, 0xF3});                            // mov rbx, rsi
+  bytes({0x49, 0x89, 0xD4});                            // mov r12, rdx
+
+  //Код начинается с адреса first_, стек которого записан в слоты
+  vector<int> start(program_.size());
+  stack_.clear();
+  bool reachable = false;
+  for (size_t index = 0; index < parts_.size();)
+  {
+    const Part& part = parts_[index];
+    if (part.first)
+    {
+      //На адрес перехода стек приходит записанным в слоты; после безусловного перехода
+      //компиляция продолжается с глубиной, вычисленной verifyProgram
+      if (reachable && isTarget_[part.address])
+      {
+        flush();
+      }
+      start[part.address] = code.size();
+      if (!reachable)
+      {
+        stack_.assign(max(depth_[part.address], 0), {Operand::SLOT, 0, Value()});
+      }
+      reachable = depth_[part.address] >= 0;
+    }
+    address_ = part.address;
+    if (!reachable)
+    {
+      ++index;
+      continue;
+    }
+    index += compilePart(index);
+    if (part.instruction == JUMP || part.instruction == STOP)
+    {
+      reachable = false;
+    }
+  }
+  if (reachable && last_ + 1 < int(program_.size()))
+  {
+    flush();
+    jumpTo(0, last_ + 1);
+  }
+
+  //Выходы за пределы участка: mov eax, -2 - адрес
+  for (const pair<int, int>& fixup : fixups_)
+  {
+    int target = fixup.second;
+    if ((target < first_ || target > last_) && start[target] == 0)
+    {
+      start[target] = code.size();
+      bytes({0xB8});
+      dword(-2 - target);
+      exit();
+    }
+  }
+
+  //Эпилог: eax уже содержит результат
+  int exit = code.size();
+  bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+
+  for (const pair<int, int>& fixup : fixups_)
+  {
+    int32_t offset = start[fixup.second] - (fixup.first + 4);
+    memcpy(&code[fixup.first], &offset, 4);
+  }
+  for (int position : exits_)
+  {
+    int32_t offset = exit - (position + 4);
+    memcpy(&code[position], &offset, 4);
+  }
+}
+
+// Идентификатор компилятора для кэша кода. Версию нужно увеличивать при любом изменении
+// порождаемого кода: последовательностей команд, таблицы HELPERS, раскладки Context и Value,
+// набора суперинструкций. Одинаковые сборки пользуются одним кэшем.
+const char COMPILER_ID[] = "milan template jit 2";
+
+// Копирование кода в память, выделенную mmap: код записывается в память, доступную для
+// записи, и только затем она делается исполняемой
+void* makeExecutable(const vector<uint8_t>& code, string& error)
+{
+  void* region = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+  {
+    error = "cannot allocate memory for machine code";
+    return nullptr;
+  }
+  memcpy(region, code.data(), code.size());
+  if (mprotect(region, code.size(), PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(region, code.size());
+    error = "cannot make machine code executable";
+    return nullptr;
+  }
+  return region;
+}
+
+// Выполнение кода; возвращает результат кода, сообщение об ошибке - в message
+int execute(const void* code, Value* stack, vector<Value>& memory, istream& input, ostream& output, string& message)
+{
+  Context context;
+  context.memory = memory.data();
+  context.memoryVector = &memory;
+  context.input = &input;
+  context.output = &output;
+  copy(HELPERS, HELPERS + HELPER_COUNT, context.helpers);
+
+  typedef int (*Entry)(Context* context, Value* stack, Value* memory);
+  int result = reinterpret_cast<Entry>(const_cast<void*>(code))(&context, stack, memory.data());
+  message = context.message;
+  return result;
+}
+
+}
+
+JitMachine::~JitMachine()
+{
+  if (mapping_)
+  {
+    munmap(mapping_, mappingSize_);
+  }
+}
+
+bool JitMachine::run()
+{
+  error_.clear();
+  vector<int> depth;
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth, maxDepth, memorySize, error_))
+  {
+    return false;
+  }
+
+  string miss;
+  if (!code_ && !cacheDirectory_.empty())
+  {
+    CachedCode cached;
+    if (loadCachedCode(cacheDirectory_, COMPILER_ID, program_, cached, miss))
+    {
+      mapping_ = cached.mapping;
+      mappingSize_ = cached.mappingSize;
+      code_ = cached.code;
+      cacheStatus_ = "loaded " + miss;
+    }
+  }
+  if (!code_)
+  {
+    vector<uint8_t> code;
+    Compiler(program_, depth).compile(code);
+    mapping_ = makeExecutable(code, error_);
+    if (!mapping_)
+    {
+      return false;
+    }
+    mappingSize_ = code.size();
+    code_ = mapping_;
+    if (!cacheDirectory_.empty())
+    {
+      string status;
+      bool stored = storeCachedCode(cacheDirectory_, COMPILER_ID, program_, code, status);
+      cacheStatus_ = (stored ? "stored " : "not stored: ") + status + " (" + miss + ")";
+    }
+  }
+
+  memory_.assign(memorySize, Value());
+  stack_.assign(maxDepth + 1, Value());
+  string message;
+  int failed = execute(code_, stack_.data(), memory_, input_, output_, message);
+  output_.flush();
+  if (failed >= 0)
+  {
+    error_ = "address " + to_string(failed) + ": " + message;
+    return false;
+  }
+  return true;
+}
+
+JitRegion::~JitRegion()
+{
+  if (code_)
+  {
+    munmap(code_, codeSize_);
+  }
+}
+
+bool JitRegion::compile(const vector<Command>& program, const vector<int>& depth, int first, int last, string& error)
+{
+  vector<uint8_t> code;
+  Compiler(program, depth, first, last).compile(code);
+  code_ = makeExecutable(code, error);
+  if (!code_)
+  {
+    return false;
+  }
+  codeSize_ = code.size();
+  return true;
+}
+
+int JitRegion::run(Value* stack, vector<Value>& memory, istream& input, ostream& output, string& error) const
+{
+  string message;
+  int result = execute(code_, stack, memory, input, output, message);
+  if (result >= 0)
+  {
+    error = "address " + to_string(result) + ": " + message;
+    return -2;
+  }
+  return result == -1 ? -1 : -2 - result;
+}
+
+#else
+
+// На других платформах программа выполняется интерпретатором
+JitMachine::~JitMachine()
+{
+}
+
+bool JitMachine::run()
+{
+  if (!cacheDirectory_.empty())
+  {
+    cacheStatus_ = "not used: no machine code on this platform";
+  }
+  ThreadedMachine machine(program_, input_, output_);
+  bool ok = machine.run();
+  error_ = machine.error();
+  return ok;
+}
+
+JitRegion::~JitRegion()
+{
+}
+
+bool JitRegion::compile(const vector<Command>&, const vector<int>&, int, int, string& error)
+{
+  error = "machine code is supported only on x86-64";
+  return false;
+}
+
+int JitRegion::run(Value*, vector<Value>&, istream&, ostream&, string& error) const
+{
+  error = "machine code is supported only on x86-64";
+  return -2;
+}
+
+#endif
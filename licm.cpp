@@ -0,0 +1,248 @@
+// Вынос инвариантных вычислений из циклов.
+//
+// Циклы находятся как естественные циклы обратных дуг (дуга B -> H, где H доминирует над B);
+// циклы с общим заголовком объединяются. Выражение инвариантно, если оно вычисляется без
+// побочных эффектов из констант и переменных, которые в цикле не записываются. Максимальные
+// инвариантные выражения из двух и более инструкций вычисляются один раз в предзаголовке -
+// новом блоке, через который проходят все входы в цикл, - и сохраняются во временные
+// переменные; одинаковые выражения делят одну переменную. Вложенные циклы обрабатываются
+// раньше внешних, поэтому вынесенное из внутреннего цикла может быть вынесено и дальше.
+//
+// Предзаголовок выполняется, только если управление дошло до заголовка цикла. Для цикла
+// с проверкой в начале это может случиться и при нуле итераций, поэтому лишнее вычисление
+// допустимо лишь для выражений, которые не могут вызвать ошибку. Деление на переменную
+// выносится, только если оно стоит в заголовке до первой инструкции ввода-вывода: тогда
+// оно в любом случае выполнилось бы при первом проходе по заголовку, и ошибка деления
+// на ноль происходит в том же месте относительно ввода и вывода программы.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <map>
+
+namespace
+{
+
+// Ключ для сравнения участков кода (commandKey инструкций)
+typedef vector<pair<int, uint64_t>> CodeKey;
+
+CodeKey codeKey(vector<Command>::const_iterator begin, vector<Command>::const_iterator end)
+{
+  CodeKey key;
+  for (auto it = begin; it != end; ++it)
+  {
+    key.push_back(commandKey(*it));
+  }
+  return key;
+}
+
+// Свойства выражений блока для выноса
+struct Invariants
+{
+  vector<ExpressionNode> nodes;
+  vector<bool> invariant;   // Участок узла чистый и вычисляется из инвариантных значений
+  vector<bool> traps;       // Вычисление может завершиться ошибкой деления на ноль
+};
+
+bool findInvariants(const vector<Command>& code, const vector<bool>& stored, Invariants& result)
+{
+  vector<int> top;
+  if (!buildExpressionTrees(code, result.nodes, top))
+  {
+    return false;
+  }
+  int count = result.nodes.size();
+  result.invariant.assign(count, false);
+  result.traps.assign(count, false);
+  for (int n = 0; n < count; ++n)
+  {
+    const ExpressionNode& node = result.nodes[n];
+    if (node.start < 0)
+    {
+      continue;
+    }
+    const Command& command = code[node.end - 1];
+    switch (command.instruction())
+    {
+    case LOAD:
+      result.invariant[n] = command.arg() >= int(stored.size()) || !stored[command.arg()];
+      break;
+    case PUSH:
+      result.invariant[n] = true;
+      break;
+    case INPUT:
+      break;
+    default:
+      result.invariant[n] = true;
+      result.traps[n] = command.instruction() == DIV && !isRemovable(code, node.end - 1);
+      for (int operand : node.operands)
+      {
+        if (operand >= 0)
+        {
+          result.invariant[n] = result.invariant[n] && result.invariant[operand];
+          result.traps[n] = result.traps[n] || result.traps[operand];
+        }
+      }
+      break;
+    }
+  }
+  return true;
+}
+
+class LoopInvariantMotion
+{
+public:
+  LoopInvariantMotion(FlowGraph& graph, int firstTemporary)
+    : graph_(graph), nextTemporary_(firstTemporary)
+  {}
+
+  // Вынос из одного цикла; возвращает число вынесенных выражений
+  int hoist(Loop& loop, vector<Loop>& loops);
+
+  // Размещение созданных предзаголовков
+  void placePreheaders()
+  {
+    graph_.placeBefore(placements_);
+  }
+
+private:
+  int hoistFromBlock(BasicBlock* block, bool isHeader, const vector<bool>& stored);
+
+  FlowGraph& graph_;
+  int nextTemporary_;
+  vector<Command> hoisted_;                   // Код предзаголовка
+  map<CodeKey, int> temporaries_;             // Вынесенное выражение и его временная переменная
+  vector<pair<BasicBlock*, BasicBlock*>> placements_;  // Новые предзаголовки и их заголовки
+};
+
+int LoopInvariantMotion::hoistFromBlock(BasicBlock* block, bool isHeader, const vector<bool>& stored)
+{
+  vector<Command>& code = block->code;
+  Invariants invariants;
+  if (!findInvariants(code, stored, invariants))
+  {
+    return 0;
+  }
+  const vector<ExpressionNode>& nodes = invariants.nodes;
+
+  //Деление на переменную можно выполнить заранее только до первого ввода-вывода в заголовке
+  int firstEffect = 0;
+  if (isHeader)
+  {
+    while (firstEffect < int(code.size()) && code[firstEffect].instruction() != PRINT &&
+           code[firstEffect].instruction() != INPUT)
+    {
+      ++firstEffect;
+    }
+  }
+
+  //Выбор максимальных инвариантных выражений: от корней к листьям
+  vector<bool> chosen(nodes.size(), false);
+  vector<bool> covered(nodes.size(), false);
+  vector<int> replaceAt(code.size(), -1);
+  int count = 0;
+  for (int n = nodes.size() - 1; n >= 0; --n)
+  {
+    const ExpressionNode& node = nodes[n];
+    if (node.parent >= 0)
+    {
+      covered[n] = covered[node.parent] || chosen[node.parent];
+    }
+    if (covered[n] || !invariants.invariant[n] || node.end - node.start <= 1 ||
+        (invariants.traps[n] && node.end > firstEffect))
+    {
+      continue;
+    }
+    chosen[n] = true;
+    replaceAt[node.start] = n;
+    ++count;
+  }
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  vector<Command> result;
+  result.reserve(code.size());
+  int i = 0;
+  while (i < int(code.size()))
+  {
+    int n = replaceAt[i];
+    if (n < 0)
+    {
+      result.push_back(code[i++]);
+      continue;
+    }
+    auto begin = code.begin() + nodes[n].start;
+    auto end = code.begin() + nodes[n].end;
+    CodeKey key = codeKey(begin, end);
+    auto it = temporaries_.find(key);
+    if (it == temporaries_.end())
+    {
+      it = temporaries_.insert(make_pair(key, nextTemporary_++)).first;
+      hoisted_.insert(hoisted_.end(), begin, end);
+      hoisted_.push_back(Command(STORE, it->second));
+    }
+    result.push_back(Command(LOAD, it->second));
+    i = nodes[n].end;
+  }
+  code.swap(result);
+  return count;
+}
+
+int LoopInvariantMotion::hoist(Loop& loop, vector<Loop>& loops)
+{
+  //Переменные, записываемые в цикле
+  vector<bool> stored;
+  for (BasicBlock* block : loop.body)
+  {
+    for (const Command& command : block->code)
+    {
+      if (command.instruction() == STORE)
+      {
+        if (command.arg() >= int(stored.size()))
+        {
+          stored.resize(command.arg() + 1, false);
+        }
+        stored[command.arg()] = true;
+      }
+    }
+  }
+
+  hoisted_.clear();
+  temporaries_.clear();
+  int count = 0;
+  for (BasicBlock* block : loop.body)
+  {
+    count += hoistFromBlock(block, block == loop.header, stored);
+  }
+  if (count > 0)
+  {
+    vector<Command>& preheader = loopPreheader(graph_, loop, loops, placements_)->code;
+    preheader.insert(preheader.end(), hoisted_.begin(), hoisted_.end());
+  }
+  return count;
+}
+
+}
+
+int hoistLoopInvariants(FlowGraph& graph, AnalysisManager& analyses)
+{
+  //При индексной адресации запись может изменить любую переменную
+  int firstTemporary = analyses.variableCount();
+  if (firstTemporary < 0)
+  {
+    return 0;
+  }
+
+  vector<Loop>& loops = analyses.loops();
+  LoopInvariantMotion motion(graph, firstTemporary);
+  int changes = 0;
+  for (size_t i = 0; i < loops.size(); ++i)
+  {
+    changes += motion.hoist(loops[i], loops);
+  }
+  motion.placePreheaders();
+  return changes;
+}
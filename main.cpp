@@ -1,30 +1,155 @@
 #include "parser.hpp"
+#include "passmanager.hpp"
+#include "native.hpp"
+#include "transpiler.hpp"
+#include <fstream>
 #include <iostream>
 #include <cstdlib>
+#include <sstream>
 
 using namespace std;
 
 void printHelp()
 {
-  cout << "Usage: cmilan input_file" << endl;
+  cout << "Usage: cmilan [-O0|-O1|-O2|-Os] [--passes=LIST] [--stats] [--time-passes] [--unroll-limit=N] [--emit=KIND] [-o FILE] input_file" << endl;
+  cout << "  -O0               do not optimize" << endl;
+  cout << "  -O1               constant propagation, simplification and dead code elimination" << endl;
+  cout << "  -O2               all optimizations (default)" << endl;
+  cout << "  -Os               optimizations that do not increase code size" << endl;
+  cout << "  --passes=LIST     run the comma-separated list of passes instead of an -O level" << endl;
+  cout << "  --stats           print the number of instructions removed by each optimization" << endl;
+  cout << "  --time-passes     print the time and instruction counts of each optimization" << endl;
+  cout << "  --unroll-limit=N  largest code size produced by unrolling a loop (0 disables unrolling)" << endl;
+  cout << "  --emit=KIND       output to produce:" << endl;
+  cout << "                      listing  stack machine listing for milanvm (default)" << endl;
+  cout << "                      asm      x86-64 assembly for GNU as" << endl;
+  cout << "                      c        portable C program" << endl;
+  cout << "                      exe      executable built with as and cc" << endl;
+  cout << "  -o FILE           write the output to FILE (default: standard output, a.out for exe)" << endl;
+  cout << "Passes:" << endl;
+  PassManager::printPasses(cout);
+}
+
+bool writeOutput(const Parser& parser, const string& emit, const string& outputName)
+{
+  string error;
+  if(emit == "exe") {
+    string name = outputName.empty() ? "a.out" : outputName;
+    if(!buildExecutable(parser.code(), name, error)) {
+      cerr << "Cannot build '" << name << "': " << error << endl;
+      return false;
+    }
+    return true;
+  }
+
+  ofstream file;
+  if(!outputName.empty()) {
+    file.open(outputName);
+    if(!file) {
+      cerr << "Cannot write '" << outputName << "'" << endl;
+      return false;
+    }
+  }
+  ostream& output = outputName.empty() ? cout : file;
+  if(emit == "asm") {
+    if(!emitAssembly(parser.code(), output, error)) {
+      cerr << "Cannot compile to assembly: " << error << endl;
+      return false;
+    }
+  }
+  else if(emit == "c") {
+    if(!emitC(parser.code(), parser.variableNames(), output, error)) {
+      cerr << "Cannot translate to C: " << error << endl;
+      return false;
+    }
+  }
+  else {
+    printListing(parser.code(), output);
+  }
+  return true;
 }
 
 int main(int argc, char** argv)
 {
-  if(argc < 2) {
+  bool printStats = false;
+  bool timePasses = false;
+  OptimizationOptions options;
+  string emit = "listing";
+  string outputName;
+  const char* fileName = nullptr;
+  for(int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if(arg == "--stats") {
+      printStats = true;
+    }
+    else if(arg == "--time-passes") {
+      timePasses = true;
+    }
+    else if(arg.compare(0, 2, "-O") == 0 && PassManager::knowsLevel(arg.substr(2))) {
+      options.level = arg.substr(2);
+    }
+    else if(arg.compare(0, 9, "--passes=") == 0) {
+      options.customPasses = true;
+      options.passes.clear();
+      istringstream list(arg.substr(9));
+      string name;
+      while(getline(list, name, ',')) {
+        if(!PassManager::knows(name)) {
+          cerr << "Unknown pass '" << name << "'" << endl;
+          printHelp();
+          return EXIT_FAILURE;
+        }
+        options.passes.push_back(name);
+      }
+    }
+    else if(arg.compare(0, 15, "--unroll-limit=") == 0 && arg.size() > 15 &&
+            arg.find_first_not_of("0123456789", 15) == string::npos) {
+      options.unrollLimit = atoi(arg.c_str() + 15);
+    }
+    else if(arg.compare(0, 7, "--emit=") == 0) {
+      emit = arg.substr(7);
+      if(emit != "listing" && emit != "asm" && emit != "c" && emit != "exe") {
+        cerr << "Unknown output kind '" << emit << "'" << endl;
+        printHelp();
+        return EXIT_FAILURE;
+      }
+    }
+    else if(arg == "-o" && i + 1 < argc) {
+      outputName = argv[++i];
+    }
+    else if(!fileName && arg[0] != '-') {
+      fileName = argv[i];
+    }
+    else {
+      printHelp();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(!fileName) {
     printHelp();
     return EXIT_FAILURE;
   }
 
   ifstream input;
-  input.open(argv[1]);
+  input.open(fileName);
 
   if(input) {
-    Parser p(argv[1], input);
-    p.parse();
-    return EXIT_SUCCESS;
+    OptimizationStats stats;
+    Parser p(fileName, input, options, (printStats || timePasses) ? &stats : nullptr);
+    bool ok = p.parse();
+    if(printStats) {
+      stats.print(cerr);
+    }
+    if(timePasses) {
+      stats.printTimes(cerr);
+    }
+    if(!ok) {
+      return EXIT_FAILURE;
+    }
+    return writeOutput(p, emit, outputName) ? EXIT_SUCCESS : EXIT_FAILURE;
   }
-  cerr << "File '" << argv[1] << "' not found" << endl;
+  cerr << "File '" << fileName << "' not found" << endl;
   return EXIT_FAILURE;
 }
 
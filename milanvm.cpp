@@ -0,0 +1,190 @@
+// Виртуальная машина Милана: выполнение листинга, сгенерированного cmilan.
+//
+// Сборка: g++ -std=c++17 -O2 milanvm.cpp vm.cpp threaded.cpp quickening.cpp nanbox.cpp registers.cpp jit.cpp codecache.cpp tracing.cpp tiered.cpp typeinfer.cpp value.cpp vmio.cpp codegen.cpp flowgraph.cpp -pthread -o milanvm
+// (с -DMILAN_VM_SWITCH быстрый интерпретатор выбирает обработчики оператором switch)
+// Использование: milanvm [--time] [--traces] [--tiers] [--threshold=N] [--cache=каталог] [--line-buffered]
+//                        [--engine=threaded|quickening|nanbox|register|jit|tracing|tiered|reference] листинг
+// Программа читает ввод со стандартного ввода и печатает вывод на стандартный вывод. Ввод и
+// вывод идут блоками (vmio.hpp); если стандартный вывод - терминал или задан --line-buffered,
+// вывод записывается после каждой строки.
+
+#include "vm.hpp"
+#include "vmio.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+
+using namespace std;
+
+void printHelp()
+{
+  cout << "Usage: milanvm [--time] [--traces] [--tiers] [--threshold=N] [--cache=DIR] [--line-buffered]" << endl;
+  cout << "               [--engine=NAME] listing_file" << endl;
+  cout << "  --time         print the number of executed instructions and the run time" << endl;
+  cout << "  --traces       print trace statistics of the tracing engine" << endl;
+  cout << "  --tiers        print the tier-up log of the tiered engine" << endl;
+  cout << "  --threshold=N  loop iterations before the tiered engine compiles a loop (default "
+       << TieredMachine::DEFAULT_THRESHOLD << ")" << endl;
+  cout << "  --cache=DIR    keep machine code of the jit engine in DIR and reuse it in later runs" << endl;
+  cout << "  --line-buffered  write the program output after every line (default on a terminal)" << endl;
+  cout << "  --engine=NAME  interpreter to use:" << endl;
+  cout << "                   threaded   pre-decoded program, direct-threaded dispatch (default)" << endl;
+  cout << "                   quickening opcodes rewritten to typed variants at run time" << endl;
+  cout << "                   nanbox     switch interpreter with NaN-boxed 64-bit values" << endl;
+  cout << "                   register   translation to three-address register code" << endl;
+  cout << "                   jit        x86-64 machine code (threaded on other platforms)" << endl;
+  cout << "                   tracing    interpreter with a tracing JIT for hot loops (x86-64)" << endl;
+  cout << "                   tiered     interpreter, hot loops compiled in the background (x86-64)" << endl;
+  cout << "                   reference  straightforward switch interpreter" << endl;
+}
+
+template <typename M>
+int execute(M& machine, bool printTime)
+{
+  auto start = chrono::steady_clock::now();
+  bool ok = machine.run();
+  auto finish = chrono::steady_clock::now();
+  if(!ok) {
+    cerr << "Runtime error at " << machine.error() << endl;
+  }
+  if(printTime) {
+    double time = chrono::duration<double, milli>(finish - start).count();
+    if(machine.steps() >= 0) {
+      cerr << "Executed " << machine.steps() << " instructions in " << time << " ms" << endl;
+    }
+    else {
+      cerr << "Executed in " << time << " ms" << endl;
+    }
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char** argv)
+{
+  bool printTime = false;
+  bool printTraces = false;
+  bool printTiers = false;
+  bool lineBuffered = false;
+  int threshold = TieredMachine::DEFAULT_THRESHOLD;
+  string cacheDirectory;
+  string engine = "threaded";
+  const char* fileName = nullptr;
+  for(int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if(arg == "--time") {
+      printTime = true;
+    }
+    else if(arg == "--traces") {
+      printTraces = true;
+    }
+    else if(arg == "--tiers") {
+      printTiers = true;
+    }
+    else if(arg == "--line-buffered") {
+      lineBuffered = true;
+    }
+    else if(arg.compare(0, 12, "--threshold=") == 0) {
+      char* end;
+      long value = strtol(arg.c_str() + 12, &end, 10);
+      if(end == arg.c_str() + 12 || *end || value < 1 || value > 1000000000) {
+        cerr << "Invalid threshold '" << arg.substr(12) << "'" << endl;
+        printHelp();
+        return EXIT_FAILURE;
+      }
+      threshold = value;
+    }
+    else if(arg.compare(0, 8, "--cache=") == 0 && arg.size() > 8) {
+      cacheDirectory = arg.substr(8);
+    }
+    else if(arg.compare(0, 9, "--engine=") == 0) {
+      engine = arg.substr(9);
+      if(engine != "threaded" && engine != "quickening" && engine != "nanbox" && engine != "register" &&
+         engine != "jit" && engine != "tracing" && engine != "tiered" && engine != "reference") {
+        cerr << "Unknown engine '" << engine << "'" << endl;
+        printHelp();
+        return EXIT_FAILURE;
+      }
+    }
+    else if(!fileName && arg[0] != '-') {
+      fileName = argv[i];
+    }
+    else {
+      printHelp();
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(!fileName) {
+    printHelp();
+    return EXIT_FAILURE;
+  }
+
+  ifstream input(fileName);
+  if(!input) {
+    cerr << "File '" << fileName << "' not found" << endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<Command> program;
+  string error;
+  if(!loadListing(input, program, error)) {
+    cerr << fileName << ": " << error << endl;
+    return EXIT_FAILURE;
+  }
+
+  OutputBuffer outputBuffer(1, lineBuffered || isTerminal(1));
+  InputBuffer inputBuffer(0, &outputBuffer);
+  istream in(&inputBuffer);
+  ostream out(&outputBuffer);
+
+  if(engine == "reference") {
+    Machine machine(program, in, out);
+    return execute(machine, printTime);
+  }
+  if(engine == "quickening") {
+    QuickeningMachine machine(program, in, out);
+    int status = execute(machine, printTime);
+    if(printTime) {
+      cerr << machine.quickeningReport();
+    }
+    return status;
+  }
+  if(engine == "nanbox") {
+    NanBoxMachine machine(program, in, out);
+    int status = execute(machine, printTime);
+    if(printTime) {
+      cerr << machine.footprintReport();
+    }
+    return status;
+  }
+  if(engine == "register") {
+    RegisterMachine machine(program, in, out);
+    return execute(machine, printTime);
+  }
+  if(engine == "jit") {
+    JitMachine machine(program, in, out, cacheDirectory);
+    int status = execute(machine, printTime);
+    if(printTime && !machine.cacheStatus().empty()) {
+      cerr << "Code cache: " << machine.cacheStatus() << endl;
+    }
+    return status;
+  }
+  if(engine == "tracing") {
+    TracingMachine machine(program, in, out);
+    int status = execute(machine, printTime);
+    if(printTraces) {
+      cerr << machine.traceReport();
+    }
+    return status;
+  }
+  if(engine == "tiered") {
+    TieredMachine machine(program, in, out, threshold);
+    int status = execute(machine, printTime);
+    if(printTiers) {
+      cerr << machine.tierLog();
+    }
+    return status;
+  }
+  ThreadedMachine machine(program, in, out);
+  return execute(machine, printTime);
+}
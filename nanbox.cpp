@@ -0,0 +1,425 @@
+#include "vm.hpp"
+#include "nanbox.hpp"
+#include "typeinfer.hpp"
+#include "vmio.hpp"
+#include <sstream>
+
+namespace
+{
+
+// Операции над словом стека и памяти. Один и тот же интерпретатор порождается шаблоном
+// для обоих представлений, поэтому при сравнении они различаются только этими функциями.
+template <typename Slot>
+struct Slots;
+
+// Структура с признаком типа (Value)
+template <>
+struct Slots<Value>
+{
+  static const char* name()
+  {
+    return "tagged struct";
+  }
+
+  static bool bothInt(const Value& a, const Value& b)
+  {
+    return !(a.isFloat | b.isFloat);
+  }
+
+  static bool bothFloat(const Value& a, const Value& b)
+  {
+    return a.isFloat & b.isFloat;
+  }
+
+  static int toInt(const Value& a)
+  {
+    return a.i;
+  }
+
+  static float toFloat(const Value& a)
+  {
+    return a.f;
+  }
+
+  static Value fromInt(int i)
+  {
+    return Value::fromInt(i);
+  }
+
+  // Вещественное число, которое не NaN
+  static Value fromNumber(float f)
+  {
+    return Value::fromFloat(f);
+  }
+
+  static Value toValue(const Value& a)
+  {
+    return a;
+  }
+
+  static Value fromValue(const Value& a)
+  {
+    return a;
+  }
+};
+
+// 64-разрядное слово NaN-boxing (BoxedValue)
+template <>
+struct Slots<BoxedValue>
+{
+  static const char* name()
+  {
+    return "NaN-boxed";
+  }
+
+  static bool bothInt(BoxedValue a, BoxedValue b)
+  {
+    return BoxedValue::bothInt(a, b);
+  }
+
+  static bool bothFloat(BoxedValue a, BoxedValue b)
+  {
+    return !a.isInt() && !b.isInt();
+  }
+
+  static int toInt(BoxedValue a)
+  {
+    return a.toInt();
+  }
+
+  static float toFloat(BoxedValue a)
+  {
+    return a.asFloat();
+  }
+
+  static BoxedValue fromInt(int i)
+  {
+    return BoxedValue::fromInt(i);
+  }
+
+  static BoxedValue fromNumber(float f)
+  {
+    return BoxedValue::fromNumber(f);
+  }
+
+  static Value toValue(BoxedValue a)
+  {
+    return a.toValue();
+  }
+
+  static BoxedValue fromValue(const Value& a)
+  {
+    return BoxedValue::fromValue(a);
+  }
+};
+
+// Интерпретатор с выбором обработчика оператором switch. Программа проверяется verifyProgram,
+// поэтому стек не проверяется. Целые и вещественные операнды одного типа обрабатываются
+// на месте, остальные случаи - функциями value.hpp над Value.
+template <typename Slot>
+class Engine
+{
+  typedef Slots<Slot> S;
+
+public:
+  Engine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output), steps_(0), maxDepth_(0)
+  {}
+
+  bool run(string& error);
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+  void report(ostream& output, size_t& footprint) const
+  {
+    footprint = sizeof(Slot) * (stack_.size() + memory_.size());
+    output << "Value representation: " << S::name() << ", " << sizeof(Slot) << " bytes per slot; stack "
+           << stack_.size() << " slots, memory " << memory_.size() << " slots (" << footprint << " bytes)" << endl;
+  }
+
+private:
+  // Арифметика над значениями не одного типа, целое деление и NaN: знак NaN, полученного из
+  // двух NaN, зависит от порядка операндов, который выбирает компилятор, поэтому NaN
+  // вычисляется evaluate, как у остальных машин
+  static bool arithmetic(Instruction op, Slot& a, Slot b)
+  {
+    Value result;
+    if (!evaluate(op, S::toValue(a), S::toValue(b), result))
+    {
+      return false;
+    }
+    a = S::fromValue(result);
+    return true;
+  }
+
+  // Вещественная арифметика над двумя вещественными числами
+  static bool floatArithmetic(Instruction op, Slot& a, Slot b)
+  {
+    float x = S::toFloat(a);
+    float y = S::toFloat(b);
+    float result = op == ADD ? x + y : op == SUB ? x - y : x * y;
+    if (result != result)
+    {
+      return arithmetic(op, a, b);
+    }
+    a = S::fromNumber(result);
+    return true;
+  }
+
+  static bool compareSlots(int cmp, Slot a, Slot b)
+  {
+    if (S::bothInt(a, b))
+    {
+      int x = S::toInt(a);
+      int y = S::toInt(b);
+      switch (cmp)
+      {
+      case 0:
+        return x == y;
+      case 1:
+        return x != y;
+      case 2:
+        return x < y;
+      case 3:
+        return x > y;
+      case 4:
+        return x <= y;
+      default:
+        return x >= y;
+      }
+    }
+    return compare(cmp, S::toValue(a), S::toValue(b));
+  }
+
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  vector<Operation> operations_;
+  vector<int> firstOperation_;
+  vector<int> depth_;
+  vector<Slot> memory_;
+  vector<Slot> stack_;
+  long long steps_;
+  int maxDepth_;
+};
+
+template <typename Slot>
+bool Engine<Slot>::run(string& error)
+{
+  int memorySize;
+  if (!verifyProgram(program_, depth_, maxDepth_, memorySize, error))
+  {
+    return false;
+  }
+  splitProgram(program_, operations_, firstOperation_);
+  memory_.assign(memorySize, Slot());
+  stack_.assign(maxDepth_ + 1, Slot());
+  vector<Slot> constants(operations_.size());
+  for (size_t index = 0; index < operations_.size(); ++index)
+  {
+    constants[index] = S::fromValue(operations_[index].value);
+  }
+
+  auto fail = [&](int address, const string& message)
+  {
+    output_.flush();
+    error = "address " + to_string(address) + ": " + message;
+    return false;
+  };
+
+  Slot* stack = stack_.data();
+  Slot* sp = stack;
+  size_t index = 0;
+  for (;;)
+  {
+    const Operation& operation = operations_[index];
+    if (operation.first)
+    {
+      ++steps_;
+    }
+
+    int target = -1;
+    switch (operation.instruction)
+    {
+    case NOP:
+      break;
+
+    case STOP:
+      output_.flush();
+      return true;
+
+    case LOAD:
+      *sp++ = memory_[operation.arg];
+      break;
+
+    case STORE:
+      memory_[operation.arg] = *--sp;
+      break;
+
+    case BLOAD:
+    case BSTORE:
+    {
+      Value offset = S::toValue(*--sp);
+      if (offset.isFloat)
+      {
+        return fail(operation.address, "float index");
+      }
+      int address = operation.arg + offset.i;
+      if (static_cast<unsigned int>(address) >= memory_.size())
+      {
+        if (address < 0 || address >= MEMORY_LIMIT)
+        {
+          return fail(operation.address, "invalid address " + to_string(address));
+        }
+        memory_.resize(address + 1);
+      }
+      if (operation.instruction == BLOAD)
+      {
+        *sp++ = memory_[address];
+      }
+      else
+      {
+        memory_[address] = *--sp;
+      }
+      break;
+    }
+
+    case PUSH:
+      *sp++ = constants[index];
+      break;
+
+    case POP:
+      --sp;
+      break;
+
+    case DUP:
+      *sp = sp[-1];
+      ++sp;
+      break;
+
+    case ADD:
+    case SUB:
+    case MULT:
+      if (S::bothInt(sp[-2], sp[-1]))
+      {
+        unsigned int x = S::toInt(sp[-2]);
+        unsigned int y = S::toInt(sp[-1]);
+        unsigned int result = operation.instruction == ADD ? x + y : operation.instruction == SUB ? x - y : x * y;
+        sp[-2] = S::fromInt(static_cast<int>(result));
+      }
+      else if (S::bothFloat(sp[-2], sp[-1]))
+      {
+        floatArithmetic(operation.instruction, sp[-2], sp[-1]);
+      }
+      else
+      {
+        arithmetic(operation.instruction, sp[-2], sp[-1]);
+      }
+      --sp;
+      break;
+
+    case DIV:
+      //Деление на 0 и -1 (переполнение) - в evaluate
+      if (S::bothInt(sp[-2], sp[-1]) && static_cast<unsigned int>(S::toInt(sp[-1])) + 1 > 1)
+      {
+        sp[-2] = S::fromInt(S::toInt(sp[-2]) / S::toInt(sp[-1]));
+      }
+      else if (!arithmetic(DIV, sp[-2], sp[-1]))
+      {
+        return fail(operation.address, "division by zero");
+      }
+      --sp;
+      break;
+
+    case INVERT:
+      sp[-1] = S::fromValue(invert(S::toValue(sp[-1])));
+      break;
+
+    case SHL:
+    case SHR:
+      sp[-1] = S::fromValue(shift(operation.instruction, S::toValue(sp[-1]), operation.arg));
+      break;
+
+    case COMPARE:
+      sp[-2] = S::fromInt(compareSlots(operation.arg, sp[-2], sp[-1]) ? 1 : 0);
+      --sp;
+      break;
+
+    case JUMP:
+      target = operation.arg;
+      break;
+
+    case JUMP_YES:
+    case JUMP_NO:
+      if ((*--sp).isTrue() == (operation.instruction == JUMP_YES))
+      {
+        target = operation.arg;
+      }
+      break;
+
+    case INPUT:
+    {
+      int number;
+      if (!readInt(input_, number))
+      {
+        return fail(operation.address, "invalid input");
+      }
+      *sp++ = S::fromInt(number);
+      break;
+    }
+
+    case PRINT:
+    {
+      printValue(output_, S::toValue(*--sp));
+      break;
+    }
+
+    default:
+      sp -= 2;
+      if (compareSlots(jumpComparison(operation.instruction), sp[0], sp[1]))
+      {
+        target = operation.arg;
+      }
+      break;
+    }
+
+    if (target < 0)
+    {
+      ++index;
+    }
+    else
+    {
+      index = firstOperation_[target];
+      sp = stack + depth_[target];
+    }
+  }
+}
+
+template <typename Slot>
+bool execute(const vector<Command>& program, istream& input, ostream& output, long long& steps, string& error,
+             string& report, size_t& footprint)
+{
+  Engine<Slot> engine(program, input, output);
+  bool ok = engine.run(error);
+  steps = engine.steps();
+  ostringstream text;
+  engine.report(text, footprint);
+  report = text.str();
+  return ok;
+}
+
+}
+
+bool NanBoxMachine::run()
+{
+  error_.clear();
+  steps_ = 0;
+  if (representation_ == TAGGED_STRUCT)
+  {
+    return execute<Value>(program_, input_, output_, steps_, error_, report_, footprint_);
+  }
+  return execute<BoxedValue>(program_, input_, output_, steps_, error_, report_, footprint_);
+}
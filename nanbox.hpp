@@ -0,0 +1,110 @@
+#ifndef CMILAN_NANBOX_HPP
+#define CMILAN_NANBOX_HPP
+
+#include "value.hpp"
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+// Значение машины Милана в одном 64-разрядном слове (NaN-boxing).
+//
+// Вещественное число хранится как double, в которое оно переводится без потерь. Все NaN
+// заменяются одним NaN того же знака (0x7FF8000000000000 или 0xFFF8000000000000): содержимое
+// NaN программе не видно, а знак печатается. Поэтому слова, старшие 16 разрядов которых равны
+// INT_TAG (0xFFF9), среди вещественных чисел не встречаются, и в них хранятся целые: число -
+// в младших 32 разрядах. Тип проверяется одной маской, оба операнда сразу - маской от AND
+// двух слов (у вещественного слова не может быть всех единиц INT_TAG), а вещественное
+// число не нужно ни распаковывать, ни размещать отдельно.
+
+struct BoxedValue
+{
+  static const uint64_t TAG_MASK = 0xFFFF000000000000ull;
+  static const uint64_t INT_TAG = 0xFFF9000000000000ull;
+  static const uint64_t CANONICAL_NAN = 0x7FF8000000000000ull;
+  static const uint64_t SIGN = 0x8000000000000000ull;
+
+  uint64_t bits;
+
+  // Целый ноль, как Value()
+  BoxedValue()
+    : bits(INT_TAG)
+  {}
+
+  static BoxedValue fromInt(int i)
+  {
+    BoxedValue value;
+    value.bits = INT_TAG | static_cast<uint32_t>(i);
+    return value;
+  }
+
+  static BoxedValue fromFloat(float f)
+  {
+    BoxedValue value;
+    double d = f;
+    memcpy(&value.bits, &d, sizeof(d));
+    if (d != d)
+    {
+      value.bits = CANONICAL_NAN | (value.bits & SIGN);
+    }
+    return value;
+  }
+
+  // Вещественное число, которое заведомо не NaN (без проверки)
+  static BoxedValue fromNumber(float f)
+  {
+    BoxedValue value;
+    double d = f;
+    memcpy(&value.bits, &d, sizeof(d));
+    return value;
+  }
+
+  static BoxedValue fromValue(const Value& value)
+  {
+    return value.isFloat ? fromFloat(value.f) : fromInt(value.i);
+  }
+
+  Value toValue() const
+  {
+    return isInt() ? Value::fromInt(toInt()) : Value::fromFloat(asFloat());
+  }
+
+  bool isInt() const
+  {
+    return (bits & TAG_MASK) == INT_TAG;
+  }
+
+  // Оба значения целые
+  static bool bothInt(BoxedValue a, BoxedValue b)
+  {
+    return (a.bits & b.bits & TAG_MASK) == INT_TAG;
+  }
+
+  // Целое значение (только для isInt())
+  int toInt() const
+  {
+    return static_cast<int>(static_cast<uint32_t>(bits));
+  }
+
+  // Вещественное значение (только для !isInt())
+  float asFloat() const
+  {
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return static_cast<float>(d);
+  }
+
+  float toFloat() const
+  {
+    return isInt() ? static_cast<float>(toInt()) : asFloat();
+  }
+
+  bool isTrue() const
+  {
+    return isInt() ? toInt() != 0 : asFloat() != 0;
+  }
+};
+
+static_assert(sizeof(BoxedValue) == sizeof(uint64_t), "BoxedValue must be one 64-bit word");
+
+#endif
@@ -0,0 +1,862 @@
+#include "native.hpp"
+#include "typeinfer.hpp"
+#include "vm.hpp"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <unistd.h>
+
+namespace
+{
+
+// Регистры для верхних слов стека: сохраняются при вызовах функций библиотеки C
+const int REGISTER_SLOTS = 6;
+const char* const REGISTERS64[REGISTER_SLOTS] = {"%rbx", "%r12", "%r13", "%r14", "%r15", "%rbp"};
+const char* const REGISTERS32[REGISTER_SLOTS] = {"%ebx", "%r12d", "%r13d", "%r14d", "%r15d", "%ebp"};
+
+// Библиотека времени выполнения. milan_read и milan_print вызываются сгенерированным кодом,
+// milan_fail и milan_fail_address печатают сообщение об ошибке и завершают программу.
+const char* const RUNTIME = R"(	.section .rodata
+.Lformat_int:
+	.string "%d\n"
+.Lformat_read:
+	.string "%ld"
+.Lformat_float:
+	.string "%s\n"
+.Lformat_float_point:
+	.string "%s.0\n"
+.Lformat_error:
+	.string "Runtime error at address %d: %s\n"
+.Lformat_address:
+	.string "Runtime error at address %d: invalid address %d\n"
+.Lmessage_input:
+	.string "invalid input"
+.Lmessage_division:
+	.string "division by zero"
+.Lmessage_index:
+	.string "float index"
+
+	.text
+# Чтение целого числа; edi - адрес инструкции INPUT
+milan_read:
+	pushq %rbx
+	subq $16, %rsp
+	movl %edi, %ebx
+	leaq .Lformat_read(%rip), %rdi
+	movq %rsp, %rsi
+	xorl %eax, %eax
+	call scanf@PLT
+	cmpl $1, %eax
+	jne 1f
+	movq (%rsp), %rax
+	movslq %eax, %rcx
+	cmpq %rax, %rcx
+	jne 1f
+	movl %eax, %eax
+	addq $16, %rsp
+	popq %rbx
+	ret
+1:	movl %ebx, %edi
+	leaq .Lmessage_input(%rip), %rsi
+	call milan_fail
+
+# Печать значения rdi на отдельной строке
+milan_print:
+	subq $40, %rsp
+	btq $32, %rdi
+	jc 1f
+	movl %edi, %esi
+	leaq .Lformat_int(%rip), %rdi
+	xorl %eax, %eax
+	call printf@PLT
+	addq $40, %rsp
+	ret
+1:	movd %edi, %xmm0
+	movq %rsp, %rdi
+	leaq 28(%rsp), %rsi
+	call _ZSt8to_charsPcS_f@PLT
+	movb $0, (%rax)
+	# Как в formatFloat: ".0" добавляется, если в записи нет '.', 'e' и 'n'
+	leaq .Lformat_float_point(%rip), %rdi
+	movq %rsp, %rcx
+2:	movb (%rcx), %dl
+	testb %dl, %dl
+	je 4f
+	cmpb $'.', %dl
+	je 3f
+	cmpb $'e', %dl
+	je 3f
+	cmpb $'n', %dl
+	je 3f
+	incq %rcx
+	jmp 2b
+3:	leaq .Lformat_float(%rip), %rdi
+4:	movq %rsp, %rsi
+	xorl %eax, %eax
+	call printf@PLT
+	addq $40, %rsp
+	ret
+
+# Ошибка: edi - адрес инструкции, rsi - сообщение
+milan_fail:
+	pushq %rbx
+	pushq %r12
+	subq $8, %rsp
+	movl %edi, %ebx
+	movq %rsi, %r12
+	xorl %edi, %edi
+	call fflush@PLT
+	movl $2, %edi
+	leaq .Lformat_error(%rip), %rsi
+	movl %ebx, %edx
+	movq %r12, %rcx
+	xorl %eax, %eax
+	call dprintf@PLT
+	movl $1, %edi
+	call exit@PLT
+
+# Ошибка обращения к памяти: edi - адрес инструкции, esi - адрес слова
+milan_fail_address:
+	pushq %rbx
+	pushq %r12
+	subq $8, %rsp
+	movl %edi, %ebx
+	movl %esi, %r12d
+	xorl %edi, %edi
+	call fflush@PLT
+	movl $2, %edi
+	leaq .Lformat_address(%rip), %rsi
+	movl %ebx, %edx
+	movl %r12d, %ecx
+	xorl %eax, %eax
+	call dprintf@PLT
+	movl $1, %edi
+	call exit@PLT
+)";
+
+class Generator
+{
+public:
+  Generator(const vector<Command>& program, ostream& output)
+    : program_(program), output_(output), labels_(0)
+  {}
+
+  bool generate(string& error);
+
+private:
+  // Можно ли не записывать целую константу составляющей index в стек, а подставить ее
+  // непосредственным операндом в следующую составляющую
+  bool isImmediate(size_t index);
+
+  void compilePart(const Operation& operation, const TypeState& state);
+  void compileArithmetic(Instruction instruction, int first, int a, int b);
+  void compileIntArithmetic(Instruction instruction, int first);
+  void compileFloatArithmetic(Instruction instruction, int first, int a, int b);
+  void compileInvert(int position, int type);
+  void compileShift(Instruction instruction, int position, int type, int bits);
+
+  // Переход к target, если выполнено сравнение cmp слов first и first + 1
+  void branchIf(int cmp, int first, int a, int b, const string& target);
+  void intBranch(int cmp, int first, const string& target);
+  void floatBranch(int cmp, int first, int a, int b, const string& target);
+
+  // Переход к target, если слово position истинно (onTrue) или ложно
+  void branchTruth(int position, int type, bool onTrue, const string& target);
+
+  // Загрузка слова position типа type в регистр xmm как вещественного числа
+  // (scratch - регистр общего назначения для значения неизвестного типа)
+  void loadFloat(int position, int type, const string& xmm, const string& scratch);
+
+  // Если тип слова известен только во время выполнения, порождается проверка признака,
+  // и код intPart и floatPart выполняется в зависимости от нее; иначе - только нужная часть
+  template <typename IntPart, typename FloatPart>
+  void dispatch(const string& tagged, int type, IntPart intPart, FloatPart floatPart);
+
+  static bool isRegister(int position)
+  {
+    return position < REGISTER_SLOTS;
+  }
+
+  static string slot(int position)
+  {
+    if (isRegister(position))
+    {
+      return REGISTERS64[position];
+    }
+    return "milan_stack+" + to_string(8 * (position - REGISTER_SLOTS)) + "(%rip)";
+  }
+
+  static string slot32(int position)
+  {
+    return isRegister(position) ? REGISTERS32[position] : slot(position);
+  }
+
+  // Второй (верхний) целый операнд: слово first + 1 или непосредственная константа
+  string second(int first) const
+  {
+    return immediate_.empty() ? slot32(first + 1) : immediate_;
+  }
+
+  static string variable(int address)
+  {
+    return "milan_memory+" + to_string(8 * address) + "(%rip)";
+  }
+
+  static string target(int address)
+  {
+    return ".La" + to_string(address);
+  }
+
+  void emit(const string& text)
+  {
+    output_ << '\t' << text << '\n';
+  }
+
+  void label(const string& name)
+  {
+    output_ << name << ":\n";
+  }
+
+  string newLabel()
+  {
+    return ".L" + to_string(labels_++);
+  }
+
+  // Пересылка 64-разрядного слова (через rax, если оба операнда в памяти)
+  void move(const string& source, const string& destination);
+
+  // Метка вызова milan_fail с сообщением message для текущей инструкции
+  string fail(const string& message);
+
+  const vector<Command>& program_;
+  ostream& output_;
+  vector<Operation> operations_;
+  vector<int> firstOperation_;        // Номер первой составляющей инструкции
+  vector<TypeState> states_;
+  vector<bool> isTarget_;             // Инструкция - цель перехода
+  string immediate_;                  // Константа, не записанная в стек ("$c")
+  map<string, string> failures_;      // Метка вызова milan_fail по сообщению и адресу
+  string stubs_;                      // Код вызовов milan_fail, выводится после программы
+  int labels_;
+  int address_;
+};
+
+void Generator::move(const string& source, const string& destination)
+{
+  if (source == destination)
+  {
+    return;
+  }
+  if (source.find('(') != string::npos && destination.find('(') != string::npos)
+  {
+    emit("movq " + source + ", %rax");
+    emit("movq %rax, " + destination);
+    return;
+  }
+  emit("movq " + source + ", " + destination);
+}
+
+string Generator::fail(const string& message)
+{
+  string key = to_string(address_) + " " + message;
+  auto found = failures_.find(key);
+  if (found != failures_.end())
+  {
+    return found->second;
+  }
+  string name = newLabel();
+  failures_[key] = name;
+  stubs_ += name + ":\n\tmovl $" + to_string(address_) + ", %edi\n\tleaq .Lmessage_" + message +
+            "(%rip), %rsi\n\tcall milan_fail\n";
+  return name;
+}
+
+template <typename IntPart, typename FloatPart>
+void Generator::dispatch(const string& tagged, int type, IntPart intPart, FloatPart floatPart)
+{
+  if (type == TYPE_INT)
+  {
+    intPart();
+    return;
+  }
+  if (type == TYPE_FLOAT)
+  {
+    floatPart();
+    return;
+  }
+  string isFloat = newLabel();
+  string done = newLabel();
+  emit("btq $32, " + tagged);
+  emit("jc " + isFloat);
+  intPart();
+  emit("jmp " + done);
+  label(isFloat);
+  floatPart();
+  label(done);
+}
+
+void Generator::loadFloat(int position, int type, const string& xmm, const string& scratch)
+{
+  if (type == TYPE_INT)
+  {
+    emit("cvtsi2ssl " + slot32(position) + ", " + xmm);
+    return;
+  }
+  if (type == TYPE_FLOAT)
+  {
+    emit("movd " + slot32(position) + ", " + xmm);
+    return;
+  }
+  string scratch32 = "%e" + scratch.substr(2);
+  emit("movq " + slot(position) + ", " + scratch);
+  dispatch(scratch, TYPE_ANY, [&] { emit("cvtsi2ssl " + scratch32 + ", " + xmm); },
+           [&] { emit("movd " + scratch32 + ", " + xmm); });
+}
+
+void Generator::compileIntArithmetic(Instruction instruction, int first)
+{
+  string b = second(first);
+  const char* name = instruction == ADD ? "addl " : instruction == SUB ? "subl " : "imull ";
+  if (instruction != DIV && isRegister(first))
+  {
+    emit(name + b + ", " + slot32(first));
+    return;
+  }
+  emit("movl " + slot32(first) + ", %eax");
+  if (instruction != DIV)
+  {
+    emit(name + b + ", %eax");
+  }
+  else if (!immediate_.empty())
+  {
+    int divisor = stoi(immediate_.substr(1));
+    if (divisor == 0)
+    {
+      emit("jmp " + fail("division"));
+    }
+    else if (divisor == -1)
+    {
+      emit("negl %eax");
+    }
+    else
+    {
+      emit("movl " + b + ", %ecx");
+      emit("cltd");
+      emit("idivl %ecx");
+    }
+  }
+  else
+  {
+    //Деление на -1 выполняется как изменение знака: idiv для INT_MIN / -1 дает исключение
+    string divide = newLabel();
+    string done = newLabel();
+    emit("movl " + b + ", %ecx");
+    emit("testl %ecx, %ecx");
+    emit("je " + fail("division"));
+    emit("cmpl $-1, %ecx");
+    emit("jne " + divide);
+    emit("negl %eax");
+    emit("jmp " + done);
+    label(divide);
+    emit("cltd");
+    emit("idivl %ecx");
+    label(done);
+  }
+  emit("movq %rax, " + slot(first));
+}
+
+void Generator::compileFloatArithmetic(Instruction instruction, int first, int a, int b)
+{
+  loadFloat(first, a, "%xmm0", "%rax");
+  loadFloat(first + 1, b, "%xmm1", "%rcx");
+  switch (instruction)
+  {
+  case ADD:
+    emit("addss %xmm1, %xmm0");
+    break;
+  case SUB:
+    emit("subss %xmm1, %xmm0");
+    break;
+  case MULT:
+    emit("mulss %xmm1, %xmm0");
+    break;
+  default:
+  {
+    string nonZero = newLabel();
+    emit("xorps %xmm2, %xmm2");
+    emit("ucomiss %xmm2, %xmm1");
+    emit("jp " + nonZero);
+    emit("je " + fail("division"));
+    label(nonZero);
+    emit("divss %xmm1, %xmm0");
+    break;
+  }
+  }
+  emit("movd %xmm0, %eax");
+  emit("btsq $32, %rax");
+  emit("movq %rax, " + slot(first));
+}
+
+void Generator::compileArithmetic(Instruction instruction, int first, int a, int b)
+{
+  //Вещественная операция, если хотя бы один операнд вещественный
+  int type = (a == TYPE_INT && b == TYPE_INT) ? TYPE_INT
+             : (a == TYPE_FLOAT || b == TYPE_FLOAT) ? TYPE_FLOAT : TYPE_ANY;
+  if (type == TYPE_ANY)
+  {
+    emit("movq " + slot(first) + ", %rax");
+    emit("orq " + slot(first + 1) + ", %rax");
+  }
+  dispatch("%rax", type, [&] { compileIntArithmetic(instruction, first); },
+           [&] { compileFloatArithmetic(instruction, first, a, b); });
+}
+
+void Generator::compileInvert(int position, int type)
+{
+  dispatch(slot(position), type,
+           [&] {
+             if (isRegister(position))
+             {
+               emit("negl " + slot32(position));
+               return;
+             }
+             emit("movl " + slot32(position) + ", %eax");
+             emit("negl %eax");
+             emit("movq %rax, " + slot(position));
+           },
+           [&] { emit("btcq $31, " + slot(position)); });
+}
+
+void Generator::compileShift(Instruction instruction, int position, int type, int bits)
+{
+  dispatch(slot(position), type,
+           [&] {
+             if (instruction == SHL && isRegister(position))
+             {
+               emit("shll $" + to_string(bits) + ", " + slot32(position));
+               return;
+             }
+             emit("movl " + slot32(position) + ", %eax");
+             if (instruction == SHL)
+             {
+               emit("shll $" + to_string(bits) + ", %eax");
+             }
+             else
+             {
+               //Для отрицательных чисел прибавляем 2^bits - 1, чтобы сдвиг округлял к нулю
+               emit("movl %eax, %edx");
+               emit("sarl $31, %edx");
+               emit("andl $" + to_string((1u << bits) - 1) + ", %edx");
+               emit("addl %edx, %eax");
+               emit("sarl $" + to_string(bits) + ", %eax");
+             }
+             emit("movq %rax, " + slot(position));
+           },
+           [&] {
+             float scale = static_cast<float>(1 << bits);
+             uint32_t scaleBits;
+             memcpy(&scaleBits, &scale, 4);
+             emit("movd " + slot32(position) + ", %xmm0");
+             emit("movl $" + to_string(scaleBits) + ", %ecx");
+             emit("movd %ecx, %xmm1");
+             emit(instruction == SHL ? "mulss %xmm1, %xmm0" : "divss %xmm1, %xmm0");
+             emit("movd %xmm0, %eax");
+             emit("btsq $32, %rax");
+             emit("movq %rax, " + slot(position));
+           });
+}
+
+void Generator::intBranch(int cmp, int first, const string& target)
+{
+  static const char* const jumps[] = {"je ", "jne ", "jl ", "jg ", "jle ", "jge "};
+  if (isRegister(first))
+  {
+    emit("cmpl " + second(first) + ", " + slot32(first));
+  }
+  else
+  {
+    emit("movl " + slot32(first) + ", %eax");
+    emit("cmpl " + second(first) + ", %eax");
+  }
+  emit(jumps[cmp] + target);
+}
+
+void Generator::floatBranch(int cmp, int first, int a, int b, const string& target)
+{
+  //ucomiss дает "не упорядочены" (PF = 1) для NaN: верно только сравнение "!="
+  loadFloat(first, a, "%xmm0", "%rax");
+  loadFloat(first + 1, b, "%xmm1", "%rcx");
+  switch (cmp)
+  {
+  case 0:
+  {
+    string skip = newLabel();
+    emit("ucomiss %xmm1, %xmm0");
+    emit("jp " + skip);
+    emit("je " + target);
+    label(skip);
+    break;
+  }
+  case 1:
+    emit("ucomiss %xmm1, %xmm0");
+    emit("jp " + target);
+    emit("jne " + target);
+    break;
+  case 2:
+    emit("ucomiss %xmm0, %xmm1");
+    emit("ja " + target);
+    break;
+  case 3:
+    emit("ucomiss %xmm1, %xmm0");
+    emit("ja " + target);
+    break;
+  case 4:
+    emit("ucomiss %xmm0, %xmm1");
+    emit("jae " + target);
+    break;
+  default:
+    emit("ucomiss %xmm1, %xmm0");
+    emit("jae " + target);
+    break;
+  }
+}
+
+void Generator::branchIf(int cmp, int first, int a, int b, const string& target)
+{
+  int type = (a == TYPE_INT && b == TYPE_INT) ? TYPE_INT
+             : (a == TYPE_FLOAT || b == TYPE_FLOAT) ? TYPE_FLOAT : TYPE_ANY;
+  if (type == TYPE_ANY)
+  {
+    emit("movq " + slot(first) + ", %rax");
+    emit("orq " + slot(first + 1) + ", %rax");
+  }
+  dispatch("%rax", type, [&] { intBranch(cmp, first, target); },
+           [&] { floatBranch(cmp, first, a, b, target); });
+}
+
+void Generator::branchTruth(int position, int type, bool onTrue, const string& target)
+{
+  dispatch(slot(position), type,
+           [&] {
+             emit("cmpl $0, " + slot32(position));
+             emit((onTrue ? "jne " : "je ") + target);
+           },
+           [&] {
+             //Вещественное истинно, если не равно нулю (NaN истинно)
+             emit("movd " + slot32(position) + ", %xmm0");
+             emit("xorps %xmm1, %xmm1");
+             emit("ucomiss %xmm1, %xmm0");
+             if (onTrue)
+             {
+               emit("jp " + target);
+               emit("jne " + target);
+               return;
+             }
+             string skip = newLabel();
+             emit("jp " + skip);
+             emit("je " + target);
+             label(skip);
+           });
+}
+
+bool Generator::isImmediate(size_t index)
+{
+  const Operation& operation = operations_[index];
+  if (operation.instruction != PUSH || operation.value.isFloat || index + 1 == operations_.size())
+  {
+    return false;
+  }
+  //На следующую инструкцию можно перейти, минуя константу
+  const Operation& next = operations_[index + 1];
+  if (next.first && isTarget_[next.address])
+  {
+    return false;
+  }
+  //Непосредственный операнд подставляется только в целые операции
+  const vector<int>& stack = states_[index + 1].stack;
+  bool integer = stack.size() >= 2 && stack[stack.size() - 2] == TYPE_INT;
+  switch (next.instruction)
+  {
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  case COMPARE:
+    return integer;
+  default:
+    return integer && jumpComparison(next.instruction) >= 0;
+  }
+}
+
+void Generator::compilePart(const Operation& operation, const TypeState& state)
+{
+  int depth = state.stack.size();
+  int top = depth - 1;
+  switch (operation.instruction)
+  {
+  case NOP:
+    break;
+
+  case STOP:
+    emit("jmp .Lexit");
+    break;
+
+  case LOAD:
+    move(variable(operation.arg), slot(depth));
+    break;
+
+  case STORE:
+    move(slot(top), variable(operation.arg));
+    break;
+
+  case PUSH:
+    if (operation.value.isFloat)
+    {
+      uint32_t bits;
+      memcpy(&bits, &operation.value.f, 4);
+      emit("movabsq $" + to_string((uint64_t(1) << 32) | bits) + ", %rax");
+      emit("movq %rax, " + slot(depth));
+    }
+    else if (isRegister(depth))
+    {
+      emit("movl $" + to_string(operation.value.i) + ", " + slot32(depth));
+    }
+    else
+    {
+      emit("movl $" + to_string(operation.value.i) + ", %eax");
+      emit("movq %rax, " + slot(depth));
+    }
+    break;
+
+  case POP:
+    break;
+
+  case DUP:
+    move(slot(top), slot(depth));
+    break;
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+    compileArithmetic(operation.instruction, top - 1, state.stack[top - 1], state.stack[top]);
+    break;
+
+  case INVERT:
+    compileInvert(top, state.stack[top]);
+    break;
+
+  case SHL:
+  case SHR:
+    compileShift(operation.instruction, top, state.stack[top], operation.arg);
+    break;
+
+  case COMPARE:
+  {
+    string isTrue = newLabel();
+    string done = newLabel();
+    branchIf(operation.arg, top - 1, state.stack[top - 1], state.stack[top], isTrue);
+    emit("movl $0, %eax");
+    emit("jmp " + done);
+    label(isTrue);
+    emit("movl $1, %eax");
+    label(done);
+    emit("movq %rax, " + slot(top - 1));
+    break;
+  }
+
+  case BLOAD:
+  case BSTORE:
+  {
+    if (state.stack[top] & TYPE_FLOAT)
+    {
+      emit("btq $32, " + slot(top));
+      emit("jc " + fail("index"));
+    }
+    string invalid = newLabel();
+    emit("movl " + slot32(top) + ", %eax");
+    emit("addl $" + to_string(operation.arg) + ", %eax");
+    emit("cmpl $" + to_string(MEMORY_LIMIT) + ", %eax");
+    emit("jae " + invalid);
+    stubs_ += invalid + ":\n\tmovl $" + to_string(address_) + ", %edi\n\tmovl %eax, %esi\n\tcall milan_fail_address\n";
+    emit("leaq milan_memory(%rip), %rcx");
+    if (operation.instruction == BLOAD)
+    {
+      emit("movq (%rcx,%rax,8), %rax");
+      emit("movq %rax, " + slot(top));
+    }
+    else
+    {
+      emit("movq " + slot(top - 1) + ", %rdx");
+      emit("movq %rdx, (%rcx,%rax,8)");
+    }
+    break;
+  }
+
+  case INPUT:
+    emit("movl $" + to_string(address_) + ", %edi");
+    emit("call milan_read");
+    emit("movq %rax, " + slot(depth));
+    break;
+
+  case PRINT:
+    emit("movq " + slot(top) + ", %rdi");
+    emit("call milan_print");
+    break;
+
+  case JUMP:
+    emit("jmp " + target(operation.arg));
+    break;
+
+  case JUMP_YES:
+  case JUMP_NO:
+    branchTruth(top, state.stack[top], operation.instruction == JUMP_YES, target(operation.arg));
+    break;
+
+  default:
+    branchIf(jumpComparison(operation.instruction), top - 1, state.stack[top - 1], state.stack[top], target(operation.arg));
+    break;
+  }
+}
+
+bool Generator::generate(string& error)
+{
+  vector<int> depth;
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth, maxDepth, memorySize, error))
+  {
+    return false;
+  }
+
+  splitProgram(program_, operations_, firstOperation_);
+  states_ = inferTypes(operations_, firstOperation_, memorySize);
+  bool indexed = false;
+  isTarget_.assign(program_.size(), false);
+  for (const Operation& operation : operations_)
+  {
+    indexed |= operation.instruction == BLOAD || operation.instruction == BSTORE;
+    if (isJump(operation.instruction))
+    {
+      isTarget_[operation.arg] = true;
+    }
+  }
+
+  //Память: переменные, к которым обращаются LOAD и STORE, или вся память машины,
+  //если есть доступ по индексу
+  int memoryWords = indexed ? MEMORY_LIMIT : max(memorySize, 1);
+  int stackWords = max(maxDepth + 1 - REGISTER_SLOTS, 1);
+  output_ << "# Generated by cmilan\n";
+  emit(".local milan_memory, milan_stack");
+  emit(".comm milan_memory, " + to_string(8LL * memoryWords) + ", 8");
+  emit(".comm milan_stack, " + to_string(8 * stackWords) + ", 8");
+  output_ << '\n';
+  emit(".text");
+  emit(".globl main");
+  emit(".type main, @function");
+  label("main");
+  emit("pushq %rbx");
+  emit("pushq %rbp");
+  emit("pushq %r12");
+  emit("pushq %r13");
+  emit("pushq %r14");
+  emit("pushq %r15");
+  emit("subq $8, %rsp");
+
+  for (size_t index = 0; index < operations_.size(); ++index)
+  {
+    const Operation& operation = operations_[index];
+    address_ = operation.address;
+    if (operation.first)
+    {
+      label(target(operation.address));
+    }
+    if (!states_[index].reached)
+    {
+      continue;
+    }
+    if (isImmediate(index))
+    {
+      immediate_ = "$" + to_string(operation.value.i);
+      continue;
+    }
+    compilePart(operation, states_[index]);
+    immediate_.clear();
+  }
+
+  label(".Lexit");
+  emit("xorl %eax, %eax");
+  emit("addq $8, %rsp");
+  emit("popq %r15");
+  emit("popq %r14");
+  emit("popq %r13");
+  emit("popq %r12");
+  emit("popq %rbp");
+  emit("popq %rbx");
+  emit("ret");
+  output_ << stubs_ << '\n' << RUNTIME;
+  emit(".section .note.GNU-stack,\"\",@progbits");
+  return true;
+}
+
+// Аргумент команды оболочки в одинарных кавычках
+string quote(const string& text)
+{
+  string quoted = "'";
+  for (char c : text)
+  {
+    quoted += c == '\'' ? string("'\\''") : string(1, c);
+  }
+  return quoted + "'";
+}
+
+}
+
+bool emitAssembly(const vector<Command>& program, ostream& output, string& error)
+{
+  Generator generator(program, output);
+  return generator.generate(error);
+}
+
+bool buildExecutable(const vector<Command>& program, const string& fileName, string& error)
+{
+  const char* temp = getenv("TMPDIR");
+  string pattern = string(temp && *temp ? temp : "/tmp") + "/cmilanXXXXXX";
+  vector<char> directory(pattern.begin(), pattern.end());
+  directory.push_back('\0');
+  if (!mkdtemp(directory.data()))
+  {
+    error = "cannot create a temporary directory";
+    return false;
+  }
+  string base = directory.data();
+  string assembly = base + "/program.s";
+  string object = base + "/program.o";
+
+  bool ok;
+  {
+    ofstream output(assembly);
+    ok = emitAssembly(program, output, error);
+    output.close();
+    if (ok && !output)
+    {
+      error = "cannot write " + assembly;
+      ok = false;
+    }
+  }
+  if (ok && system(("as -o " + quote(object) + " " + quote(assembly)).c_str()) != 0)
+  {
+    error = "the assembler failed";
+    ok = false;
+  }
+  if (ok && system(("cc -o " + quote(fileName) + " " + quote(object) + " -lstdc++").c_str()) != 0)
+  {
+    error = "the linker failed";
+    ok = false;
+  }
+  unlink(object.c_str());
+  unlink(assembly.c_str());
+  rmdir(base.c_str());
+  return ok;
+}
@@ -0,0 +1,33 @@
+#ifndef CMILAN_NATIVE_HPP
+#define CMILAN_NATIVE_HPP
+
+#include "codegen.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Компиляция программы в машинный код x86-64 (Linux, System V ABI).
+//
+// Программа переводится в ассемблер GNU as (синтаксис AT&T) с функцией main. Глубина стека
+// перед каждой инструкцией известна (verifyProgram), поэтому верхние слова стека размещаются
+// в регистрах rbx, r12 - r15 и rbp, остальные - в статическом массиве. Значение занимает
+// 64 разряда: младшие 32 - целое или вещественное число, разряд 32 - признак вещественного.
+// Анализ типов по графу переходов определяет, какие значения всегда целые или всегда
+// вещественные; для них проверки признака не порождаются.
+//
+// Небольшая библиотека времени выполнения (чтение, печать, сообщения об ошибках) выводится
+// в тот же файл и использует стандартную библиотеку C; вещественные числа печатаются
+// std::to_chars из libstdc++, как formatFloat. Результат и сообщения об ошибках времени
+// выполнения (с кодом возврата 1) совпадают с виртуальной машиной milanvm.
+
+// Запись ассемблера программы в output. Возвращает false и сообщение в error, если программа
+// не проходит verifyProgram.
+bool emitAssembly(const vector<Command>& program, ostream& output, string& error);
+
+// Сборка исполняемого файла fileName: ассемблер записывается во временный файл, который
+// ассемблируется командой as и компонуется командой cc (с библиотеками C и libstdc++).
+bool buildExecutable(const vector<Command>& program, const string& fileName, string& error);
+
+#endif
@@ -0,0 +1,288 @@
+#include "optimizer.hpp"
+#include "passmanager.hpp"
+#include "value.hpp"
+#include "analysis.hpp"
+#include <algorithm>
+#include <iomanip>
+
+void optimize(FlowGraph& graph, const OptimizationOptions& options, OptimizationStats* stats)
+{
+  vector<string> pipeline = options.passes;
+  if (!options.customPasses)
+  {
+    PassManager::levelPipeline(options.level, pipeline);
+  }
+  PassManager manager(options);
+  for (const string& name : pipeline)
+  {
+    manager.add(name);
+  }
+  manager.run(graph, stats);
+}
+
+void OptimizationStats::print(ostream& output) const
+{
+  int total = 0;
+  output << "Removed instructions:" << endl;
+  for (const Pass& pass : passes)
+  {
+    output << "  " << pass.name << ": " << pass.sizeBefore - pass.sizeAfter << endl;
+    total += pass.sizeBefore - pass.sizeAfter;
+  }
+  output << "  total: " << total << " of " << initialSize << endl;
+}
+
+void OptimizationStats::printTimes(ostream& output) const
+{
+  double total = 0;
+  output << "Pass execution time:" << endl;
+  output << "  pass        time, ms  instructions" << endl;
+  ios::fmtflags flags = output.flags();
+  output << fixed << setprecision(3);
+  for (const Pass& pass : passes)
+  {
+    output << "  " << left << setw(10) << pass.name << right << setw(10) << pass.seconds * 1000 << "  "
+           << pass.sizeBefore << " -> " << pass.sizeAfter << endl;
+    total += pass.seconds;
+  }
+  int finalSize = passes.empty() ? initialSize : passes.back().sizeAfter;
+  output << "  " << left << setw(10) << "total" << right << setw(10) << total * 1000 << "  "
+         << initialSize << " -> " << finalSize << endl;
+  output << "  analyses computed: " << analyses << endl;
+  output.flags(flags);
+}
+
+bool constantOnEntry(BasicBlock* block, int variable, int& value)
+{
+  for (int hop = 0; hop < 2 && block; ++hop)
+  {
+    const vector<Command>& code = block->code;
+    for (int i = code.size() - 1; i >= 0; --i)
+    {
+      if (code[i].instruction() == STORE && code[i].arg() == variable)
+      {
+        if (i > 0 && code[i - 1].instruction() == PUSH && !code[i - 1].isFloat())
+        {
+          value = code[i - 1].arg();
+          return true;
+        }
+        return false;
+      }
+    }
+    block = (block->preds.size() == 1) ? block->preds[0] : nullptr;
+  }
+  return false;
+}
+
+BasicBlock* loopPreheader(FlowGraph& graph, Loop& loop, vector<Loop>& loops,
+                          vector<pair<BasicBlock*, BasicBlock*>>& placements)
+{
+  BasicBlock* header = loop.header;
+  vector<BasicBlock*> entries;
+  for (BasicBlock* pred : header->preds)
+  {
+    if (!loop.members.count(pred))
+    {
+      entries.push_back(pred);
+    }
+  }
+  if (entries.size() == 1 && entries[0]->branch == NOP && entries[0]->next == header)
+  {
+    return entries[0];
+  }
+
+  //Новый блок будет размещен перед заголовком; списки дуг обновляются на месте
+  BasicBlock* preheader = graph.newBlock();
+  preheader->next = header;
+  for (BasicBlock* pred : entries)
+  {
+    if (pred->target == header)
+    {
+      pred->target = preheader;
+    }
+    if (pred->next == header)
+    {
+      pred->next = preheader;
+    }
+    replace(pred->succs.begin(), pred->succs.end(), header, preheader);
+  }
+  placements.push_back(make_pair(preheader, header));
+  preheader->preds = entries;
+  preheader->succs.push_back(header);
+  header->preds.erase(remove_if(header->preds.begin(), header->preds.end(), [&](BasicBlock* pred) {
+    return !loop.members.count(pred);
+  }), header->preds.end());
+  header->preds.push_back(preheader);
+
+  for (int outer = loop.parent; outer >= 0; outer = loops[outer].parent)
+  {
+    loops[outer].members.insert(preheader);
+    loops[outer].body.push_back(preheader);
+  }
+  return preheader;
+}
+
+int branchPops(Instruction branch)
+{
+  int pops, pushes;
+  if (branch == NOP || branch == STOP)
+  {
+    return 0;
+  }
+  stackEffect(branch, pops, pushes);
+  return pops;
+}
+
+bool isRemovable(const vector<Command>& code, int index)
+{
+  switch (code[index].instruction())
+  {
+  case LOAD:
+  case PUSH:
+  case DUP:
+  case ADD:
+  case SUB:
+  case MULT:
+  case INVERT:
+  case COMPARE:
+  case SHL:
+  case SHR:
+    return true;
+  case DIV:
+    //Деление безопасно удалить, только если делитель - ненулевая константа
+    return index > 0 && code[index - 1].instruction() == PUSH && Value::fromCommand(code[index - 1]).isTrue();
+  default:
+    return false;
+  }
+}
+
+int foldConstants(vector<Command>& code)
+{
+  int changes = 0;
+  vector<Command> folded;
+  folded.reserve(code.size());
+  for (const Command& command : code)
+  {
+    Instruction instruction = command.instruction();
+    int size = folded.size();
+    bool lastIsConstant = size >= 1 && folded[size - 1].instruction() == PUSH;
+    bool lastTwoAreConstant = lastIsConstant && size >= 2 && folded[size - 2].instruction() == PUSH;
+
+    if (lastTwoAreConstant && (instruction == ADD || instruction == SUB || instruction == MULT ||
+                               instruction == DIV || instruction == COMPARE))
+    {
+      Value a = Value::fromCommand(folded[size - 2]);
+      Value b = Value::fromCommand(folded[size - 1]);
+      Value result;
+      bool ok = true;
+      if (instruction == COMPARE)
+      {
+        result = Value::fromInt(compare(command.arg(), a, b) ? 1 : 0);
+      }
+      else
+      {
+        ok = evaluate(instruction, a, b, result);
+      }
+      //Деление на ноль оставляем: ошибка должна произойти во время выполнения
+      if (ok)
+      {
+        folded.pop_back();
+        folded.back() = result.toPush();
+        ++changes;
+        continue;
+      }
+    }
+    else if (lastIsConstant && instruction == INVERT)
+    {
+      folded.back() = invert(Value::fromCommand(folded.back())).toPush();
+      ++changes;
+      continue;
+    }
+    else if (lastIsConstant && (instruction == SHL || instruction == SHR))
+    {
+      folded.back() = shift(instruction, Value::fromCommand(folded.back()), command.arg()).toPush();
+      ++changes;
+      continue;
+    }
+    folded.push_back(command);
+  }
+  code.swap(folded);
+  return changes;
+}
+
+int removeDeadPops(vector<Command>& code)
+{
+  //Для каждого значения на стеке помним, с какой позиции начинается вычисляющий его участок кода.
+  //Участок можно удалить вместе с POP, если после его начала не было инструкций с побочными
+  //эффектами (позиция последней такой инструкции - lastImpure).
+  int changes = 0;
+  vector<Command> result;
+  result.reserve(code.size());
+  vector<int> starts;
+  int lastImpure = -1;
+
+  for (const Command& command : code)
+  {
+    Instruction instruction = command.instruction();
+    if (instruction == POP && !starts.empty())
+    {
+      int start = starts.back();
+      starts.pop_back();
+      if (start >= 0 && lastImpure < start)
+      {
+        changes += result.size() - start + 1;
+        result.erase(result.begin() + start, result.end());
+        continue;
+      }
+      result.push_back(command);
+      continue;
+    }
+
+    int pops, pushes;
+    stackEffect(instruction, pops, pushes);
+    int position = result.size();
+    result.push_back(command);
+    if (!isRemovable(result, position))
+    {
+      lastImpure = position;
+    }
+
+    if (instruction == DUP)
+    {
+      //Копия лежит поверх оригинала; оригинал сохраняет свой участок, а копию можно удалить отдельно
+      if (starts.empty())
+      {
+        starts.push_back(-1);
+      }
+      starts.push_back(position);
+      continue;
+    }
+
+    //Начало участка результата - начало участка самого глубокого операнда.
+    //Значения, пришедшие из другого блока (-1), удалять нельзя.
+    int start = position;
+    for (int i = 0; i < pops; ++i)
+    {
+      if (starts.empty() || starts.back() < 0)
+      {
+        start = -1;
+      }
+      else if (start >= 0)
+      {
+        start = min(start, starts.back());
+      }
+      if (!starts.empty())
+      {
+        starts.pop_back();
+      }
+    }
+
+    for (int i = 0; i < pushes; ++i)
+    {
+      starts.push_back(start);
+    }
+  }
+
+  code.swap(result);
+  return changes;
+}
@@ -0,0 +1,121 @@
+#ifndef CMILAN_OPTIMIZER_HPP
+#define CMILAN_OPTIMIZER_HPP
+
+#include "flowgraph.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Оптимизирующие преобразования графа программы.
+//
+// Все преобразования сохраняют соглашение, которого придерживается Parser: на границах
+// базовых блоков стек пуст, кроме операндов условного перехода, завершающего блок.
+// Каждое преобразование возвращает число изменений (0 - граф не изменился). Анализы
+// берутся из кэша AnalysisManager. Преобразование, запрашивающее анализ после изменения
+// графа, сначала само сбрасывает его; после преобразования PassManager сбрасывает анализы,
+// которые преобразование не сохраняет.
+
+class AnalysisManager;
+
+// Статистика оптимизации: размер графа до и после каждого преобразования и время его
+// работы. Размер графа считается функцией FlowGraph::size.
+struct OptimizationStats
+{
+  struct Pass
+  {
+    string name;
+    int sizeBefore;
+    int sizeAfter;
+    double seconds;
+  };
+
+  int initialSize = 0;
+  vector<Pass> passes;
+  int analyses = 0;         // Сколько раз вычислялись анализы
+
+  // Число инструкций, удаленных каждым преобразованием
+  void print(ostream& output) const;
+
+  // Время работы и изменение размера по преобразованиям
+  void printTimes(ostream& output) const;
+};
+
+// Параметры оптимизации
+struct OptimizationOptions
+{
+  string level = "2";           // Уровень оптимизации: "0", "1", "2" или "s"
+  bool customPasses = false;    // Конвейер задан списком passes, а не уровнем
+  vector<string> passes;
+  int unrollLimit = 128;        // Наибольший размер кода, получаемого развертыванием цикла (0 - не развертывать)
+};
+
+// Запуск преобразований над графом программы по конвейеру из options (см. PassManager).
+// Если stats не nullptr, в него записывается статистика.
+void optimize(FlowGraph& graph, const OptimizationOptions& options, OptimizationStats* stats = nullptr);
+
+// Разреженное условное распространение констант (SCCP) на SSA-форме переменных.
+// Загрузки переменных с известным значением заменяются константами, условные переходы
+// с известным условием - безусловными; ставшие недостижимыми блоки удаляются.
+int propagateConstants(FlowGraph& graph, AnalysisManager& analyses);
+
+// Удаление мертвого кода: условных переходов к следующему блоку, мертвых записей
+// в переменные (по анализу живых переменных) и недостижимых блоков.
+int eliminateDeadCode(FlowGraph& graph, AnalysisManager& analyses);
+
+// Алгебраические упрощения выражений: целые выражения перегруппировываются так, чтобы
+// одинаковые слагаемые и константы собрались вместе; для вещественных применяются только
+// тождества, верные при NaN и -0.
+int simplifyExpressions(FlowGraph& graph, AnalysisManager& analyses);
+
+// Развертывание циклов с известным на этапе компиляции числом итераций: полное, если
+// копии тела укладываются в sizeLimit инструкций, иначе частичное с остатком перед циклом.
+int unrollLoops(FlowGraph& graph, AnalysisManager& analyses, int sizeLimit);
+
+// Вынос инвариантных выражений естественных циклов во временные переменные,
+// вычисляемые в предзаголовке цикла.
+int hoistLoopInvariants(FlowGraph& graph, AnalysisManager& analyses);
+
+// Понижение стоимости: умножение индуктивных переменных циклов на инвариантные множители
+// заменяется сложением во временной переменной, проверка выхода из цикла переводится
+// на эту переменную, умножение и деление на степени двойки заменяются сдвигами.
+int reduceStrength(FlowGraph& graph, AnalysisManager& analyses);
+
+// Нумерация значений в базовых блоках: повторные вычисления чистых выражений заменяются
+// загрузкой переменной, хранящей значение, копией DUP или временной переменной,
+// если это дешевле повторного вычисления.
+int eliminateCommonSubexpressions(FlowGraph& graph, AnalysisManager& analyses);
+
+// Вспомогательные преобразования графа и кода блока
+
+struct Loop;
+
+// Целая константа, записанная в переменную к концу блока block: ищется последняя запись
+// в блоке, а если ее нет - в единственном предшественнике блока
+bool constantOnEntry(BasicBlock* block, int variable, int& value);
+
+// Предзаголовок цикла - блок, через который проходят все входы в цикл и который передает
+// управление только заголовку. Если такого блока нет, он создается, добавляется во все
+// циклы из loops, объемлющие цикл, и записывается в placements для размещения перед
+// заголовком: вызывающий размещает все новые блоки одним вызовом FlowGraph::placeBefore.
+// Требует актуальных списков дуг вокруг заголовка и поддерживает их.
+BasicBlock* loopPreheader(FlowGraph& graph, Loop& loop, vector<Loop>& loops,
+                          vector<pair<BasicBlock*, BasicBlock*>>& placements);
+
+
+// Свертка констант: PUSH a; PUSH b; ADD -> PUSH a+b и т.п.
+int foldConstants(vector<Command>& code);
+
+// Удаление вычислений, результат которых сразу снимается со стека инструкцией POP,
+// если они не имеют побочных эффектов
+int removeDeadPops(vector<Command>& code);
+
+// Можно ли удалить инструкцию, если ее результат не используется. code[index] - сама
+// инструкция, предыдущие инструкции нужны для проверки делителя DIV.
+bool isRemovable(const vector<Command>& code, int index);
+
+// Число значений, которые снимает со стека завершающий переход блока
+int branchPops(Instruction branch);
+
+#endif
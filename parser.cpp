@@ -1,18 +1,23 @@
 #include "parser.hpp"
+#include "optimizer.hpp"
+#include "value.hpp"
 #include <sstream>
 #include "scanner.hpp"
 #include <algorithm>
 
 //Выполняем синтаксический разбор блока program. Если во время разбора не обнаруживаем
-//никаких ошибок, то выводим последовательность команд стек-машины
+//никаких ошибок, то формируем последовательность команд стек-машины
 
-void Parser::parse()
+bool Parser::parse()
 {
   program();
   if (!error_)
   {
-    codegen_->flush();
+    optimize(codegen_->graph(), options_, stats_);
+    codegen_->linearize();
+    codegen_->fuseSuperops();
   }
+  return !error_;
 }
 
 void Parser::program()
@@ -20,7 +25,7 @@ void Parser::program()
   mustBe(T_BEGIN);
   statementList();
   mustBe(T_END);
-  codegen_->emit(STOP);
+  codegen_->stop();
 }
 
 void Parser::statementList()
@@ -73,33 +78,32 @@ void Parser::statement()
     expression();
     codegen_->emit(STORE, varAddress);
   }
-    // Если встретили IF, то затем должно следовать условие. На вершине стека лежит 1 или 0 в зависимости от выполнения условия.
-    // Затем зарезервируем место для условного перехода JUMP_NO к блоку ELSE (переход в случае ложного условия). Адрес перехода
-    // станет известным только после того, как будет сгенерирован код для блока THEN.
+    // Если встретили IF, то затем должно следовать условие. На вершине стека лежат два сравниваемых значения.
+    // Текущий блок завершается переходом к блоку ELSE в случае ложного условия (см. falseBranch), блок THEN
+    // начинается следом за ним.
   else if (match(T_IF))
   {
-    relation();
+    Cmp cmp = relation();
 
-    int jumpNoAddress = codegen_->reserve();
+    BasicBlock* elseBlock = codegen_->newBlock();
+    falseBranch(cmp, elseBlock);
 
     mustBe(T_THEN);
     statementList();
     if (match(T_ELSE))
     {
       //Если есть блок ELSE, то чтобы не выполнять его в случае выполнения THEN,
-      //зарезервируем место для команды JUMP в конец этого блока
-      int jumpAddress = codegen_->reserve();
-      //Заполним зарезервированное место после проверки условия инструкцией перехода в начало блока ELSE.
-      codegen_->emitAt(jumpNoAddress, JUMP_NO, codegen_->getCurrentAddress());
+      //завершим блок THEN переходом в конец оператора
+      BasicBlock* endBlock = codegen_->newBlock();
+      codegen_->jump(endBlock);
+      codegen_->startBlock(elseBlock);
       statementList();
-      //Заполним второй адрес инструкцией перехода в конец условного блока ELSE.
-      codegen_->emitAt(jumpAddress, JUMP, codegen_->getCurrentAddress());
+      codegen_->startBlock(endBlock);
     }
     else
     {
-      //Если блок ELSE отсутствует, то в зарезервированный адрес после проверки условия будет записана
-      //инструкция условного перехода в конец оператора IF...THEN
-      codegen_->emitAt(jumpNoAddress, JUMP_NO, codegen_->getCurrentAddress());
+      //Если блок ELSE отсутствует, то условный переход ведет в конец оператора IF...THEN
+      codegen_->startBlock(elseBlock);
     }
 
     mustBe(T_FI);
@@ -107,18 +111,27 @@ void Parser::statement()
 
   else if (match(T_WHILE))
   {
-    //запоминаем адрес начала проверки условия.
-    int conditionAddress = codegen_->getCurrentAddress();
-    relation();
-    //резервируем место под инструкцию условного перехода для выхода из цикла.
-    int jumpNoAddress = codegen_->reserve();
+    //Цикл генерируется в "перевернутой" форме: проверка условия перед входом в цикл, затем тело
+    //и проверка условия в конце тела с переходом назад, если оно истинно. На каждой итерации выполняется
+    //один переход вместо двух. Условие вычисляется столько же раз, сколько и в прямой форме, поэтому
+    //побочные эффекты READ в условии сохраняются.
+    //запоминаем, где начинается и кончается код проверки условия.
+    BasicBlock* conditionBlock = codegen_->currentBlock();
+    int conditionStart = codegen_->position();
+    Cmp cmp = relation();
+    int conditionEnd = codegen_->position();
+    //в обход цикла переходим на следующий за циклом оператор.
+    BasicBlock* bodyBlock = codegen_->newBlock();
+    BasicBlock* exitBlock = codegen_->newBlock();
+    falseBranch(cmp, exitBlock);
     mustBe(T_DO);
+    codegen_->startBlock(bodyBlock);
     statementList();
     mustBe(T_OD);
-    //переходим по адресу проверки условия
-    codegen_->emit(JUMP, conditionAddress);
-    //заполняем зарезервированный адрес инструкцией условного перехода на следующий за циклом оператор.
-    codegen_->emitAt(jumpNoAddress, JUMP_NO, codegen_->getCurrentAddress());
+    //повторяем проверку условия и переходим в начало тела, если оно выполнено
+    codegen_->emitCopy(conditionBlock, conditionStart, conditionEnd);
+    codegen_->branch(trueJump(cmp), bodyBlock);
+    codegen_->startBlock(exitBlock);
   }
   else if (match(T_WRITE))
   {
@@ -306,48 +319,74 @@ void Parser::factor()
   }
 }
 
-void Parser::relation()
+Cmp Parser::relation()
 {
-  //Условие сравнивает два выражения по какому-либо из знаков. Каждый знак имеет свой номер. В зависимости от
-  //результата сравнения на вершине стека окажется 0 или 1.
+  //Условие сравнивает два выражения по какому-либо из знаков. Значения обоих выражений остаются на вершине стека,
+  //а сравнение выполняет совмещенная инструкция перехода (JEQ, JNE, JLT, ...), которую генерирует вызывающий оператор.
+  //Так проверка условия в IF и WHILE обычно обходится одной инструкцией вместо пары COMPARE + JUMP_NO.
   expression();
   if (see(T_CMP))
   {
     Cmp cmp = scanner_->getCmpValue();
     next();
     expression();
-    switch (cmp)
-    {
-      //для знака "=" - номер 0
-    case C_EQ:
-      codegen_->emit(COMPARE, 0);
-      break;
-      //для знака "!=" - номер 1
-    case C_NE:
-      codegen_->emit(COMPARE, 1);
-      break;
-      //для знака "<" - номер 2
-    case C_LT:
-      codegen_->emit(COMPARE, 2);
-      break;
-      //для знака ">" - номер 3
-    case C_GT:
-      codegen_->emit(COMPARE, 3);
-      break;
-      //для знака "<=" - номер 4
-    case C_LE:
-      codegen_->emit(COMPARE, 4);
-      break;
-      //для знака ">=" - номер 5
-    case C_GE:
-      codegen_->emit(COMPARE, 5);
-      break;
-    };
+    return cmp;
   }
-  else
+
+  reportError("comparison operator expected.");
+  return C_EQ;
+}
+
+Instruction Parser::trueJump(Cmp cmp)
+{
+  //Совмещенная инструкция перехода, выполняемого при истинном условии.
+  switch (cmp)
+  {
+  case C_EQ:
+    return JEQ;
+  case C_NE:
+    return JNE;
+  case C_LT:
+    return JLT;
+  case C_GT:
+    return JGT;
+  case C_LE:
+    return JLE;
+  case C_GE:
+    return JGE;
+  }
+  return JUMP_YES;
+}
+
+void Parser::falseBranch(Cmp cmp, BasicBlock* target)
+{
+  //Переход выполняется, если условие ложно. Для "=" и "!=" отрицание условия - противоположное
+  //сравнение, и переход совмещается со сравнением. Для "<", ">", "<=" и ">=" это не так: если
+  //один из операндов NaN, ложны и условие, и противоположное сравнение, поэтому условие
+  //вычисляется COMPARE и проверяется JUMP_NO.
+  switch (cmp)
+  {
+  case C_EQ:
+    codegen_->branch(JNE, target);
+    return;
+  case C_NE:
+    codegen_->branch(JEQ, target);
+    return;
+  default:
+    codegen_->emit(COMPARE, jumpComparison(trueJump(cmp)));
+    codegen_->branch(JUMP_NO, target);
+    return;
+  }
+}
+
+vector<string> Parser::variableNames() const
+{
+  vector<string> names(lastVar_.first);
+  for (const auto& variable : variables_)
   {
-    reportError("comparison operator expected.");
+    names[variable.second.first] = variable.first;
   }
+  return names;
 }
 
 int Parser::findVariable(const string& var)
@@ -3,6 +3,8 @@
 
 #include "scanner.hpp"
 #include "codegen.hpp"
+#include "flowgraph.hpp"
+#include "optimizer.hpp"
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -31,21 +33,24 @@ using namespace std;
  * Поскольку стратегия восстановления после ошибки очень проста, возможна печать
  * сообщений о несуществующих ("наведенных") ошибках или пропуск некоторых
  * ошибок без печати сообщений. Если в процессе разбора была найдена хотя бы
- * одна ошибка, код для виртуальной машины не печатается.*/
+ * одна ошибка, код для виртуальной машины не формируется.*/
 
 class Parser
 {
 public:
   // Конструктор
   //    const string& fileName - имя файла с программой для анализа
+  //    const OptimizationOptions& options - параметры оптимизации
+  //    OptimizationStats* stats - куда записать статистику оптимизации (nullptr - не нужна)
   //
   // Конструктор создает экземпляры лексического анализатора и генератора.
 
-  Parser(const string& fileName, istream& input)
-    : output_(cout), error_(false), recovered_(true), lastVar_({0, false})
+  Parser(const string& fileName, istream& input, const OptimizationOptions& options = OptimizationOptions(),
+         OptimizationStats* stats = nullptr)
+    : error_(false), recovered_(true), lastVar_({0, false}), options_(options), stats_(stats)
   {
     scanner_ = new Scanner(fileName, input);
-    codegen_ = new CodeGen(output_);
+    codegen_ = new CodeGen();
     next();
   }
 
@@ -55,7 +60,16 @@ public:
     delete scanner_;
   }
 
-  void parse();	//проводим синтаксический разбор
+  bool parse();	//проводим синтаксический разбор; возвращает false, если найдены ошибки
+
+  // Код программы после успешного разбора
+  const vector<Command>& code() const
+  {
+    return codegen_->code();
+  }
+
+  // Имена переменных программы по их адресам
+  vector<string> variableNames() const;
 
 private:
   typedef std::pair<int, bool> Variable;
@@ -67,7 +81,7 @@ private:
   void expression(); //разбор арифметического выражения.
   void term(); //разбор слагаемого.
   void factor(); //разбор множителя.
-  void relation(); //разбор условия.
+  Cmp relation(); //разбор условия. Возвращает операцию сравнения, операнды остаются на вершине стека.
 
   // Сравнение текущей лексемы с образцом. Текущая позиция в потоке лексем не изменяется.
   bool see(Token t)
@@ -103,6 +117,9 @@ private:
     error_ = true;
   }
 
+  Instruction trueJump(Cmp cmp); //совмещенная инструкция перехода, выполняемого при истинном условии cmp.
+  void falseBranch(Cmp cmp, BasicBlock* target); //завершение текущего блока переходом к target при ложном условии cmp.
+
   void mustBe(Token t); //проверяем, совпадает ли данная лексема с образцом. Если да, то лексема изымается из потока.
   //Иначе создаем сообщение об ошибке и пробуем восстановиться
   void recover(Token t); //восстановление после ошибки: идем по коду до тех пор,
@@ -113,13 +130,14 @@ private:
 
   Scanner* scanner_; //лексический анализатор для конструктора
   CodeGen* codegen_; //указатель на виртуальную машину
-  ostream& output_; //выходной поток (в данном случае используем cout)
-  bool error_; //флаг ошибки. Используется чтобы определить, выводим ли список команд после разбора или нет
+  bool error_; //флаг ошибки. Используется чтобы определить, получен ли код программы
   bool recovered_; //не используется
   VarTable variables_; //массив переменных, найденных в программе
   Variable lastVar_; //номер последней записанной переменной
   list<bool> isFloatCast; // флаг, обозначающий к какому типу нужно неявно приводить (0 - тип не меняется, 1 - int, 2 - float)
   Token lastToken_;
+  OptimizationOptions options_; //параметры оптимизации
+  OptimizationStats* stats_; //статистика оптимизации или nullptr
 };
 
 #endif
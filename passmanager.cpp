@@ -0,0 +1,158 @@
+#include "passmanager.hpp"
+#include "analysis.hpp"
+#include <chrono>
+
+struct PassManager::PassInfo
+{
+  const char* name;
+  const char* description;
+  unsigned preserved;     // Анализы, остающиеся верными (сумма AnalysisManager::Analysis)
+  int (*run)(FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions& options);
+};
+
+// Удаление кода и перестановки внутри блоков не добавляют переменных и вещественных
+// записей: число переменных и их типы остаются верными с запасом. Преобразования,
+// заводящие временные переменные, сохраняют только типы - временные переменные
+// считаются не целыми.
+static const PassManager::PassInfo passes[] = {
+  {"sccp", "sparse conditional constant propagation",
+   AnalysisManager::VARIABLES | AnalysisManager::TYPES,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return propagateConstants(graph, analyses);
+   }},
+  {"simplify", "algebraic simplification and reassociation of expressions",
+   AnalysisManager::VARIABLES | AnalysisManager::TYPES | AnalysisManager::DOMINATORS | AnalysisManager::LOOPS,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return simplifyExpressions(graph, analyses);
+   }},
+  {"dce", "dead code, dead store and unreachable block elimination",
+   AnalysisManager::VARIABLES | AnalysisManager::TYPES,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return eliminateDeadCode(graph, analyses);
+   }},
+  {"unroll", "unrolling of loops with a constant trip count",
+   AnalysisManager::VARIABLES | AnalysisManager::TYPES,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions& options) {
+     return unrollLoops(graph, analyses, options.unrollLimit);
+   }},
+  {"licm", "loop-invariant code motion",
+   AnalysisManager::TYPES,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return hoistLoopInvariants(graph, analyses);
+   }},
+  {"strength", "induction variable strength reduction and shifts",
+   AnalysisManager::TYPES,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return reduceStrength(graph, analyses);
+   }},
+  {"gvn", "value numbering and common subexpression elimination",
+   AnalysisManager::TYPES | AnalysisManager::DOMINATORS | AnalysisManager::LOOPS,
+   [](FlowGraph& graph, AnalysisManager& analyses, const OptimizationOptions&) {
+     return eliminateCommonSubexpressions(graph, analyses);
+   }},
+};
+
+const PassManager::PassInfo* PassManager::find(const string& name)
+{
+  for (const PassInfo& pass : passes)
+  {
+    if (name == pass.name)
+    {
+      return &pass;
+    }
+  }
+  return nullptr;
+}
+
+bool PassManager::add(const string& name)
+{
+  const PassInfo* pass = find(name);
+  if (!pass)
+  {
+    return false;
+  }
+  pipeline_.push_back(pass);
+  return true;
+}
+
+void PassManager::run(FlowGraph& graph, OptimizationStats* stats)
+{
+  AnalysisManager analyses(graph);
+  if (stats)
+  {
+    stats->initialSize = graph.size();
+  }
+  for (const PassInfo* pass : pipeline_)
+  {
+    int before = graph.size();
+    auto start = chrono::steady_clock::now();
+    pass->run(graph, analyses, options_);
+    analyses.invalidate(pass->preserved);
+    auto finish = chrono::steady_clock::now();
+    if (stats)
+    {
+      OptimizationStats::Pass record;
+      record.name = pass->name;
+      record.sizeBefore = before;
+      record.sizeAfter = graph.size();
+      record.seconds = chrono::duration<double>(finish - start).count();
+      stats->passes.push_back(record);
+    }
+  }
+  if (stats)
+  {
+    stats->analyses = analyses.computed();
+  }
+}
+
+// Конвейеры уровней оптимизации. После развертывания распространение констант и упрощения
+// повторяются, чтобы свернуть скопированные счетчики; общие подвыражения ищутся
+// в окончательном коде.
+static const struct
+{
+  const char* level;
+  vector<const char*> pipeline;
+} levels[] = {
+  {"0", {}},
+  {"1", {"sccp", "simplify", "dce"}},
+  {"2", {"sccp", "simplify", "dce", "unroll", "sccp", "simplify", "dce", "licm", "strength", "gvn"}},
+  {"s", {"sccp", "simplify", "dce", "gvn"}},
+};
+
+bool PassManager::knows(const string& name)
+{
+  return find(name) != nullptr;
+}
+
+bool PassManager::knowsLevel(const string& level)
+{
+  for (const auto& entry : levels)
+  {
+    if (level == entry.level)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PassManager::levelPipeline(const string& level, vector<string>& pipeline)
+{
+  for (const auto& entry : levels)
+  {
+    if (level == entry.level)
+    {
+      pipeline.assign(entry.pipeline.begin(), entry.pipeline.end());
+      return true;
+    }
+  }
+  return false;
+}
+
+void PassManager::printPasses(ostream& output)
+{
+  for (const PassInfo& pass : passes)
+  {
+    output << "  " << pass.name << string(10 - string(pass.name).size(), ' ') << pass.description << endl;
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef CMILAN_PASSMANAGER_HPP
+#define CMILAN_PASSMANAGER_HPP
+
+#include "optimizer.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Менеджер преобразований: запускает преобразования графа программы в заданном порядке
+// и хранит общий кэш анализов. После каждого преобразования сбрасываются анализы, которые
+// оно не сохраняет (у каждого преобразования при регистрации указано, какие анализы
+// остаются верными после него).
+//
+// Конвейер задается уровнем оптимизации или явным списком преобразований:
+//    -O0  без преобразований;
+//    -O1  распространение констант, упрощения и удаление мертвого кода;
+//    -O2  все преобразования (по умолчанию);
+//    -Os  преобразования, которые не увеличивают размер кода.
+
+class PassManager
+{
+public:
+  // Описание зарегистрированного преобразования
+  struct PassInfo;
+
+  explicit PassManager(const OptimizationOptions& options)
+    : options_(options)
+  {}
+
+  // Добавление преобразования в конец конвейера. Возвращает false, если преобразования
+  // с таким именем нет.
+  bool add(const string& name);
+
+  // Запуск конвейера. Если stats не nullptr, в него записываются размер графа до и после
+  // каждого преобразования и время его работы.
+  void run(FlowGraph& graph, OptimizationStats* stats = nullptr);
+
+  // Есть ли преобразование с таким именем
+  static bool knows(const string& name);
+
+  // Есть ли уровень оптимизации ("0", "1", "2" или "s")
+  static bool knowsLevel(const string& level);
+
+  // Конвейер уровня оптимизации. Возвращает false, если уровня нет.
+  static bool levelPipeline(const string& level, vector<string>& passes);
+
+  // Печать списка преобразований для справки
+  static void printPasses(ostream& output);
+
+private:
+  static const PassInfo* find(const string& name);
+
+  const OptimizationOptions& options_;
+  vector<const PassInfo*> pipeline_;
+};
+
+#endif
@@ -0,0 +1,576 @@
+#include "vm.hpp"
+#include "typeinfer.hpp"
+#include "vmio.hpp"
+#include <sstream>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MILAN_VM_SWITCH)
+#define MILAN_VM_THREADED
+#endif
+
+namespace
+{
+
+// Коды операций: базовые инструкции (NOP ... SHR) - общие обработчики, которые проверяют
+// типы операндов; за ними - специализированные варианты. Вариант двуместной операции
+// выбирается по типам операндов (BinaryKind), одноместной - по типу операнда (0 - целое,
+// 1 - вещественное).
+enum QuickOpcode
+{
+  ADD_QUICK = SHR + 1,
+  SUB_QUICK = ADD_QUICK + 4,
+  MULT_QUICK = SUB_QUICK + 4,
+  DIV_QUICK = MULT_QUICK + 4,
+  COMPARE_QUICK = DIV_QUICK + 4,
+  JEQ_QUICK = COMPARE_QUICK + 4,
+  JNE_QUICK = JEQ_QUICK + 4,
+  JLT_QUICK = JNE_QUICK + 4,
+  JGT_QUICK = JLT_QUICK + 4,
+  JLE_QUICK = JGT_QUICK + 4,
+  JGE_QUICK = JLE_QUICK + 4,
+  INVERT_QUICK = JGE_QUICK + 4,
+  JUMP_YES_QUICK = INVERT_QUICK + 2,
+  JUMP_NO_QUICK = JUMP_YES_QUICK + 2,
+  OPCODE_COUNT = JUMP_NO_QUICK + 2
+};
+
+// Типы операндов двуместной операции: целые, целое и вещественное, вещественное и целое,
+// вещественные
+enum BinaryKind
+{
+  INT_INT,
+  INT_FLOAT,
+  FLOAT_INT,
+  FLOAT_FLOAT
+};
+
+// Сколько раз операцию можно специализировать; операция, которая столько раз встретила
+// другие типы, остается общей
+const int MAX_REWRITES = 3;
+
+inline int binaryKind(const Value& a, const Value& b)
+{
+  return a.isFloat * 2 + b.isFloat;
+}
+
+// Операция программы, разложенной на базовые инструкции. Код и обработчик меняются во время
+// выполнения.
+struct QuickOperation
+{
+  const void* handler;  // Адрес обработчика (при переходах по меткам)
+  int opcode;
+  int arg;              // Аргумент; для переходов - номер операции, к которой выполняется переход
+  Value value;          // Константа PUSH
+  int address;          // Адрес инструкции программы
+  int first;            // 1 для первой составляющей инструкции (для подсчета инструкций)
+  int rewrites;         // Число специализаций
+  int deopts;           // Число возвратов к общему обработчику
+};
+
+template <typename T>
+inline bool compareNumbers(int cmp, T x, T y)
+{
+  switch (cmp)
+  {
+  case 0:
+    return x == y;
+  case 1:
+    return x != y;
+  case 2:
+    return x < y;
+  case 3:
+    return x > y;
+  case 4:
+    return x <= y;
+  default:
+    return x >= y;
+  }
+}
+
+// Вещественные значения операндов для вариантов с хотя бы одним вещественным операндом
+template <int Kind>
+inline float leftFloat(const Value& a)
+{
+  return Kind & 2 ? a.f : static_cast<float>(a.i);
+}
+
+template <int Kind>
+inline float rightFloat(const Value& b)
+{
+  return Kind & 1 ? b.f : static_cast<float>(b.i);
+}
+
+inline int wrap(unsigned int value)
+{
+  return static_cast<int>(value);
+}
+
+// Отчет о специализации: операции в конце выполнения по вариантам и возвраты к общим
+// обработчикам
+string report(const vector<QuickOperation>& code)
+{
+  int quickened = 0;
+  int kinds[3] = {0, 0, 0};   // Целые, вещественные, разных типов
+  int deoptimized = 0;
+  int deopts = 0;
+  int generic = 0;
+  for (const QuickOperation& operation : code)
+  {
+    if (operation.rewrites > 0)
+    {
+      ++quickened;
+    }
+    deopts += operation.deopts;
+    if (operation.deopts > 0)
+    {
+      ++deoptimized;
+    }
+    if (operation.opcode >= INVERT_QUICK)
+    {
+      ++kinds[(operation.opcode - INVERT_QUICK) % 2];
+    }
+    else if (operation.opcode >= ADD_QUICK)
+    {
+      int kind = (operation.opcode - ADD_QUICK) % 4;
+      ++kinds[kind == INT_INT ? 0 : kind == FLOAT_FLOAT ? 1 : 2];
+    }
+    else if (operation.rewrites >= MAX_REWRITES)
+    {
+      ++generic;
+    }
+  }
+  ostringstream output;
+  output << "Quickened operations: " << quickened << "; specialized at exit: " << kinds[0] << " int, " << kinds[1]
+         << " float, " << kinds[2] << " mixed" << endl;
+  output << "Deoptimizations: " << deopts << " in " << deoptimized << " operations, " << generic
+         << " left generic" << endl;
+  return output.str();
+}
+
+}
+
+#define BASE_INSTRUCTIONS(X) \
+  X(NOP) X(STOP) X(LOAD) X(STORE) X(BLOAD) X(BSTORE) X(PUSH) X(POP) X(DUP) X(ADD) X(SUB) \
+  X(MULT) X(DIV) X(INVERT) X(COMPARE) X(JUMP) X(JUMP_YES) X(JUMP_NO) X(INPUT) X(PRINT) \
+  X(JEQ) X(JNE) X(JLT) X(JGT) X(JLE) X(JGE) X(SHL) X(SHR)
+
+// Специализированные варианты в порядке их кодов
+#define BINARY_VARIANTS(X, name) X(name, 0) X(name, 1) X(name, 2) X(name, 3)
+#define UNARY_VARIANTS(X, name) X(name, 0) X(name, 1)
+#define QUICK_INSTRUCTIONS(X) \
+  BINARY_VARIANTS(X, ADD) BINARY_VARIANTS(X, SUB) BINARY_VARIANTS(X, MULT) BINARY_VARIANTS(X, DIV) \
+  BINARY_VARIANTS(X, COMPARE) BINARY_VARIANTS(X, JEQ) BINARY_VARIANTS(X, JNE) BINARY_VARIANTS(X, JLT) \
+  BINARY_VARIANTS(X, JGT) BINARY_VARIANTS(X, JLE) BINARY_VARIANTS(X, JGE) UNARY_VARIANTS(X, INVERT) \
+  UNARY_VARIANTS(X, JUMP_YES) UNARY_VARIANTS(X, JUMP_NO)
+
+// Переход к обработчику операции op: NEXT - после выполненной, AGAIN - к той же операции,
+// обработчик которой только что заменен (инструкция при этом не считается повторно)
+#ifdef MILAN_VM_THREADED
+#define LABEL(name) L_##name:
+#define QUICK_LABEL(name, kind) L_##name##_##kind:
+#define NEXT() do { executed += op->first; goto *op->handler; } while (0)
+#define AGAIN() goto *op->handler
+#else
+#define LABEL(name) case name:
+#define QUICK_LABEL(name, kind) case name##_QUICK + kind:
+#define NEXT() do { executed += op->first; goto dispatch; } while (0)
+#define AGAIN() goto again
+#endif
+
+// Замена кода операции op
+#ifdef MILAN_VM_THREADED
+#define SET_OPCODE(code) do { op->opcode = (code); op->handler = handlers[op->opcode]; } while (0)
+#else
+#define SET_OPCODE(code) op->opcode = (code)
+#endif
+
+// Специализация общей операции по наблюдаемым типам операндов
+#ifdef MILAN_VM_NO_QUICKENING
+#define QUICKEN(code)
+#else
+#define QUICKEN(code) \
+  if (op->rewrites < MAX_REWRITES) \
+  { \
+    ++op->rewrites; \
+    SET_OPCODE(code); \
+    AGAIN(); \
+  }
+#endif
+
+// Возврат к общему обработчику, если типы операндов не те, для которых специализирована операция
+#define GUARD(condition, name) \
+  if (!(condition)) \
+  { \
+    ++op->deopts; \
+    SET_OPCODE(name); \
+    AGAIN(); \
+  }
+
+#define JUMP_TO(condition) \
+  if (condition) \
+  { \
+    op = code + op->arg; \
+  } \
+  else \
+  { \
+    ++op; \
+  } \
+  NEXT()
+
+#define FAIL(text) \
+  do \
+  { \
+    message = text; \
+    goto failed; \
+  } while (0)
+
+bool QuickeningMachine::run()
+{
+  steps_ = 0;
+  error_.clear();
+  report_.clear();
+  vector<int> depth;
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth, maxDepth, memorySize, error_))
+  {
+    return false;
+  }
+
+#ifdef MILAN_VM_THREADED
+#define ADDRESS(name) &&L_##name,
+#define QUICK_ADDRESS(name, kind) &&L_##name##_##kind,
+  static const void* const handlers[] = {
+    BASE_INSTRUCTIONS(ADDRESS)
+    QUICK_INSTRUCTIONS(QUICK_ADDRESS)
+  };
+  static_assert(sizeof(handlers) / sizeof(handlers[0]) == OPCODE_COUNT, "a handler for every opcode");
+#undef ADDRESS
+#undef QUICK_ADDRESS
+#endif
+
+  //Суперинструкции раскладываются на составляющие: специализируется каждая из них
+  vector<Operation> operations;
+  vector<int> firstOperation;
+  splitProgram(program_, operations, firstOperation);
+  vector<QuickOperation> decoded(operations.size());
+  for (size_t i = 0; i < operations.size(); ++i)
+  {
+    const Operation& operation = operations[i];
+    QuickOperation& quick = decoded[i];
+    quick.opcode = operation.instruction;
+#ifdef MILAN_VM_THREADED
+    quick.handler = handlers[quick.opcode];
+#endif
+    quick.arg = isJump(operation.instruction) ? firstOperation[operation.arg] : operation.arg;
+    quick.value = operation.value;
+    quick.address = operation.address;
+    quick.first = operation.first ? 1 : 0;
+    quick.rewrites = 0;
+    quick.deopts = 0;
+  }
+
+  memory_.assign(memorySize, Value());
+  stack_.assign(maxDepth + 1, Value());
+  Value* memory = memory_.data();
+  Value* sp = stack_.data();
+  QuickOperation* const code = decoded.data();
+  QuickOperation* op = code;
+  long long executed = 0;
+  string message;
+
+#ifdef MILAN_VM_THREADED
+  NEXT();
+#else
+dispatch:
+  executed += op->first;
+again:
+  switch (op->opcode)
+  {
+#endif
+
+  LABEL(NOP)
+  ++op;
+  NEXT();
+
+  LABEL(STOP)
+  goto stopped;
+
+  LABEL(LOAD)
+  *sp++ = memory[op->arg];
+  ++op;
+  NEXT();
+
+  LABEL(STORE)
+  memory[op->arg] = *--sp;
+  ++op;
+  NEXT();
+
+  LABEL(BLOAD)
+  LABEL(BSTORE)
+  {
+    const Value& offset = *--sp;
+    if (offset.isFloat)
+    {
+      FAIL("float index");
+    }
+    int address = op->arg + offset.i;
+    if (static_cast<unsigned int>(address) >= memory_.size())
+    {
+      if (address < 0 || address >= MEMORY_LIMIT)
+      {
+        FAIL("invalid address " + to_string(address));
+      }
+      memory_.resize(address + 1);
+      memory = memory_.data();
+    }
+    if (op->opcode == BLOAD)
+    {
+      *sp++ = memory[address];
+    }
+    else
+    {
+      memory[address] = *--sp;
+    }
+    ++op;
+    NEXT();
+  }
+
+  LABEL(PUSH)
+  *sp++ = op->value;
+  ++op;
+  NEXT();
+
+  LABEL(POP)
+  --sp;
+  ++op;
+  NEXT();
+
+  LABEL(DUP)
+  *sp = sp[-1];
+  ++sp;
+  ++op;
+  NEXT();
+
+  LABEL(ADD)
+  LABEL(SUB)
+  LABEL(MULT)
+  LABEL(DIV)
+  {
+    static_assert(SUB_QUICK - ADD_QUICK == 4 * (SUB - ADD) && DIV_QUICK - ADD_QUICK == 4 * (DIV - ADD),
+                  "arithmetic variants must follow the order of the instructions");
+    QUICKEN(ADD_QUICK + 4 * (op->opcode - ADD) + binaryKind(sp[-2], sp[-1]));
+    Value result;
+    if (!evaluate(static_cast<Instruction>(op->opcode), sp[-2], sp[-1], result))
+    {
+      FAIL("division by zero");
+    }
+    sp[-2] = result;
+    --sp;
+    ++op;
+    NEXT();
+  }
+
+  LABEL(INVERT)
+  QUICKEN(INVERT_QUICK + sp[-1].isFloat);
+  sp[-1] = invert(sp[-1]);
+  ++op;
+  NEXT();
+
+  LABEL(SHL)
+  LABEL(SHR)
+  sp[-1] = shift(static_cast<Instruction>(op->opcode), sp[-1], op->arg);
+  ++op;
+  NEXT();
+
+  LABEL(COMPARE)
+  QUICKEN(COMPARE_QUICK + binaryKind(sp[-2], sp[-1]));
+  sp[-2] = Value::fromInt(compare(op->arg, sp[-2], sp[-1]) ? 1 : 0);
+  --sp;
+  ++op;
+  NEXT();
+
+  LABEL(JUMP)
+  op = code + op->arg;
+  NEXT();
+
+  LABEL(JUMP_YES)
+  LABEL(JUMP_NO)
+  QUICKEN((op->opcode == JUMP_YES ? JUMP_YES_QUICK : JUMP_NO_QUICK) + sp[-1].isFloat);
+  --sp;
+  JUMP_TO(sp->isTrue() == (op->opcode == JUMP_YES));
+
+  LABEL(INPUT)
+  {
+    int number;
+    if (!readInt(input_, number))
+    {
+      FAIL("invalid input");
+    }
+    *sp++ = Value::fromInt(number);
+    ++op;
+    NEXT();
+  }
+
+  LABEL(PRINT)
+  {
+    printValue(output_, *--sp);
+    ++op;
+    NEXT();
+  }
+
+  LABEL(JEQ)
+  LABEL(JNE)
+  LABEL(JLT)
+  LABEL(JGT)
+  LABEL(JLE)
+  LABEL(JGE)
+  QUICKEN(JEQ_QUICK + 4 * (op->opcode - JEQ) + binaryKind(sp[-2], sp[-1]));
+  sp -= 2;
+  JUMP_TO(compare(jumpComparison(static_cast<Instruction>(op->opcode)), sp[0], sp[1]));
+
+  //Специализированные варианты. Каждый сначала проверяет, что типы операндов те же,
+  //которые наблюдались при специализации. Знак NaN, полученного из двух NaN, зависит от
+  //порядка операндов, который выбирает компилятор, поэтому NaN вычисляется заново evaluate,
+  //как у остальных машин.
+
+#define ARITHMETIC(name, kind) \
+  QUICK_LABEL(name, kind) \
+  GUARD(binaryKind(sp[-2], sp[-1]) == kind, name) \
+  if (kind == INT_INT) \
+  { \
+    unsigned int x = sp[-2].i; \
+    unsigned int y = sp[-1].i; \
+    if (name == ADD) \
+    { \
+      sp[-2].i = wrap(x + y); \
+    } \
+    else if (name == SUB) \
+    { \
+      sp[-2].i = wrap(x - y); \
+    } \
+    else if (name == MULT) \
+    { \
+      sp[-2].i = wrap(x * y); \
+    } \
+    else if (sp[-1].i == 0) \
+    { \
+      FAIL("division by zero"); \
+    } \
+    else \
+    { \
+      sp[-2].i = sp[-1].i == -1 ? wrap(0u - x) : sp[-2].i / sp[-1].i; \
+    } \
+  } \
+  else \
+  { \
+    float x = leftFloat<kind>(sp[-2]); \
+    float y = rightFloat<kind>(sp[-1]); \
+    if (name == DIV && y == 0) \
+    { \
+      FAIL("division by zero"); \
+    } \
+    float result = name == ADD ? x + y : name == SUB ? x - y : name == MULT ? x * y : x / y; \
+    if (result != result) \
+    { \
+      evaluate(name, sp[-2], sp[-1], sp[-2]); \
+    } \
+    else \
+    { \
+      sp[-2] = Value::fromFloat(result); \
+    } \
+  } \
+  --sp; \
+  ++op; \
+  NEXT();
+
+#define COMPARISON(name, kind) \
+  QUICK_LABEL(name, kind) \
+  { \
+    GUARD(binaryKind(sp[-2], sp[-1]) == kind, name) \
+    bool result = kind == INT_INT ? compareNumbers(name == COMPARE ? op->arg : jumpComparison(name), sp[-2].i, sp[-1].i) \
+                                  : compareNumbers(name == COMPARE ? op->arg : jumpComparison(name), \
+                                                   leftFloat<kind>(sp[-2]), rightFloat<kind>(sp[-1])); \
+    if (name == COMPARE) \
+    { \
+      sp[-2] = Value::fromInt(result ? 1 : 0); \
+      --sp; \
+      ++op; \
+      NEXT(); \
+    } \
+    sp -= 2; \
+    JUMP_TO(result); \
+  }
+
+  BINARY_VARIANTS(ARITHMETIC, ADD)
+  BINARY_VARIANTS(ARITHMETIC, SUB)
+  BINARY_VARIANTS(ARITHMETIC, MULT)
+  BINARY_VARIANTS(ARITHMETIC, DIV)
+  BINARY_VARIANTS(COMPARISON, COMPARE)
+  BINARY_VARIANTS(COMPARISON, JEQ)
+  BINARY_VARIANTS(COMPARISON, JNE)
+  BINARY_VARIANTS(COMPARISON, JLT)
+  BINARY_VARIANTS(COMPARISON, JGT)
+  BINARY_VARIANTS(COMPARISON, JLE)
+  BINARY_VARIANTS(COMPARISON, JGE)
+
+#undef ARITHMETIC
+#undef COMPARISON
+
+  QUICK_LABEL(INVERT, 0)
+  GUARD(!sp[-1].isFloat, INVERT)
+  sp[-1].i = wrap(0u - static_cast<unsigned int>(sp[-1].i));
+  ++op;
+  NEXT();
+
+  QUICK_LABEL(INVERT, 1)
+  GUARD(sp[-1].isFloat, INVERT)
+  sp[-1].f = -sp[-1].f;
+  ++op;
+  NEXT();
+
+  QUICK_LABEL(JUMP_YES, 0)
+  GUARD(!sp[-1].isFloat, JUMP_YES)
+  --sp;
+  JUMP_TO(sp->i != 0);
+
+  QUICK_LABEL(JUMP_YES, 1)
+  GUARD(sp[-1].isFloat, JUMP_YES)
+  --sp;
+  JUMP_TO(sp->f != 0);
+
+  QUICK_LABEL(JUMP_NO, 0)
+  GUARD(!sp[-1].isFloat, JUMP_NO)
+  --sp;
+  JUMP_TO(sp->i == 0);
+
+  QUICK_LABEL(JUMP_NO, 1)
+  GUARD(sp[-1].isFloat, JUMP_NO)
+  --sp;
+  JUMP_TO(sp->f == 0);
+
+#ifndef MILAN_VM_THREADED
+  }
+#endif
+
+stopped:
+  steps_ = executed;
+  output_.flush();
+  report_ = report(decoded);
+  return true;
+
+failed:
+  steps_ = executed;
+  error_ = "address " + to_string(op->address) + ": " + message;
+  output_.flush();
+  report_ = report(decoded);
+  return false;
+}
+
+#undef LABEL
+#undef QUICK_LABEL
+#undef NEXT
+#undef AGAIN
+#undef SET_OPCODE
+#undef QUICKEN
+#undef GUARD
+#undef JUMP_TO
+#undef FAIL
@@ -0,0 +1,609 @@
+#include "vm.hpp"
+#include "vmio.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MILAN_VM_SWITCH)
+#define MILAN_VM_THREADED
+#endif
+
+namespace
+{
+
+// Инструкция регистровой машины. Код операции - код инструкции стековой машины с тем же
+// действием, пересылка обозначается STORE:
+//   STORE d, a          d := a
+//   ADD ... DIV d, a, b d := a op b
+//   INVERT d, a         d := -a
+//   SHL, SHR d, a, n    d := a * 2^n, a / 2^n
+//   COMPARE d, a, b, c  d := сравнение a и b с кодом c
+//   BLOAD d, a, n       d := память[n + a]
+//   BSTORE a, b, n      память[n + b] := a
+//   INPUT d; PRINT a; STOP
+//   JUMP t; JUMP_YES, JUMP_NO a, t; JEQ ... JGE a, b, t
+// Операнды - номера регистров. Регистры - слова стека (0 ... slots - 1), за ними слова памяти
+// (переменная с адресом x - регистр slots + x); константы - регистры с отрицательными номерами.
+struct Operation
+{
+  const void* handler;    // Адрес обработчика (при переходах по меткам)
+  Instruction code;
+  int dst;
+  int a;
+  int b;
+  int extra;              // Код сравнения, величина сдвига, адрес BLOAD и BSTORE или адрес перехода
+  int address;            // Адрес исходной инструкции стековой машины
+};
+
+// Перевод стековой программы в регистровую абстрактной интерпретацией стека. Слово стека на
+// глубине i - регистр i, но значения LOAD и PUSH не копируются в стек: на абстрактном стеке
+// лежит сам регистр переменной или константы, и инструкция, снимающая его, читает этот регистр
+// прямо. Такие ссылки переносятся в регистры стека перед записью в переменную, перед BSTORE и
+// на границах блоков, где стек должен лежать в своих регистрах. Результат, сразу записываемый
+// STORE в переменную, вычисляется прямо в нее.
+class Translator
+{
+public:
+  Translator(const vector<Command>& program, const vector<int>& depth, int slots)
+    : program_(program), depth_(depth), slots_(slots)
+  {}
+
+  void translate(vector<Operation>& code, vector<Value>& constants);
+
+private:
+  void translateInstruction(Instruction instruction, int arg);
+  void emit(Instruction code, int dst, int a = 0, int b = 0, int extra = 0);
+  void emitResult(Instruction code, int a, int b = 0, int extra = 0);
+
+  // Номер регистра константы
+  int constant(const Value& value);
+
+  int variable(int address)
+  {
+    return slots_ + address;
+  }
+
+  int pop()
+  {
+    int reg = stack_.back();
+    stack_.pop_back();
+    return reg;
+  }
+
+  // Перенос слова стека i в его регистр
+  void materialize(int i);
+
+  // Перенос всех ссылок на переменные (или на переменную reg) в регистры стека
+  void materializeVariables(int reg = -1);
+
+  // Перенос всего стека в свои регистры, как на границе блока
+  void materializeStack();
+
+  const vector<Command>& program_;
+  const vector<int>& depth_;
+  int slots_;
+  vector<Operation>* code_;
+  vector<Value>* constants_;
+  vector<int> stack_;             // Регистры, в которых лежат слова абстрактного стека
+  int lastResult_;                // Номер последней инструкции, вычислившей слово стека, или -1
+  int address_;                   // Адрес переводимой инструкции
+};
+
+void Translator::emit(Instruction code, int dst, int a, int b, int extra)
+{
+  Operation operation;
+  operation.handler = nullptr;
+  operation.code = code;
+  operation.dst = dst;
+  operation.a = a;
+  operation.b = b;
+  operation.extra = extra;
+  operation.address = address_;
+  code_->push_back(operation);
+  lastResult_ = -1;
+}
+
+void Translator::emitResult(Instruction code, int a, int b, int extra)
+{
+  int dst = stack_.size();
+  emit(code, dst, a, b, extra);
+  lastResult_ = code_->size() - 1;
+  stack_.push_back(dst);
+}
+
+int Translator::constant(const Value& value)
+{
+  for (size_t i = 0; i < constants_->size(); ++i)
+  {
+    if ((*constants_)[i].same(value))
+    {
+      return -1 - i;
+    }
+  }
+  constants_->push_back(value);
+  return -int(constants_->size());
+}
+
+void Translator::materialize(int i)
+{
+  if (stack_[i] != i)
+  {
+    emit(STORE, i, stack_[i]);
+    stack_[i] = i;
+  }
+}
+
+void Translator::materializeVariables(int reg)
+{
+  for (size_t i = 0; i < stack_.size(); ++i)
+  {
+    if (stack_[i] >= slots_ && (reg < 0 || stack_[i] == reg))
+    {
+      materialize(i);
+    }
+  }
+}
+
+void Translator::materializeStack()
+{
+  for (size_t i = 0; i < stack_.size(); ++i)
+  {
+    materialize(i);
+  }
+}
+
+void Translator::translateInstruction(Instruction instruction, int arg)
+{
+  switch (instruction)
+  {
+  case NOP:
+    break;
+
+  case STOP:
+    emit(STOP, 0);
+    break;
+
+  case LOAD:
+    stack_.push_back(variable(arg));
+    break;
+
+  case PUSH:
+    //Вещественные PUSH обрабатываются в translate: аргумент суперинструкции всегда целый
+    stack_.push_back(constant(Value::fromInt(arg)));
+    break;
+
+  case STORE:
+  {
+    int reg = variable(arg);
+    int value = pop();
+    bool referenced = false;
+    for (int entry : stack_)
+    {
+      referenced = referenced || entry == reg;
+    }
+    if (lastResult_ >= 0 && value == int(stack_.size()) && !referenced)
+    {
+      (*code_)[lastResult_].dst = reg;
+      lastResult_ = -1;
+    }
+    else
+    {
+      materializeVariables(reg);
+      emit(STORE, reg, value);
+    }
+    break;
+  }
+
+  case POP:
+    pop();
+    break;
+
+  case DUP:
+  {
+    int top = stack_.back();
+    if (top < slots_)
+    {
+      emitResult(STORE, top);
+    }
+    else
+    {
+      stack_.push_back(top);
+    }
+    break;
+  }
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  case COMPARE:
+  {
+    int b = pop();
+    int a = pop();
+    emitResult(instruction, a, b, arg);
+    break;
+  }
+
+  case INVERT:
+  case SHL:
+  case SHR:
+  case BLOAD:
+    emitResult(instruction, pop(), 0, arg);
+    break;
+
+  case BSTORE:
+  {
+    int index = pop();
+    int value = pop();
+    materializeVariables();
+    emit(BSTORE, 0, value, index, arg);
+    break;
+  }
+
+  case INPUT:
+    emitResult(INPUT, 0);
+    break;
+
+  case PRINT:
+    emit(PRINT, 0, pop());
+    break;
+
+  case JUMP:
+    materializeStack();
+    emit(JUMP, 0, 0, 0, arg);
+    break;
+
+  case JUMP_YES:
+  case JUMP_NO:
+  {
+    int a = pop();
+    materializeStack();
+    emit(instruction, 0, a, 0, arg);
+    break;
+  }
+
+  default:
+  {
+    int b = pop();
+    int a = pop();
+    materializeStack();
+    emit(instruction, 0, a, b, arg);
+    break;
+  }
+  }
+}
+
+void Translator::translate(vector<Operation>& code, vector<Value>& constants)
+{
+  code_ = &code;
+  constants_ = &constants;
+  code.clear();
+  constants.clear();
+  stack_.clear();
+  lastResult_ = -1;
+
+  int size = program_.size();
+  vector<bool> isTarget(size, false);
+  for (int i = 0; i < size; ++i)
+  {
+    Instruction instruction = program_[i].instruction();
+    if (depth_[i] >= 0 && isJump(instruction))
+    {
+      isTarget[program_[i].arg(argumentCount(instruction) - 1)] = true;
+    }
+  }
+
+  //Адреса переходов переводятся в номера регистровых инструкций после перевода
+  vector<int> start(size + 1, 0);
+  bool reachable = false;
+  for (int i = 0; i < size; ++i)
+  {
+    if (depth_[i] < 0)
+    {
+      start[i] = code.size();
+      reachable = false;
+      continue;
+    }
+    address_ = i;
+    if (!reachable)
+    {
+      //Сюда можно попасть только переходом: стек лежит в своих регистрах
+      stack_.clear();
+      for (int j = 0; j < depth_[i]; ++j)
+      {
+        stack_.push_back(j);
+      }
+    }
+    else if (isTarget[i])
+    {
+      materializeStack();
+    }
+    if (isTarget[i])
+    {
+      lastResult_ = -1;
+    }
+    start[i] = code.size();
+
+    const Command& command = program_[i];
+    Instruction instruction = command.instruction();
+    const Superop* superop = findSuperop(instruction);
+    if (instruction == PUSH && command.isFloat())
+    {
+      stack_.push_back(constant(Value::fromCommand(command)));
+    }
+    else if (!superop)
+    {
+      translateInstruction(instruction, command.arg());
+    }
+    else
+    {
+      int next = 0;
+      for (int j = 0; j < superop->length; ++j)
+      {
+        Instruction part = superop->parts[j];
+        translateInstruction(part, argumentCount(part) > 0 ? command.arg(next++) : 0);
+      }
+    }
+    Instruction last = superop ? superop->parts[superop->length - 1] : instruction;
+    reachable = last != STOP && last != JUMP;
+  }
+  start[size] = code.size();
+
+  for (Operation& operation : code)
+  {
+    if (isJump(operation.code))
+    {
+      operation.extra = start[operation.extra];
+    }
+  }
+}
+
+}
+
+
+// Выполнение завершается переходом к обработчику следующей инструкции, как в ThreadedMachine
+#ifdef MILAN_VM_THREADED
+#define LABEL(name) L_##name:
+#define DISPATCH() do { ++executed; goto *op->handler; } while (0)
+#else
+#define LABEL(name) case name:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() do { ++op; DISPATCH(); } while (0)
+#define JUMP_TO(target) do { op = code.data() + (target); DISPATCH(); } while (0)
+#define FAIL(text) do { message = text; goto failed; } while (0)
+
+#define ARITHMETIC(instruction, operation) \
+  { \
+    const Value& a = r[op->a]; \
+    const Value& b = r[op->b]; \
+    if (!(a.isFloat | b.isFloat)) \
+    { \
+      int result = static_cast<int>(static_cast<unsigned int>(a.i) operation static_cast<unsigned int>(b.i)); \
+      r[op->dst].isFloat = false; \
+      r[op->dst].i = result; \
+    } \
+    else \
+    { \
+      evaluate(instruction, a, b, r[op->dst]); \
+    } \
+  }
+
+#define JUMP_IF(cmp, operation) \
+  { \
+    const Value& a = r[op->a]; \
+    const Value& b = r[op->b]; \
+    if ((a.isFloat | b.isFloat) ? compare(cmp, a, b) : a.i operation b.i) \
+    { \
+      JUMP_TO(op->extra); \
+    } \
+  }
+
+// Адрес BLOAD и BSTORE: op->extra + целое в регистре reg; память расширяется по мере обращений
+#define INDEX(reg) \
+  if (r[reg].isFloat) \
+  { \
+    FAIL("float index"); \
+  } \
+  address = op->extra + r[reg].i; \
+  if (static_cast<unsigned int>(address) >= static_cast<unsigned int>(memorySize)) \
+  { \
+    if (address < 0 || address >= MEMORY_LIMIT) \
+    { \
+      FAIL("invalid address " + to_string(address)); \
+    } \
+    memorySize = address + 1; \
+    registers_.resize(base + slots + memorySize); \
+    r = registers_.data() + base; \
+  }
+
+bool RegisterMachine::run()
+{
+  steps_ = 0;
+  error_.clear();
+  vector<int> depth;
+  int slots, memorySize;
+  if (!verifyProgram(program_, depth, slots, memorySize, error_))
+  {
+    return false;
+  }
+
+  vector<Operation> code;
+  vector<Value> constants;
+  Translator(program_, depth, slots).translate(code, constants);
+  instructionCount_ = code.size();
+
+#ifdef MILAN_VM_THREADED
+  static const void* const handlers[] = {
+    &&L_NOP, &&L_STOP, &&L_LOAD, &&L_STORE, &&L_BLOAD, &&L_BSTORE, &&L_PUSH, &&L_POP, &&L_DUP,
+    &&L_ADD, &&L_SUB, &&L_MULT, &&L_DIV, &&L_INVERT, &&L_COMPARE, &&L_JUMP, &&L_JUMP_YES,
+    &&L_JUMP_NO, &&L_INPUT, &&L_PRINT, &&L_JEQ, &&L_JNE, &&L_JLT, &&L_JGT, &&L_JLE, &&L_JGE,
+    &&L_SHL, &&L_SHR,
+  };
+  for (Operation& operation : code)
+  {
+    operation.handler = handlers[operation.code];
+  }
+#endif
+
+  //Регистры: константы в обратном порядке, слова стека, память
+  int base = constants.size();
+  registers_.assign(base + slots + memorySize, Value());
+  for (int i = 0; i < base; ++i)
+  {
+    registers_[base - 1 - i] = constants[i];
+  }
+  Value* r = registers_.data() + base;
+  const Operation* op = code.data();
+  long long executed = 0;
+  string message;
+  int address;
+
+#ifdef MILAN_VM_THREADED
+  DISPATCH();
+#else
+dispatch:
+  ++executed;
+  switch (op->code)
+  {
+#endif
+
+  LABEL(STORE)
+    r[op->dst] = r[op->a];
+    NEXT();
+
+  LABEL(ADD)
+    ARITHMETIC(ADD, +)
+    NEXT();
+
+  LABEL(SUB)
+    ARITHMETIC(SUB, -)
+    NEXT();
+
+  LABEL(MULT)
+    ARITHMETIC(MULT, *)
+    NEXT();
+
+  LABEL(DIV)
+  {
+    const Value& a = r[op->a];
+    const Value& b = r[op->b];
+    if (!(a.isFloat | b.isFloat) && b.i > 0)
+    {
+      int result = a.i / b.i;
+      r[op->dst].isFloat = false;
+      r[op->dst].i = result;
+    }
+    else if (!evaluate(DIV, a, b, r[op->dst]))
+    {
+      FAIL("division by zero");
+    }
+    NEXT();
+  }
+
+  LABEL(INVERT)
+    r[op->dst] = invert(r[op->a]);
+    NEXT();
+
+  LABEL(SHL)
+    r[op->dst] = shift(SHL, r[op->a], op->extra);
+    NEXT();
+
+  LABEL(SHR)
+    r[op->dst] = shift(SHR, r[op->a], op->extra);
+    NEXT();
+
+  LABEL(COMPARE)
+    r[op->dst] = Value::fromInt(compare(op->extra, r[op->a], r[op->b]) ? 1 : 0);
+    NEXT();
+
+  LABEL(BLOAD)
+    INDEX(op->a)
+    r[op->dst] = r[slots + address];
+    NEXT();
+
+  LABEL(BSTORE)
+    INDEX(op->b)
+    r[slots + address] = r[op->a];
+    NEXT();
+
+  LABEL(INPUT)
+  {
+    int value;
+    if (!readInt(input_, value))
+    {
+      FAIL("invalid input");
+    }
+    r[op->dst] = Value::fromInt(value);
+    NEXT();
+  }
+
+  LABEL(PRINT)
+    printValue(output_, r[op->a]);
+    NEXT();
+
+  LABEL(JUMP)
+    JUMP_TO(op->extra);
+
+  LABEL(JUMP_YES)
+    if (r[op->a].isTrue())
+    {
+      JUMP_TO(op->extra);
+    }
+    NEXT();
+
+  LABEL(JUMP_NO)
+    if (!r[op->a].isTrue())
+    {
+      JUMP_TO(op->extra);
+    }
+    NEXT();
+
+  LABEL(JEQ)
+    JUMP_IF(0, ==)
+    NEXT();
+
+  LABEL(JNE)
+    JUMP_IF(1, !=)
+    NEXT();
+
+  LABEL(JLT)
+    JUMP_IF(2, <)
+    NEXT();
+
+  LABEL(JGT)
+    JUMP_IF(3, >)
+    NEXT();
+
+  LABEL(JLE)
+    JUMP_IF(4, <=)
+    NEXT();
+
+  LABEL(JGE)
+    JUMP_IF(5, >=)
+    NEXT();
+
+  //Инструкций стековой машины NOP, LOAD, PUSH, POP и DUP в регистровом коде нет
+  LABEL(NOP)
+  LABEL(LOAD)
+  LABEL(PUSH)
+  LABEL(POP)
+  LABEL(DUP)
+  LABEL(STOP)
+    goto stopped;
+
+#ifndef MILAN_VM_THREADED
+  default:
+    goto stopped;
+  }
+#endif
+
+stopped:
+  steps_ = executed;
+  output_.flush();
+  return true;
+
+failed:
+  steps_ = executed;
+  error_ = "address " + to_string(op->address) + ": " + message;
+  output_.flush();
+  return false;
+}
@@ -0,0 +1,568 @@
+// Разреженное условное распространение констант (алгоритм Вегмана - Задека).
+//
+// Над переменными программы (ячейками памяти, к которым обращаются LOAD и STORE) строится
+// SSA-форма: каждая запись STORE и каждая φ-функция в узле слияния определяют новую версию
+// переменной, а каждая загрузка LOAD читает ровно одну версию. Значения внутри блока
+// передаются через стек, поэтому блок вычисляется целиком при изменении любой версии,
+// которую он читает, или при появлении новой выполнимой входящей дуги.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include "value.hpp"
+#include <algorithm>
+
+// Элемент решетки значений: неизвестно (TOP), константа, переменное значение (BOTTOM)
+struct Lattice
+{
+  enum Kind
+  {
+    TOP,
+    CONSTANT,
+    BOTTOM
+  };
+
+  Kind kind;
+  Value value;
+
+  Lattice(Kind k = TOP)
+    : kind(k)
+  {}
+
+  static Lattice constant(const Value& value)
+  {
+    Lattice result(CONSTANT);
+    result.value = value;
+    return result;
+  }
+
+  bool operator==(const Lattice& other) const
+  {
+    return kind == other.kind && (kind != CONSTANT || value.same(other.value));
+  }
+};
+
+static Lattice meet(const Lattice& a, const Lattice& b)
+{
+  if (a.kind == Lattice::TOP)
+  {
+    return b;
+  }
+  if (b.kind == Lattice::TOP)
+  {
+    return a;
+  }
+  if (a.kind == Lattice::CONSTANT && b.kind == Lattice::CONSTANT && a.value.same(b.value))
+  {
+    return a;
+  }
+  return Lattice(Lattice::BOTTOM);
+}
+
+// SSA-форма переменных. Версии с номерами от 0 до variableCount - 1 - начальные значения
+// переменных при входе в программу.
+struct SsaForm
+{
+  struct Phi
+  {
+    int variable;
+    int version;
+    vector<int> args;     // Версии, приходящие по дугам от block->preds[i]
+  };
+
+  int variableCount;
+  int versionCount;
+  vector<vector<Phi>> phis;        // φ-функции каждого блока
+  vector<vector<int>> versions;    // Для каждой инструкции блока: версия, которую читает LOAD
+                                   // или определяет STORE, иначе -1
+
+  SsaForm(FlowGraph& graph, const DominatorTree& dom, int variableCount);
+};
+
+SsaForm::SsaForm(FlowGraph& graph, const DominatorTree& dom, int variableCount)
+  : variableCount(variableCount), versionCount(variableCount)
+{
+  vector<BasicBlock*>& blocks = graph.blocks();
+  phis.assign(blocks.size(), vector<Phi>());
+  versions.assign(blocks.size(), vector<int>());
+
+  //Размещение φ-функций по итерированным границам доминирования мест записи
+  vector<vector<BasicBlock*>> defSites(variableCount);
+  for (BasicBlock* block : dom.order())
+  {
+    for (const Command& command : block->code)
+    {
+      if (command.instruction() == STORE)
+      {
+        vector<BasicBlock*>& sites = defSites[command.arg()];
+        if (sites.empty() || sites.back() != block)
+        {
+          sites.push_back(block);
+        }
+      }
+    }
+  }
+
+  vector<vector<BasicBlock*>> frontier = dom.frontiers();
+  vector<int> hasPhi(blocks.size(), -1);     // Переменная, для которой в блоке уже есть φ
+  vector<int> queued(blocks.size(), -1);
+  for (int variable = 0; variable < variableCount; ++variable)
+  {
+    vector<BasicBlock*> work = defSites[variable];
+    for (BasicBlock* block : work)
+    {
+      queued[block->id] = variable;
+    }
+    while (!work.empty())
+    {
+      BasicBlock* block = work.back();
+      work.pop_back();
+      for (BasicBlock* join : frontier[block->id])
+      {
+        if (hasPhi[join->id] == variable)
+        {
+          continue;
+        }
+        hasPhi[join->id] = variable;
+        phis[join->id].push_back({variable, versionCount++, vector<int>(join->preds.size(), -1)});
+        if (queued[join->id] != variable)
+        {
+          queued[join->id] = variable;
+          work.push_back(join);
+        }
+      }
+    }
+  }
+
+  //Переименование обходом дерева доминаторов. Стек текущих версий каждой переменной;
+  //журнал pushed позволяет снять версии блока при выходе из него.
+  vector<vector<int>> current(variableCount);
+  for (int variable = 0; variable < variableCount; ++variable)
+  {
+    current[variable].push_back(variable);
+  }
+  vector<int> pushed;
+  vector<pair<BasicBlock*, size_t>> walk;
+  vector<size_t> marks;
+  if (graph.entry())
+  {
+    walk.push_back(make_pair(graph.entry(), 0));
+  }
+
+  while (!walk.empty())
+  {
+    BasicBlock* block = walk.back().first;
+    size_t child = walk.back().second;
+    if (child == 0)
+    {
+      //Вход в блок
+      marks.push_back(pushed.size());
+      for (Phi& phi : phis[block->id])
+      {
+        current[phi.variable].push_back(phi.version);
+        pushed.push_back(phi.variable);
+      }
+      vector<int>& blockVersions = versions[block->id];
+      blockVersions.assign(block->code.size(), -1);
+      for (size_t i = 0; i < block->code.size(); ++i)
+      {
+        const Command& command = block->code[i];
+        if (command.instruction() == LOAD)
+        {
+          blockVersions[i] = current[command.arg()].back();
+        }
+        else if (command.instruction() == STORE)
+        {
+          blockVersions[i] = versionCount++;
+          current[command.arg()].push_back(blockVersions[i]);
+          pushed.push_back(command.arg());
+        }
+      }
+      for (BasicBlock* succ : block->succs)
+      {
+        size_t index = find(succ->preds.begin(), succ->preds.end(), block) - succ->preds.begin();
+        for (Phi& phi : phis[succ->id])
+        {
+          phi.args[index] = current[phi.variable].back();
+        }
+      }
+    }
+
+    const vector<BasicBlock*>& children = dom.children(block);
+    if (child < children.size())
+    {
+      ++walk.back().second;
+      walk.push_back(make_pair(children[child], 0));
+    }
+    else
+    {
+      //Выход из блока
+      while (pushed.size() > marks.back())
+      {
+        current[pushed.back()].pop_back();
+        pushed.pop_back();
+      }
+      marks.pop_back();
+      walk.pop_back();
+    }
+  }
+}
+
+// Решатель SCCP
+class ConstantPropagation
+{
+public:
+  ConstantPropagation(FlowGraph& graph, const SsaForm& ssa)
+    : graph_(graph), ssa_(ssa)
+  {}
+
+  void solve();
+
+  // Вычисление блока; taken - преемник при известном условии, иначе nullptr
+  Lattice evaluateBlock(BasicBlock* block, bool update, BasicBlock*& taken);
+
+  const Lattice& valueOf(int version) const
+  {
+    return values_[version];
+  }
+
+  bool executable(const BasicBlock* block) const
+  {
+    return executable_[block->id];
+  }
+
+private:
+  void setValue(int version, const Lattice& value);
+  void markEdge(BasicBlock* from, BasicBlock* to);
+  void enqueue(BasicBlock* block);
+
+  FlowGraph& graph_;
+  const SsaForm& ssa_;
+  vector<Lattice> values_;
+  vector<vector<BasicBlock*>> users_;     // Блоки, читающие версию
+  vector<bool> executable_;
+  vector<vector<bool>> edgeExecutable_;   // По индексу предшественника
+  vector<BasicBlock*> work_;
+  vector<bool> queued_;
+};
+
+void ConstantPropagation::solve()
+{
+  vector<BasicBlock*>& blocks = graph_.blocks();
+  values_.assign(ssa_.versionCount, Lattice(Lattice::TOP));
+  //Начальные значения переменных неизвестны
+  for (int version = 0; version < ssa_.variableCount; ++version)
+  {
+    values_[version] = Lattice(Lattice::BOTTOM);
+  }
+  users_.assign(ssa_.versionCount, vector<BasicBlock*>());
+  executable_.assign(blocks.size(), false);
+  edgeExecutable_.assign(blocks.size(), vector<bool>());
+  queued_.assign(blocks.size(), false);
+
+  for (BasicBlock* block : blocks)
+  {
+    edgeExecutable_[block->id].assign(block->preds.size(), false);
+    auto addUser = [&] (int version)
+    {
+      if (version >= 0 && (users_[version].empty() || users_[version].back() != block))
+      {
+        users_[version].push_back(block);
+      }
+    };
+    for (const SsaForm::Phi& phi : ssa_.phis[block->id])
+    {
+      for (int arg : phi.args)
+      {
+        addUser(arg);
+      }
+    }
+    for (size_t i = 0; i < block->code.size(); ++i)
+    {
+      if (block->code[i].instruction() == LOAD)
+      {
+        addUser(ssa_.versions[block->id][i]);
+      }
+    }
+  }
+
+  if (!graph_.entry())
+  {
+    return;
+  }
+  executable_[graph_.entry()->id] = true;
+  enqueue(graph_.entry());
+  while (!work_.empty())
+  {
+    BasicBlock* block = work_.back();
+    work_.pop_back();
+    queued_[block->id] = false;
+    BasicBlock* taken;
+    evaluateBlock(block, true, taken);
+  }
+}
+
+void ConstantPropagation::enqueue(BasicBlock* block)
+{
+  if (!queued_[block->id])
+  {
+    queued_[block->id] = true;
+    work_.push_back(block);
+  }
+}
+
+void ConstantPropagation::setValue(int version, const Lattice& value)
+{
+  Lattice lowered = meet(values_[version], value);
+  if (lowered == values_[version])
+  {
+    return;
+  }
+  values_[version] = lowered;
+  for (BasicBlock* user : users_[version])
+  {
+    if (executable_[user->id])
+    {
+      enqueue(user);
+    }
+  }
+}
+
+void ConstantPropagation::markEdge(BasicBlock* from, BasicBlock* to)
+{
+  size_t index = find(to->preds.begin(), to->preds.end(), from) - to->preds.begin();
+  if (edgeExecutable_[to->id][index])
+  {
+    return;
+  }
+  edgeExecutable_[to->id][index] = true;
+  executable_[to->id] = true;
+  enqueue(to);
+}
+
+// Результат операции над элементами решетки
+static Lattice evaluateLattice(Instruction op, int arg, const Lattice& a, const Lattice& b)
+{
+  if (a.kind == Lattice::BOTTOM || b.kind == Lattice::BOTTOM)
+  {
+    return Lattice(Lattice::BOTTOM);
+  }
+  if (a.kind == Lattice::TOP || b.kind == Lattice::TOP)
+  {
+    return Lattice(Lattice::TOP);
+  }
+  if (op == COMPARE)
+  {
+    return Lattice::constant(Value::fromInt(compare(arg, a.value, b.value) ? 1 : 0));
+  }
+  Value result;
+  if (!evaluate(op, a.value, b.value, result))
+  {
+    return Lattice(Lattice::BOTTOM);
+  }
+  return Lattice::constant(result);
+}
+
+Lattice ConstantPropagation::evaluateBlock(BasicBlock* block, bool update, BasicBlock*& taken)
+{
+  taken = nullptr;
+  if (update)
+  {
+    for (const SsaForm::Phi& phi : ssa_.phis[block->id])
+    {
+      Lattice value(Lattice::TOP);
+      for (size_t i = 0; i < phi.args.size(); ++i)
+      {
+        if (edgeExecutable_[block->id][i])
+        {
+          value = meet(value, phi.args[i] >= 0 ? values_[phi.args[i]] : Lattice(Lattice::BOTTOM));
+        }
+      }
+      setValue(phi.version, value);
+    }
+  }
+
+  const vector<int>& versions = ssa_.versions[block->id];
+  vector<Lattice> stack;
+  auto pop = [&stack] ()
+  {
+    if (stack.empty())
+    {
+      return Lattice(Lattice::BOTTOM);
+    }
+    Lattice top = stack.back();
+    stack.pop_back();
+    return top;
+  };
+
+  for (size_t i = 0; i < block->code.size(); ++i)
+  {
+    const Command& command = block->code[i];
+    switch (command.instruction())
+    {
+    case PUSH:
+      stack.push_back(Lattice::constant(Value::fromCommand(command)));
+      break;
+    case LOAD:
+      stack.push_back(values_[versions[i]]);
+      break;
+    case STORE:
+    {
+      Lattice value = pop();
+      if (update)
+      {
+        setValue(versions[i], value);
+      }
+      break;
+    }
+    case DUP:
+    {
+      Lattice top = pop();
+      stack.push_back(top);
+      stack.push_back(top);
+      break;
+    }
+    case ADD:
+    case SUB:
+    case MULT:
+    case DIV:
+    case COMPARE:
+    {
+      Lattice b = pop();
+      Lattice a = pop();
+      stack.push_back(evaluateLattice(command.instruction(), command.arg(), a, b));
+      break;
+    }
+    case INVERT:
+    {
+      Lattice a = pop();
+      stack.push_back(a.kind == Lattice::CONSTANT ? Lattice::constant(invert(a.value)) : a);
+      break;
+    }
+    case SHL:
+    case SHR:
+    {
+      Lattice a = pop();
+      stack.push_back(a.kind == Lattice::CONSTANT ? Lattice::constant(shift(command.instruction(), a.value, command.arg())) : a);
+      break;
+    }
+    default:
+    {
+      int pops, pushes;
+      stackEffect(command.instruction(), pops, pushes);
+      for (int k = 0; k < pops; ++k)
+      {
+        pop();
+      }
+      for (int k = 0; k < pushes; ++k)
+      {
+        stack.push_back(Lattice(Lattice::BOTTOM));
+      }
+      break;
+    }
+    }
+  }
+
+  //Условие завершающего перехода
+  Lattice condition(Lattice::BOTTOM);
+  if (block->branch == STOP)
+  {
+    return condition;
+  }
+  if (!block->isConditional())
+  {
+    taken = block->next;
+  }
+  else
+  {
+    int cmp = jumpComparison(block->branch);
+    if (cmp >= 0)
+    {
+      Lattice b = pop();
+      Lattice a = pop();
+      condition = evaluateLattice(COMPARE, cmp, a, b);
+    }
+    else
+    {
+      condition = pop();
+      if (condition.kind == Lattice::CONSTANT && block->branch == JUMP_NO)
+      {
+        condition = Lattice::constant(Value::fromInt(condition.value.isTrue() ? 0 : 1));
+      }
+    }
+    if (condition.kind == Lattice::CONSTANT)
+    {
+      taken = condition.value.isTrue() ? block->target : block->next;
+    }
+  }
+
+  if (update)
+  {
+    if (taken)
+    {
+      markEdge(block, taken);
+    }
+    else if (condition.kind == Lattice::BOTTOM)
+    {
+      markEdge(block, block->target);
+      markEdge(block, block->next);
+    }
+  }
+  return condition;
+}
+
+int propagateConstants(FlowGraph& graph, AnalysisManager& analyses)
+{
+  //Индексная адресация (BLOAD, BSTORE) может обращаться к любой переменной
+  int variableCount = analyses.variableCount();
+  if (variableCount < 0)
+  {
+    return 0;
+  }
+
+  const DominatorTree& dom = analyses.dominators();
+  SsaForm ssa(graph, dom, variableCount);
+  ConstantPropagation solver(graph, ssa);
+  solver.solve();
+
+  int changes = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    if (!solver.executable(block))
+    {
+      continue;
+    }
+
+    //Условный переход с известным условием становится безусловным, его операнды снимаются со стека
+    BasicBlock* taken;
+    Lattice condition = solver.evaluateBlock(block, false, taken);
+    if (block->isConditional() && condition.kind == Lattice::CONSTANT)
+    {
+      int pops = branchPops(block->branch);
+      for (int i = 0; i < pops; ++i)
+      {
+        block->code.push_back(Command(POP));
+      }
+      block->branch = NOP;
+      block->target = nullptr;
+      block->next = taken;
+      ++changes;
+    }
+
+    //Загрузки переменных с известным значением
+    const vector<int>& versions = ssa.versions[block->id];
+    for (size_t i = 0; i < versions.size(); ++i)
+    {
+      if (block->code[i].instruction() == LOAD && solver.valueOf(versions[i]).kind == Lattice::CONSTANT)
+      {
+        block->code[i] = solver.valueOf(versions[i]).value.toPush();
+        ++changes;
+      }
+    }
+
+    foldConstants(block->code);
+    removeDeadPops(block->code);
+  }
+
+  graph.removeUnreachable();
+  return changes;
+}
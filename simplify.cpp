@@ -0,0 +1,438 @@
+// Алгебраические упрощения выражений.
+//
+// Код блока разбирается в деревья выражений, и каждое дерево строится заново. Целые выражения
+// из сложений, вычитаний, смены знака, умножений на константу и сдвигов влево приводятся
+// к линейной форме c1*t1 + ... + cn*tn + c, где ti - остальные подвыражения. Целая
+// арифметика выполняется по модулю 2^32, поэтому такая перегруппировка не меняет результата:
+// одинаковые слагаемые складываются (x - x дает 0, x * 0 - тоже), а константы собираются
+// в одну. Слагаемое с нулевым коэффициентом удаляется, только если его вычисление не читает
+// ввод и не может завершиться ошибкой деления на ноль; порядок вычисления таких слагаемых
+// сохраняется.
+//
+// Для вещественных выражений применяются только тождества, точные для всех значений,
+// включая NaN и -0: -(-x) = x, x * 1 = x, x / 1 = x, x - 0 = x (константы целые, поэтому
+// тип результата не меняется). Например, x + 0 не равно x при x = -0, а x - x не равно 0
+// при x = NaN.
+//
+// Новое выражение заменяет исходное, только если оно не длиннее.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include "value.hpp"
+#include <cstdint>
+
+namespace
+{
+
+// Узел дерева выражения (buildExpressionTrees)
+struct Node : ExpressionNode
+{
+  Command command;
+  bool integer;     // Значение заведомо целое
+  bool pure;        // Вычисление не читает ввод и не может завершиться ошибкой
+
+  Node(const ExpressionNode& tree, const Command& c)
+    : ExpressionNode(tree), command(c), integer(false), pure(false)
+  {}
+};
+
+bool sameCode(const vector<Command>& a, const vector<Command>& b)
+{
+  if (a.size() != b.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i)
+  {
+    if (!sameCommand(a[i], b[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool isIntConstant(const vector<Command>& code, int value)
+{
+  return code.size() == 1 && code[0].instruction() == PUSH && !code[0].isFloat() && code[0].arg() == value;
+}
+
+// Линейная форма целого выражения; коэффициенты по модулю 2^32
+struct Linear
+{
+  struct Term
+  {
+    vector<Command> code;
+    uint32_t factor;
+    bool pure;
+  };
+
+  vector<Term> terms;
+  uint32_t constant = 0;
+};
+
+class Simplifier
+{
+public:
+  Simplifier(vector<Command>& code, AnalysisManager& analyses)
+    : code_(code), analyses_(analyses)
+  {}
+
+  // Возвращает число измененных выражений
+  int run();
+
+private:
+  bool build();
+  bool decomposes(int n) const;
+  const vector<Command>& simplify(int n);
+  void linearize(int n, uint32_t factor, Linear& linear);
+  bool emitLinear(Linear& linear, vector<Command>& result);
+  void emitSimple(int n, vector<Command>& result);
+
+  vector<Command>& code_;
+  AnalysisManager& analyses_;
+  vector<Node> nodes_;
+  vector<int> roots_;
+  vector<vector<Command>> simplified_;
+  vector<bool> done_;
+};
+
+// Разбор кода блока. Корни - выражения, значения которых потребляют другие инструкции
+// или переход в конце блока.
+bool Simplifier::build()
+{
+  vector<ExpressionNode> trees;
+  vector<int> top;
+  if (!buildExpressionTrees(code_, trees, top))
+  {
+    return false;
+  }
+  nodes_.reserve(trees.size());
+  for (int n = 0; n < int(trees.size()); ++n)
+  {
+    nodes_.push_back(Node(trees[n], code_[trees[n].end - 1]));
+    Node& node = nodes_[n];
+    Instruction instruction = node.command.instruction();
+    if (node.operands[0] >= 0)
+    {
+      node.integer = true;
+      node.pure = instruction != DIV || isRemovable(code_, node.end - 1);
+      for (int operand : node.operands)
+      {
+        if (operand >= 0)
+        {
+          node.integer = node.integer && nodes_[operand].integer;
+          node.pure = node.pure && nodes_[operand].pure;
+          //Операнды выражения, которое нельзя заменить целиком, упрощаются по отдельности
+          if (node.start < 0)
+          {
+            roots_.push_back(operand);
+          }
+        }
+      }
+      node.integer = node.integer || instruction == COMPARE;
+    }
+    else if (instruction == LOAD)
+    {
+      node.integer = analyses_.integerVariable(node.command.arg());
+      node.pure = true;
+    }
+    else if (instruction == PUSH)
+    {
+      node.integer = !node.command.isFloat();
+      node.pure = true;
+    }
+    else if (instruction == INPUT)
+    {
+      node.integer = true;
+    }
+    if (node.parent < 0)
+    {
+      roots_.push_back(n);
+    }
+  }
+  return true;
+}
+
+// Раскладывается ли целое выражение на слагаемые: умножение - только на константу
+bool Simplifier::decomposes(int n) const
+{
+  const Node& node = nodes_[n];
+  switch (node.command.instruction())
+  {
+  case PUSH:
+  case ADD:
+  case SUB:
+  case INVERT:
+  case SHL:
+    return node.integer;
+  case MULT:
+    return node.integer && (nodes_[node.operands[0]].command.instruction() == PUSH ||
+                            nodes_[node.operands[1]].command.instruction() == PUSH);
+  default:
+    return false;
+  }
+}
+
+void Simplifier::linearize(int n, uint32_t factor, Linear& linear)
+{
+  const Node& node = nodes_[n];
+  if (!decomposes(n))
+  {
+    //Прочие выражения - слагаемые; одинаковые чистые слагаемые складываются
+    const vector<Command>& code = simplify(n);
+    if (node.pure)
+    {
+      for (Linear::Term& term : linear.terms)
+      {
+        if (term.pure && sameCode(term.code, code))
+        {
+          term.factor += factor;
+          return;
+        }
+      }
+    }
+    linear.terms.push_back(Linear::Term{code, factor, node.pure});
+    return;
+  }
+
+  switch (node.command.instruction())
+  {
+  case PUSH:
+    linear.constant += factor * uint32_t(node.command.arg());
+    return;
+  case ADD:
+    linearize(node.operands[0], factor, linear);
+    linearize(node.operands[1], factor, linear);
+    return;
+  case SUB:
+    linearize(node.operands[0], factor, linear);
+    linearize(node.operands[1], -factor, linear);
+    return;
+  case INVERT:
+    linearize(node.operands[0], -factor, linear);
+    return;
+  case SHL:
+    linearize(node.operands[0], factor << node.command.arg(), linear);
+    return;
+  default:
+  {
+    //Умножение на константу
+    const Node& b = nodes_[node.operands[1]];
+    if (b.command.instruction() == PUSH)
+    {
+      linearize(node.operands[0], factor * uint32_t(b.command.arg()), linear);
+    }
+    else
+    {
+      linearize(node.operands[1], factor * uint32_t(nodes_[node.operands[0]].command.arg()), linear);
+    }
+    return;
+  }
+  }
+}
+
+bool Simplifier::emitLinear(Linear& linear, vector<Command>& result)
+{
+  //Слагаемые с нулевым коэффициентом удаляются, если их вычисление не наблюдаемо
+  vector<Linear::Term> terms;
+  for (Linear::Term& term : linear.terms)
+  {
+    if (term.factor != 0)
+    {
+      terms.push_back(term);
+    }
+    else if (!term.pure)
+    {
+      return false;
+    }
+  }
+
+  //Первым вычисляется слагаемое с положительным коэффициентом, если его можно переставить
+  //в начало: тогда не нужна смена знака
+  if (!terms.empty() && int32_t(terms[0].factor) < 0)
+  {
+    for (size_t i = 1; i < terms.size(); ++i)
+    {
+      if (terms[i].pure && int32_t(terms[i].factor) > 0)
+      {
+        Linear::Term term = terms[i];
+        terms.erase(terms.begin() + i);
+        terms.insert(terms.begin(), term);
+        break;
+      }
+    }
+  }
+
+  int32_t constant = int32_t(linear.constant);
+  bool constantFirst = terms.empty() || (int32_t(terms[0].factor) < 0 && constant != 0);
+  if (constantFirst)
+  {
+    result.push_back(Command(PUSH, constant));
+  }
+  for (size_t i = 0; i < terms.size(); ++i)
+  {
+    const Linear::Term& term = terms[i];
+    int32_t factor = int32_t(term.factor);
+    bool first = i == 0 && !constantFirst;
+    bool negative = factor < 0 && factor != INT32_MIN && !(first && factor != -1);
+    int32_t magnitude = negative ? -factor : factor;
+    result.insert(result.end(), term.code.begin(), term.code.end());
+    if (magnitude != 1)
+    {
+      result.push_back(Command(PUSH, int(magnitude)));
+      result.push_back(Command(MULT));
+    }
+    if (first)
+    {
+      if (negative)
+      {
+        result.push_back(Command(INVERT));
+      }
+    }
+    else
+    {
+      result.push_back(Command(negative ? SUB : ADD));
+    }
+  }
+  if (!constantFirst && constant != 0)
+  {
+    bool negative = constant < 0 && constant != INT32_MIN;
+    result.push_back(Command(PUSH, negative ? -constant : constant));
+    result.push_back(Command(negative ? SUB : ADD));
+  }
+  return true;
+}
+
+// Упрощение без перегруппировки: операнды упрощаются, затем применяются тождества,
+// верные и для вещественных чисел
+void Simplifier::emitSimple(int n, vector<Command>& result)
+{
+  const Node& node = nodes_[n];
+  Instruction instruction = node.command.instruction();
+  if (node.operands[0] < 0)
+  {
+    result.push_back(node.command);
+    return;
+  }
+  const vector<Command>& a = simplify(node.operands[0]);
+  if (node.operands[1] < 0)
+  {
+    if (instruction == INVERT && !a.empty() && a.back().instruction() == INVERT)
+    {
+      result.insert(result.end(), a.begin(), a.end() - 1);
+      return;
+    }
+    result = a;
+    result.push_back(node.command);
+    return;
+  }
+  const vector<Command>& b = simplify(node.operands[1]);
+  if (((instruction == MULT || instruction == DIV) && isIntConstant(b, 1)) ||
+      (instruction == SUB && isIntConstant(b, 0)))
+  {
+    result = a;
+    return;
+  }
+  if (instruction == MULT && isIntConstant(a, 1))
+  {
+    result = b;
+    return;
+  }
+  result = a;
+  result.insert(result.end(), b.begin(), b.end());
+  result.push_back(node.command);
+}
+
+const vector<Command>& Simplifier::simplify(int n)
+{
+  if (done_[n])
+  {
+    return simplified_[n];
+  }
+  const Node& node = nodes_[n];
+  Instruction instruction = node.command.instruction();
+  vector<Command> result;
+  bool linearized = false;
+  if (instruction != PUSH && decomposes(n))
+  {
+    Linear linear;
+    linearize(n, 1, linear);
+    linearized = emitLinear(linear, result) && int(result.size()) <= node.end - node.start;
+  }
+  if (!linearized)
+  {
+    result.clear();
+    emitSimple(n, result);
+  }
+  done_[n] = true;
+  simplified_[n].swap(result);
+  return simplified_[n];
+}
+
+int Simplifier::run()
+{
+  if (!build())
+  {
+    return 0;
+  }
+  simplified_.resize(nodes_.size());
+  done_.assign(nodes_.size(), false);
+
+  vector<int> replaceAt(code_.size(), -1);
+  for (int root : roots_)
+  {
+    const Node& node = nodes_[root];
+    if (node.start >= 0 && node.end - node.start > 1)
+    {
+      replaceAt[node.start] = root;
+    }
+  }
+
+  int changes = 0;
+  vector<Command> result;
+  result.reserve(code_.size());
+  int i = 0;
+  while (i < int(code_.size()))
+  {
+    int n = replaceAt[i];
+    if (n < 0)
+    {
+      result.push_back(code_[i++]);
+      continue;
+    }
+    const Node& node = nodes_[n];
+    const vector<Command>& simplified = simplify(n);
+    vector<Command> original(code_.begin() + node.start, code_.begin() + node.end);
+    if (int(simplified.size()) <= node.end - node.start && !sameCode(simplified, original))
+    {
+      result.insert(result.end(), simplified.begin(), simplified.end());
+      ++changes;
+    }
+    else
+    {
+      result.insert(result.end(), original.begin(), original.end());
+    }
+    i = node.end;
+  }
+  code_.swap(result);
+  return changes;
+}
+
+}
+
+int simplifyExpressions(FlowGraph& graph, AnalysisManager& analyses)
+{
+  //Упрощения не меняют типов значений, поэтому типы переменных вычисляются один раз
+  int changes = 0;
+  for (BasicBlock* block : graph.blocks())
+  {
+    Simplifier simplifier(block->code, analyses);
+    if (simplifier.run() > 0)
+    {
+      ++changes;
+      foldConstants(block->code);
+    }
+  }
+  return changes;
+}
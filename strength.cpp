@@ -0,0 +1,515 @@
+// Понижение стоимости операций.
+//
+// Умножение и деление на целую степень двойки заменяются сдвигами SHL и SHR; константный
+// множитель может стоять с любой стороны, делитель - только справа. Сдвиг вещественного
+// числа определен как умножение или деление, поэтому замена не зависит от типов.
+//
+// Индуктивные переменные цикла - целые переменные, все записи которых в цикле имеют вид
+// i := i + c или i := i - c с целой константой c. Произведение i * k, где k - целая константа
+// или целая переменная, не записываемая в цикле, заменяется временной переменной t:
+// предзаголовок вычисляет t := i * k, а после каждого изменения i к t прибавляется c * k.
+// Целая арифметика выполняется по модулю 2^32, поэтому равенство t = i * k сохраняется
+// и при переполнении. Замена выполняется, если произведений в цикле не меньше, чем изменений
+// переменной: каждое произведение (LOAD, PUSH, MULT) становится одной инструкцией LOAD,
+// а каждое обновление t сливается в одну суперинструкцию LOAD_PUSH_ADD_STORE.
+//
+// Замена условия выхода (LFTR): проверка i < B в конце тела цикла заменяется проверкой
+// t < B * k, если k и B - константы, k > 0, i изменяется один раз за итерацию в том же блоке,
+// начальное значение i известно, и все значения i * k, которые может принять t до выхода
+// из цикла, представимы без переполнения. Если после этого i в цикле не читается и не
+// нужна после выхода из него, ее изменения удаляются.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <tuple>
+
+// Показатель степени, если команда - PUSH целой степени двойки 2^n (1 <= n <= 30), иначе -1
+static int powerOfTwo(const Command& command)
+{
+  if (command.instruction() != PUSH || command.isFloat())
+  {
+    return -1;
+  }
+  int value = command.arg();
+  if (value < 2 || (value & (value - 1)) != 0)
+  {
+    return -1;
+  }
+  int bits = 0;
+  while ((1 << bits) != value)
+  {
+    ++bits;
+  }
+  return bits;
+}
+
+// Замена умножения и деления на степень двойки сдвигами
+static int introduceShifts(vector<Command>& code)
+{
+  //Для каждого значения на стеке помним начало вычисляющего его участка (-1 - неизвестно)
+  vector<int> starts;
+  vector<bool> erased(code.size(), false);
+  int changes = 0;
+  for (int i = 0; i < int(code.size()); ++i)
+  {
+    Instruction instruction = code[i].instruction();
+    if ((instruction == MULT || instruction == DIV) && starts.size() >= 2)
+    {
+      int left = starts[starts.size() - 2];
+      int right = starts.back();
+      int bits;
+      if (right == i - 1 && (bits = powerOfTwo(code[i - 1])) > 0)
+      {
+        erased[i - 1] = true;
+        code[i] = Command(instruction == MULT ? SHL : SHR, bits);
+        ++changes;
+      }
+      else if (instruction == MULT && left >= 0 && right == left + 1 && (bits = powerOfTwo(code[left])) > 0)
+      {
+        erased[left] = true;
+        code[i] = Command(SHL, bits);
+        ++changes;
+      }
+    }
+
+    //Сдвиг снимает одно значение, умножение и деление - два; начало участка результата
+    //определяется по исходной инструкции
+    int pops, pushes;
+    stackEffect(instruction, pops, pushes);
+    int start = (instruction == DUP) ? -1 : i;
+    for (int k = 0; k < pops && !starts.empty(); ++k)
+    {
+      start = (starts.back() < 0 || start < 0) ? -1 : min(start, starts.back());
+      starts.pop_back();
+    }
+    for (int k = 0; k < pushes; ++k)
+    {
+      starts.push_back(start);
+    }
+  }
+
+  if (changes > 0)
+  {
+    vector<Command> result;
+    result.reserve(code.size());
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+      if (!erased[i])
+      {
+        result.push_back(code[i]);
+      }
+    }
+    code.swap(result);
+  }
+  return changes;
+}
+
+namespace
+{
+
+// Изменение индуктивной переменной: LOAD i; PUSH c; ADD/SUB; STORE i (или PUSH c; LOAD i; ADD)
+struct Increment
+{
+  BasicBlock* block;
+  int position;     // Позиция STORE
+  int step;
+};
+
+// Множитель произведения: константа (true, k) или переменная (false, адрес)
+typedef pair<bool, int> Factor;
+
+// Произведение индуктивной переменной на множитель: три инструкции, начиная с position
+struct Product
+{
+  BasicBlock* block;
+  int position;
+};
+
+class InductionVariables
+{
+public:
+  InductionVariables(FlowGraph& graph, AnalysisManager& analyses, int variableCount, const vector<Loop>& loops)
+    : graph_(graph), analyses_(analyses), variableCount_(variableCount), nextTemporary_(variableCount),
+      innermost_(innermostLoops(loops))
+  {}
+
+  // Понижение стоимости в одном цикле; возвращает число замененных произведений
+  int reduce(Loop& loop, vector<Loop>& loops);
+
+  // Размещение созданных предзаголовков
+  void placePreheaders()
+  {
+    graph_.placeBefore(placements_);
+  }
+
+private:
+  bool isIncrement(const vector<Command>& code, int position, int& step) const;
+  bool isFactor(const Command& command, const vector<bool>& stored, Factor& factor) const;
+  bool replaceTest(Loop& loop, vector<Loop>& loops, BasicBlock* preheader, int variable,
+                   const Increment& increment, int factor, int temporary);
+  bool removeIncrements(Loop& loop, int variable);
+
+  FlowGraph& graph_;
+  AnalysisManager& analyses_;
+  int variableCount_;
+  int nextTemporary_;
+  unordered_map<BasicBlock*, int> innermost_;          // Ближайшие циклы блоков (innermostLoops)
+  vector<pair<BasicBlock*, BasicBlock*>> placements_;  // Новые предзаголовки и их заголовки
+};
+
+bool InductionVariables::isIncrement(const vector<Command>& code, int position, int& step) const
+{
+  if (position < 3)
+  {
+    return false;
+  }
+  int variable = code[position].arg();
+  const Command& a = code[position - 3];
+  const Command& b = code[position - 2];
+  Instruction op = code[position - 1].instruction();
+  auto isConstant = [](const Command& command) {
+    return command.instruction() == PUSH && !command.isFloat();
+  };
+  auto isVariable = [variable](const Command& command) {
+    return command.instruction() == LOAD && command.arg() == variable;
+  };
+  if (isVariable(a) && isConstant(b) && (op == ADD || op == SUB))
+  {
+    step = (op == ADD) ? b.arg() : static_cast<int>(0u - static_cast<unsigned int>(b.arg()));
+    return true;
+  }
+  if (isConstant(a) && isVariable(b) && op == ADD)
+  {
+    step = a.arg();
+    return true;
+  }
+  return false;
+}
+
+bool InductionVariables::isFactor(const Command& command, const vector<bool>& stored, Factor& factor) const
+{
+  if (command.instruction() == PUSH && !command.isFloat() && command.arg() != 0 &&
+      command.arg() != 1 && command.arg() != -1)
+  {
+    factor = Factor(true, command.arg());
+    return true;
+  }
+  int variable = command.arg();
+  if (command.instruction() == LOAD && variable < variableCount_ && !stored[variable] &&
+      analyses_.integerVariable(variable))
+  {
+    factor = Factor(false, variable);
+    return true;
+  }
+  return false;
+}
+
+// Замена проверки i < B в конце блока-защелки проверкой t < B * k
+bool InductionVariables::replaceTest(Loop& loop, vector<Loop>& loops, BasicBlock* preheader, int variable,
+                                     const Increment& increment, int factor, int temporary)
+{
+  BasicBlock* latch = increment.block;
+  vector<Command>& code = latch->code;
+  int size = code.size();
+  if (factor <= 0 || latch->target != loop.header || size < 2 || code[size - 2].instruction() != LOAD ||
+      code[size - 2].arg() != variable || code[size - 1].instruction() != PUSH || code[size - 1].isFloat())
+  {
+    return false;
+  }
+
+  //Изменение должно выполняться ровно один раз за итерацию: защелка не входит во вложенный цикл
+  auto innermost = innermost_.find(latch);
+  if (innermost == innermost_.end() || &loops[innermost->second] != &loop)
+  {
+    return false;
+  }
+
+  //Границы значений i, которые проверяются до выхода из цикла
+  int initial;
+  if (!constantOnEntry(preheader, variable, initial))
+  {
+    return false;
+  }
+  long long bound = code[size - 1].arg();
+  long long step = increment.step;
+  long long low, high;
+  if (step > 0 && (latch->branch == JLT || latch->branch == JLE))
+  {
+    low = min<long long>(initial, bound);
+    high = max<long long>(initial, bound) + step;
+  }
+  else if (step < 0 && (latch->branch == JGT || latch->branch == JGE))
+  {
+    low = min<long long>(initial, bound) + step;
+    high = max<long long>(initial, bound);
+  }
+  else
+  {
+    return false;
+  }
+  if (low * factor < INT_MIN || high * factor > INT_MAX)
+  {
+    return false;
+  }
+
+  code[size - 2] = Command(LOAD, temporary);
+  code[size - 1] = Command(PUSH, static_cast<int>(bound * factor));
+  return true;
+}
+
+// Удаление изменений переменной, которая в цикле читается только ими и не нужна после выхода
+bool InductionVariables::removeIncrements(Loop& loop, int variable)
+{
+  int loads = 0;
+  int stores = 0;
+  for (BasicBlock* block : loop.body)
+  {
+    for (const Command& command : block->code)
+    {
+      if (command.arg() == variable && command.instruction() == LOAD)
+      {
+        ++loads;
+      }
+      if (command.arg() == variable && command.instruction() == STORE)
+      {
+        ++stores;
+      }
+    }
+  }
+  if (loads != stores)
+  {
+    return false;
+  }
+
+  //Код цикла уже изменен: живые переменные вычисляются заново, циклы поддерживаются
+  //актуальными на месте, а временные переменные целые и в типах не нужны
+  analyses_.invalidate(AnalysisManager::LOOPS | AnalysisManager::TYPES);
+  const Liveness& liveness = analyses_.liveness();
+  for (BasicBlock* block : loop.body)
+  {
+    for (BasicBlock* succ : block->succs)
+    {
+      if (!loop.members.count(succ) && liveness.liveIn(succ).test(variable))
+      {
+        return false;
+      }
+    }
+  }
+
+  for (BasicBlock* block : loop.body)
+  {
+    vector<Command>& code = block->code;
+    for (int i = code.size() - 1; i >= 3; --i)
+    {
+      if (code[i].instruction() == STORE && code[i].arg() == variable)
+      {
+        code.erase(code.begin() + i - 3, code.begin() + i + 1);
+        i -= 3;
+      }
+    }
+  }
+  return true;
+}
+
+int InductionVariables::reduce(Loop& loop, vector<Loop>& loops)
+{
+  //Индуктивные переменные и их изменения
+  vector<bool> stored(variableCount_, false);
+  map<int, vector<Increment>> increments;
+  vector<int> other;
+  for (BasicBlock* block : loop.body)
+  {
+    for (int i = 0; i < int(block->code.size()); ++i)
+    {
+      const Command& command = block->code[i];
+      int variable = command.arg();
+      if (command.instruction() != STORE || variable >= variableCount_)
+      {
+        continue;
+      }
+      stored[variable] = true;
+      int step;
+      if (analyses_.integerVariable(variable) && isIncrement(block->code, i, step))
+      {
+        increments[variable].push_back(Increment{block, i, step});
+      }
+      else
+      {
+        other.push_back(variable);
+      }
+    }
+  }
+  for (int variable : other)
+  {
+    increments.erase(variable);
+  }
+  if (increments.empty())
+  {
+    return 0;
+  }
+
+  //Произведения индуктивных переменных на инвариантные множители
+  map<pair<int, Factor>, vector<Product>> products;
+  for (BasicBlock* block : loop.body)
+  {
+    const vector<Command>& code = block->code;
+    for (int i = 0; i + 2 < int(code.size()); ++i)
+    {
+      if (code[i + 2].instruction() != MULT)
+      {
+        continue;
+      }
+      for (int k = 0; k < 2; ++k)
+      {
+        const Command& variable = code[i + k];
+        Factor factor;
+        if (variable.instruction() == LOAD && increments.count(variable.arg()) &&
+            isFactor(code[i + 1 - k], stored, factor))
+        {
+          products[make_pair(variable.arg(), factor)].push_back(Product{block, i});
+          break;
+        }
+      }
+    }
+  }
+
+  BasicBlock* preheader = nullptr;
+  map<BasicBlock*, map<int, int>> replaceAt;                 // Позиция произведения -> t
+  map<BasicBlock*, map<int, vector<Command>>> insertAfter;   // Позиция STORE i -> обновление t
+  vector<int> replacedTests;
+  int changes = 0;
+  for (const auto& group : products)
+  {
+    int variable = group.first.first;
+    Factor factor = group.first.second;
+    const vector<Increment>& changesOf = increments[variable];
+    if (group.second.size() < changesOf.size())
+    {
+      continue;
+    }
+    if (!preheader)
+    {
+      preheader = loopPreheader(graph_, loop, loops, placements_);
+    }
+
+    //t := i * k в предзаголовке
+    int temporary = nextTemporary_++;
+    Command factorCommand = factor.first ? Command(PUSH, factor.second) : Command(LOAD, factor.second);
+    vector<Command>& init = preheader->code;
+    init.push_back(Command(LOAD, variable));
+    init.push_back(factorCommand);
+    init.push_back(Command(MULT));
+    init.push_back(Command(STORE, temporary));
+
+    //t := t + c * k после каждого изменения i
+    map<int, int> stepTemporaries;
+    for (const Increment& increment : changesOf)
+    {
+      vector<Command>& update = insertAfter[increment.block][increment.position];
+      update.push_back(Command(LOAD, temporary));
+      if (factor.first)
+      {
+        unsigned int delta = static_cast<unsigned int>(increment.step) * static_cast<unsigned int>(factor.second);
+        update.push_back(Command(PUSH, static_cast<int>(delta)));
+        update.push_back(Command(ADD));
+      }
+      else if (increment.step == 1 || increment.step == -1)
+      {
+        update.push_back(factorCommand);
+        update.push_back(Command(increment.step == 1 ? ADD : SUB));
+      }
+      else
+      {
+        auto it = stepTemporaries.find(increment.step);
+        if (it == stepTemporaries.end())
+        {
+          it = stepTemporaries.insert(make_pair(increment.step, nextTemporary_++)).first;
+          init.push_back(Command(PUSH, increment.step));
+          init.push_back(factorCommand);
+          init.push_back(Command(MULT));
+          init.push_back(Command(STORE, it->second));
+        }
+        update.push_back(Command(LOAD, it->second));
+        update.push_back(Command(ADD));
+      }
+      update.push_back(Command(STORE, temporary));
+    }
+
+    for (const Product& product : group.second)
+    {
+      replaceAt[product.block][product.position] = temporary;
+      ++changes;
+    }
+
+    if (factor.first && changesOf.size() == 1 &&
+        find(replacedTests.begin(), replacedTests.end(), variable) == replacedTests.end() &&
+        replaceTest(loop, loops, preheader, variable, changesOf[0], factor.second, temporary))
+    {
+      replacedTests.push_back(variable);
+    }
+  }
+
+  //Перестройка измененных блоков
+  for (BasicBlock* block : loop.body)
+  {
+    auto replaced = replaceAt.find(block);
+    auto inserted = insertAfter.find(block);
+    if (replaced == replaceAt.end() && inserted == insertAfter.end())
+    {
+      continue;
+    }
+    vector<Command> result;
+    const vector<Command>& code = block->code;
+    for (int i = 0; i < int(code.size()); ++i)
+    {
+      if (replaced != replaceAt.end() && replaced->second.count(i))
+      {
+        result.push_back(Command(LOAD, replaced->second[i]));
+        i += 2;
+        continue;
+      }
+      result.push_back(code[i]);
+      if (inserted != insertAfter.end() && inserted->second.count(i))
+      {
+        const vector<Command>& update = inserted->second[i];
+        result.insert(result.end(), update.begin(), update.end());
+      }
+    }
+    block->code.swap(result);
+  }
+
+  for (int variable : replacedTests)
+  {
+    removeIncrements(loop, variable);
+  }
+  return changes;
+}
+
+}
+
+int reduceStrength(FlowGraph& graph, AnalysisManager& analyses)
+{
+  int changes = 0;
+  int variableCount = analyses.variableCount();
+  if (variableCount >= 0)
+  {
+    vector<Loop>& loops = analyses.loops();
+    InductionVariables inductionVariables(graph, analyses, variableCount, loops);
+    for (Loop& loop : loops)
+    {
+      changes += inductionVariables.reduce(loop, loops);
+    }
+    inductionVariables.placePreheaders();
+  }
+
+  //Сдвиги вводятся последними, чтобы произведения индуктивных переменных на степени
+  //двойки тоже заменялись временными переменными
+  for (BasicBlock* block : graph.blocks())
+  {
+    changes += introduceShifts(block->code);
+  }
+  return changes;
+}
@@ -0,0 +1,66 @@
+#!/bin/bash
+# Сравнение программ, переведенных на C (cmilan --emit=c), с виртуальной машиной.
+#
+# Программы корпуса tests/*.mil и случайные программы tests/gen.py с номерами 1..COUNT
+# (с ключом -f - с вещественными числами) компилируются cmilan с -O0 и -O2 в листинг и в C.
+# Программа на C собирается "$CC -O2 -ffp-contract=off" и выполняется с тем же вводом, что
+# milanvm --engine=reference; вывод и код завершения должны совпадать, включая знак NaN
+# (см. transpiler.hpp).
+#
+# Использование: tests/cbackend.sh [-n COUNT] [-f] [cmilan [milanvm]]
+
+root=$(dirname "$0")/..
+count=100
+floats=
+while getopts "n:f" option; do
+  case $option in
+    n) count=$OPTARG ;;
+    f) floats=float ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+CMILAN=${1:-$root/cmilan}
+MILANVM=${2:-$root/milanvm}
+CC=${CC:-cc}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+{ echo 3 7 11 2 5 9 4 1 8 6; yes 0 | head -n 500; } > "$work/random.in"
+
+programs=0
+failed=0
+
+# check ФАЙЛ.mil ФАЙЛ_ВВОДА НАЗВАНИЕ
+check() {
+  programs=$((programs + 1))
+  for level in -O0 -O2; do
+    if ! "$CMILAN" $level "$1" > "$work/program.lst" ||
+       ! "$CMILAN" $level --emit=c -o "$work/program.c" "$1" ||
+       ! $CC -O2 -ffp-contract=off -o "$work/program" "$work/program.c" -lm; then
+      echo "$3 $level: build failed"
+      failed=$((failed + 1))
+      continue
+    fi
+    { timeout 20 "$MILANVM" --engine=reference "$work/program.lst" < "$2" 2>/dev/null; echo "exit $?"; } > "$work/expected"
+    { timeout 20 "$work/program" < "$2" 2>/dev/null; echo "exit $?"; } > "$work/actual"
+    if ! cmp -s "$work/expected" "$work/actual"; then
+      echo "$3 $level: differs from milanvm"
+      diff "$work/expected" "$work/actual" | head -5
+      failed=$((failed + 1))
+    fi
+  done
+}
+
+for program in "$root"/tests/*.mil; do
+  input=${program%.mil}.in
+  [ -f "$input" ] || input=/dev/null
+  check "$program" "$input" "$(basename "$program")"
+done
+for seed in $(seq 1 "$count"); do
+  python3 "$root/tests/gen.py" $seed $floats > "$work/random.mil"
+  check "$work/random.mil" "$work/random.in" "seed $seed"
+done
+
+echo "programs: $programs, failed: $failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Дифференциальное тестирование интерпретаторов на случайных программах.
+#
+# Программы с номерами 1..COUNT строятся tests/gen.py (с ключом -f - с вещественными числами),
+# компилируются cmilan с -O0 и -O2 и выполняются milanvm интерпретатором reference и каждым из
+# проверяемых интерпретаторов (по умолчанию jit). Вывод программы и код завершения должны
+# совпадать. Программа, на которой результаты различаются, сохраняется в fuzz-fail-НОМЕР.mil
+# в текущем каталоге.
+#
+# Использование: tests/fuzz.sh [-n COUNT] [-f] [-e ENGINE]... [cmilan [milanvm]]
+
+root=$(dirname "$0")/..
+count=200
+floats=
+engines=()
+while getopts "n:fe:" option; do
+  case $option in
+    n) count=$OPTARG ;;
+    f) floats=float ;;
+    e) engines+=("$OPTARG") ;;
+    *) exit 2 ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ ${#engines[@]} -eq 0 ] && engines=(jit)
+CMILAN=${1:-$root/cmilan}
+MILANVM=${2:-$root/milanvm}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+#Программы читают не больше нескольких сотен чисел
+{ echo 3 7 11 2 5 9 4 1 8 6; yes 0 | head -n 500; } > "$work/input"
+
+run() {
+  timeout 20 "$MILANVM" --engine=$1 "$work/program.lst" < "$work/input" 2>/dev/null
+  echo "exit $?"
+}
+
+failed=0
+for seed in $(seq 1 "$count"); do
+  python3 "$root/tests/gen.py" $seed $floats > "$work/program.mil"
+  for level in -O0 -O2; do
+    "$CMILAN" $level "$work/program.mil" > "$work/program.lst" || { echo "seed $seed $level: cmilan failed"; exit 1; }
+    run reference > "$work/expected"
+    for engine in "${engines[@]}"; do
+      if ! run $engine | cmp -s - "$work/expected"; then
+        echo "seed $seed $level: --engine=$engine differs from --engine=reference"
+        cp "$work/program.mil" fuzz-fail-$seed.mil
+        failed=$((failed + 1))
+      fi
+    done
+  done
+done
+
+echo "programs: $count, failed: $failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# Генератор случайных программ на Милане для дифференциального тестирования.
+#
+# Программа состоит из объявлений, присваиваний, write, ветвлений и циклов со счетчиком глубиной
+# до трех; выражения читают ввод (read) и повторно используют уже построенные подвыражения.
+# Циклы всегда завершаются: счетчику цикла ничего не присваивается, кроме приращения в конце тела.
+# Делитель - положительная константа, но делимое может оказаться вещественным нулем или NaN.
+#
+# Использование: gen.py SEED [float]   (float - вещественные переменные и константы)
+
+import random
+import sys
+
+seed = int(sys.argv[1])
+random.seed(seed)
+FLOATS = len(sys.argv) > 2
+
+variables = []   # Переменные, которым можно присваивать
+counters = []    # Счетчики объемлющих циклов: их можно только читать
+pool = []        # Построенные подвыражения без read
+count = [0]
+
+
+def new_variable():
+    count[0] += 1
+    return 'v%d' % count[0]
+
+
+def expression(depth=0):
+    if pool and random.random() < 0.15:
+        return random.choice(pool)
+    e = new_expression(depth)
+    if 'read' not in e and ' ' in e:
+        pool.append('(%s)' % e)
+    return e
+
+
+def new_expression(depth):
+    r = random.random()
+    if depth > 3 or r < 0.3:
+        c = random.random()
+        if c < 0.45 and variables + counters:
+            return random.choice(variables + counters)
+        if c < 0.55:
+            return 'read'
+        if FLOATS and c < 0.62:
+            return '%d.%d' % (random.randint(0, 9), random.choice([0, 5, 25]))
+        return str(random.randint(0, 12))
+    op = random.choice(['+', '-', '*', '/', '+', '-', '*'])
+    a = expression(depth + 1)
+    b = expression(depth + 1)
+    if op == '/':
+        b = str(random.randint(1, 5))
+    if random.random() < 0.1:
+        return '-(%s)' % a
+    if random.random() < 0.5:
+        return '(%s %s %s)' % (a, op, b)
+    return '%s %s %s' % (a, op, b)
+
+
+def condition():
+    return '%s %s %s' % (expression(2), random.choice(['<', '>', '=', '!=', '<=', '>=']), expression(2))
+
+
+def statements(depth, n):
+    out = []
+    for _ in range(n):
+        r = random.random()
+        if r < 0.25 or not variables:
+            v = new_variable()
+            t = 'float' if FLOATS and random.random() < 0.2 else 'int'
+            out.append('%s %s := %s' % (t, v, expression()))
+            variables.append(v)
+        elif r < 0.5:
+            out.append('%s := %s' % (random.choice(variables), expression()))
+        elif r < 0.6:
+            out.append('write(%s)' % expression())
+        elif r < 0.75 and depth < 3:
+            s = 'if %s then %s' % (condition(), '; '.join(statements(depth + 1, random.randint(0, 3))))
+            if random.random() < 0.5:
+                s += ' else ' + '; '.join(statements(depth + 1, random.randint(0, 3)))
+            out.append(s + ' fi')
+        elif depth < 3:
+            c = new_variable()
+            counters.append(c)
+            limit = random.randint(0, 6)
+            step = random.choice([1, 1, 2])
+            out.append('int %s := 0' % c)
+            body = statements(depth + 1, random.randint(0, 4))
+            body.append('%s := %s + %d' % (c, c, step))
+            op = random.choice(['<', '<=', '!='] if step == 1 else ['<', '<='])
+            out.append('while %s %s %d do %s od' % (c, op, limit, '; '.join(body)))
+            counters.remove(c)
+            out.append('write(%s)' % c)
+        else:
+            out.append('write(%s)' % expression())
+    return out
+
+
+print('begin\n  ' + ';\n  '.join(statements(0, random.randint(3, 12))) + '\nend')
@@ -0,0 +1,48 @@
+#!/bin/bash
+# Тесты соответствия компилятора и виртуальной машины.
+#
+# Каждая программа tests/NAME.mil компилируется cmilan на каждом уровне оптимизации и выполняется
+# milanvm каждым интерпретатором (tiered - дважды: с порогом по умолчанию и с порогом 1, чтобы
+# циклы компилировались). Ввод программы берется из NAME.in, если этот файл есть. Вывод программы
+# и строка "exit КОД" сравниваются с NAME.out; сообщения об ошибках (stderr) не сравниваются,
+# потому что в них указаны адреса, которые зависят от уровня оптимизации.
+#
+# Использование: tests/run.sh [cmilan [milanvm]]   (по умолчанию - из корня репозитория)
+
+root=$(dirname "$0")/..
+CMILAN=$(realpath "${1:-$root/cmilan}")
+MILANVM=$(realpath "${2:-$root/milanvm}")
+cd "$root/tests" || exit 1
+LEVELS="-O0 -O1 -O2 -Os"
+ENGINES=("threaded" "quickening" "nanbox" "register" "jit" "tracing" "tiered" "tiered --threshold=1" "reference")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+passed=0
+failed=0
+for program in *.mil; do
+  name=${program%.mil}
+  input=/dev/null
+  [ -f "$name.in" ] && input=$name.in
+  for level in $LEVELS; do
+    if ! "$CMILAN" $level "$program" > "$work/$name.lst"; then
+      echo "FAIL $name $level: cmilan failed"
+      failed=$((failed + 1))
+      continue
+    fi
+    for engine in "${ENGINES[@]}"; do
+      { timeout 60 "$MILANVM" --engine=$engine "$work/$name.lst" < "$input" 2>/dev/null; echo "exit $?"; } > "$work/out"
+      if cmp -s "$work/out" "$name.out"; then
+        passed=$((passed + 1))
+      else
+        echo "FAIL $name $level --engine=$engine"
+        diff "$name.out" "$work/out" | head -5
+        failed=$((failed + 1))
+      fi
+    done
+  done
+done
+
+echo "passed: $passed, failed: $failed"
+[ $failed -eq 0 ]
@@ -0,0 +1,647 @@
+#include "vm.hpp"
+#include "vmio.hpp"
+#include <algorithm>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MILAN_VM_SWITCH)
+#define MILAN_VM_THREADED
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MILAN_INLINE inline __attribute__((always_inline))
+#else
+#define MILAN_INLINE inline
+#endif
+
+// Наибольшее число верхних слов стека в кэше; состояния кэша - числа от 0 до CACHE_SIZE
+const int CACHE_SIZE = 2;
+const int CACHE_STATES = CACHE_SIZE + 1;
+
+namespace
+{
+
+// Декодированная инструкция
+struct Operation
+{
+  const void* handler;          // Адрес обработчика (при переходах по меткам)
+  int index;                    // Номер обработчика: (инструкция * 3 + кэш до) * 3 + кэш после
+  int args[MAX_SUPEROP_ARGS];   // Целые аргументы, для переходов - адреса
+  Value value;                  // Константа PUSH
+};
+
+enum Status
+{
+  CONTINUE,   // Выполнение продолжается со следующей операции
+  JUMPED,     // Переход по адресу target
+  STOPPED,
+  FAILED      // Ошибка, сообщение в *message
+};
+
+// Состояние выполнения. Обработчики встраиваются в ThreadedMachine::run, и поля Frame
+// остаются в регистрах, пока ни адрес Frame, ни адреса его полей не передаются
+// невстраиваемым функциям. Стек - слова в памяти до sp, за ними second и top, если они в кэше.
+struct Frame
+{
+  Value* sp;
+  Value top;
+  Value second;
+  Value* memory;
+  int memorySize;
+  vector<Value>* memoryVector;
+  istream* input;
+  ostream* output;
+  string* message;
+};
+
+// Число слов в кэше после базовой инструкции, если перед ней их было count
+constexpr int cachedAfter(Instruction instruction, int count)
+{
+  return min(max(count - stackPops(instruction), 0) + stackPushes(instruction), CACHE_SIZE);
+}
+
+// Копирование значения по полям. Присваивание структуры копирует и байты выравнивания после
+// isFloat, и тогда компилятор держит кэшированные слова в памяти, а не в регистрах.
+MILAN_INLINE void copy(Value& to, const Value& from)
+{
+  to.isFloat = from.isFloat;
+  to.i = from.i;
+  to.f = from.f;
+}
+
+// Операции над стеком, в кэше которого Count слов
+
+// Слово с номером Index от вершины (0 - вершина)
+template <int Count, int Index>
+MILAN_INLINE Value& word(Frame& frame)
+{
+  if constexpr (Index == 0 && Count > 0)
+  {
+    return frame.top;
+  }
+  else if constexpr (Index == 1 && Count > 1)
+  {
+    return frame.second;
+  }
+  else
+  {
+    return frame.sp[Count - Index - 1];
+  }
+}
+
+// Снятие Pops слов, уже прочитанных через word; в кэше остается max(Count - Pops, 0) слов
+template <int Count, int Pops>
+MILAN_INLINE void drop(Frame& frame)
+{
+  if constexpr (Pops >= Count)
+  {
+    frame.sp -= Pops - Count;
+  }
+  else if constexpr (Pops == 1)
+  {
+    copy(frame.top, frame.second);
+  }
+}
+
+// Добавление слова; при полном кэше нижнее слово кэша вытесняется в память
+template <int Count>
+MILAN_INLINE void push(Frame& frame, const Value& value)
+{
+  if constexpr (Count == CACHE_SIZE)
+  {
+    copy(*frame.sp++, frame.second);
+  }
+  if constexpr (Count > 0)
+  {
+    copy(frame.second, frame.top);
+  }
+  copy(frame.top, value);
+}
+
+// Переход от Count слов в кэше к Out словам: вытеснение в память или загрузка из нее
+template <int Count, int Out>
+MILAN_INLINE void settle(Frame& frame)
+{
+  if constexpr (Count > Out)
+  {
+    copy(*frame.sp++, Count == 2 ? frame.second : frame.top);
+    settle<Count - 1, Out>(frame);
+  }
+  else if constexpr (Count < Out)
+  {
+    copy(Count == 0 ? frame.top : frame.second, *--frame.sp);
+    settle<Count + 1, Out>(frame);
+  }
+}
+
+MILAN_INLINE Status fail(Frame& frame, const string& message)
+{
+  *frame.message = message;
+  return FAILED;
+}
+
+// Вещественные операции и сравнения выполняются общими функциями value.hpp. Операнды
+// передаются им копиями, чтобы не передавать адреса полей Frame.
+Value evaluateSlow(Instruction instruction, Value a, Value b)
+{
+  Value result;
+  evaluate(instruction, a, b, result);
+  return result;
+}
+
+bool compareSlow(int cmp, Value a, Value b)
+{
+  return compare(cmp, a, b);
+}
+
+// ADD, SUB, MULT и DIV; деление на ноль проверяется до вызова
+template <Instruction I>
+MILAN_INLINE Value calculate(const Value& a, const Value& b)
+{
+  if (!(a.isFloat | b.isFloat))
+  {
+    unsigned int x = a.i;
+    unsigned int y = b.i;
+    if constexpr (I == ADD)
+    {
+      return Value::fromInt(static_cast<int>(x + y));
+    }
+    else if constexpr (I == SUB)
+    {
+      return Value::fromInt(static_cast<int>(x - y));
+    }
+    else if constexpr (I == MULT)
+    {
+      return Value::fromInt(static_cast<int>(x * y));
+    }
+    else if (b.i > 0)
+    {
+      return Value::fromInt(a.i / b.i);
+    }
+  }
+  return evaluateSlow(I, a, b);
+}
+
+template <int Cmp>
+MILAN_INLINE bool test(const Value& a, const Value& b)
+{
+  if (a.isFloat | b.isFloat)
+  {
+    return compareSlow(Cmp, a, b);
+  }
+  switch (Cmp)
+  {
+  case 0:
+    return a.i == b.i;
+  case 1:
+    return a.i != b.i;
+  case 2:
+    return a.i < b.i;
+  case 3:
+    return a.i > b.i;
+  case 4:
+    return a.i <= b.i;
+  default:
+    return a.i >= b.i;
+  }
+}
+
+// Адрес BLOAD и BSTORE: base + offset; память расширяется по мере обращений
+MILAN_INLINE bool locate(Frame& frame, int base, const Value& offset, int& address)
+{
+  if (offset.isFloat)
+  {
+    *frame.message = "float index";
+    return false;
+  }
+  address = base + offset.i;
+  if (static_cast<unsigned int>(address) >= static_cast<unsigned int>(frame.memorySize))
+  {
+    if (address < 0 || address >= MEMORY_LIMIT)
+    {
+      *frame.message = "invalid address " + to_string(address);
+      return false;
+    }
+    frame.memoryVector->resize(address + 1);
+    frame.memory = frame.memoryVector->data();
+    frame.memorySize = address + 1;
+  }
+  return true;
+}
+
+// Выполнение базовой инструкции I, перед которой в кэше In слов, а после должно остаться Out.
+// arg - номер очередного целого аргумента операции (для суперинструкций).
+template <Instruction I, int In, int Out>
+MILAN_INLINE Status step(Frame& frame, const Operation& op, int& arg, int& target)
+{
+  constexpr int left = max(In - stackPops(I), 0);
+  constexpr int after = cachedAfter(I, In);
+
+  if constexpr (I == NOP)
+  {
+    settle<In, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == STOP)
+  {
+    return STOPPED;
+  }
+  else if constexpr (I == LOAD || I == PUSH || I == INPUT)
+  {
+    Value value;
+    if constexpr (I == LOAD)
+    {
+      copy(value, frame.memory[op.args[arg++]]);
+    }
+    else if constexpr (I == PUSH)
+    {
+      value = Value::fromInt(op.args[arg++]);
+    }
+    else
+    {
+      int number;
+      if (!readInt(*frame.input, number))
+      {
+        return fail(frame, "invalid input");
+      }
+      value = Value::fromInt(number);
+    }
+    push<In>(frame, value);
+    settle<after, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == STORE || I == POP || I == PRINT)
+  {
+    Value a;
+    copy(a, word<In, 0>(frame));
+    drop<In, 1>(frame);
+    if constexpr (I == STORE)
+    {
+      copy(frame.memory[op.args[arg++]], a);
+    }
+    else if constexpr (I == PRINT)
+    {
+      printValue(*frame.output, a);
+    }
+    settle<left, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == DUP)
+  {
+    Value a;
+    copy(a, word<In, 0>(frame));
+    drop<In, 1>(frame);
+    push<left>(frame, a);
+    push<min(left + 1, CACHE_SIZE)>(frame, a);
+    settle<after, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == BLOAD || I == INVERT || I == SHL || I == SHR)
+  {
+    Value a;
+    copy(a, word<In, 0>(frame));
+    drop<In, 1>(frame);
+    Value result;
+    if constexpr (I == BLOAD)
+    {
+      int address;
+      if (!locate(frame, op.args[arg++], a, address))
+      {
+        return FAILED;
+      }
+      copy(result, frame.memory[address]);
+    }
+    else if constexpr (I == INVERT)
+    {
+      result = a.isFloat ? Value::fromFloat(-a.f) : Value::fromInt(static_cast<int>(0u - static_cast<unsigned int>(a.i)));
+    }
+    else
+    {
+      result = shift(I, a, op.args[arg++]);
+    }
+    push<left>(frame, result);
+    settle<after, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == BSTORE)
+  {
+    Value offset;
+    copy(offset, word<In, 0>(frame));
+    Value value;
+    copy(value, word<In, 1>(frame));
+    drop<In, 2>(frame);
+    int address;
+    if (!locate(frame, op.args[arg++], offset, address))
+    {
+      return FAILED;
+    }
+    copy(frame.memory[address], value);
+    settle<left, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == ADD || I == SUB || I == MULT || I == DIV || I == COMPARE)
+  {
+    Value a;
+    copy(a, word<In, 1>(frame));
+    Value b;
+    copy(b, word<In, 0>(frame));
+    drop<In, 2>(frame);
+    Value result;
+    if constexpr (I == COMPARE)
+    {
+      result = Value::fromInt(compareSlow(op.args[arg++], a, b) ? 1 : 0);
+    }
+    else
+    {
+      if (I == DIV && (b.isFloat ? b.f == 0 : b.i == 0))
+      {
+        return fail(frame, "division by zero");
+      }
+      result = calculate<I>(a, b);
+    }
+    push<left>(frame, result);
+    settle<after, Out>(frame);
+    return CONTINUE;
+  }
+  else if constexpr (I == JUMP)
+  {
+    settle<In, Out>(frame);
+    target = op.args[arg++];
+    return JUMPED;
+  }
+  else if constexpr (I == JUMP_YES || I == JUMP_NO)
+  {
+    Value a;
+    copy(a, word<In, 0>(frame));
+    drop<In, 1>(frame);
+    settle<left, Out>(frame);
+    if (a.isTrue() == (I == JUMP_YES))
+    {
+      target = op.args[arg++];
+      return JUMPED;
+    }
+    return CONTINUE;
+  }
+  else
+  {
+    static_assert(I >= JEQ && I <= JGE, "unknown instruction");
+    Value a;
+    copy(a, word<In, 1>(frame));
+    Value b;
+    copy(b, word<In, 0>(frame));
+    drop<In, 2>(frame);
+    settle<left, Out>(frame);
+    if (test<jumpComparison(I)>(a, b))
+    {
+      target = op.args[arg++];
+      return JUMPED;
+    }
+    return CONTINUE;
+  }
+}
+
+// Обработчик операции: базовая инструкция целиком, суперинструкция - составляющие подряд,
+// каждая со своим числом слов в кэше, без диспетчеризации между ними
+template <int In, int Out, Instruction Part, Instruction... Rest>
+MILAN_INLINE Status steps(Frame& frame, const Operation& op, int& arg, int& target)
+{
+  if constexpr (sizeof...(Rest) == 0)
+  {
+    return step<Part, In, Out>(frame, op, arg, target);
+  }
+  else
+  {
+    constexpr int next = cachedAfter(Part, In);
+    Status status = step<Part, In, next>(frame, op, arg, target);
+    if (status != CONTINUE)
+    {
+      return status;
+    }
+    return steps<next, Out, Rest...>(frame, op, arg, target);
+  }
+}
+
+template <Instruction I, int In, int Out>
+struct Handler
+{
+  static MILAN_INLINE Status run(Frame& frame, const Operation& op, int& target)
+  {
+    int arg = 0;
+    return step<I, In, Out>(frame, op, arg, target);
+  }
+};
+
+// PUSH как отдельная инструкция может загружать и вещественную константу
+template <int In, int Out>
+struct Handler<PUSH, In, Out>
+{
+  static MILAN_INLINE Status run(Frame& frame, const Operation& op, int&)
+  {
+    push<In>(frame, op.value);
+    settle<cachedAfter(PUSH, In), Out>(frame);
+    return CONTINUE;
+  }
+};
+
+#define SUPEROP(name, length, ...) \
+  template <int In, int Out> \
+  struct Handler<name, In, Out> \
+  { \
+    static MILAN_INLINE Status run(Frame& frame, const Operation& op, int& target) \
+    { \
+      int arg = 0; \
+      return steps<In, Out, __VA_ARGS__>(frame, op, arg, target); \
+    } \
+  };
+#include "superops.def"
+#undef SUPEROP
+
+}
+
+#define BASE_INSTRUCTIONS(X) \
+  X(NOP) X(STOP) X(LOAD) X(STORE) X(BLOAD) X(BSTORE) X(PUSH) X(POP) X(DUP) X(ADD) X(SUB) \
+  X(MULT) X(DIV) X(INVERT) X(COMPARE) X(JUMP) X(JUMP_YES) X(JUMP_NO) X(INPUT) X(PRINT) \
+  X(JEQ) X(JNE) X(JLT) X(JGT) X(JLE) X(JGE) X(SHL) X(SHR)
+
+// Обработчики всех инструкций для всех пар состояний кэша. Выполнение операции завершается
+// переходом к обработчику следующей (DISPATCH): либо косвенным переходом по адресу метки,
+// записанному в операции, либо возвратом к switch.
+#ifdef MILAN_VM_THREADED
+#define LABEL(name, in, out) L_##name##_##in##out:
+#define DISPATCH() do { ++executed; goto *op->handler; } while (0)
+#else
+#define LABEL(name, in, out) case (name * CACHE_STATES + in) * CACHE_STATES + out:
+#define DISPATCH() goto dispatch
+#endif
+
+#define HANDLER(name, in, out) \
+  LABEL(name, in, out) \
+  switch (Handler<name, in, out>::run(frame, *op, target)) \
+  { \
+  case CONTINUE: \
+    ++op; \
+    DISPATCH(); \
+  case JUMPED: \
+    if (hooked && target <= op - code) \
+    { \
+      goto backEdge; \
+    } \
+    op = code + target; \
+    DISPATCH(); \
+  case STOPPED: \
+    goto stopped; \
+  default: \
+    goto failed; \
+  }
+
+#define HANDLERS(name) \
+  HANDLER(name, 0, 0) HANDLER(name, 0, 1) HANDLER(name, 0, 2) \
+  HANDLER(name, 1, 0) HANDLER(name, 1, 1) HANDLER(name, 1, 2) \
+  HANDLER(name, 2, 0) HANDLER(name, 2, 1) HANDLER(name, 2, 2)
+
+#define ADDRESSES(name) \
+  &&L_##name##_00, &&L_##name##_01, &&L_##name##_02, \
+  &&L_##name##_10, &&L_##name##_11, &&L_##name##_12, \
+  &&L_##name##_20, &&L_##name##_21, &&L_##name##_22,
+
+bool ThreadedMachine::run()
+{
+  steps_ = 0;
+  error_.clear();
+  vector<int> depth;
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth, maxDepth, memorySize, error_))
+  {
+    return false;
+  }
+  if (hook_)
+  {
+    hook_->prepare(depth);
+  }
+
+#ifdef MILAN_VM_THREADED
+  static const void* const handlers[] = {
+    BASE_INSTRUCTIONS(ADDRESSES)
+#define SUPEROP(name, length, ...) ADDRESSES(name)
+#include "superops.def"
+#undef SUPEROP
+  };
+#endif
+
+  //Состояния кэша: на адресах переходов и после переходов кэш пуст, внутри блока число слов
+  //в кэше переходит от инструкции к инструкции
+  int size = program_.size();
+  vector<bool> isTarget(size, false);
+  for (const Command& command : program_)
+  {
+    int count = argumentCount(command.instruction());
+    if (isJump(command.instruction()) && command.arg(count - 1) >= 0 && command.arg(count - 1) < size)
+    {
+      isTarget[command.arg(count - 1)] = true;
+    }
+  }
+
+  //Декодирование: аргументы переносятся в операции, PUSH получает готовое значение
+  vector<Operation> decoded(size);
+  int cached = 0;
+  for (int i = 0; i < size; ++i)
+  {
+    const Command& command = program_[i];
+    Instruction instruction = command.instruction();
+    const Superop* superop = findSuperop(instruction);
+    int in = isTarget[i] ? 0 : cached;
+    int out = in;
+    for (int j = 0; j < (superop ? superop->length : 1); ++j)
+    {
+      out = cachedAfter(superop ? superop->parts[j] : instruction, out);
+    }
+    if (isJump(instruction) || instruction == STOP || (i + 1 < size && isTarget[i + 1]))
+    {
+      out = 0;
+    }
+#ifdef MILAN_VM_MEMORY_STACK
+    in = 0;
+    out = 0;
+#endif
+    cached = out;
+
+    Operation& operation = decoded[i];
+    operation.index = (instruction * CACHE_STATES + in) * CACHE_STATES + out;
+#ifdef MILAN_VM_THREADED
+    operation.handler = handlers[operation.index];
+#endif
+    for (int j = 0; j < MAX_SUPEROP_ARGS; ++j)
+    {
+      operation.args[j] = command.arg(j);
+    }
+    if (instruction == PUSH)
+    {
+      operation.value = Value::fromCommand(command);
+    }
+  }
+
+  memory_.assign(memorySize, Value());
+  stack_.assign(maxDepth + 1, Value());
+  string message;
+  Frame frame;
+  frame.sp = stack_.data();
+  frame.memory = memory_.data();
+  frame.memorySize = memorySize;
+  frame.memoryVector = &memory_;
+  frame.input = &input_;
+  frame.output = &output_;
+  frame.message = &message;
+
+  const bool hooked = hook_ != nullptr;
+  const Operation* code = decoded.data();
+  const Operation* op = code;
+  long long executed = 0;
+  int target;
+
+#ifdef MILAN_VM_THREADED
+  DISPATCH();
+#else
+dispatch:
+  ++executed;
+  switch (op->index)
+  {
+#endif
+
+  BASE_INSTRUCTIONS(HANDLERS)
+#define SUPEROP(name, length, ...) HANDLERS(name)
+#include "superops.def"
+#undef SUPEROP
+
+#ifndef MILAN_VM_THREADED
+  }
+#endif
+
+stopped:
+  steps_ = executed;
+  output_.flush();
+  return true;
+
+failed:
+  steps_ = executed;
+  error_ = "address " + to_string(op - code) + ": " + message;
+  output_.flush();
+  return false;
+
+  //Обратный переход: после переходов кэш пуст, и стек целиком в памяти. Обработчик может
+  //выполнить часть программы сам и расширить память.
+backEdge:
+  target = hook_->backEdge(target, stack_.data(), memory_, message);
+  if (target < 0)
+  {
+    steps_ = executed;
+    if (target != -1)
+    {
+      error_ = message;
+    }
+    output_.flush();
+    return target == -1;
+  }
+  frame.sp = stack_.data() + depth[target];
+  frame.memory = memory_.data();
+  frame.memorySize = memory_.size();
+  op = code + target;
+  DISPATCH();
+}
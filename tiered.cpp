@@ -0,0 +1,239 @@
+#include "vm.hpp"
+#include "typeinfer.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+
+// Многоуровневое выполнение программы: ThreadedMachine (уровень 0) и циклы, скомпилированные
+// в фоновом потоке (уровень 1).
+//
+// Циклы определяются по обратным переходам: цикл с началом по адресу h занимает адреса от h
+// до последней инструкции, переходящей назад к h. Engine - обработчик обратных переходов
+// интерпретатора: он считает переходы к каждому началу цикла; горячий цикл ставится в очередь
+// компиляции, а готовый код публикуется через атомарный указатель ready_[h], который
+// обработчик читает на каждом обратном переходе. Код, очередь и журнал защищены mutex_; код,
+// опубликованный в ready_, больше не меняется до конца выполнения.
+class Engine : public BackEdgeHook
+{
+public:
+  Engine(const vector<Command>& program, istream& input, ostream& output, int threshold)
+    : program_(program), input_(input), output_(output), threshold_(threshold), steps_(0), stop_(false)
+  {}
+
+  ~Engine();
+
+  bool run(string& error);
+
+  void report(ostream& output);
+
+  void prepare(const vector<int>& depth) override;
+
+  int backEdge(int target, Value* stack, vector<Value>& memory, string& error) override;
+
+private:
+  // Постановка цикла с началом header в очередь компиляции
+  void request(int header);
+
+  // Фоновый поток: компиляция циклов из очереди
+  void work();
+
+  // Время от начала выполнения в миллисекундах
+  double elapsed() const
+  {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start_).count();
+  }
+
+  // Запись в журнал (под mutex_)
+  void log(const string& message);
+
+  string loopName(int header) const
+  {
+    return "loop at addresses " + to_string(header) + "-" + to_string(loopEnd_[header]);
+  }
+
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  int threshold_;
+  vector<int> depth_;
+  vector<int> loopEnd_;                     // Конец цикла с началом по адресу или -1
+  vector<long long> hot_;                   // Число обратных переходов, выполненных интерпретатором
+  vector<long long> entries_;               // Число входов в скомпилированный код цикла
+  unique_ptr<atomic<const JitRegion*>[]> ready_;
+  long long steps_;
+  chrono::steady_clock::time_point start_;
+
+  mutex mutex_;
+  condition_variable wake_;
+  deque<int> queue_;
+  vector<unique_ptr<JitRegion>> regions_;
+  bool stop_;
+  thread worker_;
+  string log_;
+};
+
+Engine::~Engine()
+{
+  if (worker_.joinable())
+  {
+    {
+      lock_guard<mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wake_.notify_one();
+    worker_.join();
+  }
+}
+
+void Engine::log(const string& message)
+{
+  char time[32];
+  snprintf(time, sizeof(time), "%10.3f ms: ", elapsed());
+  log_ += time + message + "\n";
+}
+
+void Engine::request(int header)
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    log(loopName(header) + " is hot after " + to_string(hot_[header]) + " iterations");
+    queue_.push_back(header);
+  }
+  //Поток компиляции запускается только тогда, когда появляется работа для него
+  if (!worker_.joinable())
+  {
+    worker_ = thread(&Engine::work, this);
+  }
+  else
+  {
+    wake_.notify_one();
+  }
+  //Если процессор один, без этого компиляция ждет, пока у интерпретатора не кончится квант
+  this_thread::yield();
+}
+
+void Engine::work()
+{
+  unique_lock<mutex> lock(mutex_);
+  for (;;)
+  {
+    wake_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+    if (stop_)
+    {
+      return;
+    }
+    int header = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+
+    auto start = chrono::steady_clock::now();
+    unique_ptr<JitRegion> region(new JitRegion());
+    string error;
+    bool ok = region->compile(program_, depth_, header, loopEnd_[header], error);
+    double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    lock.lock();
+    if (!ok)
+    {
+      log(loopName(header) + " not compiled: " + error);
+      continue;
+    }
+    char time[32];
+    snprintf(time, sizeof(time), "%.3f", milliseconds);
+    log(loopName(header) + " compiled to " + to_string(region->size()) + " bytes in " + time + " ms");
+    ready_[header].store(region.get(), memory_order_release);
+    regions_.push_back(move(region));
+  }
+}
+
+void Engine::prepare(const vector<int>& depth)
+{
+  depth_ = depth;
+  hot_.assign(program_.size(), 0);
+  entries_.assign(program_.size(), 0);
+  ready_.reset(new atomic<const JitRegion*>[program_.size()]);
+  for (size_t address = 0; address < program_.size(); ++address)
+  {
+    ready_[address].store(nullptr, memory_order_relaxed);
+  }
+  //Переходы внутри суперинструкций тоже замыкают циклы
+  vector<Operation> operations;
+  vector<int> firstOperation;
+  splitProgram(program_, operations, firstOperation);
+  loopEnd_.assign(program_.size(), -1);
+  for (const Operation& operation : operations)
+  {
+    if (isJump(operation.instruction) && operation.arg <= operation.address && depth_[operation.address] >= 0)
+    {
+      loopEnd_[operation.arg] = max(loopEnd_[operation.arg], operation.address);
+    }
+  }
+}
+
+//Обратный переход: вход в скомпилированный код цикла (OSR) или подсчет проходов
+int Engine::backEdge(int target, Value* stack, vector<Value>& memory, string& error)
+{
+  const JitRegion* region = ready_[target].load(memory_order_acquire);
+  if (!region)
+  {
+    if (++hot_[target] == threshold_)
+    {
+      request(target);
+    }
+    return target;
+  }
+  if (entries_[target]++ == 0)
+  {
+    lock_guard<mutex> lock(mutex_);
+    log(loopName(target) + " entered at tier 1 after " + to_string(hot_[target]) + " iterations");
+  }
+  return region->run(stack, memory, input_, output_, error);
+}
+
+bool Engine::run(string& error)
+{
+  start_ = chrono::steady_clock::now();
+  ThreadedMachine machine(program_, input_, output_, this);
+  bool ok = machine.run();
+  error = machine.error();
+  steps_ = machine.steps();
+  return ok;
+}
+
+void Engine::report(ostream& output)
+{
+  lock_guard<mutex> lock(mutex_);
+  output << "Tier-up log (threshold " << threshold_ << "):" << endl;
+  output << log_;
+  for (size_t header = 0; header < entries_.size(); ++header)
+  {
+    if (entries_[header] > 0)
+    {
+      output << loopName(header) << ": " << hot_[header] << " iterations at tier 0, entered at tier 1 "
+             << entries_[header] << (entries_[header] == 1 ? " time" : " times") << endl;
+    }
+  }
+  output << "Interpreted instructions: " << steps_ << endl;
+}
+
+}
+
+bool TieredMachine::run()
+{
+  error_.clear();
+  Engine engine(program_, input_, output_, threshold_);
+  bool ok = engine.run(error_);
+  ostringstream log;
+  engine.report(log);
+  log_ = log.str();
+  return ok;
+}
@@ -0,0 +1,191 @@
+// Скорость ввода и вывода чисел виртуальной машины Милана.
+//
+// Печатает count целых и count вещественных чисел в файл так, как это делает PRINT
+// (printInt и printFloat через OutputBuffer) и так, как это делается operator<< и formatFloat
+// через ofstream, затем читает count целых чисел так, как это делает INPUT (readInt через
+// InputBuffer) и operator>> через ifstream, и печатает число чисел в секунду для каждого
+// способа. Результаты обоих способов сравниваются; если они различаются, утилита сообщает
+// об ошибке. Файл удаляется после измерений.
+//
+// Сборка: g++ -std=c++17 -O2 -I.. iobench.cpp ../vmio.cpp ../codegen.cpp ../flowgraph.cpp -o iobench
+// Использование: iobench [-n count] [файл]
+
+#include "vmio.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
+#include <random>
+#include <unistd.h>
+
+using namespace std;
+
+static double seconds(chrono::steady_clock::time_point start)
+{
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(const char* what, const char* method, long count, double time)
+{
+  printf("%-11s %-28s %10ld numbers %9.1f ms %8.1f M numbers/s\n", what, method, count, time * 1000,
+         count / time / 1e6);
+}
+
+// Сумма count целых чисел, прочитанных readInt; -1 в count, если чисел меньше
+static long long readBuffered(const string& file, long& count)
+{
+  int fd = open(file.c_str(), O_RDONLY);
+  InputBuffer buffer(fd);
+  istream input(&buffer);
+  long long sum = 0;
+  for (long i = 0; i < count; ++i)
+  {
+    int number;
+    if (!readInt(input, number))
+    {
+      count = -1;
+      break;
+    }
+    sum += number;
+  }
+  close(fd);
+  return sum;
+}
+
+static long long readStream(const string& file, long& count)
+{
+  ifstream input(file);
+  long long sum = 0;
+  for (long i = 0; i < count; ++i)
+  {
+    int number;
+    if (!(input >> number))
+    {
+      count = -1;
+      break;
+    }
+    sum += number;
+  }
+  return sum;
+}
+
+static string contents(const string& file)
+{
+  ifstream input(file, ios::binary);
+  return string(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+}
+
+int main(int argc, char** argv)
+{
+  long count = 2000000;
+  string file = "iobench.tmp";
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc)
+    {
+      count = atol(argv[++i]);
+    }
+    else
+    {
+      file = arg;
+    }
+  }
+  if (count < 1)
+  {
+    fprintf(stderr, "Usage: iobench [-n count] [file]\n");
+    return EXIT_FAILURE;
+  }
+
+  //Числа разной длины, как в выводе программ
+  mt19937 generator(1);
+  vector<int> integers(count);
+  vector<float> floats(count);
+  for (long i = 0; i < count; ++i)
+  {
+    integers[i] = static_cast<int>(generator()) >> (generator() % 31);
+    floats[i] = static_cast<float>(integers[i]) / static_cast<float>(1 + generator() % 1000);
+  }
+
+  //Вывод: целые, затем вещественные; texts - напечатанное первым способом
+  string texts[2];
+  const char* methods[] = {"operator<< and formatFloat", "printInt, printFloat"};
+  for (int method = 0; method < 2; ++method)
+  {
+    for (int pass = 0; pass < 2; ++pass)
+    {
+      auto start = chrono::steady_clock::now();
+      if (method == 0)
+      {
+        ofstream output(file);
+        if (pass == 0)
+        {
+          for (int value : integers)
+          {
+            output << value << '\n';
+          }
+        }
+        else
+        {
+          for (float value : floats)
+          {
+            output << formatFloat(value) << '\n';
+          }
+        }
+      }
+      else
+      {
+        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        {
+          OutputBuffer buffer(fd);
+          ostream output(&buffer);
+          if (pass == 0)
+          {
+            for (int value : integers)
+            {
+              printInt(output, value);
+            }
+          }
+          else
+          {
+            for (float value : floats)
+            {
+              printFloat(output, value);
+            }
+          }
+        }
+        close(fd);
+      }
+      report(pass == 0 ? "print int" : "print float", methods[method], count, seconds(start));
+      string written = contents(file);
+      if (method == 1 && written != texts[pass])
+      {
+        fprintf(stderr, "printed numbers differ\n");
+        return EXIT_FAILURE;
+      }
+      texts[pass] = written;
+    }
+  }
+
+  //Ввод напечатанных целых чисел
+  {
+    ofstream output(file);
+    output << texts[0];
+  }
+  long streamCount = count;
+  auto start = chrono::steady_clock::now();
+  long long streamSum = readStream(file, streamCount);
+  report("input int", "operator>>", count, seconds(start));
+  long bufferedCount = count;
+  start = chrono::steady_clock::now();
+  long long bufferedSum = readBuffered(file, bufferedCount);
+  report("input int", "readInt", count, seconds(start));
+  remove(file.c_str());
+  if (streamCount != bufferedCount || streamSum != bufferedSum)
+  {
+    fprintf(stderr, "read numbers differ\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
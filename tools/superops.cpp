@@ -0,0 +1,317 @@
+// Утилита выбора суперинструкций.
+//
+// Читает листинги программ, сгенерированные cmilan, находит самые частые последовательности
+// (n-граммы) инструкций длиной от 2 до MAX_SUPEROP_LENGTH и записывает выбранные суперинструкции
+// в файл superops.def, по которому CodeGen строит сопоставитель шаблонов.
+//
+// Частота последовательности оценивается статически: инструкция внутри цикла глубины d
+// считается выполняемой LOOP_WEIGHT^d раз. Последовательности не пересекают границы базовых
+// блоков, переход может быть только последней инструкцией, число аргументов не больше
+// MAX_SUPEROP_ARGS. Выбор жадный: после выбора очередной суперинструкции ее вхождения
+// заменяются в корпусе, и частоты пересчитываются.
+//
+// Сборка: g++ -std=c++17 -I.. superops.cpp ../codegen.cpp ../flowgraph.cpp -o superops
+// Использование: superops [-n число] [-o superops.def] листинг...
+
+#include "codegen.hpp"
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+
+using namespace std;
+
+const double LOOP_WEIGHT = 10.0;
+const int MAX_LOOP_DEPTH = 6;
+
+// Элемент корпуса: базовая инструкция или уже выбранная суперинструкция (номер в списке выбранных)
+struct Token
+{
+  Command command;
+  double weight;	// оценка числа выполнений
+  bool leader;		// начало базового блока
+  int fused;		// номер выбранной суперинструкции, покрывающей токен, или -1
+  bool head;		// первый токен суперинструкции
+};
+
+typedef vector<Instruction> Pattern;
+
+struct Listing
+{
+  string name;
+  vector<Token> tokens;
+};
+
+// Разбор листинга с разворачиванием суперинструкций в базовые инструкции
+static bool readListing(const string& fileName, Listing& listing)
+{
+  ifstream input(fileName);
+  if (!input)
+  {
+    cerr << "File '" << fileName << "' not found" << endl;
+    return false;
+  }
+
+  vector<Command> code;
+  vector<int> newAddress;
+  string line;
+  while (getline(input, line))
+  {
+    Command command(NOP);
+    if (!Command::parse(line, command))
+    {
+      continue;
+    }
+    newAddress.push_back(code.size());
+    const Superop* superop = findSuperop(command.instruction());
+    if (!superop)
+    {
+      code.push_back(command);
+      continue;
+    }
+    int arg = 0;
+    for (int i = 0; i < superop->length; ++i)
+    {
+      if (argumentCount(superop->parts[i]) > 0)
+      {
+        code.push_back(Command(superop->parts[i], command.arg(arg++)));
+      }
+      else
+      {
+        code.push_back(Command(superop->parts[i]));
+      }
+    }
+  }
+  newAddress.push_back(code.size());
+
+  int count = code.size();
+  vector<int> depth(count + 1, 0);
+  vector<bool> leader(count + 1, false);
+  leader[0] = true;
+  for (int address = 0; address < count; ++address)
+  {
+    Command& command = code[address];
+    if (!isJump(command.instruction()))
+    {
+      continue;
+    }
+    command.setArg(0, newAddress[command.arg()]);
+    int target = command.arg();
+    leader[target] = true;
+    leader[address + 1] = true;
+    //Переход назад замыкает цикл из инструкций с адресами от target до address
+    if (target <= address)
+    {
+      for (int i = target; i <= address; ++i)
+      {
+        ++depth[i];
+      }
+    }
+  }
+
+  listing.name = fileName;
+  for (int address = 0; address < count; ++address)
+  {
+    double weight = 1.0;
+    for (int d = 0; d < depth[address] && d < MAX_LOOP_DEPTH; ++d)
+    {
+      weight *= LOOP_WEIGHT;
+    }
+    listing.tokens.push_back({code[address], weight, leader[address], -1, false});
+  }
+  return true;
+}
+
+// Может ли последовательность токенов с позиции start длиной length стать суперинструкцией
+static bool fusible(const vector<Token>& tokens, int start, int length)
+{
+  if (start + length > static_cast<int>(tokens.size()))
+  {
+    return false;
+  }
+  int args = 0;
+  for (int i = 0; i < length; ++i)
+  {
+    const Token& token = tokens[start + i];
+    Instruction instruction = token.command.instruction();
+    if (token.fused >= 0 || (i > 0 && token.leader) || token.command.isFloat() ||
+        instruction == NOP || instruction == STOP || (isJump(instruction) && i != length - 1))
+    {
+      return false;
+    }
+    args += argumentCount(instruction);
+  }
+  return args <= MAX_SUPEROP_ARGS;
+}
+
+static Pattern patternAt(const vector<Token>& tokens, int start, int length)
+{
+  Pattern pattern;
+  for (int i = 0; i < length; ++i)
+  {
+    pattern.push_back(tokens[start + i].command.instruction());
+  }
+  return pattern;
+}
+
+// Замена вхождений шаблона в корпусе (слева направо, без перекрытий)
+static void applyPattern(vector<Listing>& corpus, const Pattern& pattern, int index)
+{
+  int length = pattern.size();
+  for (Listing& listing : corpus)
+  {
+    vector<Token>& tokens = listing.tokens;
+    for (int start = 0; start < static_cast<int>(tokens.size()); ++start)
+    {
+      if (fusible(tokens, start, length) && patternAt(tokens, start, length) == pattern)
+      {
+        for (int i = 0; i < length; ++i)
+        {
+          tokens[start + i].fused = index;
+          tokens[start + i].head = (i == 0);
+        }
+        start += length - 1;
+      }
+    }
+  }
+}
+
+// Оценка числа диспетчеризаций: каждая незамененная инструкция и каждая суперинструкция - одна
+static void countDispatches(const Listing& listing, double& weighted, int& size)
+{
+  weighted = 0;
+  size = 0;
+  for (const Token& token : listing.tokens)
+  {
+    if (token.fused < 0 || token.head)
+    {
+      weighted += token.weight;
+      ++size;
+    }
+  }
+}
+
+static string patternName(const Pattern& pattern)
+{
+  string name;
+  for (Instruction instruction : pattern)
+  {
+    if (!name.empty())
+    {
+      name += "_";
+    }
+    name += instructionToString(instruction);
+  }
+  return name;
+}
+
+int main(int argc, char** argv)
+{
+  int limit = 8;
+  string outputName = "superops.def";
+  vector<Listing> corpus;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+    {
+      limit = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+    {
+      outputName = argv[++i];
+    }
+    else
+    {
+      Listing listing;
+      if (!readListing(argv[i], listing))
+      {
+        return EXIT_FAILURE;
+      }
+      corpus.push_back(listing);
+    }
+  }
+
+  if (corpus.empty())
+  {
+    cout << "Usage: superops [-n count] [-o superops.def] listing..." << endl;
+    return EXIT_FAILURE;
+  }
+
+  vector<double> weightedBefore(corpus.size());
+  vector<int> sizeBefore(corpus.size());
+  for (size_t i = 0; i < corpus.size(); ++i)
+  {
+    countDispatches(corpus[i], weightedBefore[i], sizeBefore[i]);
+  }
+
+  vector<Pattern> chosen;
+  while (static_cast<int>(chosen.size()) < limit)
+  {
+    //Выигрыш от последовательности длины n - (n - 1) диспетчеризаций на каждое выполнение
+    map<Pattern, double> gain;
+    for (const Listing& listing : corpus)
+    {
+      for (int start = 0; start < static_cast<int>(listing.tokens.size()); ++start)
+      {
+        for (int length = 2; length <= MAX_SUPEROP_LENGTH; ++length)
+        {
+          if (fusible(listing.tokens, start, length))
+          {
+            gain[patternAt(listing.tokens, start, length)] += listing.tokens[start].weight * (length - 1);
+          }
+        }
+      }
+    }
+
+    Pattern best;
+    double bestGain = 0;
+    for (const auto& entry : gain)
+    {
+      if (entry.second > bestGain)
+      {
+        best = entry.first;
+        bestGain = entry.second;
+      }
+    }
+    if (best.empty())
+    {
+      break;
+    }
+
+    cout << patternName(best) << "\testimated gain " << bestGain << endl;
+    applyPattern(corpus, best, chosen.size());
+    chosen.push_back(best);
+  }
+
+  cout << endl << "Estimated dispatches per program (static size in parentheses):" << endl;
+  for (size_t i = 0; i < corpus.size(); ++i)
+  {
+    double weighted;
+    int size;
+    countDispatches(corpus[i], weighted, size);
+    cout << corpus[i].name << "\t" << weightedBefore[i] << " -> " << weighted
+         << "\t(" << sizeBefore[i] << " -> " << size << ")" << endl;
+  }
+
+  ofstream output(outputName);
+  if (!output)
+  {
+    cerr << "Cannot write '" << outputName << "'" << endl;
+    return EXIT_FAILURE;
+  }
+  output << "// Суперинструкции виртуальной машины Милана." << endl
+         << "// Файл сгенерирован утилитой tools/superops по корпусу листингов, не редактируйте его вручную." << endl
+         << "// SUPEROP(название, длина, составляющие инструкции...)" << endl;
+  for (const Pattern& pattern : chosen)
+  {
+    output << "SUPEROP(" << patternName(pattern) << ", " << pattern.size();
+    for (Instruction instruction : pattern)
+    {
+      output << ", " << instructionToString(instruction);
+    }
+    output << ")" << endl;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,132 @@
+// Сравнение представлений значений виртуальной машины Милана.
+//
+// Выполняет листинги программ, сгенерированные cmilan, интерпретатором NanBoxMachine дважды:
+// со словами NaN-boxing (8 байт) и со структурами Value (12 байт), и печатает для каждого
+// представления размер стека и памяти, число выполненных инструкций, лучшее время из
+// нескольких запусков и число инструкций в секунду. Вывод программ в обоих представлениях
+// должен совпадать; если это не так или программа завершилась ошибкой времени выполнения,
+// утилита сообщает об ошибке и не печатает время.
+//
+// Сборка: g++ -std=c++17 -O2 -I.. valuebench.cpp ../nanbox.cpp ../vm.cpp ../typeinfer.cpp ../value.cpp
+//         ../vmio.cpp ../codegen.cpp ../flowgraph.cpp -o valuebench
+// Использование: valuebench [-r число_запусков] [-i файл_ввода] листинг...
+
+#include "vm.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+struct Measurement
+{
+  bool ok;
+  string output;
+  string error;
+  long long steps;
+  size_t footprint;
+  double milliseconds;  // Лучшее время
+};
+
+static Measurement measure(const vector<Command>& program, const string& input, int repeats,
+                           NanBoxMachine::Representation representation)
+{
+  Measurement result;
+  result.milliseconds = 0;
+  for (int repeat = 0; repeat < repeats; ++repeat)
+  {
+    istringstream in(input);
+    ostringstream out;
+    NanBoxMachine machine(program, in, out, representation);
+    auto start = chrono::steady_clock::now();
+    result.ok = machine.run();
+    double time = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    if (repeat == 0 || time < result.milliseconds)
+    {
+      result.milliseconds = time;
+    }
+    result.output = out.str();
+    result.error = machine.error();
+    result.steps = machine.steps();
+    result.footprint = machine.footprint();
+  }
+  return result;
+}
+
+static void print(const string& name, const char* representation, size_t slotSize, const Measurement& m)
+{
+  printf("%-24s %-14s %4zu %12zu %14lld %10.1f %10.1f\n", name.c_str(), representation, slotSize, m.footprint,
+         m.steps, m.milliseconds, m.milliseconds > 0 ? m.steps / m.milliseconds / 1000 : 0.0);
+}
+
+int main(int argc, char** argv)
+{
+  int repeats = 3;
+  string input;
+  vector<string> files;
+  for (int i = 1; i < argc; ++i)
+  {
+    string arg = argv[i];
+    if (arg == "-r" && i + 1 < argc)
+    {
+      repeats = atoi(argv[++i]);
+    }
+    else if (arg == "-i" && i + 1 < argc)
+    {
+      //Ввод читается из файла один раз и подается каждому запуску
+      ifstream file(argv[++i]);
+      if (!file)
+      {
+        fprintf(stderr, "%s: cannot open\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      ostringstream text;
+      text << file.rdbuf();
+      input = text.str();
+    }
+    else
+    {
+      files.push_back(arg);
+    }
+  }
+  if (files.empty() || repeats < 1)
+  {
+    fprintf(stderr, "Usage: valuebench [-r repeats] [-i input-file] listing...\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%-24s %-14s %4s %12s %14s %10s %10s\n", "listing", "values", "slot", "bytes", "instructions", "best ms",
+         "M instr/s");
+  int status = EXIT_SUCCESS;
+  for (const string& file : files)
+  {
+    ifstream listing(file);
+    vector<Command> program;
+    string error;
+    if (!listing || !loadListing(listing, program, error))
+    {
+      fprintf(stderr, "%s: %s\n", file.c_str(), listing ? error.c_str() : "cannot open");
+      status = EXIT_FAILURE;
+      continue;
+    }
+    Measurement boxed = measure(program, input, repeats, NanBoxMachine::NAN_BOXED);
+    Measurement tagged = measure(program, input, repeats, NanBoxMachine::TAGGED_STRUCT);
+    if (!boxed.ok || !tagged.ok)
+    {
+      fprintf(stderr, "%s: runtime error: %s\n", file.c_str(), (boxed.ok ? tagged : boxed).error.c_str());
+      status = EXIT_FAILURE;
+      continue;
+    }
+    if (boxed.ok != tagged.ok || boxed.output != tagged.output || boxed.error != tagged.error)
+    {
+      fprintf(stderr, "%s: results of the representations differ\n", file.c_str());
+      status = EXIT_FAILURE;
+      continue;
+    }
+    print(file, "NaN-boxed", sizeof(uint64_t), boxed);
+    print(file, "tagged struct", sizeof(Value), tagged);
+  }
+  return status;
+}
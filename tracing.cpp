@@ -0,0 +1,2722 @@
+#include "vm.hpp"
+#include "typeinfer.hpp"
+#include "vmio.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define MILAN_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+
+const int HOT_LOOP = 50;          // Число обратных переходов к адресу, после которого записывается трасса цикла
+const int HOT_EXIT = 20;          // Число выходов через боковой выход, после которого записывается боковая трасса
+const int MAX_RECORDED = 2000;    // Наибольшая длина трассы в инструкциях программы
+const int MAX_ATTEMPTS = 3;       // Число прерванных записей с одного места, после которого запись не повторяется
+const int MAX_TRACES = 256;
+const int MAX_EXITS = 16384;
+
+// Данные, к которым обращаются вспомогательные функции трасс
+struct Context
+{
+  istream* input;
+  ostream* output;
+  int value;            // Число, прочитанное traceInput
+};
+
+bool traceInput(Context* context)
+{
+  return readInt(*context->input, context->value);
+}
+
+void tracePrintInteger(Context* context, int value)
+{
+  printInt(*context->output, value);
+}
+
+void tracePrintFloat(Context* context, float value)
+{
+  printFloat(*context->output, value);
+}
+
+// Инструкция трассы. Трасса - линейная последовательность инструкций в форме SSA: результат
+// инструкции обозначается ее номером, операнды a и b - номера более ранних инструкций.
+// Типы всех значений известны при записи:
+//   CONST                   константа value
+//   VARIABLE n, SLOT n      значение переменной n или слова стека n при входе в трассу
+//                           (тип проверяется при входе)
+//   ADD ... DIV, NEG        целая арифметика по правилам evaluate и invert
+//   SHL n, SHR n            целые сдвиги на n разрядов, как shift
+//   FADD ... FDIV, FNEG     вещественная арифметика
+//   TOFLOAT                 преобразование целого a в вещественное
+//   COMPARE n               1 или 0 - результат сравнения a и b (оба одного типа) с кодом n
+//   GUARD n                 выход из трассы, если результат сравнения a и b с кодом n не равен
+//                           expected
+//   INPUT                   чтение целого (при ошибке - выход)
+//   PRINT                   печать a
+enum Opcode
+{
+  IR_CONST,
+  IR_VARIABLE,
+  IR_SLOT,
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_NEG,
+  IR_SHL,
+  IR_SHR,
+  IR_FADD,
+  IR_FSUB,
+  IR_FMUL,
+  IR_FDIV,
+  IR_FNEG,
+  IR_TOFLOAT,
+  IR_COMPARE,
+  IR_GUARD,
+  IR_INPUT,
+  IR_PRINT
+};
+
+struct TraceInstruction
+{
+  Opcode opcode;
+  int type;             // Тип результата: TYPE_INT, TYPE_FLOAT или 0, если результата нет
+  int a;
+  int b;
+  int arg;
+  Value value;
+  bool expected;
+  int snapshot;         // У GUARD и INPUT - снимок состояния для выхода
+  int address;          // Адрес инструкции программы, при записи которой получена инструкция
+};
+
+// Ячейка состояния машины: переменная (номер >= 0) или слово стека (номер -1 - позиция)
+int slotCell(int position)
+{
+  return -1 - position;
+}
+
+bool isSlot(int cell)
+{
+  return cell < 0;
+}
+
+// Слово стека, которое не изменилось с входа в трассу
+const int UNCHANGED = -1;
+
+// Снимок состояния для выхода из трассы: адрес, с которого продолжает интерпретатор, глубина
+// стека на нем и ячейки, значения которых в памяти машины устарели, с номерами инструкций,
+// вычисляющих их значения
+struct Snapshot
+{
+  int pc;
+  int depth;
+  vector<pair<int, int>> cells;
+};
+
+// Ячейка, которая читается в теле цикла до записи: значение при входе в очередной проход
+// (инструкция entry) хранится в регистре и в конце прохода заменяется значением final
+struct Carried
+{
+  int cell;
+  int entry;
+  int final;
+};
+
+struct Trace
+{
+  int start;                    // Адрес начала трассы
+  int depth;                    // Глубина стека в начале
+  int parentExit;               // Выход, от которого отходит боковая трасса, или -1
+  int link;                     // Трасса, в которую переходит незамкнутая трасса, или -1 для цикла
+  int recorded;                 // Число записанных инструкций программы
+  vector<TraceInstruction> code;
+  vector<Snapshot> snapshots;
+  vector<pair<int, int>> entries;   // Ячейки, прочитанные из памяти машины, и инструкции VARIABLE и SLOT
+  Snapshot final;               // Состояние в конце прохода цикла или перед переходом в трассу link
+
+  // Результат оптимизации
+  int loopStart;                // Начало тела цикла: перед ним - вынесенные из цикла инструкции
+  vector<Carried> carried;
+  vector<pair<int, int>> stored;    // Ячейки, которые в цикле только записываются: запись в память в конце прохода
+  int hoisted;                  // Число вынесенных из цикла инструкций (без констант)
+  int hoistedGuards;
+  int guards;
+
+  // Результат компиляции
+  int registers;
+  int spilled;
+  void* machineCode;
+  size_t codeSize;
+  size_t mappedSize;
+  int firstExit;
+  int exitCount;
+};
+
+// Выход из трассы
+struct ExitInfo
+{
+  int trace;
+  int pc;               // Адрес, с которого продолжается выполнение
+  int address;          // Адрес инструкции, проверка которой не прошла
+  bool entry;           // Проверка типа или вынесенная из цикла проверка при входе в трассу
+  int attempts;         // Число прерванных записей боковой трассы
+  long long nextAttempt;
+};
+
+// Данные выхода, к которым обращается машинный код: адрес боковой трассы и число выходов
+struct ExitSlot
+{
+  void* link;
+  long long count;
+};
+
+struct TraceCounters
+{
+  long long entries;
+  long long iterations;
+};
+
+static_assert(offsetof(ExitSlot, link) == 0 && offsetof(ExitSlot, count) == 8, "machine code relies on the layout of ExitSlot");
+static_assert(offsetof(TraceCounters, entries) == 0 && offsetof(TraceCounters, iterations) == 8,
+              "machine code relies on the layout of TraceCounters");
+static_assert(sizeof(Value) == 12 && offsetof(Value, isFloat) == 0 && offsetof(Value, i) == 4 &&
+              offsetof(Value, f) == 8, "machine code relies on the layout of Value");
+
+// Коды сравнений с противоположным результатом и с переставленными операндами
+const int NEGATED[] = {1, 0, 5, 4, 3, 2};
+const int MIRRORED[] = {0, 1, 3, 2, 5, 4};
+
+// Запись трассы. Интерпретатор передает каждую составляющую инструкции перед ее выполнением;
+// запись символически выполняет ее над стеком номеров инструкций трассы. Значения, которые
+// известны при записи, вычисляются сразу (свертка констант), одинаковые чистые операции
+// и проверки не повторяются, умножение и деление на степени двойки заменяются сдвигами.
+// Условный переход становится проверкой того направления, которое выбрано при записи.
+class Recorder
+{
+public:
+  Recorder(int start, int depth, int parentExit)
+    : startSnapshot_(-1), effect_(false), address_(start)
+  {
+    trace_.start = start;
+    trace_.depth = depth;
+    trace_.parentExit = parentExit;
+    trace_.link = -1;
+    trace_.recorded = 0;
+    stack_.assign(depth, UNCHANGED);
+  }
+
+  // Запись составляющей operation; stack и sp - стек интерпретатора, memory - память машины.
+  // Возвращает false, если трассу записать нельзя (причина - reason()).
+  bool record(const Operation& operation, const Value* stack, int sp, const Value* memory);
+
+  // Завершение записи: трасса замыкается в цикл или переходит в трассу link с адресом pc
+  Trace& closeLoop();
+  Trace& linkTo(int link, int pc);
+
+  int start() const
+  {
+    return trace_.start;
+  }
+
+  bool isRoot() const
+  {
+    return trace_.parentExit < 0;
+  }
+
+  int parentExit() const
+  {
+    return trace_.parentExit;
+  }
+
+  int length() const
+  {
+    return trace_.recorded;
+  }
+
+  const string& reason() const
+  {
+    return reason_;
+  }
+
+private:
+  bool abort(const string& reason)
+  {
+    reason_ = reason;
+    return false;
+  }
+
+  int emit(Opcode opcode, int type, int a = -1, int b = -1, int arg = 0);
+  int pure(Opcode opcode, int type, int a, int b = -1, int arg = 0);
+  int constant(const Value& value);
+  int entry(int cell);
+  int variable(int address);
+  int value(int position);
+  int pop();
+
+  void push(int ref)
+  {
+    stack_.push_back(ref);
+  }
+
+  int type(int ref) const
+  {
+    return trace_.code[ref].type;
+  }
+
+  bool isConstant(int ref) const
+  {
+    return trace_.code[ref].opcode == IR_CONST;
+  }
+
+  const Value& constantValue(int ref) const
+  {
+    return trace_.code[ref].value;
+  }
+
+  int toFloat(int ref);
+  int arithmetic(Instruction instruction, int a, int b);
+  int integerArithmetic(Instruction instruction, int a, int b);
+  int negate(int a);
+  int shiftValue(Instruction instruction, int a, int bits);
+  int comparison(int cmp, int a, int b);
+
+  // Проверка сравнения; pc - адрес выхода или -1 для выхода на начало текущей инструкции
+  bool guard(int cmp, int a, int b, bool expected, int pc);
+  bool jump(int target);
+
+  int makeSnapshot(int pc, const vector<int>& stack, const map<int, int>& variables);
+
+  Trace trace_;
+  vector<int> stack_;                 // Номера инструкций со значениями слов стека
+  map<int, int> variables_;           // Записанные в трассе переменные
+  map<int, int> entries_;             // Прочитанные ячейки и инструкции VARIABLE и SLOT
+  map<tuple<int, int, int, int, int, int, uint32_t, bool>, int> known_;   // Чистые операции и проверки
+  set<int> loops_;                    // Адреса обратных переходов, пройденных при записи
+  vector<int> startStack_;            // Состояние перед текущей инструкцией программы
+  map<int, int> startVariables_;
+  int startSnapshot_;
+  bool effect_;                       // В текущей инструкции уже выполнен ввод или вывод
+  int address_;
+  const Value* stackValues_;
+  const Value* memoryValues_;
+  string reason_;
+};
+
+int Recorder::emit(Opcode opcode, int type, int a, int b, int arg)
+{
+  TraceInstruction instruction;
+  instruction.opcode = opcode;
+  instruction.type = type;
+  instruction.a = a;
+  instruction.b = b;
+  instruction.arg = arg;
+  instruction.expected = true;
+  instruction.snapshot = -1;
+  instruction.address = address_;
+  trace_.code.push_back(instruction);
+  return trace_.code.size() - 1;
+}
+
+int Recorder::pure(Opcode opcode, int type, int a, int b, int arg)
+{
+  auto key = make_tuple(int(opcode), type, a, b, arg, 0, 0u, true);
+  auto found = known_.find(key);
+  if (found != known_.end())
+  {
+    return found->second;
+  }
+  int ref = emit(opcode, type, a, b, arg);
+  known_[key] = ref;
+  return ref;
+}
+
+int Recorder::constant(const Value& value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value.f, sizeof(bits));
+  auto key = make_tuple(int(IR_CONST), 0, 0, 0, 0, value.isFloat ? 0 : value.i, value.isFloat ? bits : 0u,
+                        value.isFloat);
+  auto found = known_.find(key);
+  if (found != known_.end())
+  {
+    return found->second;
+  }
+  int ref = emit(IR_CONST, value.isFloat ? TYPE_FLOAT : TYPE_INT);
+  trace_.code[ref].value = value;
+  known_[key] = ref;
+  return ref;
+}
+
+int Recorder::entry(int cell)
+{
+  auto found = entries_.find(cell);
+  if (found != entries_.end())
+  {
+    return found->second;
+  }
+  //Тип значения при входе - тот, что видит интерпретатор сейчас: до первой записи ячейки
+  //ее значение в памяти машины не меняется
+  const Value& current = isSlot(cell) ? stackValues_[-1 - cell] : memoryValues_[cell];
+  int ref = emit(isSlot(cell) ? IR_SLOT : IR_VARIABLE, current.isFloat ? TYPE_FLOAT : TYPE_INT, -1, -1,
+                 isSlot(cell) ? -1 - cell : cell);
+  entries_[cell] = ref;
+  trace_.entries.push_back({cell, ref});
+  return ref;
+}
+
+int Recorder::variable(int address)
+{
+  auto found = variables_.find(address);
+  return found != variables_.end() ? found->second : entry(address);
+}
+
+int Recorder::value(int position)
+{
+  int ref = stack_[position];
+  return ref != UNCHANGED ? ref : entry(slotCell(position));
+}
+
+int Recorder::pop()
+{
+  int ref = value(stack_.size() - 1);
+  stack_.pop_back();
+  return ref;
+}
+
+int Recorder::toFloat(int ref)
+{
+  if (type(ref) == TYPE_FLOAT)
+  {
+    return ref;
+  }
+  if (isConstant(ref))
+  {
+    return constant(Value::fromFloat(constantValue(ref).toFloat()));
+  }
+  return pure(IR_TOFLOAT, TYPE_FLOAT, ref);
+}
+
+// Степень двойки value (от 1 до 30) или -1
+static int powerOfTwo(int value)
+{
+  for (int bits = 1; bits <= 30; ++bits)
+  {
+    if (value == 1 << bits)
+    {
+      return bits;
+    }
+  }
+  return -1;
+}
+
+int Recorder::arithmetic(Instruction instruction, int a, int b)
+{
+  if (isConstant(a) && isConstant(b))
+  {
+    Value result;
+    evaluate(instruction, constantValue(a), constantValue(b), result);
+    return constant(result);
+  }
+  if (type(a) == TYPE_INT && type(b) == TYPE_INT)
+  {
+    return integerArithmetic(instruction, a, b);
+  }
+  a = toFloat(a);
+  b = toFloat(b);
+  switch (instruction)
+  {
+  case ADD:
+    return pure(IR_FADD, TYPE_FLOAT, a, b);
+  case SUB:
+    return pure(IR_FSUB, TYPE_FLOAT, a, b);
+  case MULT:
+    return pure(IR_FMUL, TYPE_FLOAT, a, b);
+  default:
+    if (!(isConstant(b) && constantValue(b).f != 0) &&
+        !guard(1, b, constant(Value::fromFloat(0)), true, -1))
+    {
+      return -1;
+    }
+    return pure(IR_FDIV, TYPE_FLOAT, a, b);
+  }
+}
+
+int Recorder::integerArithmetic(Instruction instruction, int a, int b)
+{
+  //Упрощения с одним постоянным операндом; сложение и умножение коммутативны
+  if ((instruction == ADD || instruction == MULT) && isConstant(a))
+  {
+    swap(a, b);
+  }
+  int c = isConstant(b) ? constantValue(b).i : 0;
+  switch (instruction)
+  {
+  case ADD:
+    return isConstant(b) && c == 0 ? a : pure(IR_ADD, TYPE_INT, a, b);
+
+  case SUB:
+    return isConstant(b) && c == 0 ? a : pure(IR_SUB, TYPE_INT, a, b);
+
+  case MULT:
+    if (isConstant(b))
+    {
+      if (c == 0 || c == 1)
+      {
+        return c == 0 ? b : a;
+      }
+      if (powerOfTwo(c) > 0)
+      {
+        return pure(IR_SHL, TYPE_INT, a, -1, powerOfTwo(c));
+      }
+    }
+    return pure(IR_MUL, TYPE_INT, a, b);
+
+  default:
+    if (isConstant(b))
+    {
+      //Деление на -1 - смена знака (без переполнения), на степень двойки - сдвиг с округлением к нулю
+      if (c == 1 || c == -1)
+      {
+        return c == 1 ? a : negate(a);
+      }
+      if (powerOfTwo(c) > 0)
+      {
+        return pure(IR_SHR, TYPE_INT, a, -1, powerOfTwo(c));
+      }
+    }
+    else if (!guard(1, b, constant(Value::fromInt(0)), true, -1))
+    {
+      return -1;
+    }
+    return pure(IR_DIV, TYPE_INT, a, b);
+  }
+}
+
+int Recorder::negate(int a)
+{
+  if (isConstant(a))
+  {
+    return constant(invert(constantValue(a)));
+  }
+  return type(a) == TYPE_INT ? pure(IR_NEG, TYPE_INT, a) : pure(IR_FNEG, TYPE_FLOAT, a);
+}
+
+int Recorder::shiftValue(Instruction instruction, int a, int bits)
+{
+  if (isConstant(a))
+  {
+    return constant(shift(instruction, constantValue(a), bits));
+  }
+  if (bits == 0)
+  {
+    return a;
+  }
+  if (type(a) == TYPE_INT)
+  {
+    return pure(instruction == SHL ? IR_SHL : IR_SHR, TYPE_INT, a, -1, bits);
+  }
+  //Деление на 2^bits точно совпадает с умножением на 2^-bits: оба округляют одно и то же число
+  float scale = static_cast<float>(1 << bits);
+  return pure(IR_FMUL, TYPE_FLOAT, a, constant(Value::fromFloat(instruction == SHL ? scale : 1 / scale)));
+}
+
+int Recorder::comparison(int cmp, int a, int b)
+{
+  if (isConstant(a) && isConstant(b))
+  {
+    return constant(Value::fromInt(compare(cmp, constantValue(a), constantValue(b)) ? 1 : 0));
+  }
+  if (type(a) != type(b))
+  {
+    a = toFloat(a);
+    b = toFloat(b);
+  }
+  return pure(IR_COMPARE, TYPE_INT, a, b, cmp);
+}
+
+bool Recorder::guard(int cmp, int a, int b, bool expected, int pc)
+{
+  if (isConstant(a) && isConstant(b))
+  {
+    return true;
+  }
+  if (type(a) != type(b))
+  {
+    a = toFloat(a);
+    b = toFloat(b);
+  }
+  //Для целых отрицание сравнения точное; для вещественных нет (NaN), поэтому сохраняется expected
+  if (type(a) == TYPE_INT && !expected)
+  {
+    cmp = NEGATED[cmp];
+    expected = true;
+  }
+  auto key = make_tuple(int(IR_GUARD), 0, a, b, cmp, 0, 0u, expected);
+  if (known_.count(key))
+  {
+    return true;
+  }
+  int snapshot;
+  if (pc >= 0)
+  {
+    snapshot = makeSnapshot(pc, stack_, variables_);
+  }
+  else
+  {
+    //Выход на начало инструкции: интерпретатор выполнит ее заново, поэтому до проверки
+    //в ней не должно быть ввода и вывода
+    if (effect_)
+    {
+      return abort("unsupported superinstruction");
+    }
+    if (startSnapshot_ < 0)
+    {
+      startSnapshot_ = makeSnapshot(address_, startStack_, startVariables_);
+    }
+    snapshot = startSnapshot_;
+  }
+  int ref = emit(IR_GUARD, 0, a, b, cmp);
+  trace_.code[ref].expected = expected;
+  trace_.code[ref].snapshot = snapshot;
+  known_[key] = ref;
+  return true;
+}
+
+bool Recorder::jump(int target)
+{
+  //Обратный переход к началу другого цикла, который еще не скомпилирован: трасса прошла бы
+  //его тело много раз
+  if (target <= address_ && !(isRoot() && target == trace_.start) && !loops_.insert(target).second)
+  {
+    return abort("inner loop is not compiled");
+  }
+  return true;
+}
+
+int Recorder::makeSnapshot(int pc, const vector<int>& stack, const map<int, int>& variables)
+{
+  Snapshot snapshot;
+  snapshot.pc = pc;
+  snapshot.depth = stack.size();
+  for (size_t position = 0; position < stack.size(); ++position)
+  {
+    if (stack[position] != UNCHANGED)
+    {
+      snapshot.cells.push_back({slotCell(position), stack[position]});
+    }
+  }
+  for (const pair<const int, int>& variable : variables)
+  {
+    snapshot.cells.push_back(variable);
+  }
+  trace_.snapshots.push_back(snapshot);
+  return trace_.snapshots.size() - 1;
+}
+
+bool Recorder::record(const Operation& operation, const Value* stack, int sp, const Value* memory)
+{
+  stackValues_ = stack;
+  memoryValues_ = memory;
+  address_ = operation.address;
+  if (operation.first)
+  {
+    if (++trace_.recorded > MAX_RECORDED)
+    {
+      return abort("trace is too long");
+    }
+    startStack_ = stack_;
+    startVariables_ = variables_;
+    startSnapshot_ = -1;
+    effect_ = false;
+  }
+
+  switch (operation.instruction)
+  {
+  case NOP:
+    return true;
+
+  case STOP:
+    return abort("end of program");
+
+  case BLOAD:
+  case BSTORE:
+    return abort("indexed memory access");
+
+  case LOAD:
+    push(variable(operation.arg));
+    return true;
+
+  case STORE:
+    variables_[operation.arg] = pop();
+    return true;
+
+  case PUSH:
+    push(constant(operation.value));
+    return true;
+
+  case POP:
+    pop();
+    return true;
+
+  case DUP:
+    push(value(stack_.size() - 1));
+    return true;
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  {
+    //Деление на ноль интерпретатор сейчас сообщит как ошибку
+    if (operation.instruction == DIV && !stack[sp - 1].isTrue())
+    {
+      return abort("division by zero");
+    }
+    int b = pop();
+    int a = pop();
+    int result = arithmetic(operation.instruction, a, b);
+    if (result < 0)
+    {
+      return false;
+    }
+    push(result);
+    return true;
+  }
+
+  case INVERT:
+    push(negate(pop()));
+    return true;
+
+  case SHL:
+  case SHR:
+    push(shiftValue(operation.instruction, pop(), operation.arg));
+    return true;
+
+  case COMPARE:
+  {
+    int b = pop();
+    int a = pop();
+    push(comparison(operation.arg, a, b));
+    return true;
+  }
+
+  case JUMP:
+    return jump(operation.arg);
+
+  case JUMP_YES:
+  case JUMP_NO:
+  {
+    bool truth = stack[sp - 1].isTrue();
+    int a = pop();
+    bool taken = truth == (operation.instruction == JUMP_YES);
+    int zero = constant(type(a) == TYPE_FLOAT ? Value::fromFloat(0) : Value::fromInt(0));
+    if (!guard(1, a, zero, truth, taken ? operation.address + 1 : operation.arg))
+    {
+      return false;
+    }
+    return !taken || jump(operation.arg);
+  }
+
+  case INPUT:
+  {
+    if (effect_)
+    {
+      return abort("unsupported superinstruction");
+    }
+    if (startSnapshot_ < 0)
+    {
+      startSnapshot_ = makeSnapshot(address_, startStack_, startVariables_);
+    }
+    int ref = emit(IR_INPUT, TYPE_INT);
+    trace_.code[ref].snapshot = startSnapshot_;
+    push(ref);
+    effect_ = true;
+    return true;
+  }
+
+  case PRINT:
+    emit(IR_PRINT, 0, pop());
+    effect_ = true;
+    return true;
+
+  default:
+  {
+    int cmp = jumpComparison(operation.instruction);
+    bool holds = compare(cmp, stack[sp - 2], stack[sp - 1]);
+    int b = pop();
+    int a = pop();
+    if (!guard(cmp, a, b, holds, holds ? operation.address + 1 : operation.arg))
+    {
+      return false;
+    }
+    return !holds || jump(operation.arg);
+  }
+  }
+}
+
+Trace& Recorder::closeLoop()
+{
+  address_ = trace_.start;
+  trace_.link = -1;
+  int snapshot = makeSnapshot(trace_.start, stack_, variables_);
+  trace_.final = trace_.snapshots[snapshot];
+  trace_.snapshots.pop_back();
+  return trace_;
+}
+
+Trace& Recorder::linkTo(int link, int pc)
+{
+  address_ = pc;
+  trace_.link = link;
+  int snapshot = makeSnapshot(pc, stack_, variables_);
+  trace_.final = trace_.snapshots[snapshot];
+  trace_.snapshots.pop_back();
+  return trace_;
+}
+
+bool isPure(Opcode opcode)
+{
+  return opcode != IR_VARIABLE && opcode != IR_SLOT && opcode != IR_GUARD && opcode != IR_INPUT &&
+         opcode != IR_PRINT;
+}
+
+// Оптимизация записанной трассы:
+// - для цикла проверяется, что типы ячеек, переносимых в следующий проход, не меняются;
+// - удаляются инструкции, значения которых не используются (в том числе при выходах);
+// - чтения ячеек при входе переносятся в начало трассы, а для цикла туда же выносятся
+//   инструкции, не зависящие от прохода: константы, чтения ячеек, которые в цикле не
+//   записываются, чистые операции над ними и проверки таких значений. Проверка, вынесенная
+//   из цикла, выполняется один раз при входе и при неудаче возвращает на начало цикла.
+// Возвращает false с причиной в reason, если трассу нельзя выполнять как цикл.
+bool optimizeTrace(Trace& trace, string& reason)
+{
+  const vector<TraceInstruction>& code = trace.code;
+  bool loop = trace.link < 0;
+  map<int, int> entries(trace.entries.begin(), trace.entries.end());
+  set<int> written;
+  for (const pair<int, int>& cell : trace.final.cells)
+  {
+    written.insert(cell.first);
+  }
+
+  if (loop)
+  {
+    for (const pair<int, int>& cell : trace.final.cells)
+    {
+      auto found = entries.find(cell.first);
+      if (found != entries.end() && code[found->second].type != code[cell.second].type)
+      {
+        reason = "type of a loop variable changes";
+        return false;
+      }
+    }
+    //Значение ячейки, переносимой по циклу, до ее записи в текущем проходе хранится в регистре,
+    //а в памяти машины осталось значение при входе в трассу: при выходе его нужно записать
+    for (Snapshot& snapshot : trace.snapshots)
+    {
+      set<int> present;
+      for (const pair<int, int>& cell : snapshot.cells)
+      {
+        present.insert(cell.first);
+      }
+      for (const pair<int, int>& cell : trace.final.cells)
+      {
+        auto found = entries.find(cell.first);
+        bool onStack = !isSlot(cell.first) || -1 - cell.first < snapshot.depth;
+        if (found != entries.end() && onStack && !present.count(cell.first))
+        {
+          snapshot.cells.push_back({cell.first, found->second});
+        }
+      }
+    }
+  }
+
+  //Удаление неиспользуемых инструкций: проход от конца, SSA гарантирует, что операнды раньше
+  int count = code.size();
+  vector<bool> live(count, false);
+  for (const pair<int, int>& cell : trace.final.cells)
+  {
+    live[cell.second] = true;
+  }
+  for (int index = count - 1; index >= 0; --index)
+  {
+    //Чтения ячеек не удаляются, даже если значение не нужно: трасса специализирована под их
+    //типы (например, x * 0 для целого x - целый 0), и проверка типа при входе должна остаться
+    const TraceInstruction& instruction = code[index];
+    if (!isPure(instruction.opcode))
+    {
+      live[index] = true;
+    }
+    if (!live[index])
+    {
+      continue;
+    }
+    for (int operand : {instruction.a, instruction.b})
+    {
+      if (operand >= 0)
+      {
+        live[operand] = true;
+      }
+    }
+    if (instruction.snapshot >= 0)
+    {
+      for (const pair<int, int>& cell : trace.snapshots[instruction.snapshot].cells)
+      {
+        live[cell.second] = true;
+      }
+    }
+  }
+
+  //Инструкции, не зависящие от прохода цикла
+  vector<bool> invariant(count, false);
+  for (int index = 0; loop && index < count; ++index)
+  {
+    const TraceInstruction& instruction = code[index];
+    switch (instruction.opcode)
+    {
+    case IR_CONST:
+      invariant[index] = true;
+      break;
+    case IR_VARIABLE:
+      invariant[index] = !written.count(instruction.arg);
+      break;
+    case IR_SLOT:
+      invariant[index] = !written.count(slotCell(instruction.arg));
+      break;
+    case IR_INPUT:
+    case IR_PRINT:
+      break;
+    default:
+      invariant[index] = (instruction.a < 0 || invariant[instruction.a]) && (instruction.b < 0 || invariant[instruction.b]);
+      break;
+    }
+  }
+
+  //Новый порядок: чтения при входе, вынесенные инструкции, тело цикла
+  vector<int> order;
+  for (int index = 0; index < count; ++index)
+  {
+    if (live[index] && (code[index].opcode == IR_VARIABLE || code[index].opcode == IR_SLOT))
+    {
+      order.push_back(index);
+    }
+  }
+  for (int index = 0; loop && index < count; ++index)
+  {
+    if (live[index] && invariant[index] && code[index].opcode != IR_VARIABLE && code[index].opcode != IR_SLOT)
+    {
+      order.push_back(index);
+    }
+  }
+  int loopStart = order.size();
+  for (int index = 0; index < count; ++index)
+  {
+    bool entry = code[index].opcode == IR_VARIABLE || code[index].opcode == IR_SLOT;
+    if (live[index] && !entry && !(loop && invariant[index]))
+    {
+      order.push_back(index);
+    }
+  }
+
+  vector<int> renumber(count, -1);
+  for (size_t position = 0; position < order.size(); ++position)
+  {
+    renumber[order[position]] = position;
+  }
+
+  //Вынесенные проверки выходят на начало цикла, где память машины еще не изменена
+  trace.snapshots.push_back({trace.start, trace.depth, {}});
+  int entrySnapshot = trace.snapshots.size() - 1;
+
+  vector<TraceInstruction> optimized;
+  trace.hoisted = 0;
+  trace.hoistedGuards = 0;
+  trace.guards = 0;
+  for (size_t position = 0; position < order.size(); ++position)
+  {
+    TraceInstruction instruction = code[order[position]];
+    for (int* operand : {&instruction.a, &instruction.b})
+    {
+      if (*operand >= 0)
+      {
+        *operand = renumber[*operand];
+      }
+    }
+    bool hoisted = int(position) < loopStart && instruction.opcode != IR_VARIABLE && instruction.opcode != IR_SLOT;
+    if (instruction.opcode == IR_GUARD)
+    {
+      ++trace.guards;
+      if (hoisted)
+      {
+        instruction.snapshot = entrySnapshot;
+        ++trace.hoistedGuards;
+      }
+    }
+    if (hoisted && instruction.opcode != IR_CONST)
+    {
+      ++trace.hoisted;
+    }
+    optimized.push_back(instruction);
+  }
+  for (Snapshot& snapshot : trace.snapshots)
+  {
+    for (pair<int, int>& cell : snapshot.cells)
+    {
+      cell.second = renumber[cell.second];
+    }
+  }
+  for (pair<int, int>& cell : trace.final.cells)
+  {
+    cell.second = renumber[cell.second];
+  }
+  vector<pair<int, int>> liveEntries;
+  for (const pair<int, int>& entry : trace.entries)
+  {
+    if (renumber[entry.second] >= 0)
+    {
+      liveEntries.push_back({entry.first, renumber[entry.second]});
+    }
+  }
+  trace.entries = liveEntries;
+  trace.code = optimized;
+  trace.loopStart = loopStart;
+
+  //Ячейки цикла: прочитанные до записи переносятся в регистрах, остальные (в том числе те, чье
+  //значение при входе нужно только для проверки типа) записываются в память
+  vector<bool> used(optimized.size(), false);
+  for (const TraceInstruction& instruction : optimized)
+  {
+    for (int operand : {instruction.a, instruction.b})
+    {
+      if (operand >= 0)
+      {
+        used[operand] = true;
+      }
+    }
+    if (instruction.snapshot >= 0)
+    {
+      for (const pair<int, int>& cell : trace.snapshots[instruction.snapshot].cells)
+      {
+        used[cell.second] = true;
+      }
+    }
+  }
+  for (const pair<int, int>& cell : trace.final.cells)
+  {
+    used[cell.second] = true;
+  }
+  trace.carried.clear();
+  trace.stored.clear();
+  entries = map<int, int>(trace.entries.begin(), trace.entries.end());
+  for (const pair<int, int>& cell : trace.final.cells)
+  {
+    auto found = entries.find(cell.first);
+    if (found != entries.end() && used[found->second])
+    {
+      trace.carried.push_back({cell.first, found->second, cell.second});
+    }
+    else
+    {
+      trace.stored.push_back(cell);
+    }
+  }
+  return true;
+}
+
+#ifdef MILAN_JIT_X86_64
+
+enum Register
+{
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Регистры XMM, которые не распределяются: для констант и промежуточных значений
+const int XMM14 = 14;
+const int XMM15 = 15;
+
+// Условия jcc и setcc
+enum Condition
+{
+  CC_B = 0x2,
+  CC_AE = 0x3,
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+  CC_P = 0xA,
+  CC_NP = 0xB,
+  CC_L = 0xC,
+  CC_GE = 0xD,
+  CC_LE = 0xE,
+  CC_G = 0xF
+};
+
+// Условия целых сравнений по коду COMPARE
+const int INTEGER_CONDITIONS[] = {CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE};
+
+// Операнд r/m: регистр или слово памяти [reg + offset]
+struct Rm
+{
+  bool memory;
+  int reg;
+  int offset;
+};
+
+Rm direct(int reg)
+{
+  return {false, reg, 0};
+}
+
+Rm indirect(int base, int offset)
+{
+  return {true, base, offset};
+}
+
+class Assembler
+{
+public:
+  vector<uint8_t> code;
+
+  size_t size() const
+  {
+    return code.size();
+  }
+
+  void bytes(initializer_list<uint8_t> list)
+  {
+    code.insert(code.end(), list);
+  }
+
+  void dword(uint32_t value)
+  {
+    uint8_t buffer[4];
+    memcpy(buffer, &value, 4);
+    code.insert(code.end(), buffer, buffer + 4);
+  }
+
+  void qword(uint64_t value)
+  {
+    uint8_t buffer[8];
+    memcpy(buffer, &value, 8);
+    code.insert(code.end(), buffer, buffer + 8);
+  }
+
+  // Команда с операндом r/m: обязательный префикс (0 - нет), REX (W - 64-разрядный операнд,
+  // R и B - старшие регистры), код операции и ModRM; память адресуется с 32-разрядным смещением
+  void emit(uint8_t prefix, bool wide, initializer_list<uint8_t> opcode, int reg, Rm rm)
+  {
+    if (prefix)
+    {
+      bytes({prefix});
+    }
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg & 8 ? 0x04 : 0) | (rm.reg & 8 ? 0x01 : 0);
+    if (rex != 0x40)
+    {
+      bytes({rex});
+    }
+    bytes(opcode);
+    if (!rm.memory)
+    {
+      bytes({uint8_t(0xC0 | (reg & 7) << 3 | (rm.reg & 7))});
+      return;
+    }
+    bytes({uint8_t(0x80 | (reg & 7) << 3 | (rm.reg & 7))});
+    if ((rm.reg & 7) == RSP)
+    {
+      bytes({0x24});
+    }
+    dword(rm.offset);
+  }
+
+  // mov reg, imm32 или mov reg, imm64
+  void move(int reg, uint32_t value)
+  {
+    if (reg & 8)
+    {
+      bytes({0x41});
+    }
+    bytes({uint8_t(0xB8 | (reg & 7))});
+    dword(value);
+  }
+
+  void move64(int reg, uint64_t value)
+  {
+    bytes({uint8_t(0x48 | (reg & 8 ? 0x01 : 0)), uint8_t(0xB8 | (reg & 7))});
+    qword(value);
+  }
+
+  // setcc reg8 (только al и cl)
+  void set(int condition, int reg)
+  {
+    emit(0, false, {0x0F, uint8_t(0x90 | condition)}, 0, direct(reg));
+  }
+
+  // Переход (condition < 0 - безусловный) с 32-разрядным смещением; возвращает позицию смещения
+  int jump(int condition)
+  {
+    if (condition < 0)
+    {
+      bytes({0xE9});
+    }
+    else
+    {
+      bytes({0x0F, uint8_t(0x80 | condition)});
+    }
+    dword(0);
+    return size() - 4;
+  }
+
+  void bind(int position, size_t target)
+  {
+    int32_t offset = int32_t(target) - (position + 4);
+    memcpy(&code[position], &offset, 4);
+  }
+
+  void bind(int position)
+  {
+    bind(position, size());
+  }
+};
+
+// Место значения: регистр общего назначения, регистр XMM или слово в кадре [rsp + offset]
+enum PlaceKind
+{
+  NOWHERE,
+  GPR,
+  XMM,
+  FRAME
+};
+
+struct Place
+{
+  PlaceKind kind;
+  int reg;
+  int offset;
+
+  bool operator==(const Place& other) const
+  {
+    return kind == other.kind && (kind == FRAME ? offset == other.offset : reg == other.reg);
+  }
+};
+
+// Слова кадра: Context, начало стека машины, начало памяти, затем значения инструкций, которым
+// не хватило регистров, и копии регистров на время вызовов
+const int FRAME_CONTEXT = 0;
+const int FRAME_STACK = 8;
+const int FRAME_MEMORY = 16;
+const int FRAME_VALUES = 24;
+
+// Распределяемые регистры: сначала сохраняемые вызываемой функцией
+const int GENERAL_REGISTERS[] = {RBX, R12, R13, R14, R15, RSI, RDI, R8, R9, R10, R11};
+const int XMM_REGISTERS = 14;
+
+bool callerSaved(const Place& place)
+{
+  return place.kind == XMM || (place.kind == GPR && (place.reg == RSI || place.reg == RDI || (place.reg >= R8 && place.reg <= R11)));
+}
+
+// Множитель и сдвиг для деления на постоянное d >= 2 умножением (Hacker's Delight, 10-1):
+// n / d = старшая половина (multiplier * n) [+ n, если multiplier < 0] >> shift, плюс 1 для n < 0
+void divisionMagic(int d, int& multiplier, int& shift)
+{
+  const uint32_t two31 = 0x80000000u;
+  uint32_t ad = d;
+  uint32_t anc = two31 - 1 - two31 % ad;
+  int p = 31;
+  uint32_t q1 = two31 / anc;
+  uint32_t r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad;
+  uint32_t r2 = two31 - q2 * ad;
+  uint32_t delta;
+  do
+  {
+    ++p;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc)
+    {
+      ++q1;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad)
+    {
+      ++q2;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+  multiplier = int32_t(q2 + 1);
+  shift = p - 32;
+}
+
+// Выход, для которого нужно породить код
+struct Stub
+{
+  int jump;                 // Позиция смещения перехода к коду выхода
+  const Snapshot* snapshot;
+  int exit;
+};
+
+// Компиляция оптимизированной трассы в функцию int(Context*, Value* stack, Value* memory),
+// которая возвращает номер выхода. Значения распределяются по регистрам линейным
+// сканированием интервалов жизни; для цикла значения, вынесенные из тела, живут весь цикл,
+// а ячейки, переносимые по циклу, в конце прохода пересылаются в регистры своих значений при
+// входе. Память машины при выполнении трассы не меняется: при выходе в нее записываются
+// ячейки из снимка состояния, затем выход либо переходит в присоединенную боковую трассу,
+// либо возвращает свой номер интерпретатору. Незамкнутая трасса переходит в трассу цикла
+// через ячейку linkSlot с адресом ее кода. rbp считает проходы цикла.
+class TraceCompiler
+{
+public:
+  TraceCompiler(Trace& trace, int traceIndex, vector<ExitInfo>& exits, ExitSlot* slots, TraceCounters* counters,
+                void** linkSlot)
+    : trace_(trace), code_(trace.code), traceIndex_(traceIndex), exits_(exits), slots_(slots),
+      counters_(counters), linkSlot_(linkSlot)
+  {}
+
+  void compile(vector<uint8_t>& code);
+
+private:
+  void allocate();
+  void compileInstruction(int index);
+
+  bool isConstant(int ref) const
+  {
+    return code_[ref].opcode == IR_CONST;
+  }
+
+  Rm at(int ref) const
+  {
+    const Place& place = places_[ref];
+    return place.kind == FRAME ? indirect(RSP, place.offset) : direct(place.reg);
+  }
+
+  // Регистр значения нужного вида или -1
+  int registerOf(int ref, PlaceKind kind) const
+  {
+    return ref >= 0 && !isConstant(ref) && places_[ref].kind == kind ? places_[ref].reg : -1;
+  }
+
+  void loadInteger(int reg, int ref);
+  void storeInteger(int ref, int reg);
+  void loadFloat(int xmm, int ref);
+  void storeFloat(int ref, int xmm);
+  void copy(const Place& target, const Place& source, int type);
+  void copyConstant(const Place& target, const Value& value);
+
+  // Сравнение целых a и b; возвращает условие, истинное при выполнении сравнения cmp
+  int compareIntegers(int cmp, int a, int b);
+
+  // Сравнение вещественных; возвращает условие или -1, если результат записан в al
+  int compareFloats(int cmp, int a, int b);
+
+  void integerArithmetic(int index);
+  void integerDivision(int index);
+  void floatArithmetic(int index);
+  void loadEntry(int index);
+  void guard(int index);
+
+  // Вызов вспомогательной функции с сохранением регистров, которые она может изменить
+  void call(int index, void* function);
+
+  // Переход к новому выходу со снимком snapshot
+  void exitOn(int condition, int snapshot, int address, bool entry);
+
+  // Запись ячеек в память машины
+  void writeBack(const vector<pair<int, int>>& cells);
+  void parallelMove();
+
+  // Переход в трассу по адресу в rax
+  void tailJump();
+  void epilogue();
+
+  Trace& trace_;
+  const vector<TraceInstruction>& code_;
+  int traceIndex_;
+  vector<ExitInfo>& exits_;
+  ExitSlot* slots_;
+  TraceCounters* counters_;
+  void** linkSlot_;
+  Assembler as_;
+  vector<Place> places_;
+  vector<int> end_;             // Последнее использование значения
+  int frameSize_;
+  vector<Stub> stubs_;
+  vector<int> returns_;         // Переходы к общему эпилогу
+};
+
+void TraceCompiler::allocate()
+{
+  int count = code_.size();
+  int finish = count;           // Позиция пересылок в конце прохода или перехода в другую трассу
+  bool loop = trace_.link < 0;
+  end_.assign(count, 0);
+  for (int index = 0; index < count; ++index)
+  {
+    end_[index] = index;
+  }
+  for (int index = 0; index < count; ++index)
+  {
+    const TraceInstruction& instruction = code_[index];
+    for (int operand : {instruction.a, instruction.b})
+    {
+      if (operand >= 0)
+      {
+        end_[operand] = max(end_[operand], index);
+      }
+    }
+    if (instruction.snapshot >= 0)
+    {
+      for (const pair<int, int>& cell : trace_.snapshots[instruction.snapshot].cells)
+      {
+        end_[cell.second] = max(end_[cell.second], index);
+      }
+    }
+  }
+  for (const pair<int, int>& cell : trace_.final.cells)
+  {
+    end_[cell.second] = max(end_[cell.second], finish);
+  }
+
+  //Значения, вычисленные до тела цикла и используемые в нем, нужны во всех проходах. Значения
+  //ячеек, переносимых по циклу, живут до последнего использования: в конце прохода их место
+  //получает значение следующего прохода
+  vector<bool> carriedEntry(count, false);
+  map<int, int> homeOf;         // Конечное значение ячейки -> значение при входе
+  for (const Carried& carried : trace_.carried)
+  {
+    carriedEntry[carried.entry] = true;
+    homeOf[carried.final] = carried.entry;
+  }
+  for (int index = 0; loop && index < trace_.loopStart; ++index)
+  {
+    if (end_[index] >= trace_.loopStart && !carriedEntry[index])
+    {
+      end_[index] = finish + 1;
+    }
+  }
+
+  places_.assign(count, {NOWHERE, 0, 0});
+  vector<bool> home[2] = {vector<bool>(16, false), vector<bool>(16, false)};
+  vector<int> owner[2] = {vector<int>(16, -1), vector<int>(16, -1)};
+  vector<int> active;
+  set<pair<int, int>> used;
+  trace_.spilled = 0;
+  for (int index = 0; index < count; ++index)
+  {
+    const TraceInstruction& instruction = code_[index];
+    if (instruction.type == 0 || instruction.opcode == IR_CONST)
+    {
+      continue;
+    }
+    //Освобождение регистров значений, которые больше не нужны (результат может занять регистр
+    //своего операнда)
+    for (size_t k = 0; k < active.size();)
+    {
+      int ref = active[k];
+      if (end_[ref] <= index)
+      {
+        owner[places_[ref].kind == XMM][places_[ref].reg] = -1;
+        active[k] = active.back();
+        active.pop_back();
+      }
+      else
+      {
+        ++k;
+      }
+    }
+
+    bool isFloat = instruction.type == TYPE_FLOAT;
+    PlaceKind kind = isFloat ? XMM : GPR;
+    bool forever = end_[index] > finish;
+    vector<int> candidates;
+    //Предпочтения: место значения ячейки при входе (пересылка в конце прохода не нужна)
+    //и регистр первого операнда
+    auto hint = homeOf.find(index);
+    if (hint != homeOf.end() && places_[hint->second].kind == kind)
+    {
+      candidates.push_back(places_[hint->second].reg);
+    }
+    if (registerOf(instruction.a, kind) >= 0)
+    {
+      candidates.push_back(registerOf(instruction.a, kind));
+    }
+    if (isFloat)
+    {
+      for (int reg = 0; reg < XMM_REGISTERS; ++reg)
+      {
+        candidates.push_back(reg);
+      }
+    }
+    else
+    {
+      candidates.insert(candidates.end(), begin(GENERAL_REGISTERS), end(GENERAL_REGISTERS));
+    }
+    int chosen = -1;
+    for (int reg : candidates)
+    {
+      if (owner[isFloat][reg] < 0 && !(forever && home[isFloat][reg]))
+      {
+        chosen = reg;
+        break;
+      }
+    }
+    if (chosen < 0)
+    {
+      //Регистров нет: в кадр уходит значение, которое нужно дольше всех
+      int victim = -1;
+      for (int ref : active)
+      {
+        if (places_[ref].kind == kind && !(forever && home[isFloat][places_[ref].reg]) &&
+            (victim < 0 || end_[ref] > end_[victim]))
+        {
+          victim = ref;
+        }
+      }
+      if (victim >= 0 && end_[victim] > end_[index])
+      {
+        chosen = places_[victim].reg;
+        places_[victim] = {FRAME, 0, FRAME_VALUES + 4 * victim};
+        active.erase(find(active.begin(), active.end(), victim));
+        ++trace_.spilled;
+      }
+    }
+    if (chosen < 0)
+    {
+      places_[index] = {FRAME, 0, FRAME_VALUES + 4 * index};
+      ++trace_.spilled;
+      continue;
+    }
+    places_[index] = {kind, chosen, 0};
+    owner[isFloat][chosen] = index;
+    active.push_back(index);
+    used.insert({isFloat, chosen});
+    if (carriedEntry[index])
+    {
+      home[isFloat][chosen] = true;
+    }
+  }
+  trace_.registers = used.size();
+
+  //Кадр: после шести сохраненных регистров и адреса возврата rsp должен остаться выровненным
+  //на 16 байт для вызовов
+  frameSize_ = FRAME_VALUES + 4 * count;
+  frameSize_ += (8 - frameSize_ % 16 + 16) % 16;
+}
+
+void TraceCompiler::loadInteger(int reg, int ref)
+{
+  if (isConstant(ref))
+  {
+    as_.move(reg, code_[ref].value.i);                  // mov reg, imm
+    return;
+  }
+  Rm source = at(ref);
+  if (source.memory || source.reg != reg)
+  {
+    as_.emit(0, false, {0x8B}, reg, source);            // mov reg, source
+  }
+}
+
+void TraceCompiler::storeInteger(int ref, int reg)
+{
+  Rm target = at(ref);
+  if (target.memory || target.reg != reg)
+  {
+    as_.emit(0, false, {0x89}, reg, target);            // mov target, reg
+  }
+}
+
+void TraceCompiler::loadFloat(int xmm, int ref)
+{
+  if (isConstant(ref))
+  {
+    uint32_t bits;
+    memcpy(&bits, &code_[ref].value.f, 4);
+    as_.move(RAX, bits);                                // mov eax, imm
+    as_.emit(0x66, false, {0x0F, 0x6E}, xmm, direct(RAX));  // movd xmm, eax
+    return;
+  }
+  Rm source = at(ref);
+  if (source.memory)
+  {
+    as_.emit(0xF3, false, {0x0F, 0x10}, xmm, source);   // movss xmm, [source]
+  }
+  else if (source.reg != xmm)
+  {
+    as_.emit(0, false, {0x0F, 0x28}, xmm, source);      // movaps xmm, source
+  }
+}
+
+void TraceCompiler::storeFloat(int ref, int xmm)
+{
+  Rm target = at(ref);
+  if (target.memory)
+  {
+    as_.emit(0xF3, false, {0x0F, 0x11}, xmm, target);   // movss [target], xmm
+  }
+  else if (target.reg != xmm)
+  {
+    as_.emit(0, false, {0x0F, 0x28}, target.reg, direct(xmm));  // movaps target, xmm
+  }
+}
+
+void TraceCompiler::copy(const Place& target, const Place& source, int type)
+{
+  if (target == source)
+  {
+    return;
+  }
+  Rm from = source.kind == FRAME ? indirect(RSP, source.offset) : direct(source.reg);
+  Rm to = target.kind == FRAME ? indirect(RSP, target.offset) : direct(target.reg);
+  if (source.kind == FRAME && target.kind == FRAME)
+  {
+    as_.emit(0, false, {0x8B}, RAX, from);              // mov eax, [source]
+    as_.emit(0, false, {0x89}, RAX, to);                // mov [target], eax
+  }
+  else if (type == TYPE_INT)
+  {
+    if (target.kind == GPR)
+    {
+      as_.emit(0, false, {0x8B}, target.reg, from);     // mov target, source
+    }
+    else
+    {
+      as_.emit(0, false, {0x89}, source.reg, to);       // mov [target], source
+    }
+  }
+  else if (target.kind == XMM)
+  {
+    if (source.kind == FRAME)
+    {
+      as_.emit(0xF3, false, {0x0F, 0x10}, target.reg, from);  // movss target, [source]
+    }
+    else
+    {
+      as_.emit(0, false, {0x0F, 0x28}, target.reg, from);     // movaps target, source
+    }
+  }
+  else
+  {
+    as_.emit(0xF3, false, {0x0F, 0x11}, source.reg, to);      // movss [target], source
+  }
+}
+
+void TraceCompiler::copyConstant(const Place& target, const Value& value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value.f, 4);
+  uint32_t word = value.isFloat ? bits : uint32_t(value.i);
+  if (target.kind == FRAME)
+  {
+    as_.emit(0, false, {0xC7}, 0, indirect(RSP, target.offset));  // mov dword [target], imm
+    as_.dword(word);
+  }
+  else if (target.kind == GPR)
+  {
+    as_.move(target.reg, word);                         // mov target, imm
+  }
+  else
+  {
+    as_.move(RAX, word);                                // mov eax, imm
+    as_.emit(0x66, false, {0x0F, 0x6E}, target.reg, direct(RAX));  // movd target, eax
+  }
+}
+
+int TraceCompiler::compareIntegers(int cmp, int a, int b)
+{
+  if (isConstant(a))
+  {
+    swap(a, b);
+    cmp = MIRRORED[cmp];
+  }
+  int reg = registerOf(a, GPR);
+  if (reg < 0)
+  {
+    loadInteger(RAX, a);
+    reg = RAX;
+  }
+  if (isConstant(b))
+  {
+    as_.emit(0, false, {0x81}, 7, direct(reg));         // cmp reg, imm
+    as_.dword(code_[b].value.i);
+  }
+  else
+  {
+    as_.emit(0, false, {0x3B}, reg, at(b));             // cmp reg, b
+  }
+  return INTEGER_CONDITIONS[cmp];
+}
+
+int TraceCompiler::compareFloats(int cmp, int a, int b)
+{
+  //a < b и a <= b проверяются как b > a и b >= a: условия "выше" ложны для NaN
+  if (cmp == 2 || cmp == 4)
+  {
+    swap(a, b);
+  }
+  int x = registerOf(a, XMM);
+  if (x < 0)
+  {
+    loadFloat(XMM15, a);
+    x = XMM15;
+  }
+  Rm y = at(b);
+  if (isConstant(b))
+  {
+    loadFloat(XMM14, b);
+    y = direct(XMM14);
+  }
+  as_.emit(0, false, {0x0F, 0x2E}, x, y);               // ucomiss x, y
+  switch (cmp)
+  {
+  case 0:
+    as_.set(CC_E, RAX);                                 // sete al
+    as_.set(CC_NP, RCX);                                // setnp cl
+    as_.bytes({0x20, 0xC8});                            // and al, cl
+    return -1;
+  case 1:
+    as_.set(CC_NE, RAX);                                // setne al
+    as_.set(CC_P, RCX);                                 // setp cl
+    as_.bytes({0x08, 0xC8});                            // or al, cl
+    return -1;
+  case 2:
+  case 3:
+    return CC_A;
+  default:
+    return CC_AE;
+  }
+}
+
+void TraceCompiler::integerArithmetic(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  int a = instruction.a;
+  int b = instruction.b;
+  int result = registerOf(index, GPR);
+  if (result < 0 || (b >= 0 && registerOf(b, GPR) == result && a != b))
+  {
+    result = RAX;
+  }
+  loadInteger(result, a);
+  switch (instruction.opcode)
+  {
+  case IR_NEG:
+    as_.emit(0, false, {0xF7}, 3, direct(result));      // neg result
+    break;
+  case IR_SHL:
+    as_.emit(0, false, {0xC1}, 4, direct(result));      // shl result, n
+    as_.bytes({uint8_t(instruction.arg)});
+    break;
+  case IR_MUL:
+    if (isConstant(b))
+    {
+      as_.emit(0, false, {0x69}, result, direct(result));  // imul result, result, imm
+      as_.dword(code_[b].value.i);
+    }
+    else
+    {
+      as_.emit(0, false, {0x0F, 0xAF}, result, at(b));  // imul result, b
+    }
+    break;
+  default:
+    if (isConstant(b))
+    {
+      as_.emit(0, false, {0x81}, instruction.opcode == IR_ADD ? 0 : 5, direct(result));  // add/sub result, imm
+      as_.dword(code_[b].value.i);
+    }
+    else
+    {
+      as_.emit(0, false, {uint8_t(instruction.opcode == IR_ADD ? 0x03 : 0x2B)}, result, at(b));  // add/sub result, b
+    }
+    break;
+  }
+  storeInteger(index, result);
+}
+
+void TraceCompiler::integerDivision(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  int a = instruction.a;
+  int b = instruction.b;
+  if (instruction.opcode == IR_SHR)
+  {
+    //Для отрицательных чисел прибавляем 2^n - 1, чтобы сдвиг округлял к нулю
+    loadInteger(RAX, a);
+    as_.bytes({0x89, 0xC2});                            // mov edx, eax
+    as_.bytes({0xC1, 0xFA, 0x1F});                      // sar edx, 31
+    as_.bytes({0x81, 0xE2});                            // and edx, 2^n - 1
+    as_.dword((1u << instruction.arg) - 1);
+    as_.bytes({0x01, 0xD0});                            // add eax, edx
+    as_.bytes({0xC1, 0xF8, uint8_t(instruction.arg)});  // sar eax, n
+    storeInteger(index, RAX);
+    return;
+  }
+  if (!isConstant(b) || code_[b].value.i == INT32_MIN)
+  {
+    //Делитель не ноль (проверено раньше); деление на -1 - смена знака, без переполнения idiv
+    loadInteger(RAX, a);
+    loadInteger(RCX, b);
+    as_.bytes({0x83, 0xF9, 0xFF});                      // cmp ecx, -1
+    int divide = as_.jump(CC_NE);
+    as_.bytes({0xF7, 0xD8});                            // neg eax
+    int done = as_.jump(-1);
+    as_.bind(divide);
+    as_.bytes({0x99, 0xF7, 0xF9});                      // cdq; idiv ecx
+    as_.bind(done);
+    storeInteger(index, RAX);
+    return;
+  }
+
+  //Деление на постоянное |d| >= 3 - умножением на обратную величину (делимое не константа:
+  //деление констант свернуто при записи)
+  int d = code_[b].value.i;
+  int multiplier, shift;
+  divisionMagic(d < 0 ? -d : d, multiplier, shift);
+  as_.move(RAX, multiplier);                            // mov eax, M
+  as_.emit(0, false, {0xF7}, 5, at(a));                 // imul dword a: edx = старшая половина
+  if (multiplier < 0)
+  {
+    as_.emit(0, false, {0x03}, RDX, at(a));             // add edx, a
+  }
+  if (shift > 0)
+  {
+    as_.bytes({0xC1, 0xFA, uint8_t(shift)});            // sar edx, s
+  }
+  loadInteger(RAX, a);
+  as_.bytes({0xC1, 0xE8, 0x1F});                        // shr eax, 31
+  as_.bytes({0x01, 0xC2});                              // add edx, eax
+  if (d < 0)
+  {
+    as_.bytes({0xF7, 0xDA});                            // neg edx
+  }
+  storeInteger(index, RDX);
+}
+
+void TraceCompiler::floatArithmetic(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  int a = instruction.a;
+  int b = instruction.b;
+  int result = registerOf(index, XMM);
+  if (result < 0 || (b >= 0 && registerOf(b, XMM) == result && a != b))
+  {
+    result = XMM15;
+  }
+  switch (instruction.opcode)
+  {
+  case IR_TOFLOAT:
+    as_.emit(0, false, {0x0F, 0x57}, result, direct(result));   // xorps result, result
+    as_.emit(0xF3, false, {0x0F, 0x2A}, result, at(a));         // cvtsi2ss result, a
+    break;
+  case IR_FNEG:
+  {
+    //Знаковый разряд меняется в целом регистре: так получается и знак NaN, как у invert
+    Rm source = at(a);
+    if (source.memory)
+    {
+      as_.emit(0, false, {0x8B}, RAX, source);          // mov eax, [a]
+    }
+    else
+    {
+      as_.emit(0x66, false, {0x0F, 0x7E}, source.reg, direct(RAX));  // movd eax, a
+    }
+    as_.bytes({0x35});                                  // xor eax, знаковый разряд
+    as_.dword(0x80000000u);
+    as_.emit(0x66, false, {0x0F, 0x6E}, result, direct(RAX));  // movd result, eax
+    break;
+  }
+  default:
+  {
+    static const uint8_t opcodes[] = {0x58, 0x5C, 0x59, 0x5E};   // addss, subss, mulss, divss
+    loadFloat(result, a);
+    Rm y = at(b);
+    if (isConstant(b))
+    {
+      loadFloat(XMM14, b);
+      y = direct(XMM14);
+    }
+    as_.emit(0xF3, false, {0x0F, opcodes[instruction.opcode - IR_FADD]}, result, y);
+    break;
+  }
+  }
+  storeFloat(index, result);
+}
+
+void TraceCompiler::loadEntry(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  int base = instruction.opcode == IR_SLOT ? RDX : RCX;
+  int offset = 12 * instruction.arg;
+  //Проверка типа: при несовпадении трасса не выполняется
+  as_.emit(0, false, {0x80}, 7, indirect(base, offset));  // cmp byte [tag], 0
+  as_.bytes({0x00});
+  exitOn(instruction.type == TYPE_INT ? CC_NE : CC_E, trace_.snapshots.size() - 1, trace_.start, true);
+  const Place& place = places_[index];
+  if (place.kind == FRAME)
+  {
+    as_.emit(0, false, {0x8B}, RAX, indirect(base, offset + (instruction.type == TYPE_INT ? 4 : 8)));
+    as_.emit(0, false, {0x89}, RAX, at(index));
+  }
+  else if (instruction.type == TYPE_INT)
+  {
+    as_.emit(0, false, {0x8B}, place.reg, indirect(base, offset + 4));   // mov reg, [i]
+  }
+  else
+  {
+    as_.emit(0xF3, false, {0x0F, 0x10}, place.reg, indirect(base, offset + 8));  // movss xmm, [f]
+  }
+}
+
+void TraceCompiler::guard(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  if (code_[instruction.a].type == TYPE_INT)
+  {
+    int condition = compareIntegers(instruction.arg, instruction.a, instruction.b);
+    exitOn(condition ^ 1, instruction.snapshot, instruction.address, index < trace_.loopStart);
+    return;
+  }
+  int condition = compareFloats(instruction.arg, instruction.a, instruction.b);
+  if (condition < 0)
+  {
+    as_.bytes({0x84, 0xC0});                            // test al, al
+    condition = CC_NE;
+  }
+  //Условия x86 парные: младший разряд кода обращает условие
+  exitOn(instruction.expected ? condition ^ 1 : condition, instruction.snapshot, instruction.address,
+         index < trace_.loopStart);
+}
+
+void TraceCompiler::call(int index, void* function)
+{
+  vector<int> saved;
+  for (int ref = 0; ref < index; ++ref)
+  {
+    if (!isConstant(ref) && code_[ref].type != 0 && end_[ref] >= index && callerSaved(places_[ref]))
+    {
+      saved.push_back(ref);
+    }
+  }
+  for (int ref : saved)
+  {
+    copy({FRAME, 0, FRAME_VALUES + 4 * ref}, places_[ref], code_[ref].type);
+  }
+  const TraceInstruction& instruction = code_[index];
+  if (instruction.opcode == IR_PRINT)
+  {
+    if (code_[instruction.a].type == TYPE_INT)
+    {
+      loadInteger(RSI, instruction.a);
+    }
+    else
+    {
+      loadFloat(0, instruction.a);
+    }
+  }
+  as_.emit(0, true, {0x8B}, RDI, indirect(RSP, FRAME_CONTEXT));   // mov rdi, [context]
+  as_.move64(RAX, reinterpret_cast<uint64_t>(function));
+  as_.bytes({0xFF, 0xD0});                              // call rax
+  for (int ref : saved)
+  {
+    copy(places_[ref], {FRAME, 0, FRAME_VALUES + 4 * ref}, code_[ref].type);
+  }
+}
+
+void TraceCompiler::exitOn(int condition, int snapshot, int address, bool entry)
+{
+  int exit = exits_.size();
+  const Snapshot& state = trace_.snapshots[snapshot];
+  exits_.push_back({traceIndex_, state.pc, address, entry, 0, HOT_EXIT});
+  stubs_.push_back({as_.jump(condition), &state, exit});
+}
+
+void TraceCompiler::writeBack(const vector<pair<int, int>>& cells)
+{
+  as_.emit(0, true, {0x8B}, RCX, indirect(RSP, FRAME_MEMORY));   // mov rcx, [memory]
+  as_.emit(0, true, {0x8B}, RDX, indirect(RSP, FRAME_STACK));    // mov rdx, [stack]
+  for (const pair<int, int>& cell : cells)
+  {
+    int base = isSlot(cell.first) ? RDX : RCX;
+    int offset = 12 * (isSlot(cell.first) ? -1 - cell.first : cell.first);
+    int ref = cell.second;
+    bool isFloat = code_[ref].type == TYPE_FLOAT;
+    as_.emit(0, false, {0xC6}, 0, indirect(base, offset));  // mov byte [tag], isFloat
+    as_.bytes({uint8_t(isFloat)});
+    Rm target = indirect(base, offset + (isFloat ? 8 : 4));
+    if (isConstant(ref))
+    {
+      uint32_t bits;
+      memcpy(&bits, &code_[ref].value.f, 4);
+      as_.emit(0, false, {0xC7}, 0, target);            // mov dword [value], imm
+      as_.dword(isFloat ? bits : uint32_t(code_[ref].value.i));
+    }
+    else if (places_[ref].kind == FRAME)
+    {
+      as_.emit(0, false, {0x8B}, RAX, at(ref));         // mov eax, [frame]
+      as_.emit(0, false, {0x89}, RAX, target);          // mov [value], eax
+    }
+    else if (isFloat)
+    {
+      as_.emit(0xF3, false, {0x0F, 0x11}, places_[ref].reg, target);  // movss [f], xmm
+    }
+    else
+    {
+      as_.emit(0, false, {0x89}, places_[ref].reg, target);   // mov [i], reg
+    }
+  }
+}
+
+void TraceCompiler::parallelMove()
+{
+  //Пересылки конечных значений ячеек в места значений при входе выполняются как одновременные:
+  //пересылка выполняется, когда ее цель больше никому не нужна как источник, а цикл пересылок
+  //разрывается копией во временный регистр
+  struct Move
+  {
+    Place target;
+    Place source;
+    int ref;
+  };
+  vector<Move> moves;
+  for (const Carried& carried : trace_.carried)
+  {
+    Place target = places_[carried.entry];
+    if (isConstant(carried.final) || !(places_[carried.final] == target))
+    {
+      moves.push_back({target, isConstant(carried.final) ? Place{NOWHERE, 0, 0} : places_[carried.final],
+                       carried.final});
+    }
+  }
+  while (!moves.empty())
+  {
+    bool progress = false;
+    for (size_t k = 0; k < moves.size() && !progress; ++k)
+    {
+      bool blocked = false;
+      for (size_t other = 0; other < moves.size(); ++other)
+      {
+        blocked |= other != k && moves[other].source == moves[k].target;
+      }
+      if (!blocked)
+      {
+        if (moves[k].source.kind == NOWHERE)
+        {
+          copyConstant(moves[k].target, code_[moves[k].ref].value);
+        }
+        else
+        {
+          copy(moves[k].target, moves[k].source, code_[moves[k].ref].type);
+        }
+        moves.erase(moves.begin() + k);
+        progress = true;
+      }
+    }
+    if (!progress)
+    {
+      Place busy = moves[0].target;
+      int type = TYPE_INT;
+      for (const Move& move : moves)
+      {
+        if (move.source == busy)
+        {
+          type = code_[move.ref].type;
+        }
+      }
+      Place temporary = type == TYPE_INT ? Place{GPR, RCX, 0} : Place{XMM, XMM15, 0};
+      copy(temporary, busy, type);
+      for (Move& move : moves)
+      {
+        if (move.source == busy)
+        {
+          move.source = temporary;
+        }
+      }
+    }
+  }
+}
+
+void TraceCompiler::tailJump()
+{
+  //Другая трасса получает те же аргументы, что и эта
+  as_.emit(0, true, {0x8B}, RDI, indirect(RSP, FRAME_CONTEXT));   // mov rdi, [context]
+  as_.emit(0, true, {0x8B}, RSI, indirect(RSP, FRAME_STACK));     // mov rsi, [stack]
+  as_.emit(0, true, {0x8B}, RDX, indirect(RSP, FRAME_MEMORY));    // mov rdx, [memory]
+  epilogue();
+  as_.bytes({0xFF, 0xE0});                              // jmp rax
+}
+
+void TraceCompiler::epilogue()
+{
+  as_.bytes({0x48, 0x81, 0xC4});                        // add rsp, frame
+  as_.dword(frameSize_);
+  as_.bytes({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B});  // pop r15 ... rbx
+}
+
+void TraceCompiler::compileInstruction(int index)
+{
+  const TraceInstruction& instruction = code_[index];
+  switch (instruction.opcode)
+  {
+  case IR_CONST:
+    break;
+
+  case IR_VARIABLE:
+  case IR_SLOT:
+    loadEntry(index);
+    break;
+
+  case IR_ADD:
+  case IR_SUB:
+  case IR_MUL:
+  case IR_NEG:
+  case IR_SHL:
+    integerArithmetic(index);
+    break;
+
+  case IR_DIV:
+  case IR_SHR:
+    integerDivision(index);
+    break;
+
+  case IR_FADD:
+  case IR_FSUB:
+  case IR_FMUL:
+  case IR_FDIV:
+  case IR_FNEG:
+  case IR_TOFLOAT:
+    floatArithmetic(index);
+    break;
+
+  case IR_COMPARE:
+  {
+    int condition = code_[instruction.a].type == TYPE_INT
+                    ? compareIntegers(instruction.arg, instruction.a, instruction.b)
+                    : compareFloats(instruction.arg, instruction.a, instruction.b);
+    if (condition >= 0)
+    {
+      as_.set(condition, RAX);                          // setcc al
+    }
+    as_.bytes({0x0F, 0xB6, 0xC0});                      // movzx eax, al
+    storeInteger(index, RAX);
+    break;
+  }
+
+  case IR_GUARD:
+    guard(index);
+    break;
+
+  case IR_INPUT:
+    call(index, reinterpret_cast<void*>(traceInput));
+    as_.bytes({0x84, 0xC0});                            // test al, al
+    exitOn(CC_E, instruction.snapshot, instruction.address, false);
+    as_.emit(0, true, {0x8B}, RAX, indirect(RSP, FRAME_CONTEXT));  // mov rax, [context]
+    as_.emit(0, false, {0x8B}, RAX, indirect(RAX, offsetof(Context, value)));  // mov eax, [rax + value]
+    storeInteger(index, RAX);
+    break;
+
+  case IR_PRINT:
+    call(index, code_[instruction.a].type == TYPE_INT ? reinterpret_cast<void*>(tracePrintInteger)
+                                                       : reinterpret_cast<void*>(tracePrintFloat));
+    break;
+  }
+}
+
+void TraceCompiler::compile(vector<uint8_t>& code)
+{
+  allocate();
+  trace_.firstExit = exits_.size();
+  bool loop = trace_.link < 0;
+
+  //Пролог: сохранение rbx, rbp, r12 - r15, кадр, адреса стека и памяти машины
+  as_.bytes({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+  as_.bytes({0x48, 0x81, 0xEC});                        // sub rsp, frame
+  as_.dword(frameSize_);
+  as_.emit(0, true, {0x89}, RDI, indirect(RSP, FRAME_CONTEXT));  // mov [context], rdi
+  as_.emit(0, true, {0x89}, RSI, indirect(RSP, FRAME_STACK));    // mov [stack], rsi
+  as_.emit(0, true, {0x89}, RDX, indirect(RSP, FRAME_MEMORY));   // mov [memory], rdx
+  as_.bytes({0x31, 0xED});                              // xor ebp, ebp
+  as_.move64(RAX, reinterpret_cast<uint64_t>(&counters_[traceIndex_].entries));
+  as_.bytes({0x48, 0xFF, 0x00});                        // inc qword [rax]
+  as_.bytes({0x48, 0x89, 0xF2});                        // mov rdx, rsi
+  as_.emit(0, true, {0x8B}, RCX, indirect(RSP, FRAME_MEMORY));   // mov rcx, [memory]
+
+  size_t top = 0;
+  for (int index = 0; index < int(code_.size()); ++index)
+  {
+    if (index == trace_.loopStart)
+    {
+      top = as_.size();
+    }
+    compileInstruction(index);
+  }
+  if (trace_.loopStart == int(code_.size()))
+  {
+    top = as_.size();
+  }
+
+  if (loop)
+  {
+    //Конец прохода: ячейки, которые только записываются, - в память, остальные - на места
+    //значений при входе
+    if (!trace_.stored.empty())
+    {
+      writeBack(trace_.stored);
+    }
+    parallelMove();
+    as_.bytes({0x48, 0xFF, 0xC5});                      // inc rbp
+    as_.bind(as_.jump(-1), top);
+  }
+  else
+  {
+    writeBack(trace_.final.cells);
+    as_.move64(RAX, reinterpret_cast<uint64_t>(linkSlot_));
+    as_.bytes({0x48, 0x8B, 0x00});                      // mov rax, [rax]
+    tailJump();
+  }
+
+  //Выходы: запись состояния, счетчики, переход в боковую трассу или возврат номера выхода
+  for (const Stub& stub : stubs_)
+  {
+    as_.bind(stub.jump);
+    writeBack(stub.snapshot->cells);
+    if (loop)
+    {
+      as_.move64(RAX, reinterpret_cast<uint64_t>(&counters_[traceIndex_].iterations));
+      as_.bytes({0x48, 0x01, 0x28});                    // add [rax], rbp
+    }
+    as_.move64(RAX, reinterpret_cast<uint64_t>(&slots_[stub.exit]));
+    as_.bytes({0x48, 0xFF, 0x40, 0x08});                // inc qword [rax + 8]
+    as_.bytes({0x48, 0x8B, 0x00});                      // mov rax, [rax]
+    as_.bytes({0x48, 0x85, 0xC0});                      // test rax, rax
+    int unlinked = as_.jump(CC_E);
+    tailJump();
+    as_.bind(unlinked);
+    as_.move(RAX, stub.exit);                           // mov eax, exit
+    returns_.push_back(as_.jump(-1));
+  }
+  for (int position : returns_)
+  {
+    as_.bind(position);
+  }
+  epilogue();
+  as_.bytes({0xC3});                                    // ret
+  trace_.exitCount = exits_.size() - trace_.firstExit;
+  code = as_.code;
+}
+
+#endif
+
+// Выполнение программы интерпретатором с записью и компиляцией трасс
+class Engine
+{
+public:
+  Engine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output), steps_(0),
+      slots_(new ExitSlot[MAX_EXITS]()), counters_(new TraceCounters[MAX_TRACES]())
+  {
+    context_.input = &input;
+    context_.output = &output;
+  }
+
+  ~Engine();
+
+  bool run(string& error);
+
+  void report(ostream& output) const;
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+private:
+  // Переход от адреса from к target: у начала цикла может начаться трасса или ее запись.
+  // Возвращает адрес, с которого продолжается интерпретация.
+  int arrive(int from, int target);
+
+  // Выполнение трассы; возвращает адрес, с которого продолжается интерпретация
+  int enter(int trace);
+
+  // Граница инструкций при записи: завершение трассы; возвращает трассу для входа или -1
+  int boundary(int address);
+
+  void startRecording(int pc, int parentExit);
+  void abortRecording(int address, const string& reason);
+
+  // Оптимизация, компиляция и установка записанной трассы; возвращает false при ошибке
+  bool install(Trace& trace, string& reason);
+
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  vector<Operation> operations_;
+  vector<int> firstOperation_;
+  vector<int> depth_;
+  vector<Value> memory_;
+  vector<Value> stack_;
+  vector<int> traceAt_;             // Трасса цикла с началом по адресу или -1
+  unique_ptr<void*[]> loopCode_;    // Код трассы цикла по адресу: через него переходят другие трассы
+  vector<int> hot_;
+  vector<int> attempts_;
+  vector<unique_ptr<Trace>> traces_;
+  vector<ExitInfo> exits_;
+  unique_ptr<Recorder> recorder_;
+  map<pair<int, string>, int> aborted_;   // Прерванные записи: адрес и причина
+  long long steps_;
+  unique_ptr<ExitSlot[]> slots_;
+  unique_ptr<TraceCounters[]> counters_;
+  Context context_;
+};
+
+Engine::~Engine()
+{
+#ifdef MILAN_JIT_X86_64
+  for (const unique_ptr<Trace>& trace : traces_)
+  {
+    munmap(trace->machineCode, trace->mappedSize);
+  }
+#endif
+}
+
+void Engine::startRecording(int pc, int parentExit)
+{
+  recorder_.reset(new Recorder(pc, depth_[pc], parentExit));
+}
+
+void Engine::abortRecording(int address, const string& reason)
+{
+  ++aborted_[{address, reason}];
+  if (recorder_->isRoot())
+  {
+    ++attempts_[recorder_->start()];
+  }
+  else
+  {
+    //Следующая попытка - после еще HOT_EXIT выходов
+    ExitInfo& exit = exits_[recorder_->parentExit()];
+    ++exit.attempts;
+    exit.nextAttempt = slots_[recorder_->parentExit()].count + HOT_EXIT;
+  }
+  recorder_.reset();
+}
+
+bool Engine::install(Trace& trace, string& reason)
+{
+#ifdef MILAN_JIT_X86_64
+  if (!optimizeTrace(trace, reason))
+  {
+    return false;
+  }
+  int index = traces_.size();
+  void** linkSlot = trace.link >= 0 ? &loopCode_[traces_[trace.link]->start] : nullptr;
+  vector<ExitInfo> exits = exits_;
+  vector<uint8_t> code;
+  TraceCompiler(trace, index, exits, slots_.get(), counters_.get(), linkSlot).compile(code);
+  if (exits.size() > size_t(MAX_EXITS))
+  {
+    reason = "too many exits";
+    return false;
+  }
+  //Код записывается в память, доступную для записи, и только затем делается исполняемым
+  void* region = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+  {
+    reason = "cannot allocate memory for machine code";
+    return false;
+  }
+  memcpy(region, code.data(), code.size());
+  if (mprotect(region, code.size(), PROT_READ | PROT_EXEC) != 0)
+  {
+    munmap(region, code.size());
+    reason = "cannot make machine code executable";
+    return false;
+  }
+  trace.machineCode = region;
+  trace.codeSize = code.size();
+  trace.mappedSize = code.size();
+  exits_ = exits;
+  traces_.emplace_back(new Trace(trace));
+  if (trace.parentExit >= 0)
+  {
+    slots_[trace.parentExit].link = region;
+  }
+  else
+  {
+    traceAt_[trace.start] = index;
+    loopCode_[trace.start] = region;
+  }
+  return true;
+#else
+  (void)trace;
+  reason = "machine code is not supported on this platform";
+  return false;
+#endif
+}
+
+int Engine::boundary(int address)
+{
+  if (recorder_->length() == 0)
+  {
+    return -1;
+  }
+  bool closes = recorder_->isRoot() && address == recorder_->start();
+  if (!closes && traceAt_[address] < 0)
+  {
+    return -1;
+  }
+  Trace& trace = closes ? recorder_->closeLoop() : recorder_->linkTo(traceAt_[address], address);
+  string reason;
+  if (!install(trace, reason))
+  {
+    abortRecording(recorder_->start(), reason);
+  }
+  recorder_.reset();
+  return traceAt_[address];
+}
+
+int Engine::enter(int trace)
+{
+#ifdef MILAN_JIT_X86_64
+  typedef int (*Entry)(Context* context, Value* stack, Value* memory);
+  int exit = reinterpret_cast<Entry>(traces_[trace]->machineCode)(&context_, stack_.data(), memory_.data());
+  ExitInfo& info = exits_[exit];
+  if (slots_[exit].link || slots_[exit].count < info.nextAttempt || info.attempts >= MAX_ATTEMPTS ||
+      traces_.size() >= size_t(MAX_TRACES))
+  {
+    return info.pc;
+  }
+  //Если выход из цикла происходит чаще, чем полный проход, трасса записала редкую ветвь: цикл
+  //записывается заново, а другие трассы переходят в старую, пока не готова новая
+  const Trace& parent = *traces_[info.trace];
+  if (parent.parentExit < 0 && parent.link < 0 && !info.entry && traceAt_[parent.start] == info.trace &&
+      slots_[exit].count > counters_[info.trace].iterations && attempts_[parent.start] < MAX_ATTEMPTS)
+  {
+    ++attempts_[parent.start];
+    traceAt_[parent.start] = -1;
+    hot_[parent.start] = 0;
+    info.attempts = MAX_ATTEMPTS;
+    return info.pc;
+  }
+  //Частый выход получает боковую трассу, которая начинается с его адреса
+  startRecording(info.pc, exit);
+  return info.pc;
+#else
+  (void)trace;
+  return 0;
+#endif
+}
+
+int Engine::arrive(int from, int target)
+{
+#ifdef MILAN_JIT_X86_64
+  if (target > from || recorder_)
+  {
+    return target;
+  }
+  int trace = traceAt_[target];
+  if (trace >= 0)
+  {
+    return enter(trace);
+  }
+  if (++hot_[target] >= HOT_LOOP && attempts_[target] < MAX_ATTEMPTS && traces_.size() < size_t(MAX_TRACES))
+  {
+    hot_[target] = 0;
+    startRecording(target, -1);
+  }
+#else
+  (void)from;
+#endif
+  return target;
+}
+
+bool Engine::run(string& error)
+{
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth_, maxDepth, memorySize, error))
+  {
+    return false;
+  }
+  splitProgram(program_, operations_, firstOperation_);
+  memory_.assign(memorySize, Value());
+  stack_.assign(maxDepth + 1, Value());
+  traceAt_.assign(program_.size(), -1);
+  loopCode_.reset(new void*[program_.size()]());
+  hot_.assign(program_.size(), 0);
+  attempts_.assign(program_.size(), 0);
+
+  auto fail = [&](int address, const string& message)
+  {
+    output_.flush();
+    error = "address " + to_string(address) + ": " + message;
+    return false;
+  };
+
+  size_t index = 0;
+  int sp = 0;
+  for (;;)
+  {
+    const Operation& operation = operations_[index];
+    if (operation.first)
+    {
+      ++steps_;
+      int trace = recorder_ ? boundary(operation.address) : -1;
+      if (trace >= 0)
+      {
+        int pc = enter(trace);
+        index = firstOperation_[pc];
+        sp = depth_[pc];
+        continue;
+      }
+    }
+    if (recorder_ && !recorder_->record(operation, stack_.data(), sp, memory_.data()))
+    {
+      abortRecording(operation.address, recorder_->reason());
+    }
+
+    Value* stack = stack_.data();
+    int target = -1;
+    switch (operation.instruction)
+    {
+    case NOP:
+      break;
+
+    case STOP:
+      output_.flush();
+      return true;
+
+    case LOAD:
+      stack[sp++] = memory_[operation.arg];
+      break;
+
+    case STORE:
+      memory_[operation.arg] = stack[--sp];
+      break;
+
+    case BLOAD:
+    case BSTORE:
+    {
+      const Value& offset = stack[--sp];
+      if (offset.isFloat)
+      {
+        return fail(operation.address, "float index");
+      }
+      int address = operation.arg + offset.i;
+      if (static_cast<unsigned int>(address) >= memory_.size())
+      {
+        if (address < 0 || address >= MEMORY_LIMIT)
+        {
+          return fail(operation.address, "invalid address " + to_string(address));
+        }
+        memory_.resize(address + 1);
+      }
+      if (operation.instruction == BLOAD)
+      {
+        stack[sp++] = memory_[address];
+      }
+      else
+      {
+        memory_[address] = stack[--sp];
+      }
+      break;
+    }
+
+    case PUSH:
+      stack[sp++] = operation.value;
+      break;
+
+    case POP:
+      --sp;
+      break;
+
+    case DUP:
+      stack[sp] = stack[sp - 1];
+      ++sp;
+      break;
+
+    case ADD:
+    case SUB:
+    case MULT:
+    case DIV:
+    {
+      Value result;
+      if (!evaluate(operation.instruction, stack[sp - 2], stack[sp - 1], result))
+      {
+        return fail(operation.address, "division by zero");
+      }
+      stack[sp - 2] = result;
+      --sp;
+      break;
+    }
+
+    case INVERT:
+      stack[sp - 1] = invert(stack[sp - 1]);
+      break;
+
+    case SHL:
+    case SHR:
+      stack[sp - 1] = shift(operation.instruction, stack[sp - 1], operation.arg);
+      break;
+
+    case COMPARE:
+      stack[sp - 2] = Value::fromInt(compare(operation.arg, stack[sp - 2], stack[sp - 1]) ? 1 : 0);
+      --sp;
+      break;
+
+    case JUMP:
+      target = operation.arg;
+      break;
+
+    case JUMP_YES:
+    case JUMP_NO:
+      if (stack[--sp].isTrue() == (operation.instruction == JUMP_YES))
+      {
+        target = operation.arg;
+      }
+      break;
+
+    case INPUT:
+    {
+      int number;
+      if (!readInt(input_, number))
+      {
+        return fail(operation.address, "invalid input");
+      }
+      stack[sp++] = Value::fromInt(number);
+      break;
+    }
+
+    case PRINT:
+    {
+      printValue(output_, stack[--sp]);
+      break;
+    }
+
+    default:
+      sp -= 2;
+      if (compare(jumpComparison(operation.instruction), stack[sp], stack[sp + 1]))
+      {
+        target = operation.arg;
+      }
+      break;
+    }
+
+    if (target >= 0)
+    {
+      int pc = arrive(operation.address, target);
+      index = firstOperation_[pc];
+      sp = depth_[pc];
+    }
+    else
+    {
+      ++index;
+    }
+  }
+}
+
+void Engine::report(ostream& output) const
+{
+  map<int, int> sideTraces;     // Выход -> боковая трасса
+  for (size_t index = 0; index < traces_.size(); ++index)
+  {
+    if (traces_[index]->parentExit >= 0)
+    {
+      sideTraces[traces_[index]->parentExit] = index;
+    }
+  }
+  output << "Traces: " << traces_.size() << endl;
+  for (size_t index = 0; index < traces_.size(); ++index)
+  {
+    const Trace& trace = *traces_[index];
+    output << "Trace " << index + 1 << ": ";
+    if (trace.parentExit < 0)
+    {
+      output << "loop at address " << trace.start;
+      if (traceAt_[trace.start] != int(index))
+      {
+        output << " (replaced)";
+      }
+    }
+    else
+    {
+      output << "side trace at address " << trace.start << " from exit " << trace.parentExit + 1 << " of trace "
+             << exits_[trace.parentExit].trace + 1;
+    }
+    if (trace.link >= 0)
+    {
+      output << ", continues in the loop at address " << traces_[trace.link]->start;
+    }
+    output << endl;
+    output << "  " << trace.recorded << " instructions recorded, " << trace.code.size() << " in trace ("
+           << trace.guards << " guards), " << trace.hoisted << " hoisted (" << trace.hoistedGuards << " guards)" << endl;
+    output << "  " << trace.registers << " registers, " << trace.spilled << " spilled, " << trace.codeSize
+           << " bytes of machine code" << endl;
+    output << "  entered " << counters_[index].entries << " times";
+    if (trace.link < 0)
+    {
+      output << ", " << counters_[index].iterations << " iterations";
+    }
+    output << endl;
+    for (int exit = trace.firstExit; exit < trace.firstExit + trace.exitCount; ++exit)
+    {
+      if (slots_[exit].count == 0)
+      {
+        continue;
+      }
+      const ExitInfo& info = exits_[exit];
+      output << "  exit " << exit + 1 << ": ";
+      if (info.entry)
+      {
+        output << "entry check";
+      }
+      else
+      {
+        output << "guard at address " << info.address;
+      }
+      output << " -> address " << info.pc << ", " << slots_[exit].count << " times";
+      auto side = sideTraces.find(exit);
+      if (side != sideTraces.end())
+      {
+        output << " (side trace " << side->second + 1 << ")";
+      }
+      output << endl;
+    }
+  }
+  if (!aborted_.empty())
+  {
+    output << "Aborted recordings:" << endl;
+    for (const auto& abort : aborted_)
+    {
+      output << "  address " << abort.first.first << ": " << abort.first.second << " (" << abort.second
+             << (abort.second == 1 ? " time)" : " times)") << endl;
+    }
+  }
+  output << "Interpreted instructions: " << steps_ << endl;
+}
+
+}
+
+bool TracingMachine::run()
+{
+  error_.clear();
+  Engine engine(program_, input_, output_);
+  bool ok = engine.run(error_);
+  ostringstream report;
+  engine.report(report);
+  report_ = report.str();
+  return ok;
+}
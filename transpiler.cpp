@@ -0,0 +1,1172 @@
+#include "transpiler.hpp"
+#include "typeinfer.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <set>
+
+namespace
+{
+
+// Начало программы: библиотека времени выполнения
+const char* const PRELUDE = R"(/* Generated by cmilan */
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Вещественная арифметика должна выполняться без совмещенного умножения-сложения
+   (GCC прагму не поддерживает, для него на процессорах с FMA нужен ключ -ffp-contract=off) */
+#ifndef __GNUC__
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__clang__)
+#pragma clang fp contract(off)
+#endif
+
+/* Значение, тип которого известен только во время выполнения */
+typedef struct
+{
+  int isFloat;
+  int32_t i;
+  float f;
+} milan_value;
+
+static inline void milan_fail(int address, const char* message)
+{
+  fflush(stdout);
+  fprintf(stderr, "Runtime error at address %d: %s\n", address, message);
+  exit(EXIT_FAILURE);
+}
+
+static inline int32_t milan_read(int address)
+{
+  long long value;
+  if (scanf("%lld", &value) != 1 || value < INT32_MIN || value > INT32_MAX)
+  {
+    milan_fail(address, "invalid input");
+  }
+  return (int32_t)value;
+}
+
+/* Кратчайшая запись, которая читается обратно без потерь, как std::to_chars */
+static inline void milan_format_float(float value, char* text)
+{
+  char buffer[32], digits[16];
+  int precision, count = 0, exponent, fixed, scientific, length = 0, i;
+  if (isnan(value) || isinf(value))
+  {
+    sprintf(text, "%s%s", signbit(value) ? "-" : "", isnan(value) ? "nan" : "inf");
+    return;
+  }
+  for (precision = 1; precision < 9; ++precision)
+  {
+    sprintf(buffer, "%.*e", precision - 1, value);
+    if (strtof(buffer, NULL) == value)
+    {
+      break;
+    }
+  }
+  sprintf(buffer, "%.*e", precision - 1, value);
+  for (i = buffer[0] == '-'; buffer[i] != 'e'; ++i)
+  {
+    if (buffer[i] != '.')
+    {
+      digits[count++] = buffer[i];
+    }
+  }
+  exponent = atoi(buffer + i + 1);
+  while (count > 1 && digits[count - 1] == '0')
+  {
+    --count;
+  }
+  /* Из записей %f и %e выбирается более короткая, при равной длине - %f */
+  scientific = count + (count > 1) + 2 + (abs(exponent) >= 100 ? 3 : 2);
+  fixed = exponent >= count - 1 ? exponent + 1 : exponent >= 0 ? count + 1 : count + 1 - exponent;
+  if (fixed <= scientific && exponent >= count - 1)
+  {
+    /* Целое число печатается точно, а не кратчайшими цифрами */
+    sprintf(text, "%.0f", value);
+    return;
+  }
+  if (buffer[0] == '-')
+  {
+    text[length++] = '-';
+  }
+  if (fixed <= scientific)
+  {
+    if (exponent < 0)
+    {
+      text[length++] = '0';
+      text[length++] = '.';
+      for (i = 0; i < -exponent - 1; ++i)
+      {
+        text[length++] = '0';
+      }
+    }
+    for (i = 0; i < count; ++i)
+    {
+      text[length++] = digits[i];
+      if (i == exponent && i + 1 < count)
+      {
+        text[length++] = '.';
+      }
+    }
+    text[length] = 0;
+    return;
+  }
+  text[length++] = digits[0];
+  if (count > 1)
+  {
+    text[length++] = '.';
+    memcpy(text + length, digits + 1, count - 1);
+    length += count - 1;
+  }
+  sprintf(text + length, "e%c%02d", exponent < 0 ? '-' : '+', abs(exponent));
+}
+
+static inline void milan_print_int(int32_t value)
+{
+  printf("%" PRId32 "\n", value);
+}
+
+static inline void milan_print_float(float value)
+{
+  char text[64];
+  milan_format_float(value, text);
+  printf(strpbrk(text, ".en") ? "%s\n" : "%s.0\n", text);
+}
+
+/* Целая арифметика по модулю 2^32 выполняется над беззнаковыми числами */
+static inline int32_t milan_add(int32_t a, int32_t b)
+{
+  return (int32_t)((uint32_t)a + (uint32_t)b);
+}
+
+static inline int32_t milan_sub(int32_t a, int32_t b)
+{
+  return (int32_t)((uint32_t)a - (uint32_t)b);
+}
+
+static inline int32_t milan_mul(int32_t a, int32_t b)
+{
+  return (int32_t)((uint32_t)a * (uint32_t)b);
+}
+
+static inline int32_t milan_neg(int32_t a)
+{
+  return (int32_t)(0u - (uint32_t)a);
+}
+
+static inline int32_t milan_shl(int32_t a, int bits)
+{
+  return (int32_t)((uint32_t)a << bits);
+}
+
+static inline int32_t milan_div(int32_t a, int32_t b, int address)
+{
+  if (b == 0)
+  {
+    milan_fail(address, "division by zero");
+  }
+  return b == -1 ? milan_neg(a) : a / b;
+}
+
+/* Смена знака через двоичное представление: иначе компилятор вправе заменить a + -b на a - b,
+   и знак NaN в результате (его печатает milanvm) будет другим */
+static inline float milan_fneg(float a)
+{
+  uint32_t bits;
+  memcpy(&bits, &a, sizeof bits);
+  bits ^= UINT32_C(0x80000000);
+  memcpy(&a, &bits, sizeof a);
+  return a;
+}
+
+/* Сложение и умножение: из двух NaN процессор x86 возвращает первый операнд, как в milanvm,
+   а порядок операндов коммутативной операции выбирает компилятор C, поэтому NaN результата
+   выбирается явно */
+static inline float milan_fnan(float result, float a, float b)
+{
+  return result == result ? result : a != a ? a : b != b ? b : result;
+}
+
+static inline float milan_fadd(float a, float b)
+{
+  return milan_fnan(a + b, a, b);
+}
+
+static inline float milan_fmul(float a, float b)
+{
+  return milan_fnan(a * b, a, b);
+}
+
+static inline float milan_fdiv(float a, float b, int address)
+{
+  if (b == 0)
+  {
+    milan_fail(address, "division by zero");
+  }
+  return a / b;
+}
+
+static inline milan_value milan_int(int32_t i)
+{
+  milan_value value = {0, i, 0.0f};
+  return value;
+}
+
+static inline milan_value milan_float(float f)
+{
+  milan_value value = {1, 0, f};
+  return value;
+}
+
+static inline float milan_to_float(milan_value value)
+{
+  return value.isFloat ? value.f : (float)value.i;
+}
+
+static inline void milan_print(milan_value value)
+{
+  if (value.isFloat)
+  {
+    milan_print_float(value.f);
+  }
+  else
+  {
+    milan_print_int(value.i);
+  }
+}
+
+/* Операция op ('+', '-', '*', '/'): вещественная, если вещественный хотя бы один операнд */
+static inline milan_value milan_arith(char op, milan_value a, milan_value b, int address)
+{
+  if (a.isFloat || b.isFloat)
+  {
+    float x = milan_to_float(a), y = milan_to_float(b);
+    return milan_float(op == '+' ? milan_fadd(x, y) : op == '-' ? x - y : op == '*' ? milan_fmul(x, y)
+                       : milan_fdiv(x, y, address));
+  }
+  return milan_int(op == '+' ? milan_add(a.i, b.i) : op == '-' ? milan_sub(a.i, b.i)
+                   : op == '*' ? milan_mul(a.i, b.i) : milan_div(a.i, b.i, address));
+}
+
+static inline milan_value milan_invert(milan_value a)
+{
+  return a.isFloat ? milan_float(milan_fneg(a.f)) : milan_int(milan_neg(a.i));
+}
+
+/* Сдвиг op ('<' - умножение, '>' - деление на 2^bits с округлением к нулю) */
+static inline milan_value milan_shift(char op, milan_value a, int bits)
+{
+  if (a.isFloat)
+  {
+    return milan_float(op == '<' ? a.f * (float)(1 << bits) : a.f / (float)(1 << bits));
+  }
+  return milan_int(op == '<' ? milan_shl(a.i, bits) : a.i / (1 << bits));
+}
+
+/* Сравнение с кодом cmp инструкции COMPARE: 0 "=", 1 "!=", 2 "<", 3 ">", 4 "<=", 5 ">=" */
+static inline int milan_compare(int cmp, milan_value a, milan_value b)
+{
+  if (a.isFloat || b.isFloat)
+  {
+    float x = milan_to_float(a), y = milan_to_float(b);
+    return cmp == 0 ? x == y : cmp == 1 ? x != y : cmp == 2 ? x < y : cmp == 3 ? x > y : cmp == 4 ? x <= y : x >= y;
+  }
+  return cmp == 0 ? a.i == b.i : cmp == 1 ? a.i != b.i : cmp == 2 ? a.i < b.i
+         : cmp == 3 ? a.i > b.i : cmp == 4 ? a.i <= b.i : a.i >= b.i;
+}
+
+static inline int milan_true(milan_value a)
+{
+  return a.isFloat ? a.f != 0 : a.i != 0;
+}
+
+)";
+
+// Операции сравнения C по кодам COMPARE и противоположные им для целых чисел
+const char* const COMPARISONS[] = {" == ", " != ", " < ", " > ", " <= ", " >= "};
+const char* const NEGATIONS[] = {" != ", " == ", " >= ", " <= ", " > ", " < "};
+
+// Слова языка C и имена из стандартных заголовков, которые нельзя использовать для переменных
+const set<string> RESERVED = {
+  "auto", "break", "case", "char", "const", "continue", "default", "do", "double", "else", "enum",
+  "extern", "float", "for", "goto", "if", "inline", "int", "long", "register", "restrict", "return",
+  "short", "signed", "sizeof", "static", "struct", "switch", "typedef", "union", "unsigned", "void",
+  "volatile", "while", "bool", "true", "false", "nullptr", "constexpr", "typeof", "alignas", "alignof",
+  "main", "EOF", "NULL", "BUFSIZ", "FILE", "stdin", "stdout", "stderr", "errno", "NAN", "INFINITY"
+};
+
+// Выражение C со значением слова стека
+struct Expression
+{
+  string text;
+  int type;                 // TYPE_INT, TYPE_FLOAT или TYPE_ANY
+  bool compound;            // Выражение с операцией: в операнде нужны скобки
+  bool constant;            // Константа value
+  Value value;
+  vector<int> variables;    // Переменные, значения которых читает выражение
+};
+
+// Условие перехода и его отрицание
+struct Condition
+{
+  string text;
+  string negated;
+};
+
+// Цикл, внутри которого порождается код
+struct LoopContext
+{
+  int header;               // Номер составляющей - начала цикла
+  int exit;                 // Номер составляющей, следующей за циклом (цель break)
+  bool canContinue;         // Переход к началу можно записать оператором continue
+};
+
+// Строка тела main: оператор с отступом или возможное место метки
+struct Line
+{
+  int indent;
+  string text;
+  int label;                // Адрес инструкции для метки, -1 для оператора
+};
+
+class Translator
+{
+public:
+  Translator(const vector<Command>& program, const vector<string>& names, ostream& output)
+    : program_(program), names_(names), output_(output), indent_(1)
+  {}
+
+  bool translate(string& error);
+
+private:
+  // Порождение операторов для составляющих from ... to - 1. follow - составляющая, к которой
+  // переходит управление после последней (переход к ней в конце участка не нужен).
+  void region(int from, int to, int follow);
+
+  // Цикл с началом header и переходом назад в составляющей last
+  void loop(int header, int last);
+
+  // Переход в составляющей index; возвращает номер составляющей, с которой продолжается участок
+  int jump(int index, int to, int follow);
+
+  // Последний переход назад к составляющей index внутри участка (до to) или -1
+  int backJump(int index, int to);
+
+  // Оператор передачи управления составляющей target: break, continue или goto
+  string transfer(int target);
+
+  void statement(const Operation& operation);
+  // Условие перехода или COMPARE; операнды снимаются со стека. Перед переходом (jumping)
+  // операнды при необходимости вычисляются заранее, чтобы flush их не изменил.
+  Condition condition(const Operation& operation, bool jumping);
+  Expression arithmetic(Instruction instruction, const Expression& a, const Expression& b, int address);
+
+  // Стек выражений
+  void push(const Expression& expression)
+  {
+    stack_.push_back(expression);
+  }
+
+  Expression pop()
+  {
+    Expression top = stack_.back();
+    stack_.pop_back();
+    return top;
+  }
+
+  // Запись слов стека в переменные s_N перед переходом или меткой
+  void flush();
+
+  // Стек из переменных s_N перед составляющей index
+  void reset(size_t index);
+
+  // Вычисление выражения в новую временную переменную t_N
+  Expression temporary(const string& text, int type);
+
+  // Вычисление слова стека position во временную переменную
+  void materialize(size_t position);
+
+  Expression slotExpression(int position);
+  Expression variableExpression(int address);
+  Expression constantExpression(const Value& value);
+
+  // Текст выражения в роли операнда и преобразования типа
+  static string operand(const Expression& expression);
+  static string asFloat(const Expression& expression);
+  static string asValue(const Expression& expression);
+  static string convert(const Expression& expression, int type);
+  static string typeName(int type);
+
+  string variableName(int address) const;
+
+  static string slotName(int position)
+  {
+    return "s_" + to_string(position);
+  }
+
+  void line(const string& text)
+  {
+    lines_.push_back({indent_, text, -1});
+  }
+
+  void open()
+  {
+    line("{");
+    ++indent_;
+  }
+
+  void close()
+  {
+    --indent_;
+    line("}");
+  }
+
+  // Место метки перед составляющей index (метка печатается, если на нее есть goto)
+  void label(int index);
+
+  const vector<Command>& program_;
+  const vector<string>& names_;
+  ostream& output_;
+  vector<Operation> operations_;
+  vector<int> firstOperation_;
+  vector<TypeState> states_;
+  vector<int> jumpTarget_;            // Номер составляющей - цели перехода или -1
+  vector<bool> isTarget_;             // На составляющую есть переход
+  vector<bool> labelled_;
+  vector<int> variableTypes_;         // Тип переменной (0 - не используется)
+  vector<int> slotTypes_;             // Тип переменной s_N
+  vector<bool> slotUsed_;
+  vector<int> temporaryTypes_;
+  vector<Expression> stack_;
+  vector<LoopContext> loops_;
+  set<int> gotos_;                    // Адреса инструкций, на которые есть goto
+  vector<Line> lines_;
+  int indent_;
+};
+
+string Translator::variableName(int address) const
+{
+  if (address >= int(names_.size()) || names_[address].empty())
+  {
+    return "m_" + to_string(address);
+  }
+  const string& name = names_[address];
+  //Имена Милана не содержат "_", поэтому добавленный символ не приводит к совпадениям.
+  //Макросы PRI... и SCN... определены в inttypes.h.
+  bool reserved = RESERVED.count(name) || name.compare(0, 3, "PRI") == 0 || name.compare(0, 3, "SCN") == 0;
+  return reserved ? name + "_" : name;
+}
+
+string Translator::typeName(int type)
+{
+  return type == TYPE_INT ? "int32_t" : type == TYPE_FLOAT ? "float" : "milan_value";
+}
+
+string Translator::operand(const Expression& expression)
+{
+  return expression.compound ? "(" + expression.text + ")" : expression.text;
+}
+
+string Translator::asFloat(const Expression& expression)
+{
+  if (expression.type == TYPE_FLOAT)
+  {
+    return operand(expression);
+  }
+  if (expression.type == TYPE_ANY)
+  {
+    return "milan_to_float(" + expression.text + ")";
+  }
+  if (expression.constant)
+  {
+    float value = static_cast<float>(expression.value.i);
+    return formatFloat(value) + "f";
+  }
+  return "(float)" + operand(expression);
+}
+
+string Translator::asValue(const Expression& expression)
+{
+  if (expression.type == TYPE_ANY)
+  {
+    return expression.text;
+  }
+  return (expression.type == TYPE_INT ? "milan_int(" : "milan_float(") + expression.text + ")";
+}
+
+string Translator::convert(const Expression& expression, int type)
+{
+  if (expression.type == type)
+  {
+    return expression.text;
+  }
+  if (type == TYPE_ANY)
+  {
+    return asValue(expression);
+  }
+  //Анализ типов гарантирует, что значение неизвестного типа здесь имеет тип type
+  if (expression.type == TYPE_ANY)
+  {
+    return operand(expression) + (type == TYPE_INT ? ".i" : ".f");
+  }
+  return type == TYPE_FLOAT ? asFloat(expression) : "(int32_t)" + operand(expression);
+}
+
+Expression Translator::slotExpression(int position)
+{
+  slotUsed_[position] = true;
+  return {slotName(position), slotTypes_[position], false, false, Value(), {}};
+}
+
+Expression Translator::variableExpression(int address)
+{
+  return {variableName(address), variableTypes_[address], false, false, Value(), {address}};
+}
+
+Expression Translator::constantExpression(const Value& value)
+{
+  string text;
+  if (!value.isFloat)
+  {
+    //Наименьшее целое нельзя записать литералом типа int
+    text = value.i == INT32_MIN ? "(-2147483647 - 1)" : to_string(value.i);
+  }
+  else if (std::isnan(value.f))
+  {
+    text = std::signbit(value.f) ? "(-NAN)" : "NAN";
+  }
+  else if (std::isinf(value.f))
+  {
+    text = value.f < 0 ? "(-INFINITY)" : "INFINITY";
+  }
+  else
+  {
+    text = formatFloat(value.f) + "f";
+  }
+  //Отрицательная константа в операнде берется в скобки, чтобы не получить "--"
+  return {text, value.isFloat ? TYPE_FLOAT : TYPE_INT, text[0] == '-', true, value, {}};
+}
+
+Expression Translator::temporary(const string& text, int type)
+{
+  temporaryTypes_.push_back(type);
+  string name = "t_" + to_string(temporaryTypes_.size());
+  line(name + " = " + text + ";");
+  return {name, type, false, false, Value(), {}};
+}
+
+void Translator::materialize(size_t position)
+{
+  Expression& expression = stack_[position];
+  expression = temporary(expression.text, expression.type);
+}
+
+void Translator::flush()
+{
+  //Выражение слова может читать переменные s_N только более глубоких слов, поэтому
+  //запись идет от вершины к дну
+  for (size_t position = stack_.size(); position-- > 0;)
+  {
+    if (stack_[position].text != slotName(position))
+    {
+      Expression slot = slotExpression(position);
+      line(slot.text + " = " + convert(stack_[position], slot.type) + ";");
+      stack_[position] = slot;
+    }
+  }
+}
+
+void Translator::reset(size_t index)
+{
+  stack_.clear();
+  if (index < operations_.size() && states_[index].reached)
+  {
+    for (size_t position = 0; position < states_[index].stack.size(); ++position)
+    {
+      stack_.push_back(slotExpression(position));
+    }
+  }
+}
+
+void Translator::label(int index)
+{
+  if (!labelled_[index])
+  {
+    labelled_[index] = true;
+    lines_.push_back({indent_, "", operations_[index].address});
+  }
+}
+
+Expression Translator::arithmetic(Instruction instruction, const Expression& a, const Expression& b, int address)
+{
+  int type = (a.type == TYPE_INT && b.type == TYPE_INT) ? TYPE_INT
+             : (a.type == TYPE_FLOAT || b.type == TYPE_FLOAT) ? TYPE_FLOAT : TYPE_ANY;
+  vector<int> variables = a.variables;
+  variables.insert(variables.end(), b.variables.begin(), b.variables.end());
+  string where = ", " + to_string(address) + ")";
+  Expression result = {"", type, false, false, Value(), variables};
+
+  if (type == TYPE_INT)
+  {
+    if (instruction == DIV)
+    {
+      //Деление на константу, отличную от 0 и -1, не может завершиться ошибкой
+      if (b.constant && b.value.i != 0 && b.value.i != -1)
+      {
+        result.text = operand(a) + " / " + operand(b);
+        result.compound = true;
+        return result;
+      }
+      return temporary("milan_div(" + a.text + ", " + b.text + where, TYPE_INT);
+    }
+    const char* name = instruction == ADD ? "milan_add(" : instruction == SUB ? "milan_sub(" : "milan_mul(";
+    result.text = name + a.text + ", " + b.text + ")";
+    return result;
+  }
+
+  if (type == TYPE_FLOAT)
+  {
+    string x = asFloat(a);
+    string y = asFloat(b);
+    if (instruction == DIV)
+    {
+      bool nonZero = b.constant && (b.value.isFloat ? b.value.f != 0 : b.value.i != 0);
+      if (!nonZero)
+      {
+        return temporary("milan_fdiv(" + x + ", " + y + where, TYPE_FLOAT);
+      }
+    }
+    if (instruction == ADD || instruction == MULT)
+    {
+      result.text = (instruction == ADD ? "milan_fadd(" : "milan_fmul(") + x + ", " + y + ")";
+      return result;
+    }
+    result.text = x + (instruction == SUB ? " - " : " / ") + y;
+    result.compound = true;
+    return result;
+  }
+
+  const char* op = instruction == ADD ? "'+'" : instruction == SUB ? "'-'" : instruction == MULT ? "'*'" : "'/'";
+  string text = string("milan_arith(") + op + ", " + asValue(a) + ", " + asValue(b) + where;
+  if (instruction == DIV)
+  {
+    return temporary(text, TYPE_ANY);
+  }
+  result.text = text;
+  return result;
+}
+
+Condition Translator::condition(const Operation& operation, bool jumping)
+{
+  int operands = operation.instruction == JUMP_YES || operation.instruction == JUMP_NO ? 1 : 2;
+  //Перед переходом слова стека записываются в s_N; если при этом меняются переменные,
+  //которые могут читать операнды условия, операнды вычисляются заранее
+  size_t base = stack_.size() - operands;
+  bool changes = false;
+  for (size_t position = 0; jumping && position < base; ++position)
+  {
+    changes |= stack_[position].text != slotName(position);
+  }
+  if (changes)
+  {
+    for (size_t position = base; position < stack_.size(); ++position)
+    {
+      materialize(position);
+    }
+  }
+
+  if (operands == 1)
+  {
+    Expression value = pop();
+    bool onTrue = operation.instruction == JUMP_YES;
+    if (value.type == TYPE_ANY)
+    {
+      string test = "milan_true(" + value.text + ")";
+      return onTrue ? Condition{test, "!" + test} : Condition{"!" + test, test};
+    }
+    string isTrue = operand(value) + " != 0";
+    string isFalse = operand(value) + " == 0";
+    return onTrue ? Condition{isTrue, isFalse} : Condition{isFalse, isTrue};
+  }
+
+  Expression b = pop();
+  Expression a = pop();
+  int cmp = operation.instruction == COMPARE ? operation.arg : jumpComparison(operation.instruction);
+  if (a.type == TYPE_INT && b.type == TYPE_INT)
+  {
+    return {operand(a) + COMPARISONS[cmp] + operand(b), operand(a) + NEGATIONS[cmp] + operand(b)};
+  }
+  if (a.type == TYPE_FLOAT || b.type == TYPE_FLOAT)
+  {
+    //Для вещественных чисел (NaN) отрицание сравнения не равно обратному сравнению
+    string text = asFloat(a) + COMPARISONS[cmp] + asFloat(b);
+    return {text, "!(" + text + ")"};
+  }
+  string text = "milan_compare(" + to_string(cmp) + ", " + asValue(a) + ", " + asValue(b) + ")";
+  return {text, "!" + text};
+}
+
+void Translator::statement(const Operation& operation)
+{
+  switch (operation.instruction)
+  {
+  case NOP:
+    break;
+
+  case STOP:
+    line("return 0;");
+    stack_.clear();
+    break;
+
+  case LOAD:
+    push(variableExpression(operation.arg));
+    break;
+
+  case STORE:
+  {
+    Expression value = pop();
+    if (value.text == variableName(operation.arg))
+    {
+      break;
+    }
+    //Выражения в стеке, которые читают переменную, вычисляются до записи в нее
+    for (size_t position = 0; position < stack_.size(); ++position)
+    {
+      const vector<int>& variables = stack_[position].variables;
+      if (find(variables.begin(), variables.end(), operation.arg) != variables.end())
+      {
+        materialize(position);
+      }
+    }
+    line(variableName(operation.arg) + " = " + convert(value, variableTypes_[operation.arg]) + ";");
+    break;
+  }
+
+  case PUSH:
+    push(constantExpression(operation.value));
+    break;
+
+  case POP:
+    pop();
+    break;
+
+  case DUP:
+    if (stack_.back().compound)
+    {
+      materialize(stack_.size() - 1);
+    }
+    push(stack_.back());
+    break;
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  {
+    Expression b = pop();
+    Expression a = pop();
+    push(arithmetic(operation.instruction, a, b, operation.address));
+    break;
+  }
+
+  case INVERT:
+  {
+    Expression a = pop();
+    Expression result = a;
+    result.constant = false;
+    if (a.type == TYPE_INT)
+    {
+      result.text = "milan_neg(" + a.text + ")";
+      result.compound = false;
+    }
+    else if (a.type == TYPE_FLOAT)
+    {
+      result.text = "milan_fneg(" + a.text + ")";
+      result.compound = false;
+    }
+    else
+    {
+      result.text = "milan_invert(" + a.text + ")";
+      result.compound = false;
+    }
+    push(result);
+    break;
+  }
+
+  case SHL:
+  case SHR:
+  {
+    Expression a = pop();
+    Expression result = a;
+    result.constant = false;
+    result.compound = a.type == TYPE_FLOAT || (a.type == TYPE_INT && operation.instruction == SHR);
+    string scale = to_string(1 << operation.arg);
+    if (a.type == TYPE_INT)
+    {
+      //Сдвиг вправо делит с округлением к нулю, как деление в C
+      result.text = operation.instruction == SHL ? "milan_shl(" + a.text + ", " + to_string(operation.arg) + ")"
+                                                 : operand(a) + " / " + scale;
+    }
+    else if (a.type == TYPE_FLOAT)
+    {
+      result.text = operand(a) + (operation.instruction == SHL ? " * " : " / ") + scale + ".0f";
+    }
+    else
+    {
+      result.text = string("milan_shift(") + (operation.instruction == SHL ? "'<'" : "'>'") + ", " + a.text +
+                    ", " + to_string(operation.arg) + ")";
+    }
+    push(result);
+    break;
+  }
+
+  case COMPARE:
+  {
+    vector<int> variables = stack_[stack_.size() - 2].variables;
+    variables.insert(variables.end(), stack_.back().variables.begin(), stack_.back().variables.end());
+    Condition test = condition(operation, false);
+    push({test.text, TYPE_INT, true, false, Value(), variables});
+    break;
+  }
+
+  case INPUT:
+    push(temporary("milan_read(" + to_string(operation.address) + ")", TYPE_INT));
+    break;
+
+  case PRINT:
+  {
+    Expression value = pop();
+    const char* name = value.type == TYPE_INT ? "milan_print_int(" : value.type == TYPE_FLOAT ? "milan_print_float("
+                                                                                               : "milan_print(";
+    line(name + value.text + ");");
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+string Translator::transfer(int target)
+{
+  if (!loops_.empty() && target == loops_.back().exit)
+  {
+    return "break;";
+  }
+  if (!loops_.empty() && loops_.back().canContinue && target == loops_.back().header)
+  {
+    return "continue;";
+  }
+  gotos_.insert(operations_[target].address);
+  return "goto L" + to_string(operations_[target].address) + ";";
+}
+
+int Translator::backJump(int index, int to)
+{
+  if (!loops_.empty() && loops_.back().header == index)
+  {
+    return -1;
+  }
+  int last = -1;
+  for (int source = index; source < to; ++source)
+  {
+    if (states_[source].reached && jumpTarget_[source] == index)
+    {
+      last = source;
+    }
+  }
+  return last;
+}
+
+void Translator::loop(int header, int last)
+{
+  const Operation& tail = operations_[last];
+  bool conditional = tail.instruction != JUMP;
+  bool inner = false;
+  for (int source = header; source < last; ++source)
+  {
+    inner |= states_[source].reached && jumpTarget_[source] == header;
+  }
+
+  //Перевернутый цикл WHILE: переход назад только в конце тела. В do ... while оператор
+  //continue перешел бы к проверке условия, поэтому другие переходы к началу требуют for (;;)
+  if (conditional && !inner)
+  {
+    line("do");
+    open();
+    loops_.push_back({header, last + 1, false});
+    region(header, last, last);
+    if (isTarget_[last])
+    {
+      flush();
+      label(last);
+      reset(last);
+    }
+    Condition test = condition(tail, true);
+    flush();
+    loops_.pop_back();
+    close();
+    line("while (" + test.text + ");");
+  }
+  else
+  {
+    line("for (;;)");
+    open();
+    loops_.push_back({header, last + 1, true});
+    region(header, last, conditional ? last : header);
+    if (isTarget_[last])
+    {
+      flush();
+      label(last);
+      reset(last);
+    }
+    if (conditional)
+    {
+      Condition test = condition(tail, true);
+      flush();
+      line("if (" + test.negated + ")");
+      line("  break;");
+    }
+    else
+    {
+      flush();
+    }
+    loops_.pop_back();
+    close();
+  }
+  reset(last + 1);
+}
+
+int Translator::jump(int index, int to, int follow)
+{
+  const Operation& operation = operations_[index];
+  int target = jumpTarget_[index];
+  if (operation.instruction == JUMP)
+  {
+    flush();
+    if (!(target == follow && index + 1 == to))
+    {
+      line(transfer(target));
+    }
+    return index + 1;
+  }
+
+  Condition test = condition(operation, true);
+  flush();
+
+  //Условный переход вперед внутри участка: if или if ... else
+  if (target > index && target <= to)
+  {
+    if (target == index + 1)
+    {
+      return target;
+    }
+    const Operation& last = operations_[target - 1];
+    int end = -1;
+    if (target - 1 > index && states_[target - 1].reached && last.instruction == JUMP)
+    {
+      end = jumpTarget_[target - 1];
+    }
+    if (end > target && (end <= to || end == follow))
+    {
+      int elseEnd = min(end, to);
+      line("if (" + test.negated + ")");
+      open();
+      size_t start = lines_.size();
+      region(index + 1, target, end);
+      bool empty = lines_.size() == start;
+      close();
+      if (empty)
+      {
+        //Пустая ветвь then: условие меняется на прямое
+        lines_.resize(start - 2);
+        line("if (" + test.text + ")");
+        open();
+      }
+      else
+      {
+        line("else");
+        open();
+      }
+      region(target, elseEnd, end);
+      //Ветвь заканчивается переходом к следующей инструкции, где сливаются несколько путей
+      flush();
+      close();
+      reset(elseEnd);
+      return elseEnd;
+    }
+    line("if (" + test.negated + ")");
+    open();
+    region(index + 1, target, target);
+    flush();
+    close();
+    reset(target);
+    return target;
+  }
+
+  if (!(target == follow && index + 1 == to))
+  {
+    line("if (" + test.text + ")");
+    line("  " + transfer(target));
+  }
+  return index + 1;
+}
+
+void Translator::region(int from, int to, int follow)
+{
+  int index = from;
+  while (index < to)
+  {
+    if (isTarget_[index])
+    {
+      flush();
+      label(index);
+      reset(index);
+    }
+    if (!states_[index].reached)
+    {
+      ++index;
+      continue;
+    }
+    int last = backJump(index, to);
+    if (last >= 0)
+    {
+      loop(index, last);
+      index = last + 1;
+      continue;
+    }
+    const Operation& operation = operations_[index];
+    if (isJump(operation.instruction))
+    {
+      index = jump(index, to, follow);
+      continue;
+    }
+    statement(operation);
+    ++index;
+  }
+}
+
+bool Translator::translate(string& error)
+{
+  vector<int> depth;
+  int maxDepth, memorySize;
+  if (!verifyProgram(program_, depth, maxDepth, memorySize, error))
+  {
+    return false;
+  }
+  splitProgram(program_, operations_, firstOperation_);
+  states_ = inferTypes(operations_, firstOperation_, memorySize);
+
+  size_t count = operations_.size();
+  jumpTarget_.assign(count, -1);
+  isTarget_.assign(count, false);
+  labelled_.assign(count, false);
+  variableTypes_.assign(memorySize, 0);
+  slotTypes_.assign(maxDepth + 1, 0);
+  slotUsed_.assign(maxDepth + 1, false);
+  for (size_t index = 0; index < count; ++index)
+  {
+    const Operation& operation = operations_[index];
+    const TypeState& state = states_[index];
+    if (!state.reached)
+    {
+      continue;
+    }
+    if (operation.instruction == BLOAD || operation.instruction == BSTORE)
+    {
+      error = "address " + to_string(operation.address) + ": indexed memory access is not supported";
+      return false;
+    }
+    if (isJump(operation.instruction))
+    {
+      jumpTarget_[index] = firstOperation_[operation.arg];
+      isTarget_[jumpTarget_[index]] = true;
+    }
+    //Тип переменной C объединяет типы всех записываемых в нее и читаемых из нее значений
+    if (operation.instruction == LOAD)
+    {
+      variableTypes_[operation.arg] |= state.memory[operation.arg];
+    }
+    if (operation.instruction == STORE)
+    {
+      variableTypes_[operation.arg] |= state.stack.back();
+    }
+    for (size_t position = 0; position < state.stack.size(); ++position)
+    {
+      slotTypes_[position] |= state.stack[position];
+    }
+  }
+
+  region(0, count, -1);
+
+  //Переменные, значения которых только читаются в отброшенных POP выражениях, не объявляются
+  set<string> names;
+  for (const Line& current : lines_)
+  {
+    string name;
+    for (char c : current.text + ' ')
+    {
+      if (isalnum(static_cast<unsigned char>(c)) || c == '_')
+      {
+        name += c;
+      }
+      else if (!name.empty())
+      {
+        names.insert(name);
+        name.clear();
+      }
+    }
+  }
+
+  output_ << PRELUDE << "int main(void)\n{\n";
+  for (int address = 0; address < memorySize; ++address)
+  {
+    int type = variableTypes_[address];
+    if (type != 0 && names.count(variableName(address)))
+    {
+      const char* zero = type == TYPE_INT ? "0" : type == TYPE_FLOAT ? "0.0f" : "{0, 0, 0.0f}";
+      output_ << "  " << typeName(type) << ' ' << variableName(address) << " = " << zero << ";\n";
+    }
+  }
+  for (size_t position = 0; position < slotUsed_.size(); ++position)
+  {
+    if (slotUsed_[position])
+    {
+      output_ << "  " << typeName(slotTypes_[position]) << ' ' << slotName(position) << ";\n";
+    }
+  }
+  for (size_t index = 0; index < temporaryTypes_.size(); ++index)
+  {
+    output_ << "  " << typeName(temporaryTypes_[index]) << " t_" << index + 1 << ";\n";
+  }
+  output_ << '\n';
+  for (const Line& current : lines_)
+  {
+    if (current.label >= 0)
+    {
+      //Метка может стоять в конце блока, поэтому за ней следует пустой оператор
+      if (gotos_.count(current.label))
+      {
+        output_ << string(2 * (current.indent - 1), ' ') << 'L' << current.label << ":;\n";
+      }
+      continue;
+    }
+    output_ << string(2 * current.indent, ' ') << current.text << '\n';
+  }
+  output_ << "}\n";
+  return true;
+}
+
+}
+
+bool emitC(const vector<Command>& program, const vector<string>& variableNames, ostream& output, string& error)
+{
+  Translator translator(program, variableNames, output);
+  return translator.translate(error);
+}
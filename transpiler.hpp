@@ -0,0 +1,40 @@
+#ifndef CMILAN_TRANSPILER_HPP
+#define CMILAN_TRANSPILER_HPP
+
+#include "codegen.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Перевод программы в переносимую программу на C (C99), которую можно собрать любым
+// компилятором C с его оптимизатором.
+//
+// Переменные программы становятся локальными переменными функции main с именами из
+// исходного текста. Тип переменной определяется анализом типов (typeinfer.hpp): int32_t,
+// float или, если тип известен только во время выполнения, структура с признаком типа.
+// Вычисления на стеке собираются в выражения C; слова стека, которые переходят через
+// границы линейных участков, хранятся в переменных s_N.
+//
+// Переходы восстанавливаются в структурные операторы: условный переход вперед - if или
+// if ... else, переход назад - цикл do ... while (перевернутый цикл WHILE) или for (;;),
+// выходы из цикла - break и continue. Переходы, не укладывающиеся в эту схему, остаются
+// операторами goto, поэтому перевести можно любую программу, прошедшую verifyProgram.
+//
+// Семантика совпадает с виртуальной машиной milanvm: целая арифметика по модулю 2^32
+// (без неопределенного поведения C), вещественная - в float, деление на ноль и неверный
+// ввод - ошибки времени выполнения с тем же сообщением и кодом возврата 1, вещественные
+// числа печатаются в той же записи, что formatFloat. Из двух NaN-операндов сложения и
+// умножения результатом явно выбирается первый, как это делает x86 при выполнении milanvm:
+// порядок операндов коммутативной операции выбирает компилятор C. Порядок ввода, вывода и ошибок
+// сохраняется: операции, которые могут завершиться ошибкой или читают ввод, выполняются
+// отдельными операторами в порядке инструкций. Индексная адресация BLOAD/BSTORE
+// (cmilan ее не порождает) не поддерживается.
+
+// Запись программы на C в output. variableNames - имена переменных по адресам (для адресов
+// без имени используются имена m_N). Возвращает false и сообщение в error, если программа
+// не проходит verifyProgram или использует BLOAD/BSTORE.
+bool emitC(const vector<Command>& program, const vector<string>& variableNames, ostream& output, string& error);
+
+#endif
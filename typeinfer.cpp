@@ -0,0 +1,142 @@
+#include "typeinfer.hpp"
+
+namespace
+{
+
+void transfer(const Operation& operation, TypeState& state)
+{
+  vector<int>& stack = state.stack;
+  int top = stack.size() - 1;
+  switch (operation.instruction)
+  {
+  case LOAD:
+    stack.push_back(state.memory[operation.arg]);
+    break;
+  case STORE:
+    state.memory[operation.arg] = stack[top];
+    stack.pop_back();
+    break;
+  case BLOAD:
+    stack[top] = TYPE_ANY;
+    break;
+  case BSTORE:
+    //Запись по индексу может изменить любую переменную
+    for (int& type : state.memory)
+    {
+      type |= stack[top - 1];
+    }
+    stack.resize(top - 1);
+    break;
+  case PUSH:
+    stack.push_back(operation.value.isFloat ? TYPE_FLOAT : TYPE_INT);
+    break;
+  case DUP:
+    stack.push_back(stack[top]);
+    break;
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+    stack[top - 1] = arithmeticType(stack[top - 1], stack[top]);
+    stack.pop_back();
+    break;
+  case COMPARE:
+    stack.pop_back();
+    stack[top - 1] = TYPE_INT;
+    break;
+  case INPUT:
+    stack.push_back(TYPE_INT);
+    break;
+  default:
+  {
+    //INVERT, SHL и SHR сохраняют тип, остальные инструкции только удаляют слова
+    int pops, pushes;
+    stackEffect(operation.instruction, pops, pushes);
+    stack.resize(stack.size() - pops + pushes, TYPE_ANY);
+    break;
+  }
+  }
+}
+
+bool merge(TypeState& target, const TypeState& source)
+{
+  if (!target.reached)
+  {
+    target = source;
+    target.reached = true;
+    return true;
+  }
+  bool changed = false;
+  for (size_t i = 0; i < target.stack.size(); ++i)
+  {
+    changed |= (source.stack[i] & ~target.stack[i]) != 0;
+    target.stack[i] |= source.stack[i];
+  }
+  for (size_t i = 0; i < target.memory.size(); ++i)
+  {
+    changed |= (source.memory[i] & ~target.memory[i]) != 0;
+    target.memory[i] |= source.memory[i];
+  }
+  return changed;
+}
+
+}
+
+void splitProgram(const vector<Command>& program, vector<Operation>& operations, vector<int>& firstOperation)
+{
+  operations.clear();
+  firstOperation.clear();
+  for (size_t i = 0; i < program.size(); ++i)
+  {
+    const Command& command = program[i];
+    const Superop* superop = findSuperop(command.instruction());
+    int length = superop ? superop->length : 1;
+    int next = 0;
+    firstOperation.push_back(operations.size());
+    for (int j = 0; j < length; ++j)
+    {
+      Instruction instruction = superop ? superop->parts[j] : command.instruction();
+      int arg = argumentCount(instruction) > 0 ? command.arg(next++) : 0;
+      Value value = superop ? Value::fromInt(arg) : Value::fromCommand(command);
+      operations.push_back({instruction, arg, value, int(i), j == 0});
+    }
+  }
+}
+
+vector<TypeState> inferTypes(const vector<Operation>& operations, const vector<int>& firstOperation,
+                             int memorySize)
+{
+  vector<TypeState> states(operations.size());
+  if (operations.empty())
+  {
+    return states;
+  }
+  states[0].reached = true;
+  states[0].memory.assign(memorySize, TYPE_INT);
+  vector<int> pending = {0};
+  while (!pending.empty())
+  {
+    int index = pending.back();
+    pending.pop_back();
+    const Operation& operation = operations[index];
+    TypeState state = states[index];
+    transfer(operation, state);
+    vector<int> successors;
+    if (isJump(operation.instruction))
+    {
+      successors.push_back(firstOperation[operation.arg]);
+    }
+    if (operation.instruction != JUMP && operation.instruction != STOP)
+    {
+      successors.push_back(index + 1);
+    }
+    for (int successor : successors)
+    {
+      if (merge(states[successor], state))
+      {
+        pending.push_back(successor);
+      }
+    }
+  }
+  return states;
+}
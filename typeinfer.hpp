@@ -0,0 +1,59 @@
+#ifndef CMILAN_TYPEINFER_HPP
+#define CMILAN_TYPEINFER_HPP
+
+#include "codegen.hpp"
+#include "value.hpp"
+#include <vector>
+
+using namespace std;
+
+// Анализ типов значений программы стековой машины для генераторов машинного кода.
+//
+// Суперинструкции раскладываются на составляющие их базовые инструкции, после чего для
+// каждой составляющей вычисляется, какие типы могут иметь слова стека и переменные перед ней.
+// Типы распространяются по переходам до неподвижной точки; память изначально заполнена
+// целыми нулями. Тип результата арифметики следует правилам value.hpp: вещественный, если
+// вещественным может быть хотя бы один операнд.
+
+// Составляющая инструкции программы (у суперинструкций их несколько)
+struct Operation
+{
+  Instruction instruction;
+  int arg;            // Аргумент (для переходов - адрес инструкции программы)
+  Value value;        // Значение PUSH
+  int address;        // Адрес инструкции программы
+  bool first;         // Первая составляющая инструкции
+};
+
+// Разложение программы на составляющие; firstOperation[address] - номер первой составляющей
+// инструкции с адресом address
+void splitProgram(const vector<Command>& program, vector<Operation>& operations, vector<int>& firstOperation);
+
+// Множество возможных типов значения: TYPE_ANY - тип известен только во время выполнения
+enum ValueType
+{
+  TYPE_INT = 1,
+  TYPE_FLOAT = 2,
+  TYPE_ANY = TYPE_INT | TYPE_FLOAT
+};
+
+// Тип результата арифметической операции над значениями типов a и b
+inline int arithmeticType(int a, int b)
+{
+  return ((a | b) & TYPE_FLOAT) | (a & b & TYPE_INT);
+}
+
+// Типы слов стека (от дна к вершине) и переменных перед составляющей
+struct TypeState
+{
+  bool reached = false;   // Составляющая достижима с адреса 0
+  vector<int> stack;
+  vector<int> memory;
+};
+
+// Анализ типов программы, прошедшей verifyProgram (memorySize - результат проверки).
+// Возвращает состояния перед каждой составляющей.
+vector<TypeState> inferTypes(const vector<Operation>& operations, const vector<int>& firstOperation,
+                             int memorySize);
+
+#endif
@@ -0,0 +1,366 @@
+// Развертывание циклов с известным числом итераций.
+//
+// Рассматриваются циклы, которые Parser строит для WHILE с простым счетчиком: единственная
+// запись счетчика в цикле - i := i + c в блоке-защелке, который завершается проверкой
+// i < B (<=, >, >=, !=) с константой B и переходом к заголовку, а на входе в цикл в счетчик
+// записана константа. Выход из цикла возможен только через эту проверку. Число итераций
+// вычисляется точно, с учетом того, что счетчик не должен переполниться.
+//
+// Если копии тела на все итерации укладываются в предел размера, цикл развертывается
+// полностью: проверки в копиях известны и заменяются снятием операндов со стека. Иначе
+// тело копируется U раз (U = 8, 4 или 2), проверка остается только в последней копии,
+// а остаток от деления числа итераций на U выполняется копиями тела перед циклом.
+// Предел относится к размеру кода, получаемого из тела цикла.
+
+#include "optimizer.hpp"
+#include "analysis.hpp"
+#include "value.hpp"
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+
+namespace
+{
+
+// Число итераций цикла с проверкой в конце: i = start, затем повторяется i := i + step
+// и цикл продолжается, пока выполнено сравнение i с bound
+bool tripCount(Instruction branch, long long start, long long bound, long long step, long long& count)
+{
+  if (step > 0 && (branch == JLT || branch == JLE))
+  {
+    long long distance = bound - start + (branch == JLE ? 1 : 0);
+    count = (distance <= step) ? 1 : (distance + step - 1) / step;
+    return start + count * step <= INT_MAX;
+  }
+  if (step < 0 && (branch == JGT || branch == JGE))
+  {
+    long long distance = start - bound + (branch == JGE ? 1 : 0);
+    count = (distance <= -step) ? 1 : (distance - step - 1) / -step;
+    return start + count * step >= INT_MIN;
+  }
+  if (step != 0 && branch == JNE && (bound - start) % step == 0 && (bound - start) / step >= 1)
+  {
+    count = (bound - start) / step;
+    return true;
+  }
+  return false;
+}
+
+class LoopUnrolling
+{
+public:
+  LoopUnrolling(FlowGraph& graph, AnalysisManager& analyses, int sizeLimit)
+    : graph_(graph), analyses_(analyses), sizeLimit_(sizeLimit)
+  {}
+
+  // Начало раунда над циклами loops
+  void startRound(const vector<Loop>& loops)
+  {
+    innermost_ = innermostLoops(loops);
+  }
+
+  // Развертывание одного цикла; возвращает true, если цикл развернут
+  bool unroll(Loop& loop, const vector<Loop>& loops);
+
+  // Размещение копий, созданных за раунд
+  void placeCopies()
+  {
+    graph_.placeBefore(placements_);
+    placements_.clear();
+  }
+
+private:
+  bool analyze(Loop& loop, const vector<Loop>& loops, BasicBlock*& entry, BasicBlock*& latch, long long& count);
+  vector<BasicBlock*> clone(const vector<BasicBlock*>& body, BasicBlock* latch, BasicBlock*& latchCopy);
+
+  FlowGraph& graph_;
+  AnalysisManager& analyses_;
+  int sizeLimit_;
+  set<BasicBlock*> unrolled_;   // Заголовки уже развернутых циклов
+  unordered_map<BasicBlock*, int> innermost_;          // Ближайшие циклы блоков (innermostLoops)
+  vector<pair<BasicBlock*, BasicBlock*>> placements_;  // Копии и блоки, перед которыми они размещаются
+};
+
+bool LoopUnrolling::analyze(Loop& loop, const vector<Loop>& loops, BasicBlock*& entry, BasicBlock*& latch,
+                            long long& count)
+{
+  BasicBlock* header = loop.header;
+  if (unrolled_.count(header))
+  {
+    return false;
+  }
+
+  //Единственный вход и единственный выход - через проверку в защелке
+  entry = nullptr;
+  for (BasicBlock* pred : header->preds)
+  {
+    if (!loop.members.count(pred))
+    {
+      if (entry)
+      {
+        return false;
+      }
+      entry = pred;
+    }
+  }
+  latch = nullptr;
+  for (BasicBlock* block : loop.body)
+  {
+    if (block->branch == STOP)
+    {
+      return false;
+    }
+    for (BasicBlock* succ : block->succs)
+    {
+      if (!loop.members.count(succ))
+      {
+        if (latch || block->target != header || block->next != succ)
+        {
+          return false;
+        }
+        latch = block;
+      }
+    }
+  }
+  if (!entry || !latch || jumpComparison(latch->branch) < 0)
+  {
+    return false;
+  }
+  auto innermost = innermost_.find(latch);
+  if (innermost == innermost_.end() || &loops[innermost->second] != &loop)
+  {
+    return false;
+  }
+
+  //Проверка счетчика с константой в конце защелки
+  const vector<Command>& code = latch->code;
+  int size = code.size();
+  if (size < 2 || code[size - 2].instruction() != LOAD || code[size - 1].instruction() != PUSH ||
+      code[size - 1].isFloat())
+  {
+    return false;
+  }
+  int counter = code[size - 2].arg();
+  int bound = code[size - 1].arg();
+
+  //Единственная запись счетчика - изменение на константу в защелке
+  long long step = 0;
+  int stores = 0;
+  for (BasicBlock* block : loop.body)
+  {
+    const vector<Command>& blockCode = block->code;
+    for (int i = 0; i < int(blockCode.size()); ++i)
+    {
+      if (blockCode[i].instruction() != STORE || blockCode[i].arg() != counter)
+      {
+        continue;
+      }
+      ++stores;
+      if (block != latch || i < 3 || blockCode[i - 3].instruction() != LOAD || blockCode[i - 3].arg() != counter ||
+          blockCode[i - 2].instruction() != PUSH || blockCode[i - 2].isFloat() ||
+          (blockCode[i - 1].instruction() != ADD && blockCode[i - 1].instruction() != SUB))
+      {
+        return false;
+      }
+      step = blockCode[i - 2].arg();
+      step = (blockCode[i - 1].instruction() == ADD) ? step : -step;
+    }
+  }
+  if (stores != 1)
+  {
+    return false;
+  }
+
+  //Счетчик должен быть целым: вещественное начальное значение дало бы вещественные сравнения
+  int start;
+  if (!constantOnEntry(entry, counter, start) || !analyses_.integerVariable(counter))
+  {
+    return false;
+  }
+  return tripCount(latch->branch, start, bound, step, count);
+}
+
+// Копирование блоков цикла; переходы внутри цикла ведут в копии. Возвращает копии в порядке
+// размещения; latchCopy - копия защелки.
+vector<BasicBlock*> LoopUnrolling::clone(const vector<BasicBlock*>& body, BasicBlock* latch, BasicBlock*& latchCopy)
+{
+  map<BasicBlock*, BasicBlock*> copies;
+  for (BasicBlock* block : body)
+  {
+    BasicBlock* copy = graph_.newBlock();
+    copy->code = block->code;
+    copy->branch = block->branch;
+    copies[block] = copy;
+  }
+  vector<BasicBlock*> result;
+  for (BasicBlock* block : body)
+  {
+    BasicBlock* copy = copies[block];
+    auto remap = [&copies](BasicBlock* target) {
+      auto it = copies.find(target);
+      return (it != copies.end()) ? it->second : target;
+    };
+    copy->target = block->target ? remap(block->target) : nullptr;
+    copy->next = block->next ? remap(block->next) : nullptr;
+    result.push_back(copy);
+  }
+  latchCopy = copies[latch];
+  return result;
+}
+
+// Защелка копии, после которой итерация известно продолжается: проверка не нужна
+static void dropTest(BasicBlock* latchCopy, BasicBlock* next)
+{
+  for (int i = branchPops(latchCopy->branch); i > 0; --i)
+  {
+    latchCopy->code.push_back(Command(POP));
+  }
+  removeDeadPops(latchCopy->code);
+  latchCopy->branch = NOP;
+  latchCopy->target = nullptr;
+  latchCopy->next = next;
+}
+
+bool LoopUnrolling::unroll(Loop& loop, const vector<Loop>& loops)
+{
+  BasicBlock* entry;
+  BasicBlock* latch;
+  long long count;
+  if (!analyze(loop, loops, entry, latch, count))
+  {
+    return false;
+  }
+
+  //Размер тела: инструкции блоков и завершающие условные переходы
+  vector<BasicBlock*> body = loop.body;
+  sort(body.begin(), body.end(), [](BasicBlock* a, BasicBlock* b) { return a->id < b->id; });
+  long long bodySize = 0;
+  for (BasicBlock* block : body)
+  {
+    bodySize += block->code.size() + (block->isConditional() ? 1 : 0);
+  }
+
+  //Полное развертывание или частичное с наибольшей кратностью, укладывающейся в предел
+  long long factor = 0;
+  long long peeled = 0;
+  if (count * bodySize <= sizeLimit_)
+  {
+    peeled = count;
+  }
+  else
+  {
+    for (factor = 8; factor >= 2; factor /= 2)
+    {
+      peeled = count % factor;
+      if (count / factor >= 2 && (factor + peeled) * bodySize <= sizeLimit_)
+      {
+        break;
+      }
+    }
+    if (factor < 2)
+    {
+      return false;
+    }
+  }
+
+  //Копии размещаются на месте цикла: итерации перед циклом, затем развернутое тело
+  BasicBlock* exit = latch->next;
+  BasicBlock* header = loop.header;
+  vector<BasicBlock*> placed;
+  vector<BasicBlock*> latches;
+  vector<BasicBlock*> heads;
+  for (long long k = 0; k < peeled + factor; ++k)
+  {
+    BasicBlock* latchCopy;
+    vector<BasicBlock*> copy = clone(body, latch, latchCopy);
+    heads.push_back(copy[find(body.begin(), body.end(), header) - body.begin()]);
+    latches.push_back(latchCopy);
+    placed.insert(placed.end(), copy.begin(), copy.end());
+  }
+  for (size_t k = 0; k < latches.size(); ++k)
+  {
+    if (k + 1 < latches.size())
+    {
+      dropTest(latches[k], heads[k + 1]);
+    }
+    else if (factor == 0)
+    {
+      dropTest(latches[k], exit);
+    }
+    else
+    {
+      latches[k]->target = heads[peeled];
+      latches[k]->next = exit;
+    }
+  }
+  for (BasicBlock* block : placed)
+  {
+    placements_.push_back(make_pair(block, header));
+  }
+  if (entry->target == header)
+  {
+    entry->target = heads[0];
+  }
+  if (entry->next == header)
+  {
+    entry->next = heads[0];
+  }
+  if (factor > 0)
+  {
+    unrolled_.insert(heads[peeled]);
+  }
+  return true;
+}
+
+}
+
+int unrollLoops(FlowGraph& graph, AnalysisManager& analyses, int sizeLimit)
+{
+  if (sizeLimit <= 0 || analyses.variableCount() < 0)
+  {
+    return 0;
+  }
+
+  //После развертывания цикла соседние циклы содержат устаревшие блоки и дуги, поэтому
+  //они рассматриваются в следующем раунде, когда циклы найдены заново. Копии не добавляют
+  //переменных и не меняют их типов.
+  LoopUnrolling unrolling(graph, analyses, sizeLimit);
+  int changes = 0;
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    vector<Loop>& loops = analyses.loops();
+    unrolling.startRound(loops);
+    vector<bool> stale(loops.size(), false);
+    unordered_set<BasicBlock*> touched;   // Блоки развернутых циклов
+    for (size_t i = 0; i < loops.size(); ++i)
+    {
+      //Устарели циклы, содержащие развернутый, и циклы, в которые из него есть вход
+      Loop& loop = loops[i];
+      for (BasicBlock* pred : loop.header->preds)
+      {
+        stale[i] = stale[i] || touched.count(pred);
+      }
+      if (stale[i] || !unrolling.unroll(loop, loops))
+      {
+        continue;
+      }
+      touched.insert(loop.body.begin(), loop.body.end());
+      for (int outer = loop.parent; outer >= 0; outer = loops[outer].parent)
+      {
+        stale[outer] = true;
+      }
+      changed = true;
+      ++changes;
+    }
+    if (changed)
+    {
+      unrolling.placeCopies();
+      graph.removeUnreachable();
+      analyses.invalidate(AnalysisManager::VARIABLES | AnalysisManager::TYPES);
+    }
+  }
+  return changes;
+}
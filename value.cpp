@@ -0,0 +1,151 @@
+#include "value.hpp"
+#include <cstring>
+
+bool Value::same(const Value& other) const
+{
+  return key() == other.key();
+}
+
+uint64_t Value::key() const
+{
+  uint32_t bits = static_cast<uint32_t>(i);
+  if (isFloat)
+  {
+    memcpy(&bits, &f, sizeof(bits));
+  }
+  return (uint64_t(isFloat) << 32) | bits;
+}
+
+// Целая арифметика по модулю 2^32 выполняется над беззнаковыми числами, чтобы избежать
+// неопределенного поведения при переполнении
+static int wrap(unsigned int value)
+{
+  return static_cast<int>(value);
+}
+
+bool evaluate(Instruction op, const Value& a, const Value& b, Value& result)
+{
+  if (a.isFloat || b.isFloat)
+  {
+    float x = a.toFloat();
+    float y = b.toFloat();
+    switch (op)
+    {
+    case ADD:
+      result = Value::fromFloat(x + y);
+      return true;
+    case SUB:
+      result = Value::fromFloat(x - y);
+      return true;
+    case MULT:
+      result = Value::fromFloat(x * y);
+      return true;
+    case DIV:
+      if (y == 0)
+      {
+        return false;
+      }
+      result = Value::fromFloat(x / y);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  unsigned int x = a.i;
+  unsigned int y = b.i;
+  switch (op)
+  {
+  case ADD:
+    result = Value::fromInt(wrap(x + y));
+    return true;
+  case SUB:
+    result = Value::fromInt(wrap(x - y));
+    return true;
+  case MULT:
+    result = Value::fromInt(wrap(x * y));
+    return true;
+  case DIV:
+    if (b.i == 0)
+    {
+      return false;
+    }
+    //Единственный случай переполнения: наименьшее целое, деленное на -1
+    if (b.i == -1)
+    {
+      result = Value::fromInt(wrap(0u - x));
+    }
+    else
+    {
+      result = Value::fromInt(a.i / b.i);
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
+Value invert(const Value& a)
+{
+  if (a.isFloat)
+  {
+    return Value::fromFloat(-a.f);
+  }
+  return Value::fromInt(wrap(0u - static_cast<unsigned int>(a.i)));
+}
+
+Value shift(Instruction op, const Value& a, int bits)
+{
+  if (a.isFloat)
+  {
+    float scale = static_cast<float>(1 << bits);
+    return Value::fromFloat(op == SHL ? a.f * scale : a.f / scale);
+  }
+  if (op == SHL)
+  {
+    return Value::fromInt(wrap(static_cast<unsigned int>(a.i) << bits));
+  }
+  //Для отрицательных чисел прибавляем 2^bits - 1, чтобы сдвиг округлял к нулю
+  int bias = (a.i >> 31) & ((1 << bits) - 1);
+  return Value::fromInt(static_cast<int>(static_cast<long long>(a.i) + bias) >> bits);
+}
+
+bool compare(int cmp, const Value& a, const Value& b)
+{
+  if (a.isFloat || b.isFloat)
+  {
+    float x = a.toFloat();
+    float y = b.toFloat();
+    switch (cmp)
+    {
+    case 0:
+      return x == y;
+    case 1:
+      return x != y;
+    case 2:
+      return x < y;
+    case 3:
+      return x > y;
+    case 4:
+      return x <= y;
+    default:
+      return x >= y;
+    }
+  }
+
+  switch (cmp)
+  {
+  case 0:
+    return a.i == b.i;
+  case 1:
+    return a.i != b.i;
+  case 2:
+    return a.i < b.i;
+  case 3:
+    return a.i > b.i;
+  case 4:
+    return a.i <= b.i;
+  default:
+    return a.i >= b.i;
+  }
+}
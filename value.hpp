@@ -0,0 +1,110 @@
+#ifndef CMILAN_VALUE_HPP
+#define CMILAN_VALUE_HPP
+
+#include "codegen.hpp"
+#include <cstdint>
+
+using namespace std;
+
+// Значение машины Милана: целое или вещественное число.
+//
+// Семантика операций, общая для компилятора (свертка констант) и машины:
+// - целая арифметика выполняется по модулю 2^32;
+// - если хотя бы один операнд вещественный, операция выполняется над вещественными числами;
+// - деление на ноль (целый или вещественный) - ошибка времени выполнения;
+// - целое деление округляет к нулю;
+// - сравнение дает целое 1 или 0.
+
+struct Value
+{
+  bool isFloat;
+  int i;
+  float f;
+
+  Value()
+    : isFloat(false), i(0), f(0)
+  {}
+
+  static Value fromInt(int i)
+  {
+    Value value;
+    value.i = i;
+    return value;
+  }
+
+  static Value fromFloat(float f)
+  {
+    Value value;
+    value.isFloat = true;
+    value.f = f;
+    return value;
+  }
+
+  // Значение как вещественное число
+  float toFloat() const
+  {
+    return isFloat ? f : static_cast<float>(i);
+  }
+
+  // Значение аргумента инструкции PUSH
+  static Value fromCommand(const Command& command)
+  {
+    return command.isFloat() ? fromFloat(command.farg()) : fromInt(command.arg());
+  }
+
+  // Инструкция PUSH, загружающая это значение
+  Command toPush() const
+  {
+    return isFloat ? Command(PUSH, f) : Command(PUSH, i);
+  }
+
+  // Значения совпадают по типу и побитово (0.0 и -0.0 различаются)
+  bool same(const Value& other) const;
+
+  // Ключ для упорядоченных контейнеров: ключи равны тогда и только тогда, когда значения same
+  uint64_t key() const;
+
+  // Значение, истинное для условных переходов (ненулевое)
+  bool isTrue() const
+  {
+    return isFloat ? f != 0 : i != 0;
+  }
+};
+
+// Вычисление арифметической операции (ADD, SUB, MULT, DIV) над a и b.
+// Возвращает false, если операция приводит к ошибке (деление на ноль).
+bool evaluate(Instruction op, const Value& a, const Value& b, Value& result);
+
+// Изменение знака
+Value invert(const Value& a);
+
+// Сдвиг SHL или SHR на bits разрядов (0 <= bits <= 30): то же, что умножение или деление
+// на 2^bits. Целое деление округляет к нулю, вещественные числа умножаются и делятся.
+Value shift(Instruction op, const Value& a, int bits);
+
+// Сравнение с кодом операции COMPARE (0 "=", 1 "!=", 2 "<", 3 ">", 4 "<=", 5 ">=")
+bool compare(int cmp, const Value& a, const Value& b);
+
+// Код операции COMPARE, соответствующей совмещенному переходу JEQ ... JGE, или -1
+constexpr int jumpComparison(Instruction jump)
+{
+  switch (jump)
+  {
+  case JEQ:
+    return 0;
+  case JNE:
+    return 1;
+  case JLT:
+    return 2;
+  case JGT:
+    return 3;
+  case JLE:
+    return 4;
+  case JGE:
+    return 5;
+  default:
+    return -1;
+  }
+}
+
+#endif
@@ -0,0 +1,422 @@
+#include "vm.hpp"
+#include "vmio.hpp"
+#include <algorithm>
+#include <sstream>
+
+bool loadListing(istream& input, vector<Command>& program, string& error)
+{
+  program.clear();
+  string line;
+  int lineNumber = 0;
+  while (getline(input, line))
+  {
+    ++lineNumber;
+    if (line.find_first_not_of(" \t\r") == string::npos)
+    {
+      continue;
+    }
+    Command command(NOP);
+    int address = -1;
+    istringstream(line) >> address;
+    if (!Command::parse(line, command) || address != int(program.size()))
+    {
+      error = "line " + to_string(lineNumber) + ": invalid instruction '" + line + "'";
+      return false;
+    }
+    program.push_back(command);
+  }
+  return true;
+}
+
+// Проверка аргумента базовой инструкции, не зависящего от данных
+static bool checkArgument(Instruction instruction, int arg, int programSize, string& message)
+{
+  switch (instruction)
+  {
+  case LOAD:
+  case STORE:
+    if (arg < 0 || arg >= MEMORY_LIMIT)
+    {
+      message = "invalid address " + to_string(arg);
+      return false;
+    }
+    return true;
+  case SHL:
+  case SHR:
+    if (arg < 0 || arg > 30)
+    {
+      message = "invalid shift " + to_string(arg);
+      return false;
+    }
+    return true;
+  case COMPARE:
+    if (arg < 0 || arg > 5)
+    {
+      message = "invalid comparison " + to_string(arg);
+      return false;
+    }
+    return true;
+  default:
+    if (isJump(instruction) && (arg < 0 || arg >= programSize))
+    {
+      message = "invalid jump " + to_string(arg);
+      return false;
+    }
+    return true;
+  }
+}
+
+bool verifyProgram(const vector<Command>& program, vector<int>& depth, int& maxDepth, int& memorySize, string& error)
+{
+  int size = program.size();
+  depth.assign(size, -1);
+  maxDepth = 0;
+  memorySize = 0;
+  error.clear();
+  if (size == 0)
+  {
+    error = "address 0: no instruction";
+    return false;
+  }
+
+  //Обход достижимых инструкций в глубину с распространением глубины стека
+  vector<int> pending = {0};
+  depth[0] = 0;
+  while (!pending.empty())
+  {
+    int address = pending.back();
+    pending.pop_back();
+    const Command& command = program[address];
+    Instruction instruction = command.instruction();
+    const Superop* superop = findSuperop(instruction);
+    int length = superop ? superop->length : 1;
+
+    string message;
+    int current = depth[address];
+    int next = 0;
+    int target = -1;
+    bool fallsThrough = instruction != STOP;
+    for (int i = 0; i < length && message.empty(); ++i)
+    {
+      Instruction part = superop ? superop->parts[i] : instruction;
+      int pops = stackPops(part);
+      int pushes = stackPushes(part);
+      if (current < pops)
+      {
+        message = "stack underflow";
+        break;
+      }
+      current += pushes - pops;
+      if (current > STACK_LIMIT)
+      {
+        message = "stack overflow";
+        break;
+      }
+      maxDepth = max(maxDepth, current);
+      if (argumentCount(part) > 0)
+      {
+        int arg = command.arg(next++);
+        if (checkArgument(part, arg, size, message) && (part == LOAD || part == STORE))
+        {
+          memorySize = max(memorySize, arg + 1);
+        }
+        if (isJump(part))
+        {
+          target = arg;
+          fallsThrough = part != JUMP;
+        }
+      }
+    }
+    if (message.empty() && fallsThrough && address + 1 >= size)
+    {
+      message = "execution falls off the end of the program";
+    }
+
+    for (int successor : {target, fallsThrough ? address + 1 : -1})
+    {
+      if (!message.empty() || successor < 0)
+      {
+        continue;
+      }
+      if (depth[successor] < 0)
+      {
+        depth[successor] = current;
+        pending.push_back(successor);
+      }
+      else if (depth[successor] != current)
+      {
+        address = successor;
+        message = "inconsistent stack depth";
+      }
+    }
+    if (!message.empty())
+    {
+      error = "address " + to_string(address) + ": " + message;
+      return false;
+    }
+  }
+  return true;
+}
+
+Machine::Status Machine::fail(const string& message)
+{
+  error_ = "address " + to_string(pc_) + ": " + message;
+  return FAILED;
+}
+
+bool Machine::pop(Value& value)
+{
+  if (stack_.empty())
+  {
+    return false;
+  }
+  value = stack_.back();
+  stack_.pop_back();
+  return true;
+}
+
+bool Machine::push(const Value& value)
+{
+  if (int(stack_.size()) >= STACK_LIMIT)
+  {
+    return false;
+  }
+  stack_.push_back(value);
+  return true;
+}
+
+Value* Machine::cell(int address)
+{
+  if (address < 0 || address >= MEMORY_LIMIT)
+  {
+    return nullptr;
+  }
+  if (address >= int(memory_.size()))
+  {
+    memory_.resize(address + 1);
+  }
+  return &memory_[address];
+}
+
+Machine::Status Machine::execute(Instruction instruction, const Value& arg)
+{
+  Value a, b;
+  Value* target;
+  switch (instruction)
+  {
+  case NOP:
+    return NEXT;
+
+  case STOP:
+    return STOPPED;
+
+  case LOAD:
+    target = cell(arg.i);
+    if (!target)
+    {
+      return fail("invalid address " + to_string(arg.i));
+    }
+    return push(*target) ? NEXT : fail("stack overflow");
+
+  case STORE:
+    target = cell(arg.i);
+    if (!target)
+    {
+      return fail("invalid address " + to_string(arg.i));
+    }
+    return pop(*target) ? NEXT : fail("stack underflow");
+
+  case BLOAD:
+  case BSTORE:
+  {
+    if (!pop(a))
+    {
+      return fail("stack underflow");
+    }
+    int address = arg.i + a.i;
+    target = a.isFloat ? nullptr : cell(address);
+    if (!target)
+    {
+      return fail(a.isFloat ? "float index" : "invalid address " + to_string(address));
+    }
+    if (instruction == BLOAD)
+    {
+      return push(*target) ? NEXT : fail("stack overflow");
+    }
+    return pop(*target) ? NEXT : fail("stack underflow");
+  }
+
+  case PUSH:
+    return push(arg) ? NEXT : fail("stack overflow");
+
+  case POP:
+    return pop(a) ? NEXT : fail("stack underflow");
+
+  case DUP:
+    if (stack_.empty())
+    {
+      return fail("stack underflow");
+    }
+    return push(stack_.back()) ? NEXT : fail("stack overflow");
+
+  case ADD:
+  case SUB:
+  case MULT:
+  case DIV:
+  {
+    if (!pop(b) || !pop(a))
+    {
+      return fail("stack underflow");
+    }
+    Value result;
+    if (!evaluate(instruction, a, b, result))
+    {
+      return fail("division by zero");
+    }
+    stack_.push_back(result);
+    return NEXT;
+  }
+
+  case INVERT:
+    if (!pop(a))
+    {
+      return fail("stack underflow");
+    }
+    stack_.push_back(invert(a));
+    return NEXT;
+
+  case SHL:
+  case SHR:
+    if (arg.i < 0 || arg.i > 30)
+    {
+      return fail("invalid shift " + to_string(arg.i));
+    }
+    if (!pop(a))
+    {
+      return fail("stack underflow");
+    }
+    stack_.push_back(shift(instruction, a, arg.i));
+    return NEXT;
+
+  case COMPARE:
+    if (arg.i < 0 || arg.i > 5)
+    {
+      return fail("invalid comparison " + to_string(arg.i));
+    }
+    if (!pop(b) || !pop(a))
+    {
+      return fail("stack underflow");
+    }
+    stack_.push_back(Value::fromInt(compare(arg.i, a, b) ? 1 : 0));
+    return NEXT;
+
+  case JUMP:
+    pc_ = arg.i;
+    return JUMPED;
+
+  case JUMP_YES:
+  case JUMP_NO:
+    if (!pop(a))
+    {
+      return fail("stack underflow");
+    }
+    if (a.isTrue() == (instruction == JUMP_YES))
+    {
+      pc_ = arg.i;
+      return JUMPED;
+    }
+    return NEXT;
+
+  case JEQ:
+  case JNE:
+  case JLT:
+  case JGT:
+  case JLE:
+  case JGE:
+    if (!pop(b) || !pop(a))
+    {
+      return fail("stack underflow");
+    }
+    if (compare(jumpComparison(instruction), a, b))
+    {
+      pc_ = arg.i;
+      return JUMPED;
+    }
+    return NEXT;
+
+  case INPUT:
+  {
+    int value;
+    if (!readInt(input_, value))
+    {
+      return fail("invalid input");
+    }
+    return push(Value::fromInt(value)) ? NEXT : fail("stack overflow");
+  }
+
+  case PRINT:
+    if (!pop(a))
+    {
+      return fail("stack underflow");
+    }
+    printValue(output_, a);
+    return NEXT;
+
+  default:
+    return fail("invalid instruction");
+  }
+}
+
+bool Machine::run()
+{
+  pc_ = 0;
+  steps_ = 0;
+  memory_.clear();
+  stack_.clear();
+  error_.clear();
+  while (true)
+  {
+    if (pc_ < 0 || pc_ >= int(program_.size()))
+    {
+      fail("no instruction");
+      break;
+    }
+    const Command& command = program_[pc_];
+    ++steps_;
+
+    Status status;
+    const Superop* superop = findSuperop(command.instruction());
+    if (!superop)
+    {
+      Value arg = command.isFloat() ? Value::fromFloat(command.farg()) : Value::fromInt(command.arg());
+      status = execute(command.instruction(), arg);
+    }
+    else
+    {
+      //Аргументы суперинструкции распределяются по составляющим ее инструкциям
+      status = NEXT;
+      int next = 0;
+      for (int i = 0; i < superop->length && status == NEXT; ++i)
+      {
+        Instruction part = superop->parts[i];
+        Value arg;
+        if (argumentCount(part) > 0)
+        {
+          arg = Value::fromInt(command.arg(next++));
+        }
+        status = execute(part, arg);
+      }
+    }
+
+    if (status == NEXT)
+    {
+      ++pc_;
+    }
+    else if (status != JUMPED)
+    {
+      break;
+    }
+  }
+  output_.flush();
+  return error_.empty();
+}
@@ -0,0 +1,500 @@
+#ifndef CMILAN_VM_HPP
+#define CMILAN_VM_HPP
+
+#include "codegen.hpp"
+#include "value.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Виртуальная машина Милана.
+//
+// Программа - последовательность инструкций, адрес инструкции - ее номер. Память данных
+// состоит из слов со значениями Value и изначально заполнена целыми нулями; она растет
+// по мере обращений, но не больше MEMORY_LIMIT слов. Глубина стека не больше STACK_LIMIT.
+// Арифметика и сравнения выполняются по правилам value.hpp, общим с компилятором.
+//
+// INPUT читает со входного потока целое число. PRINT печатает значение на отдельной строке:
+// целое - в десятичной записи, вещественное - как аргументы в листинге (formatFloat). Числа
+// читаются и печатаются функциями vmio.hpp прямо через буферы потоков.
+//
+// Ошибка времени выполнения (деление на ноль, исчерпание стека, обращение за пределы памяти,
+// переход за пределы программы, неверный ввод) останавливает машину.
+
+const int MEMORY_LIMIT = 1 << 24;
+const int STACK_LIMIT = 1 << 20;
+
+// Загрузка программы из текстового листинга cmilan. Адреса инструкций должны идти подряд
+// с нуля; пустые строки пропускаются. Возвращает false и сообщение в error, если листинг
+// не удалось разобрать.
+bool loadListing(istream& input, vector<Command>& program, string& error);
+
+// Проверка программы перед выполнением быстрыми интерпретаторами, которые не проверяют стек
+// при каждой инструкции. Для инструкций, достижимых с адреса 0, вычисляется глубина стека
+// перед ними (depth, -1 для недостижимых): на всех путях она должна совпадать, не становиться
+// отрицательной и не превышать STACK_LIMIT. Заранее проверяются и аргументы: адреса LOAD и
+// STORE, адреса переходов, коды сравнений и величины сдвигов. maxDepth - наибольшая глубина
+// стека, memorySize - число слов памяти, к которым обращаются LOAD и STORE.
+// Возвращает false и сообщение в error, если программа не прошла проверку. Код, который
+// порождает cmilan, проверку всегда проходит.
+bool verifyProgram(const vector<Command>& program, vector<int>& depth, int& maxDepth, int& memorySize, string& error);
+
+// Эталонный интерпретатор: выборка инструкции и выбор обработчика оператором switch.
+// Суперинструкции выполняются как последовательности составляющих их инструкций.
+
+class Machine
+{
+public:
+  Machine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output), pc_(0), steps_(0)
+  {}
+
+  // Выполнение программы с адреса 0 до STOP. Возвращает false при ошибке времени выполнения.
+  bool run();
+
+  // Сообщение об ошибке времени выполнения
+  const string& error() const
+  {
+    return error_;
+  }
+
+  // Число выполненных инструкций (суперинструкция считается одной)
+  long long steps() const
+  {
+    return steps_;
+  }
+
+private:
+  enum Status
+  {
+    NEXT,     // Выполнение продолжается со следующей инструкции
+    JUMPED,   // Выполнен переход, pc_ содержит его адрес
+    STOPPED,
+    FAILED
+  };
+
+  // Выполнение базовой инструкции с аргументом arg (для PUSH - значение, для остальных - arg.i)
+  Status execute(Instruction instruction, const Value& arg);
+
+  Status fail(const string& message);
+  bool pop(Value& value);
+  bool push(const Value& value);
+  Value* cell(int address);
+
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  vector<Value> memory_;
+  vector<Value> stack_;
+  int pc_;
+  long long steps_;
+  string error_;
+};
+
+// Быстрый интерпретатор. Программа проверяется verifyProgram и заранее декодируется в массив
+// операций с адресом обработчика и аргументами, поэтому при выполнении не проверяются ни стек,
+// ни адреса LOAD и STORE. С GCC и Clang обработчики - метки (labels as values), и каждый
+// обработчик заканчивается собственным косвенным переходом к следующей операции. С другими
+// компиляторами, а также если определен макрос MILAN_VM_SWITCH, те же обработчики выбираются
+// оператором switch в цикле. Результат и ошибки времени выполнения - как у Machine.
+//
+// До двух верхних слов стека хранятся в локальных переменных (кэш вершины стека). Число слов
+// в кэше перед каждой операцией и после нее известно при декодировании, и для каждой пары
+// состояний есть свой обработчик, порожденный шаблоном, так что LOAD; PUSH; ADD; STORE
+// обходятся без обращений к стеку в памяти. На адресах переходов и после переходов кэш пуст.
+// С макросом MILAN_VM_MEMORY_STACK кэш не используется (для сравнения производительности).
+//
+// Другие машины могут получать управление на обратных переходах (BackEdgeHook): так
+// TieredMachine считает проходы циклов и передает их скомпилированному коду.
+
+// Обработчик обратных переходов ThreadedMachine
+class BackEdgeHook
+{
+public:
+  virtual ~BackEdgeHook() {}
+
+  // Вызывается перед выполнением программы, прошедшей проверку: depth - глубины стека,
+  // вычисленные verifyProgram
+  virtual void prepare(const vector<int>& depth) = 0;
+
+  // Вызывается при каждом выполненном переходе к адресу target, не большему адреса перехода.
+  // Стек целиком в памяти: stack - слова стека (их depth[target]), memory - память машины,
+  // которую обработчик может расширить. Возвращает адрес, с которого продолжается выполнение
+  // (target или адрес, на котором скомпилированный код вернул управление, - всегда адрес
+  // перехода или инструкции после перехода), -1 после STOP или -2 после ошибки времени
+  // выполнения (сообщение с адресом в error).
+  virtual int backEdge(int target, Value* stack, vector<Value>& memory, string& error) = 0;
+};
+
+class ThreadedMachine
+{
+public:
+  // hook - обработчик обратных переходов (nullptr - без обработчика)
+  ThreadedMachine(const vector<Command>& program, istream& input, ostream& output,
+                  BackEdgeHook* hook = nullptr)
+    : program_(program), input_(input), output_(output), hook_(hook), steps_(0)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  BackEdgeHook* hook_;
+  vector<Value> memory_;
+  vector<Value> stack_;
+  long long steps_;
+  string error_;
+};
+
+// Регистровая машина. Проверенная verifyProgram программа переводится в трехадресный код:
+// слова стека на каждой глубине становятся регистрами, переменные и константы - тоже регистры,
+// поэтому LOAD, PUSH и STORE обычно исчезают, а арифметика и переходы читают операнды прямо
+// из переменных. Переведенный код выполняется так же, как в ThreadedMachine. steps() - число
+// выполненных регистровых инструкций.
+
+class RegisterMachine
+{
+public:
+  RegisterMachine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output), steps_(0), instructionCount_(0)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+  // Длина переведенной программы
+  int instructionCount() const
+  {
+    return instructionCount_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  vector<Value> registers_;
+  long long steps_;
+  int instructionCount_;
+  string error_;
+};
+
+// Интерпретатор с ускорением (quickening). Общие инструкции ADD, SUB, MULT, DIV, COMPARE,
+// INVERT и условные переходы при первом выполнении заменяются на месте вариантами,
+// специализированными для наблюдаемых типов операндов (оба целые, оба вещественные, разных
+// типов), которые не выбирают путь вычисления по типам, а только проверяют их одним
+// сравнением. Если типы изменились, операция возвращается к общей инструкции и может быть
+// специализирована снова; после нескольких таких возвратов она остается общей. Суперинструкции
+// раскладываются на составляющие, стек хранится в памяти. С макросом MILAN_VM_NO_QUICKENING
+// инструкции не заменяются (для сравнения производительности).
+
+class QuickeningMachine
+{
+public:
+  QuickeningMachine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output), steps_(0)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+  // Отчет о специализации инструкций в последнем запуске
+  const string& quickeningReport() const
+  {
+    return report_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  vector<Value> memory_;
+  vector<Value> stack_;
+  long long steps_;
+  string error_;
+  string report_;
+};
+
+// Интерпретатор, в котором стек и память - массивы 64-разрядных слов NaN-boxing (nanbox.hpp)
+// вместо структур Value: слово вдвое меньше (8 байт против 12), тип проверяется одной маской.
+// Тот же интерпретатор, порожденный для Value (TAGGED_STRUCT), служит для сравнения
+// представлений. Обработчики выбираются оператором switch, суперинструкции раскладываются
+// на составляющие. Результат и ошибки времени выполнения - как у Machine.
+
+class NanBoxMachine
+{
+public:
+  enum Representation
+  {
+    NAN_BOXED,
+    TAGGED_STRUCT
+  };
+
+  NanBoxMachine(const vector<Command>& program, istream& input, ostream& output,
+                Representation representation = NAN_BOXED)
+    : program_(program), input_(input), output_(output), representation_(representation), steps_(0),
+      footprint_(0)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return steps_;
+  }
+
+  // Размер стека и памяти в последнем запуске в байтах
+  size_t footprint() const
+  {
+    return footprint_;
+  }
+
+  // Представление значений и размеры стека и памяти в последнем запуске
+  const string& footprintReport() const
+  {
+    return report_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  Representation representation_;
+  long long steps_;
+  size_t footprint_;
+  string error_;
+  string report_;
+};
+
+// Шаблонный JIT-компилятор для x86-64. Проверенная verifyProgram программа переводится
+// в машинный код: каждая инструкция заменяется фиксированной последовательностью команд,
+// переходы - прямыми переходами, адреса которых проставляются после генерации всего кода.
+// Стек и память - массивы Value, как у интерпретаторов; целая арифметика и сравнения
+// выполняются машинными командами, а вещественные операции, ввод и вывод, сдвиги, COMPARE
+// и доступ по индексу - вызовами функций на C++. Код пишется в память, выделенную mmap,
+// которая затем делается исполняемой (и уже не доступна для записи); он компилируется при
+// первом вызове run(). Код не зависит от адреса загрузки (функции вызываются через таблицу),
+// поэтому его можно сохранить в постоянном кэше (codecache.hpp) и в следующих запусках
+// отображать из файла вместо компиляции. На других платформах программа выполняется
+// ThreadedMachine. Инструкции не считаются: steps() возвращает -1.
+
+class JitMachine
+{
+public:
+  // cacheDirectory - каталог постоянного кэша машинного кода (пустая строка - без кэша)
+  JitMachine(const vector<Command>& program, istream& input, ostream& output,
+             const string& cacheDirectory = string())
+    : program_(program), input_(input), output_(output), cacheDirectory_(cacheDirectory), mapping_(nullptr),
+      mappingSize_(0), code_(nullptr)
+  {}
+
+  ~JitMachine();
+
+  JitMachine(const JitMachine&) = delete;
+  JitMachine& operator=(const JitMachine&) = delete;
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return -1;
+  }
+
+  // Что сделано с кэшем кода при компиляции: код загружен или сохранен (с путем к записи
+  // и причиной промаха); пустая строка, если кэш не используется
+  const string& cacheStatus() const
+  {
+    return cacheStatus_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  string cacheDirectory_;
+  vector<Value> memory_;
+  vector<Value> stack_;
+  void* mapping_;         // Память с машинным кодом, выделенная mmap
+  size_t mappingSize_;
+  const void* code_;      // Начало кода
+  string error_;
+  string cacheStatus_;
+};
+
+// Цикл программы, скомпилированный тем же шаблонным компилятором, что и JitMachine: участок из
+// инструкций с адресами от first до last. Код начинает выполнение с адреса first со стеком
+// глубины depth[first] и возвращает управление, когда выполнение уходит за пределы участка.
+// Используется TieredMachine; компиляция может выполняться в другом потоке.
+
+class JitRegion
+{
+public:
+  JitRegion()
+    : code_(nullptr), codeSize_(0)
+  {}
+
+  ~JitRegion();
+
+  JitRegion(const JitRegion&) = delete;
+  JitRegion& operator=(const JitRegion&) = delete;
+
+  // Компиляция участка; depth - глубины стека, вычисленные verifyProgram. Возвращает false
+  // и сообщение в error, если код получить не удалось (на платформах, отличных от x86-64, -
+  // всегда).
+  bool compile(const vector<Command>& program, const vector<int>& depth, int first, int last, string& error);
+
+  // Выполнение с адреса first: stack - слова стека, memory - память машины (BSTORE может ее
+  // расширить). Возвращает адрес, с которого продолжается интерпретация, -1 после STOP или -2
+  // после ошибки времени выполнения (сообщение в error).
+  int run(Value* stack, vector<Value>& memory, istream& input, ostream& output, string& error) const;
+
+  // Размер машинного кода в байтах
+  size_t size() const
+  {
+    return codeSize_;
+  }
+
+private:
+  void* code_;
+  size_t codeSize_;
+};
+
+// Трассирующий JIT-компилятор для x86-64. Программа выполняется интерпретатором, который
+// считает обратные переходы: когда начало цикла становится горячим, интерпретатор записывает
+// один проход по нему - линейную трассу с проверками типов и выбранных направлений ветвлений.
+// Трасса оптимизируется (свертка констант, устранение повторных вычислений и проверок,
+// удаление лишнего кода, вынос из цикла не зависящих от прохода вычислений и проверок),
+// значения распределяются по регистрам, и трасса компилируется в машинный код, который
+// выполняет цикл, пока проверки проходят. При неудачной проверке трасса записывает состояние
+// в память и стек машины, и интерпретатор продолжает с нужного адреса; с часто используемых
+// выходов записываются боковые трассы, к которым выход затем переходит сам. Запись
+// прерывается на STOP, BLOAD/BSTORE и вложенных циклах, которые еще не скомпилированы.
+// На других платформах программа только интерпретируется. Инструкции, выполненные
+// трассами, не считаются: steps() возвращает -1, а число интерпретированных инструкций
+// приводится в отчете traceReport().
+
+class TracingMachine
+{
+public:
+  TracingMachine(const vector<Command>& program, istream& input, ostream& output)
+    : program_(program), input_(input), output_(output)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return -1;
+  }
+
+  // Отчет о трассах последнего запуска: для каждой трассы - длина, число проверок и
+  // вынесенных из цикла инструкций, размер кода, число входов, проходов и выходов
+  const string& traceReport() const
+  {
+    return report_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  string error_;
+  string report_;
+};
+
+// Многоуровневое выполнение. Программа сразу начинает выполняться ThreadedMachine (уровень 0),
+// обработчик обратных переходов которой считает проходы каждого цикла. Цикл, в котором их
+// набралось threshold, становится горячим и компилируется шаблонным компилятором JitRegion
+// (уровень 1) в фоновом потоке, пока интерпретатор продолжает работу. Когда код готов,
+// интерпретатор на очередном обратном переходе передает ему управление с текущими стеком и памятью (замена
+// на стеке, OSR); при выходе из цикла выполнение возвращается в интерпретатор. Внешний цикл,
+// ставший горячим позже, компилируется вместе с вложенными. Короткие программы не ждут
+// компиляции, а фоновый поток запускается только при первом горячем цикле. Инструкции,
+// выполненные машинным кодом, не считаются: steps() возвращает -1, а число
+// интерпретированных инструкций приводится в журнале tierLog().
+
+class TieredMachine
+{
+public:
+  static const int DEFAULT_THRESHOLD = 1000;
+
+  TieredMachine(const vector<Command>& program, istream& input, ostream& output,
+                int threshold = DEFAULT_THRESHOLD)
+    : program_(program), input_(input), output_(output), threshold_(threshold)
+  {}
+
+  bool run();
+
+  const string& error() const
+  {
+    return error_;
+  }
+
+  long long steps() const
+  {
+    return -1;
+  }
+
+  // Журнал последнего запуска: когда циклы становились горячими, компилировались и впервые
+  // выполнялись на уровне 1, число проходов на каждом уровне
+  const string& tierLog() const
+  {
+    return log_;
+  }
+
+private:
+  const vector<Command>& program_;
+  istream& input_;
+  ostream& output_;
+  int threshold_;
+  string error_;
+  string log_;
+};
+
+#endif
@@ -0,0 +1,205 @@
+#include "vmio.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+long readBlock(int fd, char* data, size_t size)
+{
+#ifdef _WIN32
+  return _read(fd, data, static_cast<unsigned int>(size));
+#else
+  return read(fd, data, size);
+#endif
+}
+
+long writeBlock(int fd, const char* data, size_t size)
+{
+#ifdef _WIN32
+  return _write(fd, data, static_cast<unsigned int>(size));
+#else
+  return write(fd, data, size);
+#endif
+}
+
+// Пробельные символы, которые пропускает operator>> (локаль "C")
+bool isSpace(int c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+}
+
+bool readInt(istream& input, int& number)
+{
+  if (input.tie())
+  {
+    input.tie()->flush();
+  }
+  streambuf* buffer = input.rdbuf();
+  int c = buffer->sgetc();
+  while (isSpace(c))
+  {
+    c = buffer->snextc();
+  }
+
+  //Знак и значащие цифры: ведущие нули не хранятся, а больше 10 значащих цифр в int
+  //не помещаются, но, как у operator>>, все цифры числа читаются из потока
+  char text[16];
+  char* end = text;
+  if (c == '-' || c == '+')
+  {
+    if (c == '-')
+    {
+      *end++ = '-';
+    }
+    c = buffer->snextc();
+  }
+  char* digits = end;
+  bool found = false;
+  bool overflow = false;
+  for (; c >= '0' && c <= '9'; c = buffer->snextc())
+  {
+    found = true;
+    if (c == '0' && end == digits)
+    {
+      continue;
+    }
+    if (end - digits == 10)
+    {
+      overflow = true;
+    }
+    else
+    {
+      *end++ = static_cast<char>(c);
+    }
+  }
+  if (!found || overflow)
+  {
+    return false;
+  }
+  if (end == digits)
+  {
+    *end++ = '0';
+  }
+  return from_chars(text, end, number).ec == errc();
+}
+
+void printInt(ostream& output, int value)
+{
+  char text[16];
+  char* end = to_chars(text, text + sizeof(text) - 1, value).ptr;
+  *end++ = '\n';
+  output.rdbuf()->sputn(text, end - text);
+}
+
+void printFloat(ostream& output, float value)
+{
+  char text[FLOAT_TEXT_SIZE + 1];
+  char* end = formatFloat(text, value);
+  *end++ = '\n';
+  output.rdbuf()->sputn(text, end - text);
+}
+
+InputBuffer::int_type InputBuffer::underflow()
+{
+  if (gptr() < egptr())
+  {
+    return traits_type::to_int_type(*gptr());
+  }
+  if (tie_)
+  {
+    tie_->pubsync();
+  }
+  long size;
+  do
+  {
+    size = readBlock(fd_, buffer_.data(), buffer_.size());
+  } while (size < 0 && errno == EINTR);
+  if (size <= 0)
+  {
+    return traits_type::eof();
+  }
+  setg(buffer_.data(), buffer_.data(), buffer_.data() + size);
+  return traits_type::to_int_type(*gptr());
+}
+
+int OutputBuffer::sync()
+{
+  const char* data = pbase();
+  size_t size = pptr() - pbase();
+  while (size > 0)
+  {
+    long written = writeBlock(fd_, data, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      setp(buffer_.data(), buffer_.data() + buffer_.size());
+      return -1;
+    }
+    data += written;
+    size -= written;
+  }
+  setp(buffer_.data(), buffer_.data() + buffer_.size());
+  return 0;
+}
+
+OutputBuffer::int_type OutputBuffer::overflow(int_type c)
+{
+  if (sync() != 0)
+  {
+    return traits_type::eof();
+  }
+  if (!traits_type::eq_int_type(c, traits_type::eof()))
+  {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    if (lineBuffered_ && c == '\n' && sync() != 0)
+    {
+      return traits_type::eof();
+    }
+  }
+  return traits_type::not_eof(c);
+}
+
+streamsize OutputBuffer::xsputn(const char* data, streamsize size)
+{
+  streamsize written = 0;
+  while (written < size)
+  {
+    if (pptr() == epptr() && sync() != 0)
+    {
+      break;
+    }
+    streamsize chunk = min(size - written, static_cast<streamsize>(epptr() - pptr()));
+    memcpy(pptr(), data + written, chunk);
+    pbump(static_cast<int>(chunk));
+    written += chunk;
+  }
+  if (lineBuffered_ && memchr(data, '\n', written))
+  {
+    sync();
+  }
+  return written;
+}
+
+bool isTerminal(int fd)
+{
+#ifdef _WIN32
+  return _isatty(fd) != 0;
+#else
+  return isatty(fd) != 0;
+#endif
+}
@@ -0,0 +1,102 @@
+#ifndef CMILAN_VMIO_HPP
+#define CMILAN_VMIO_HPP
+
+#include "value.hpp"
+#include <cstddef>
+#include <iostream>
+#include <streambuf>
+#include <vector>
+
+using namespace std;
+
+// Ввод и вывод виртуальной машины Милана (INPUT и PRINT).
+//
+// Числа читаются и печатаются прямо через буфер потока (streambuf), без форматирования
+// iostream и локалей: ввод разбирается std::from_chars, вывод записывается std::to_chars
+// (вещественные числа - кратчайшей записью formatFloat). Результат тот же, что у operator>>
+// для int и operator<< с formatFloat, с любыми потоками. milanvm подключает к потокам
+// InputBuffer и OutputBuffer, которые читают и пишут файловые дескрипторы большими блоками,
+// одним системным вызовом на блок.
+
+const size_t IO_BUFFER_SIZE = 1 << 16;
+
+// Чтение целого числа для INPUT: пробельные символы пропускаются, затем читается десятичное
+// число со знаком, как operator>> для int. Возвращает false, если числа нет или оно не
+// помещается в int.
+bool readInt(istream& input, int& number);
+
+// Печать целого или вещественного числа для PRINT на отдельной строке
+void printInt(ostream& output, int value);
+void printFloat(ostream& output, float value);
+
+inline void printValue(ostream& output, const Value& value)
+{
+  if (value.isFloat)
+  {
+    printFloat(output, value.f);
+  }
+  else
+  {
+    printInt(output, value.i);
+  }
+}
+
+class OutputBuffer;
+
+// Буфер чтения файлового дескриптора. Блок читается, когда прочитанные данные кончились;
+// read возвращает то, что уже доступно, поэтому чтение с терминала не ждет заполнения блока.
+// Перед чтением сбрасывается связанный буфер вывода tie (как cin связан с cout), чтобы
+// приглашение было видно до того, как программа начнет ждать ввода.
+class InputBuffer : public streambuf
+{
+public:
+  explicit InputBuffer(int fd, OutputBuffer* tie = nullptr, size_t size = IO_BUFFER_SIZE)
+    : fd_(fd), tie_(tie), buffer_(size)
+  {
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+  }
+
+protected:
+  int_type underflow() override;
+
+private:
+  int fd_;
+  OutputBuffer* tie_;
+  vector<char> buffer_;
+};
+
+// Буфер записи в файловый дескриптор. Блок записывается, когда буфер заполнен, при flush
+// и при разрушении буфера; в построчном режиме (для интерактивной работы) - и после каждой
+// строки.
+class OutputBuffer : public streambuf
+{
+public:
+  explicit OutputBuffer(int fd, bool lineBuffered = false, size_t size = IO_BUFFER_SIZE)
+    : fd_(fd), lineBuffered_(lineBuffered), buffer_(size)
+  {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  ~OutputBuffer() override
+  {
+    sync();
+  }
+
+  OutputBuffer(const OutputBuffer&) = delete;
+  OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+protected:
+  int_type overflow(int_type c) override;
+  streamsize xsputn(const char* data, streamsize size) override;
+  int sync() override;
+
+private:
+  int fd_;
+  bool lineBuffered_;
+  vector<char> buffer_;
+};
+
+// Связан ли файловый дескриптор с терминалом
+bool isTerminal(int fd);
+
+#endif